@@ -0,0 +1,231 @@
+/*
+ * Microbenchmark of the layout of struct client
+ *
+ * Copyright (C) 2011 Florent Bondoux
+ *
+ * This file is part of Campagnol.
+ *
+ * Campagnol is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Campagnol is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Campagnol.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ */
+
+/*
+ * The data path touches each peer from two threads:
+ * - comm_socket and comm_tun look the peer up (reference counter) and read
+ *   the fields used for each packet (state, FIFOs, address),
+ * - the worker of the peer writes the counters of both directions
+ *   (struct client_tx and struct client_rx) and uses the SSL structure.
+ *
+ * The benchmark runs these two loops over a set of peers, first with the
+ * former layout of struct client (all these fields on the same cache
+ * lines), then with the current one, and prints the number of packets per
+ * second of each loop.
+ *
+ * usage: peer_layout [peers] [duration_ms]
+ */
+
+#include "../client/campagnol.h"
+
+#include <errno.h>
+#include <time.h>
+
+#include "../client/peer.h"
+#include "../common/log.h"
+#include "../common/pthread_wrap.h"
+
+/* the hot fields of struct client before the split, in their order */
+struct client_legacy {
+    time_t time;                    // last message received
+    time_t last_keepalive;
+    struct sockaddr_in clientaddr;
+    struct in_addr vpnIP;
+    int state;
+    int tunfd;
+    int sockfd;
+    SSL *ssl;
+    BIO *wbio;
+    BIO *rbio;
+    BIO *out_fifo;
+    volatile unsigned int ref_count;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+};
+
+struct bench {
+    int n_peers;
+    int legacy;                     // use the former layout
+    void **peers;
+    volatile int start;
+    volatile int stop;
+};
+
+struct bench_thread {
+    struct bench *bench;
+    void *(*fn)(void *);
+    uint64_t ops;
+    pthread_t thread;
+};
+
+/* comm_socket/comm_tun: lookup (reference counter) and fields of the peer */
+static void *bench_lookup(void *arg) {
+    struct bench_thread *t = arg;
+    struct bench *b = t->bench;
+    uint64_t ops = 0;
+    uintptr_t sum = 0;
+    int i;
+
+    while (!b->start);
+    while (!b->stop) {
+        for (i = 0; i < b->n_peers; i++) {
+            if (b->legacy) {
+                volatile struct client_legacy *p = b->peers[i];
+                __sync_fetch_and_add(&p->ref_count, 1);
+                sum += (uintptr_t) p->state + (uintptr_t) p->out_fifo
+                        + (uintptr_t) p->rbio + p->clientaddr.sin_port;
+                __sync_fetch_and_sub(&p->ref_count, 1);
+            }
+            else {
+                volatile struct client *p = b->peers[i];
+                __sync_fetch_and_add(&p->ref_count, 1);
+                sum += (uintptr_t) p->state + (uintptr_t) p->out_fifo
+                        + (uintptr_t) p->rbio + p->clientaddr.sin_port;
+                __sync_fetch_and_sub(&p->ref_count, 1);
+            }
+        }
+        ops += (uint64_t) b->n_peers;
+    }
+    t->ops = ops + (uint64_t) (sum & 0);
+    return NULL;
+}
+
+/* worker: one outgoing and one incoming record */
+static void *bench_worker(void *arg) {
+    struct bench_thread *t = arg;
+    struct bench *b = t->bench;
+    uint64_t ops = 0;
+    uintptr_t sum = 0;
+    int i;
+
+    while (!b->start);
+    while (!b->stop) {
+        for (i = 0; i < b->n_peers; i++) {
+            if (b->legacy) {
+                volatile struct client_legacy *p = b->peers[i];
+                sum += (uintptr_t) p->ssl;
+                p->tx_packets++;
+                p->tx_bytes += 1400;
+                p->last_keepalive = (time_t) ops;
+                p->rx_packets++;
+                p->rx_bytes += 1400;
+                p->time = (time_t) ops;
+            }
+            else {
+                volatile struct client *p = b->peers[i];
+                sum += (uintptr_t) p->ssl;
+                p->tx.packets++;
+                p->tx.bytes += 1400;
+                p->tx.time = (time_t) ops;
+                p->rx.packets++;
+                p->rx.bytes += 1400;
+                p->rx.time = (time_t) ops;
+            }
+        }
+        ops += (uint64_t) b->n_peers;
+    }
+    t->ops = ops + (uint64_t) (sum & 0);
+    return NULL;
+}
+
+static void bench_run(int n_peers, int legacy, long duration_ms) {
+    struct bench b;
+    struct bench_thread threads[2];
+    struct timespec ts;
+    size_t size = legacy ? sizeof(struct client_legacy) : sizeof(struct client);
+    int i, r;
+
+    memset(&b, 0, sizeof(b));
+    b.n_peers = n_peers;
+    b.legacy = legacy;
+    b.peers = CHECK_ALLOC_FATAL(malloc(n_peers * sizeof(void *)));
+    for (i = 0; i < n_peers; i++) {
+        r = posix_memalign(&b.peers[i], PEER_CACHE_LINE, size);
+        if (r != 0) {
+            log_error(r, "posix_memalign");
+            exit(EXIT_FAILURE);
+        }
+        memset(b.peers[i], 0, size);
+    }
+
+    threads[0].fn = bench_lookup;
+    threads[1].fn = bench_worker;
+    for (i = 0; i < 2; i++) {
+        threads[i].bench = &b;
+        threads[i].ops = 0;
+        threads[i].thread = createThread(threads[i].fn, &threads[i]);
+    }
+    b.start = 1;
+    ts.tv_sec = duration_ms / 1000;
+    ts.tv_nsec = (duration_ms % 1000) * 1000000L;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+    b.stop = 1;
+    for (i = 0; i < 2; i++) {
+        joinThread(threads[i].thread, NULL);
+    }
+
+    printf("%-8s %6d %14.0f %14.0f\n", legacy ? "legacy" : "split", n_peers,
+            threads[0].ops * 1000.0 / duration_ms,
+            threads[1].ops * 1000.0 / duration_ms);
+
+    for (i = 0; i < n_peers; i++) {
+        free(b.peers[i]);
+    }
+    free(b.peers);
+}
+
+int main(int argc, char **argv) {
+    int n_peers = 64;
+    long duration_ms = 1000;
+
+    if (argc > 1)
+        n_peers = atoi(argv[1]);
+    if (argc > 2)
+        duration_ms = atol(argv[2]);
+    if (n_peers <= 0 || duration_ms <= 0) {
+        fprintf(stderr, "usage: %s [peers] [duration_ms]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("struct client: %zu bytes, struct client_legacy: %zu bytes\n",
+            sizeof(struct client), sizeof(struct client_legacy));
+    printf("%-8s %6s %14s %14s\n", "layout", "peers", "lookups/s", "worker/s");
+    bench_run(n_peers, 1, duration_ms);
+    bench_run(n_peers, 0, duration_ms);
+    return EXIT_SUCCESS;
+}
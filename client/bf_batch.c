@@ -0,0 +1,472 @@
+/*
+ * OpenSSL batching filter BIO
+ *
+ * Copyright (C) 2011 Florent Bondoux
+ *
+ * This file is part of Campagnol.
+ *
+ * Campagnol is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Campagnol is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Campagnol.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * 
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ */
+
+
+/* filter BIO
+ * Collect the records written by SSL_write and send them with a single
+ * system call (sendmmsg) when the BIO is flushed, when the batch is full or
+ * when the oldest record has been waiting for longer than the latency bound.
+ *
+ * The next BIO must be a datagram BIO. Its socket and peer address are used to
+ * send the batch. The other controls are passed to the next BIO.
+ * With UDP GSO, runs of records of the same size are sent as single messages.
+ * The records may carry their own TOS byte (IP_TOS control message).
+ *
+ * The structure of this file comes from OpenSSL's null filter.
+ */
+
+#include "campagnol.h"
+
+#include <errno.h>
+#include <sys/time.h>
+#include <netinet/udp.h>
+#include <openssl/err.h>
+
+#include "bf_batch.h"
+#include "communication.h"
+#include "net_socket.h"
+#include "../common/log.h"
+
+#ifdef _POSIX_MONOTONIC_CLOCK
+#define BATCH_CLOCK CLOCK_MONOTONIC
+#else
+#define BATCH_CLOCK CLOCK_REALTIME
+#endif
+
+static int batchf_write(BIO *h, const char *buf, int num);
+static int batchf_read(BIO *h, char *buf, int size);
+static long batchf_ctrl(BIO *h, int cmd, long arg1, void *arg2);
+static int batchf_new(BIO *h);
+static int batchf_free(BIO *h);
+
+/* BIO_METHOD describing the filter, built once */
+static BIO_METHOD *methods_batchf = NULL;
+static pthread_once_t methods_batchf_once = PTHREAD_ONCE_INIT;
+
+static void batchf_method_init(void) {
+    BIO_METHOD *m = BIO_meth_new(BIO_TYPE_BATCH_FILTER, "Batching filter");
+    if (m == NULL) return;
+    BIO_meth_set_write(m, batchf_write); // queue the records
+    BIO_meth_set_read(m, batchf_read); // transparent
+    BIO_meth_set_ctrl(m, batchf_ctrl);
+    BIO_meth_set_create(m, batchf_new);
+    BIO_meth_set_destroy(m, batchf_free);
+    methods_batchf = m;
+}
+
+/*
+ * size: maximum number of records in a batch
+ * latency: maximum delay (usec) before sending a record
+ * record_size: size of the buffers. Larger records are not batched.
+ * The messages given to sendmmsg are allocated here, not on the stack of the
+ * worker.
+ */
+BIO * BIO_f_new_batch(int size, long latency, int record_size) {
+    BIO *bi;
+    struct batch_data *data;
+    int i;
+
+    pthread_once(&methods_batchf_once, batchf_method_init);
+    if (methods_batchf == NULL) {
+        return NULL;
+    }
+    bi = BIO_new(methods_batchf);
+    if (bi == NULL) {
+        return NULL;
+    }
+    data = malloc(sizeof(struct batch_data));
+    if (data == NULL) {
+        BIO_free(bi);
+        return NULL;
+    }
+    data->records = malloc(size * sizeof(struct batch_record));
+    if (data->records == NULL) {
+        free(data);
+        BIO_free(bi);
+        return NULL;
+    }
+#ifdef HAVE_SENDMMSG
+    data->msgs = malloc(size * sizeof(struct mmsghdr));
+    data->iov = malloc(size * sizeof(struct iovec));
+    data->ctrl = malloc(size * sizeof(union batch_cmsg));
+    if (data->msgs == NULL || data->iov == NULL || data->ctrl == NULL) {
+        free(data->msgs);
+        free(data->iov);
+        free(data->ctrl);
+        free(data->records);
+        free(data);
+        BIO_free(bi);
+        return NULL;
+    }
+#endif
+    for (i = 0; i < size; i++) {
+        data->records[i].data = malloc(record_size);
+        if (data->records[i].data == NULL) {
+            while (i-- > 0) free(data->records[i].data);
+#ifdef HAVE_SENDMMSG
+            free(data->msgs);
+            free(data->iov);
+            free(data->ctrl);
+#endif
+            free(data->records);
+            free(data);
+            BIO_free(bi);
+            return NULL;
+        }
+    }
+    data->enabled = 0;
+    data->size = size;
+    data->n = 0;
+    data->record_size = record_size;
+    data->tos = 0;
+    data->latency = latency;
+    mutexInit(&data->mutex, NULL);
+    BIO_set_data(bi, data);
+    BIO_set_init(bi, 1);
+    return bi;
+}
+
+static int batchf_new(BIO *bi) {
+    BIO_set_init(bi, 0);
+    BIO_set_data(bi, NULL);
+    return 1;
+}
+
+static int batchf_free(BIO *bi) {
+    struct batch_data *data;
+    int i;
+
+    if (bi == NULL) return 0;
+    data = (struct batch_data *) BIO_get_data(bi);
+    if (data != NULL) {
+        for (i = 0; i < data->size; i++) {
+            free(data->records[i].data);
+        }
+        free(data->records);
+#ifdef HAVE_SENDMMSG
+        free(data->msgs);
+        free(data->iov);
+        free(data->ctrl);
+#endif
+        mutexDestroy(&data->mutex);
+        free(data);
+    }
+    return 1;
+}
+
+#ifdef HAVE_SENDMMSG
+#ifdef UDP_SEGMENT
+/* Limits of a GSO message (UDP_MAX_SEGMENTS and the max UDP payload) */
+#define BATCH_GSO_MAX_SEGMENTS 64
+#define BATCH_GSO_MAX_SIZE 65000
+#endif
+
+/*
+ * Prepare the messages for the records first..n-1 of the batch
+ * With UDP GSO, consecutive records of the same size and TOS are sent as one
+ * message segmented by the kernel. The last record of a message may be shorter.
+ * Return the number of messages
+ */
+static int batchf_build_msgs(struct batch_data *data, int first,
+        struct mmsghdr *msgs, struct iovec *iov, union batch_cmsg *ctrl,
+        struct sockaddr_in *peer) {
+    int i, j, n = 0;
+    size_t ctrl_len;
+
+    for (i = first; i < data->n; i++) {
+        iov[i].iov_base = data->records[i].data;
+        iov[i].iov_len = data->records[i].len;
+    }
+
+    i = first;
+    while (i < data->n) {
+        j = i + 1;
+#ifdef UDP_SEGMENT
+        if (socket_gso) {
+            int seg = data->records[i].len;
+            int total = seg;
+            while (j < data->n && j - i < BATCH_GSO_MAX_SEGMENTS
+                    && data->records[j].len <= seg
+                    && data->records[j].tos == data->records[i].tos
+                    && total + data->records[j].len <= BATCH_GSO_MAX_SIZE) {
+                total += data->records[j].len;
+                j++;
+                if (data->records[j-1].len < seg)
+                    break;
+            }
+        }
+#endif
+        memset(&msgs[n].msg_hdr, 0, sizeof(msgs[n].msg_hdr));
+        msgs[n].msg_hdr.msg_name = peer;
+        msgs[n].msg_hdr.msg_namelen = sizeof(*peer);
+        msgs[n].msg_hdr.msg_iov = &iov[i];
+        msgs[n].msg_hdr.msg_iovlen = j - i;
+        ctrl_len = 0;
+#ifdef UDP_SEGMENT
+        if (j - i > 1) {
+            uint16_t seg = (uint16_t) data->records[i].len;
+            struct cmsghdr *cmsg = (struct cmsghdr *) (ctrl[n].buf + ctrl_len);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(seg));
+            memcpy(CMSG_DATA(cmsg), &seg, sizeof(seg));
+            ctrl_len += CMSG_SPACE(sizeof(seg));
+        }
+#endif
+#ifdef IP_TOS
+        if (data->records[i].tos != 0) {
+            int tos = data->records[i].tos;
+            struct cmsghdr *cmsg = (struct cmsghdr *) (ctrl[n].buf + ctrl_len);
+            cmsg->cmsg_level = IPPROTO_IP;
+            cmsg->cmsg_type = IP_TOS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(tos));
+            memcpy(CMSG_DATA(cmsg), &tos, sizeof(tos));
+            ctrl_len += CMSG_SPACE(sizeof(tos));
+        }
+#endif
+        if (ctrl_len != 0) {
+            msgs[n].msg_hdr.msg_control = ctrl[n].buf;
+            msgs[n].msg_hdr.msg_controllen = ctrl_len;
+        }
+        n++;
+        i = j;
+    }
+    return n;
+}
+#endif
+
+/*
+ * Keep the records first..n-1 of the batch, they are sent again by the next
+ * flush. The buffers of the sent records go to the end of the table.
+ */
+static void batchf_keep(struct batch_data *data, int first) {
+    struct batch_record tmp;
+    int i;
+
+    for (i = 0; i + first < data->n; i++) {
+        tmp = data->records[i];
+        data->records[i] = data->records[i + first];
+        data->records[i + first] = tmp;
+    }
+    data->n -= first;
+}
+
+/*
+ * Send the queued records to the peer of the next BIO
+ * The socket is not waited for: if it is full, the unsent records are kept.
+ * Must be called with data->mutex locked
+ * Return -1 if records are left in the batch
+ */
+static int batchf_flush(BIO *b) {
+    struct batch_data *data = (struct batch_data *) BIO_get_data(b);
+    struct sockaddr_in peer;
+    int fd = -1;
+    int sent, r;
+
+    if (data->n == 0)
+        return 0;
+
+    BIO_get_fd(BIO_next(b), &fd);
+    BIO_dgram_get_peer(BIO_next(b), &peer);
+
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr *msgs = data->msgs;
+    int i, n;
+
+    /* sent: number of records sent */
+    sent = 0;
+    while (sent < data->n) {
+        n = batchf_build_msgs(data, sent, msgs, data->iov, data->ctrl, &peer);
+        r = sendmmsg(fd, msgs, n, 0);
+        if (r == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                batchf_keep(data, sent);
+                return -1;
+            }
+            else if (errno == EIO && msgs[0].msg_hdr.msg_iovlen > 1) {
+                /* the output device can't do the segmentation */
+                log_message("UDP segmentation offload failed, disabling it");
+                socket_gso = 0;
+            }
+            else if (errno != EINTR) {
+                /* skip the faulty message */
+                log_error(errno, "sendmmsg");
+                sent += (int) msgs[0].msg_hdr.msg_iovlen;
+            }
+        }
+        else {
+            for (i = 0; i < r; i++) {
+                sent += (int) msgs[i].msg_hdr.msg_iovlen;
+            }
+        }
+    }
+#else
+    for (sent = 0; sent < data->n; sent++) {
+        r = sendto(fd, data->records[sent].data, data->records[sent].len, 0,
+                (struct sockaddr *) &peer, sizeof(peer));
+        if (r == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                batchf_keep(data, sent);
+                return -1;
+            }
+            log_error(errno, "sendto");
+        }
+    }
+#endif
+
+    data->n = 0;
+    return 0;
+}
+
+/* Has the oldest record of the batch exceeded the latency bound? */
+static inline int batchf_expired(struct batch_data *data) {
+    struct timespec now;
+    long elapsed;
+
+    clock_gettime(BATCH_CLOCK, &now);
+    elapsed = (now.tv_sec - data->first.tv_sec) * 1000000L
+            + (now.tv_nsec - data->first.tv_nsec) / 1000L;
+    return elapsed >= data->latency;
+}
+
+static int batchf_read(BIO *b, char *out, int outl) {
+    int ret = 0;
+
+    if (out == NULL) return 0;
+    if (BIO_next(b) == NULL) return 0;
+    ret = BIO_read(BIO_next(b), out, outl);
+    BIO_clear_retry_flags(b);
+    BIO_copy_next_retry(b);
+    return ret;
+}
+
+static int batchf_write(BIO *b, const char *in, int inl) {
+    int ret = 0;
+    struct batch_data *data = (struct batch_data *) BIO_get_data(b);
+    struct batch_record *record;
+
+    if ((in == NULL) || inl <=0) return 0;
+    if (BIO_next(b) == NULL) return 0;
+
+    BIO_clear_retry_flags(b);
+    mutexLock(&data->mutex);
+    if (!data->enabled || inl > data->record_size) {
+        /* keep the records ordered */
+        if (batchf_flush(b) == -1) {
+            mutexUnlock(&data->mutex);
+            BIO_set_retry_write(b);
+            return -1;
+        }
+        mutexUnlock(&data->mutex);
+        ret = BIO_write(BIO_next(b), in, inl);
+        BIO_copy_next_retry(b);
+        return ret;
+    }
+    /* the socket was full, SSL_write is called again later with the same
+     * record */
+    if (data->n == data->size && batchf_flush(b) == -1) {
+        mutexUnlock(&data->mutex);
+        BIO_set_retry_write(b);
+        return -1;
+    }
+
+    record = &data->records[data->n];
+    memcpy(record->data, in, inl);
+    record->len = inl;
+    record->tos = data->tos;
+    if (data->n == 0) {
+        clock_gettime(BATCH_CLOCK, &data->first);
+    }
+    data->n++;
+
+    /* if the socket is full, the record stays in the batch */
+    if (data->n == data->size || batchf_expired(data)) {
+        batchf_flush(b);
+    }
+    mutexUnlock(&data->mutex);
+
+    return inl;
+}
+
+static long batchf_ctrl(BIO *b, int cmd, long num, void *ptr) {
+    long ret = 1;
+    int i;
+    struct batch_data *data = (struct batch_data *) BIO_get_data(b);
+
+    if (BIO_next(b) == NULL) return 0;
+
+    switch(cmd) {
+        case BIO_C_DO_STATE_MACHINE:
+            BIO_clear_retry_flags(b);
+            ret = BIO_ctrl(BIO_next(b), cmd, num, ptr);
+            BIO_copy_next_retry(b);
+            break;
+        case BIO_CTRL_DUP:
+            ret = 0L;
+            break;
+        case BIO_CTRL_FLUSH:
+            /* BIO_CTRL_WPENDING tells whether records are left */
+            mutexLock(&data->mutex);
+            batchf_flush(b);
+            mutexUnlock(&data->mutex);
+            ret = BIO_ctrl(BIO_next(b), cmd, num, ptr);
+            break;
+        case BIO_CTRL_WPENDING:
+            mutexLock(&data->mutex);
+            ret = 0;
+            for (i = 0; i < data->n; i++) {
+                ret += data->records[i].len;
+            }
+            mutexUnlock(&data->mutex);
+            break;
+        case BIO_CTRL_BATCH_SET_ENABLED:
+            mutexLock(&data->mutex);
+            if (!num) {
+                batchf_flush(b);
+            }
+            data->enabled = (int) num;
+            mutexUnlock(&data->mutex);
+            break;
+        case BIO_CTRL_BATCH_SET_TOS:
+            mutexLock(&data->mutex);
+            data->tos = (int) num;
+            mutexUnlock(&data->mutex);
+            break;
+        default:
+            ret = BIO_ctrl(BIO_next(b), cmd, num, ptr);
+    }
+    return ret;
+}
@@ -0,0 +1,98 @@
+/*
+ * OpenSSL batching filter BIO
+ *
+ * Copyright (C) 2011 Florent Bondoux
+ *
+ * This file is part of Campagnol.
+ *
+ * Campagnol is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Campagnol is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Campagnol.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * 
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ */
+
+
+#ifndef BF_BATCH_H_
+#define BF_BATCH_H_
+
+#include <openssl/bio.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "../common/pthread_wrap.h"
+
+/* BIO type: filter */
+#define BIO_TYPE_BATCH_FILTER   (102|BIO_TYPE_FILTER)
+
+/* enable (num = 1) or disable (num = 0) the batching of the written records.
+ * When disabled, the records are written immediately to the next BIO. */
+#define BIO_CTRL_BATCH_SET_ENABLED      120
+/* TOS byte of the outer IP header of the next batched records (num),
+ * 0 keeps the TOS of the socket. Needs sendmmsg. */
+#define BIO_CTRL_BATCH_SET_TOS          121
+
+/* maximum number of records in a batch (UIO_MAXIOV) */
+#define BATCH_MAX_SIZE 1024
+
+/* Create a new BIO
+ * size: maximum number of records in a batch, at most BATCH_MAX_SIZE
+ * latency: maximum delay (usec) before sending a record
+ * record_size: size of the buffers
+ */
+extern BIO *BIO_f_new_batch(int size, long latency, int record_size);
+
+struct batch_record {
+    int len;                        // size of the record
+    int tos;                        // TOS of the datagram (0: socket default)
+    unsigned char *data;            // the record
+};
+
+#ifdef HAVE_SENDMMSG
+/* control messages of a datagram: UDP_SEGMENT and IP_TOS */
+union batch_cmsg {
+    char buf[CMSG_SPACE(sizeof(uint16_t)) + CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+};
+#endif
+
+struct batch_data {
+    int enabled;                    // batch records or write them immediately
+    int size;                       // max number of records
+    int n;                          // current number of records
+    int record_size;                // size of each record buffer
+    int tos;                        // TOS of the next records
+    long latency;                   // max delay before flushing (usec)
+    struct timespec first;          // time of the oldest record of the batch
+    struct batch_record *records;
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr *msgs;           // messages of a flush, one per record at most
+    struct iovec *iov;
+    union batch_cmsg *ctrl;
+#endif
+    pthread_mutex_t mutex;          // the records are written by the worker of the peer
+};
+
+#endif /* BF_BATCH_H_ */
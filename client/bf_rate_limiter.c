@@ -38,6 +38,8 @@
  * use two rate limiters in the writting function.
  * use one for the DTLS channel and one global for the client
  * the rate limiters may be NULL
+ * The write never sleeps: without enough tokens, it fails with the retry flag
+ * and BIO_CTRL_RATE_GET_RETRY tells when to write the record again.
  *
  * The structure of this file comes from OpenSSL's null filter.
  */
@@ -45,6 +47,7 @@
 #include "config.h"
 
 #include <stdlib.h>
+#include <pthread.h>
 #include <openssl/err.h>
 
 #include "bf_rate_limiter.h"
@@ -55,24 +58,30 @@ static long ratef_ctrl(BIO *h, int cmd, long arg1, void *arg2);
 static int ratef_new(BIO *h);
 static int ratef_free(BIO *h);
 
-static BIO_METHOD methods_ratef = {
-        BIO_TYPE_RATE_FILTER,
-        "Rate limiter filter",
-        ratef_write, // write function, use the two rate limiters
-        ratef_read, // read function, transparent
-        NULL,
-        NULL,
-        ratef_ctrl,
-        ratef_new,
-        ratef_free,
-        NULL
-};
+/* BIO_METHOD describing the filter, built once */
+static BIO_METHOD *methods_ratef = NULL;
+static pthread_once_t methods_ratef_once = PTHREAD_ONCE_INIT;
+
+static void ratef_method_init(void) {
+    BIO_METHOD *m = BIO_meth_new(BIO_TYPE_RATE_FILTER, "Rate limiter filter");
+    if (m == NULL) return;
+    BIO_meth_set_write(m, ratef_write); // use the two rate limiters
+    BIO_meth_set_read(m, ratef_read); // transparent
+    BIO_meth_set_ctrl(m, ratef_ctrl);
+    BIO_meth_set_create(m, ratef_new);
+    BIO_meth_set_destroy(m, ratef_free);
+    methods_ratef = m;
+}
 
 /* global and client: two different rate limiters */
 BIO * BIO_f_new_rate_limiter(struct tb_state* global, struct tb_state* client) {
     BIO *bi;
     struct rate_limiter_data *data;
-    bi = BIO_new(&methods_ratef);
+    pthread_once(&methods_ratef_once, ratef_method_init);
+    if (methods_ratef == NULL) {
+        return NULL;
+    }
+    bi = BIO_new(methods_ratef);
     if (bi == NULL) {
         return NULL;
     }
@@ -83,21 +92,21 @@ BIO * BIO_f_new_rate_limiter(struct tb_state* global, struct tb_state* client) {
     }
     data->client = client;
     data->global = global;
-    bi->ptr = data;
-    bi->init = 1;
+    data->retry = 0;
+    BIO_set_data(bi, data);
+    BIO_set_init(bi, 1);
     return bi;
 }
 
 static int ratef_new(BIO *bi) {
-    bi->init = 0;
-    bi->ptr = NULL;
-    bi->flags = 0;
+    BIO_set_init(bi, 0);
+    BIO_set_data(bi, NULL);
     return 1;
 }
 
 static int ratef_free(BIO *bi) {
     if (bi == NULL) return 0;
-    free(bi->ptr);
+    free(BIO_get_data(bi));
     return 1;
 }
 
@@ -105,46 +114,78 @@ static int ratef_read(BIO *b, char *out, int outl) {
     int ret = 0;
 
     if (out == NULL) return 0;
-    if (b->next_bio == NULL) return 0;
-    ret = BIO_read(b->next_bio, out, outl);
+    if (BIO_next(b) == NULL) return 0;
+    ret = BIO_read(BIO_next(b), out, outl);
     BIO_clear_retry_flags(b);
     BIO_copy_next_retry(b);
     return ret;
 }
 
+/*
+ * Take the tokens of both rate limiters at once: the global one is shared by
+ * all the workers, the tokens taken from the client are given back if it is
+ * empty
+ */
 static int ratef_write(BIO *b, const char *in, int inl) {
     int ret = 0;
-    struct rate_limiter_data *data = (struct rate_limiter_data *) b->ptr;
+    struct rate_limiter_data *data = (struct rate_limiter_data *) BIO_get_data(b);
 
     if ((in == NULL) || inl <=0) return 0;
-    if (b->next_bio == NULL) return 0;
+    if (BIO_next(b) == NULL) return 0;
 
-    if (data->client != NULL)
-        tb_count(data->client, inl);
-    if (data->global != NULL)
-        tb_count(data->global, inl);
-    ret = BIO_write(b->next_bio, in, inl);
     BIO_clear_retry_flags(b);
+    data->retry = 0;
+    if (data->client != NULL
+            && (data->retry = tb_try_count(data->client, inl)) > 0) {
+        BIO_set_retry_write(b);
+        return -1;
+    }
+    if (data->global != NULL
+            && (data->retry = tb_try_count(data->global, inl)) > 0) {
+        if (data->client != NULL)
+            tb_uncount(data->client, inl);
+        BIO_set_retry_write(b);
+        return -1;
+    }
+    ret = BIO_write(BIO_next(b), in, inl);
+    if (ret <= 0 && BIO_should_retry(BIO_next(b))) {
+        /* the record is written again later */
+        if (data->client != NULL)
+            tb_uncount(data->client, inl);
+        if (data->global != NULL)
+            tb_uncount(data->global, inl);
+    }
     BIO_copy_next_retry(b);
     return ret;
 }
 
 static long ratef_ctrl(BIO *b, int cmd, long num, void *ptr) {
-    long ret = 1;
+    long ret = 1, delay;
+    struct rate_limiter_data *data = (struct rate_limiter_data *) BIO_get_data(b);
 
-    if (b->next_bio == NULL) return 0;
+    if (BIO_next(b) == NULL) return 0;
 
     switch(cmd) {
         case BIO_C_DO_STATE_MACHINE:
             BIO_clear_retry_flags(b);
-            ret = BIO_ctrl(b->next_bio, cmd, num, ptr);
+            ret = BIO_ctrl(BIO_next(b), cmd, num, ptr);
             BIO_copy_next_retry(b);
             break;
         case BIO_CTRL_DUP:
             ret = 0L;
             break;
+        case BIO_CTRL_RATE_GET_DELAY:
+            ret = 0;
+            if (data->client != NULL)
+                ret = tb_delay(data->client, (size_t) num);
+            if (data->global != NULL && (delay = tb_delay(data->global, (size_t) num)) > ret)
+                ret = delay;
+            break;
+        case BIO_CTRL_RATE_GET_RETRY:
+            ret = data->retry;
+            break;
         default:
-            ret = BIO_ctrl(b->next_bio, cmd, num, ptr);
+            ret = BIO_ctrl(BIO_next(b), cmd, num, ptr);
     }
     return ret;
 }
@@ -43,12 +43,20 @@
 /* BIO type: filter */
 #define BIO_TYPE_RATE_FILTER    (101|BIO_TYPE_FILTER)
 
+/* delay (usec) before a record of num bytes can be written without waiting
+ * for the tokens, 0 if it can be written now */
+#define BIO_CTRL_RATE_GET_DELAY         130
+/* delay (usec) before the record refused by the last write has its tokens,
+ * 0 if the last write was not refused by the rate limiters */
+#define BIO_CTRL_RATE_GET_RETRY         131
+
 /* Create a new BIO */
 extern BIO *BIO_f_new_rate_limiter(struct tb_state*, struct tb_state*);
 
 struct rate_limiter_data {
     struct tb_state *global;
     struct tb_state *client;
+    long retry;                     // delay returned by the last refused write
 };
 
 
@@ -45,8 +45,6 @@
 #include <sys/time.h>
 #include <fcntl.h>
 #include <getopt.h>
-#include <openssl/conf.h>
-#include <openssl/engine.h>
 #include <sys/mman.h>
 
 
@@ -54,6 +52,7 @@
 #include "net_socket.h"
 #include "communication.h"
 #include "configuration.h"
+#include "peer.h"
 #include "dtls_utils.h"
 #include "../common/log.h"
 #include "../common/pthread_wrap.h"
@@ -198,7 +197,6 @@ static void daemonize(void) {
 static void * sig_handler(void * arg __attribute__((unused))) {
     sigset_t mask;
     int sig;
-    struct itimerval timer_ping;
 
     while (1) {
         sigfillset(&mask);
@@ -209,21 +207,14 @@ static void * sig_handler(void * arg __attribute__((unused))) {
             case SIGINT:
             case SIGQUIT:
                 end_campagnol = 1;
-                // terminate timer
-                timer_ping.it_interval.tv_sec = 0;
-                timer_ping.it_interval.tv_usec = 0;
-                timer_ping.it_value.tv_sec = 0;
-                timer_ping.it_value.tv_usec = 0;
-                setitimer(ITIMER_REAL, &timer_ping, NULL);
+                interrupt_vpn();
                 log_message("Received signal %d, exiting...", sig);
                 return NULL;
-            case SIGALRM:
-                handler_sigTimerPing(sig);
-                break;
             case SIGUSR1:
                 log_message("Received signal %d, reloading client...", sig);
                 end_campagnol = 1;
                 reload = 1;
+                interrupt_vpn();
                 break;
             case SIGUSR2:
                 if (!end_campagnol) {
@@ -241,7 +232,10 @@ static void * sig_handler(void * arg __attribute__((unused))) {
 
 int main (int argc, char **argv) {
     const char *configFile = NULL;
-    int sockfd = 0, tunfd = 0;
+    int sockfd[MAX_PIPELINES], tunfd[MAX_PIPELINES];
+    int sessfd[MAX_SESSIONS];
+    int n_sockfd = 0, n_tunfd = 0, n_sessfd = 0;
+    int i;
     int pa;
     int exit_status = EXIT_SUCCESS;
     int send_bye = 0;
@@ -268,9 +262,7 @@ int main (int argc, char **argv) {
     log_init(config.daemonize, log_level, "campagnol");
 
     /* init openssl */
-    SSL_library_init();
-    SSL_load_error_strings();
-    setup_openssl_thread();
+    OPENSSL_init_ssl(OPENSSL_INIT_LOAD_SSL_STRINGS | OPENSSL_INIT_LOAD_CRYPTO_STRINGS, NULL);
 
     if (parseConfFile(configFile) != 0) {
         goto clean_end;
@@ -304,22 +296,47 @@ int main (int argc, char **argv) {
         if (config.cipher_list) printf("  DTLS cipher list: %s\n", config.cipher_list);
         if (config.crl != NULL) printf("  Using a certificate revocation list: %s\n", config.crl);
         printf("  FIFO size: %d\n", config.FIFO_size);
+        if (config.pipelines > 1) printf("  Pipelines: %d\n", config.pipelines);
         if (config.tb_client_rate > 0) printf("  Outgoing traffic: %.3f kb/s\n", config.tb_client_rate);
         if (config.tb_connection_rate > 0) printf("  Outgoing traffic per connection: %.3f kb/s\n", config.tb_connection_rate);
+        if (config.send_batch > 1) printf("  Send batch: %d records, %d usec\n", config.send_batch, config.send_batch_latency);
         printf("  Timeout: %d sec.\n", config.timeout);
         printf("  Keepalive: %u sec.\n", config.keepalive);
+        if (config.workers > 1) printf("  Worker threads: %d\n", config.workers);
+        if (config.sessions > 1) printf("  Parallel sessions: %d\n", config.sessions);
         printf("  Maximum number of connections: %d\n\n", config.max_clients);
     }
 
-    sockfd = create_socket();
-    if (sockfd < 0) {
-        exit_status = EXIT_FAILURE;
-        goto clean_end;
+    /* one socket per pipeline, sharing the same port */
+    for (i = 0; i < config.pipelines; i++) {
+        sockfd[i] = create_socket();
+        if (sockfd[i] < 0) {
+            exit_status = EXIT_FAILURE;
+            goto clean_end;
+        }
+        n_sockfd++;
+        if (fcntl(sockfd[i], F_SETFL, O_NONBLOCK) == -1) {
+            log_error(errno, "Could not set non-blocking mode on the socket");
+            exit_status = EXIT_FAILURE;
+            goto clean_end;
+        }
     }
-    if (fcntl(sockfd, F_SETFL, O_NONBLOCK) == -1) {
-        log_error(errno, "Could not set non-blocking mode on the socket");
-        exit_status = EXIT_FAILURE;
-        goto clean_end;
+
+    /* one socket per additional parallel session, on the next ports
+     * the session is not used if its socket cannot be opened */
+    sessfd[0] = -1;
+    n_sessfd = 1;
+    for (i = 1; i < config.sessions; i++) {
+        sessfd[i] = create_session_socket(i);
+        n_sessfd++;
+        if (sessfd[i] >= 0 && fcntl(sessfd[i], F_SETFL, O_NONBLOCK) == -1) {
+            log_error(errno, "Could not set non-blocking mode on the socket");
+            close(sessfd[i]);
+            sessfd[i] = -1;
+        }
+        if (sessfd[i] < 0) {
+            log_message("The parallel session %d is disabled", i);
+        }
     }
 
 
@@ -331,10 +348,26 @@ int main (int argc, char **argv) {
     /* start the signal handler */
     createDetachedThread(sig_handler, NULL);
 
-    tunfd = init_tun();
-    if (tunfd < 0) {
-        exit_status = EXIT_FAILURE;
-        goto clean_end;
+    /* one queue per pipeline */
+    for (i = 0; i < config.pipelines; i++) {
+#ifdef HAVE_LINUX
+        tunfd[i] = (i == 0) ? init_tun() : init_tun_queue();
+#else
+        tunfd[i] = init_tun();
+#endif
+        if (tunfd[i] < 0) {
+            exit_status = EXIT_FAILURE;
+            goto clean_end;
+        }
+        n_tunfd++;
+#ifndef HAVE_CYGWIN
+        /* the event loop of comm_tun reads the device until it is empty */
+        if (fcntl(tunfd[i], F_SETFL, O_NONBLOCK) == -1) {
+            log_error(errno, "Could not set non-blocking mode on the TUN device");
+            exit_status = EXIT_FAILURE;
+            goto clean_end;
+        }
+#endif
     }
 
     do {
@@ -345,7 +378,7 @@ int main (int argc, char **argv) {
 
         log_message("Starting VPN");
 
-        if (start_vpn(sockfd, tunfd) == -1) {
+        if (start_vpn(sockfd, tunfd, sessfd) == -1) {
             send_bye = 1;
             exit_status = EXIT_FAILURE;
         }
@@ -363,32 +396,27 @@ int main (int argc, char **argv) {
         smsg.port = 0;
         smsg.type = BYE;
         log_message_level(2, "Sending BYE");
-        xsendto(sockfd,&smsg,sizeof(smsg),0,(struct sockaddr *)&config.serverAddr, sizeof(config.serverAddr));
+        xsendto(sockfd[0],&smsg,sizeof(smsg),0,(struct sockaddr *)&config.serverAddr, sizeof(config.serverAddr));
     }
 
-    if (tunfd > 0)
-        close_tun(tunfd);
-    if (sockfd > 0)
-        close(sockfd);
+    /* the device is destroyed with its last queue */
+    for (i = n_tunfd - 1; i > 0; i--)
+        close(tunfd[i]);
+    if (n_tunfd > 0)
+        close_tun(tunfd[0]);
+    for (i = 0; i < n_sockfd; i++)
+        close(sockfd[i]);
+    for (i = 1; i < n_sessfd; i++) {
+        if (sessfd[i] >= 0)
+            close(sessfd[i]);
+    }
 
     log_close();
 
-    /* try to clean up everything in openssl
-     * OpenSSL has no cleanup function
-     * AFAIK there is nothing to cleanup the compression methods
-     */
     // free the strings stored in config
     freeConfig();
-    // thread error state. must be called by each thread
+    // thread local state. the global state of OpenSSL is freed at exit
     SSL_REMOVE_ERROR_STATE;
-    cleanup_openssl_thread();
-    // engine
-    ENGINE_cleanup();
-    CONF_modules_free();
-
-    ERR_free_strings();
-    EVP_cleanup();
-    CRYPTO_cleanup_all_ex_data();
 
     exit(exit_status);
 }
@@ -60,12 +60,8 @@
 #include <openssl/err.h>
 
 
-#ifdef HAVE_CRYPTO_THREADID_CURRENT
-/* new THREADID API, ERR_remove_state is deprecated */
-#   define SSL_REMOVE_ERROR_STATE ERR_remove_thread_state(NULL)
-#else
-#   define SSL_REMOVE_ERROR_STATE ERR_remove_state(0)
-#endif
+/* free the thread local state of OpenSSL (error queue...) */
+#define SSL_REMOVE_ERROR_STATE OPENSSL_thread_stop()
 
 
 /*
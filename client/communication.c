@@ -52,9 +52,22 @@
 #include "dtls_utils.h"
 #include "tun_device.h"
 #include "../common/log.h"
+#include "../common/clock.h"
 #include "../common/bss_fifo.h"
+#include "bf_batch.h"
+#include "bf_rate_limiter.h"
+#include "event_loop.h"
+#include "tun_writer.h"
+#ifdef HAVE_LINUX
+#   include "tun_offload.h"
+#endif
+#ifdef HAVE_IO_URING
+#   include "uring.h"
+#endif
 
 struct tb_state global_rate_limiter;
+struct pkt_pool *packet_pool = NULL;
+struct pkt_pool *recv_pool = NULL;
 
 
 /* Initialise a message with the given fields */
@@ -65,24 +78,51 @@ static inline void init_smsg(message_t *smsg, unsigned char type, uint32_t ip1,
     smsg->ip2.s_addr = ip2;
 }
 
-/* Initialise a timeval structure to use with select */
-static inline void init_timeout(struct timeval *timeout) {
-    timeout->tv_sec = SELECT_DELAY_SEC;
-    timeout->tv_usec = SELECT_DELAY_USEC;
+/*
+ * Registered in the event loops of comm_socket and comm_tun
+ * Signaled by interrupt_vpn so that the threads see end_campagnol without
+ * waiting for the timeout
+ */
+static struct evnotifier vpn_stop = {-1, -1};
+
+void interrupt_vpn(void) {
+    if (vpn_stop.wfd != -1) {
+        evnotifier_signal(&vpn_stop);
+    }
+}
+
+/* The data plane pipelines (one UDP socket and one TUN queue each) */
+static struct comm_args pipelines[MAX_PIPELINES];
+static struct tun_writer tun_writers[MAX_PIPELINES];
+
+/*
+ * Pipeline used to reach a peer
+ * The choice only depends on the VPN IP address so that the packets sent to a
+ * given peer always go through the same UDP socket.
+ */
+static inline struct comm_args *peer_pipeline(struct in_addr vpnIP) {
+    return &pipelines[ntohl(vpnIP.s_addr) % config.pipelines];
 }
 
 /*
- * Handler for SIGALRM
- * send a PING message
+ * Timer of the PING messages, run by the first worker
+ * The messages are sent once the client is registered with the RDV server.
  */
+static struct wheel_timer ping_timer;
+static volatile int ping_started = 0;
+static volatile int ping_enabled = 0;
 static int sockfd_global;
-void handler_sigTimerPing(int sig __attribute__((unused))) {
+
+static void ping_timer_run(struct wheel_timer *t, void *arg) {
     message_t smsg;
-    /* send a PING message to the RDV server */
-    init_smsg(&smsg, PING,0,0);
-    ssize_t s = xsendto(sockfd_global, &smsg, sizeof(smsg), 0,
-            (struct sockaddr *) &config.serverAddr, sizeof(config.serverAddr));
-    if (s == -1) log_error(errno, "PING");
+    if (ping_enabled) {
+        /* send a PING message to the RDV server */
+        init_smsg(&smsg, PING,0,0);
+        ssize_t s = xsendto_nowait(sockfd_global, &smsg, sizeof(smsg), 0,
+                (struct sockaddr *) &config.serverAddr, sizeof(config.serverAddr));
+        if (s == -1) log_error(errno, "PING");
+    }
+    worker_add_timer((struct peer_worker *) arg, t, clock_now_ms() + TIMER_PING_MS);
 }
 
 /*
@@ -112,691 +152,1543 @@ static uint16_t compute_csum(uint16_t *addr, size_t count){
 
 
 /*
- * Function sending the punch messages for UDP hole punching
- * arg: struct punch_arg
+ * Engine of the peers
+ *
+ * The connections are driven by the worker threads (see peer_worker.c). A
+ * peer is run when one of its FIFOs receives a packet, when the RDV server or
+ * the other peer answers, or when its timer expires. The run function goes
+ * through the states of the connection without waiting:
+ * - NEW: ask the RDV server for the endpoint of the peer
+ * - PUNCHING: send the punch messages and wait for one from the peer
+ * - LINKED: DTLS handshake
+ * - ESTABLISHED: decrypt the incoming records, encrypt the outgoing packets,
+ *   send the keepalive messages and check the inactivity timeout
+ * - CLOSED: the peer is destroyed
+ */
+
+#if 0
+#   define CHANGE_STATE(peer,_state) do { \
+    printf("%X %d->%d\n", (peer)->vpnIP.s_addr, (peer)->state, _state); \
+    (peer)->state = _state; (peer)->deadline = 0; \
+    } while (0)
+#else
+#   define CHANGE_STATE(peer,_state) do { (peer)->state = _state; (peer)->deadline = 0; } while (0)
+#endif
+
+/* context of a worker thread, shared by its peers */
+struct peer_worker_ctx {
+    struct pkt_buf *pkt;                        // buffer of the next decrypted packet, NULL once handed over
+};
+
+static void *peer_worker_init(struct peer_worker *w) {
+    struct peer_worker_ctx *ctx = CHECK_ALLOC_FATAL(malloc(sizeof(struct peer_worker_ctx)));
+    ctx->pkt = NULL;
+    /* the PING messages are sent by one of the workers */
+    if (__sync_bool_compare_and_swap(&ping_started, 0, 1)) {
+        ping_timer.fn = ping_timer_run;
+        worker_add_timer(w, &ping_timer, clock_now_ms() + TIMER_PING_MS);
+    }
+    return ctx;
+}
+
+static void peer_worker_cleanup(void *arg) {
+    struct peer_worker_ctx *ctx = (struct peer_worker_ctx *) arg;
+    if (ctx->pkt != NULL)
+        pkt_free(ctx->pkt);
+    free(ctx);
+}
+
+/* earliest of two deadlines, 0 means no deadline */
+static inline uint64_t earliest(uint64_t a, uint64_t b) {
+    if (a == 0) return b;
+    if (b == 0) return a;
+    return (a < b) ? a : b;
+}
+
+/* Tell the RDV server that the connection with peer is closed
+ * The parallel sessions are unknown to the server */
+static inline void send_close_connection(struct client *peer) {
+    message_t smsg;
+    if (peer->primary != NULL)
+        return;
+    init_smsg(&smsg, CLOSE_CONNECTION, peer->vpnIP.s_addr, 0);
+    xsendto_nowait(peer->sockfd, &smsg, sizeof(smsg), 0, (struct sockaddr *)&config.serverAddr, sizeof(config.serverAddr));
+}
+
+/*
+ * Hand a new peer over to its worker
+ */
+static void start_peer_handling(struct client *peer) {
+    worker_attach(peer);
+}
+
+/*
+ * Close the connection with a peer.
+ * The worker of the peer closes the DTLS session and destroys the peer.
+ *
+ * islocked: the peer's mutex is currently locked. It will be unlocked when the
+ * function returns.
+ */
+static inline void end_peer_handling(struct client *peer, int islocked) {
+    if (!islocked) {
+        CLIENT_MUTEXLOCK(peer);
+    }
+    peer->shutdown = 1;
+    CLIENT_MUTEXUNLOCK(peer);
+    worker_schedule(peer);
+}
+
+/*
+ * Parallel sessions (config.sessions)
+ *
+ * Once the connection with a peer is established, both peers open the
+ * additional sessions: the session n goes from our socket on local_port + n
+ * to the port of the peer + n. It starts with the hole punching, without the
+ * RDV server. The session is also opened when the first PUNCH message of the
+ * other peer is received on the session socket.
+ *
+ * The server does not know these ports, so the PUNCH messages of a session
+ * carry a token exported from the DTLS session of the main connection: only
+ * the peer holding its keys announces the session, a PUNCH from another
+ * source or with a wrong token is ignored.
+ *
+ * comm_tun spreads the packets sent to the peer over its established
+ * sessions by flow. Each session has its own worker, SSL structure and FIFOs.
+ * A session holds a reference on the main connection and is closed with it.
+ */
+static struct comm_args session_sockets[MAX_SESSIONS];
+
+/*
+ * Derive the tokens of the sessions once the main connection is established
+ * Both peers export the same keying material
+ */
+static void sessions_announce(struct client *primary) {
+    static const char label[] = "EXPORTER-campagnol-sessions";
+
+    if (SSL_export_keying_material(primary->ssl,
+            &primary->session_tokens[0][0], sizeof(primary->session_tokens),
+            label, sizeof(label) - 1, NULL, 0, 0) != 1) {
+        log_message("Cannot export the tokens of the sessions with peer %s", inet_ntoa(primary->vpnIP));
+        ERR_print_errors_fp(stderr);
+        return;
+    }
+    __sync_synchronize();
+    primary->sessions_announced = 1;
+}
+
+/* The token is sent in the port and ip2 fields */
+static inline void session_token_put(message_t *smsg, const unsigned char *token) {
+    memcpy(&smsg->port, token, 2);
+    memcpy(&smsg->ip2, token + 2, SESSION_TOKEN_LEN - 2);
+}
+
+static inline void session_token_get(const message_t *smsg, unsigned char *token) {
+    memcpy(token, &smsg->port, 2);
+    memcpy(token + 2, &smsg->ip2, SESSION_TOKEN_LEN - 2);
+}
+
+/*
+ * Open the session of primary (with a reference), NULL if it cannot be opened
  */
-static void *punch(void *arg) {
+static struct client *session_open(struct client *primary, int session) {
+    struct client *peer;
+
+    if (session_sockets[session].sockfd < 0)
+        return NULL;
+    peer = peers_add_session(primary, session, session_sockets[session].sockfd,
+            PUNCHING, clock_now());
+    if (peer != NULL) {
+        start_peer_handling(peer);
+    }
+    return peer;
+}
+
+/* Open the missing sessions of an established connection */
+static void sessions_open_missing(struct client *primary) {
+    struct client *peer;
+    int i;
+
+    for (i = 1; i < config.sessions; i++) {
+        if (primary->sessions[i] == NULL && (peer = session_open(primary, i)) != NULL) {
+            peers_decr_ref(peer, 1);
+        }
+    }
+}
+
+/* Close the sessions of a connection */
+static void sessions_close(struct client *primary) {
+    struct client *peer;
     int i;
-    struct client *peer = (struct client *)arg;
+
+    for (i = 1; i < config.sessions; i++) {
+        if ((peer = peers_find_session(primary, i)) != NULL) {
+            end_peer_handling(peer, 0);
+            peers_decr_ref(peer, 1);
+        }
+    }
+}
+
+/*
+ * A PUNCH message from addr was received on the socket of a session: open the
+ * session if it comes from the port of an established peer + session and
+ * carries the token of this session
+ * Return the session with a reference, or NULL
+ */
+static struct client *session_accept(int session, message_t *msg, struct sockaddr_in *addr) {
+    struct client *primary, *peer = NULL;
+    struct in_addr ip1 = msg->ip1;
+    unsigned char token[SESSION_TOKEN_LEN];
+
+    primary = peers_find_by_VPN(&ip1);
+    if (primary == NULL)
+        return NULL;
+    session_token_get(msg, token);
+    if (primary->state == ESTABLISHED && primary->sessions_announced
+            && primary->clientaddr.sin_addr.s_addr == addr->sin_addr.s_addr
+            && ntohs(primary->clientaddr.sin_port) + session == ntohs(addr->sin_port)) {
+        __sync_synchronize(); // session_tokens is written before sessions_announced
+        if (CRYPTO_memcmp(token, primary->session_tokens[session], SESSION_TOKEN_LEN) == 0) {
+            peer = session_open(primary, session);
+        }
+        else {
+            log_message_level(2, "Invalid PUNCH message for the session %d of peer %s",
+                    session, inet_ntoa(primary->vpnIP));
+        }
+    }
+    peers_decr_ref(primary, 1);
+    return peer;
+}
+
+/*
+ * Send the punch messages for UDP hole punching
+ * PUNCH_NUMBER messages are sent every PUNCH_DELAY_USEC, whatever the state
+ * of the connection: the other peer may still be waiting for them.
+ */
+static void peer_punch(struct client *peer, uint64_t now) {
     message_t smsg;
+
+    if (peer->punch_next == 0 || now < peer->punch_next)
+        return;
+    if (peer->punch_count == 0)
+        log_message_level(2, "Punching %s %d", inet_ntoa(peer->clientaddr.sin_addr), ntohs(peer->clientaddr.sin_port));
     init_smsg(&smsg, PUNCH, config.vpnIP.s_addr, 0);
-    log_message_level(2, "Punching %s %d", inet_ntoa(peer->clientaddr.sin_addr), ntohs(peer->clientaddr.sin_port));
-    for (i=0; i<PUNCH_NUMBER; i++) {
-        CLIENT_MUTEXLOCK(peer);
-        if (peer->state == CLOSED) {
-            CLIENT_MUTEXUNLOCK(peer);
-            break;
+    if (peer->primary != NULL) {
+        session_token_put(&smsg, peer->primary->session_tokens[peer->session]);
+    }
+    xsendto_nowait(peer->sockfd,&smsg,sizeof(smsg),0,(struct sockaddr *)&(peer->clientaddr), sizeof(peer->clientaddr));
+    peer->punch_count++;
+    peer->punch_next = (peer->punch_count < PUNCH_NUMBER) ? now + PUNCH_DELAY_USEC / 1000 : 0;
+}
+
+/*
+ * Send the close notify alert
+ * The worker does not wait for the socket: the alert is written again once if
+ * it could not be sent, then the session is closed anyway.
+ */
+static void peer_ssl_shutdown(struct client *peer) {
+    int r = SSL_shutdown(peer->ssl);
+    if (r < 0 && SSL_get_error(peer->ssl, r) == SSL_ERROR_WANT_WRITE) {
+        /* the alert is still pending, dispatch it again */
+        SSL_shutdown(peer->ssl);
+    }
+    ERR_print_errors_fp(stderr);
+}
+
+/*
+ * NEW: ask the RDV server for a new connection with peer
+ * rdv_handling schedules the peer when the answer is received
+ */
+static uint64_t peer_connect(struct client *peer, uint64_t now) {
+    message_t smsg;
+
+    CLIENT_MUTEXLOCK(peer);
+    if (end_campagnol || peer->shutdown) {
+        CHANGE_STATE(peer, CLOSED);
+    }
+    else if (peer->deadline == 0) {
+        init_smsg(&smsg, ASK_CONNECTION, peer->vpnIP.s_addr, 0);
+        xsendto_nowait(peer->sockfd,&smsg,sizeof(smsg),0,(struct sockaddr *)&config.serverAddr, sizeof(config.serverAddr));
+        peer->deadline = now + CONNECT_TIMEOUT_MS;
+    }
+    else if (peer->rdv_answer == ANS_CONNECTION) {
+        // the RDV accepted the connection,
+        // we now know the public endpoint of the peer
+        if (peers_register_endpoint(peer) != 0) {
+            CHANGE_STATE(peer, CLOSED);
+        }
+        else {
+            CHANGE_STATE(peer, PUNCHING);
         }
+    }
+    else if (peer->rdv_answer == REJ_CONNECTION || now >= peer->deadline) {
+        // timeout or connection rejected by the RDV
+        CHANGE_STATE(peer, CLOSED);
+    }
+    CLIENT_MUTEXUNLOCK(peer);
+    return peer->deadline;
+}
+
+/*
+ * PUNCHING: start punching and wait for a punch message from the peer
+ * comm_socket schedules the peer when it receives one
+ */
+static uint64_t peer_wait_punch(struct client *peer, uint64_t now) {
+    CLIENT_MUTEXLOCK(peer);
+    if (end_campagnol || peer->shutdown) {
+        CHANGE_STATE(peer, CLOSED);
+        CLIENT_MUTEXUNLOCK(peer);
+        return 0;
+    }
+    if (peer->deadline == 0) {
+        peer->deadline = now + CONNECT_TIMEOUT_MS;
+        peer->punch_count = 0;
+        peer->punch_next = now;
+    }
+    if (peer->punched) {
+        CHANGE_STATE(peer, LINKED);
+    }
+    else if (now >= peer->deadline) {
+        // timeout
+        CHANGE_STATE(peer, CLOSED);
         CLIENT_MUTEXUNLOCK(peer);
-        xsendto(peer->sockfd,&smsg,sizeof(smsg),0,(struct sockaddr *)&(peer->clientaddr), sizeof(peer->clientaddr));
-        usleep(PUNCH_DELAY_USEC);
+        send_close_connection(peer);
+        return 0;
     }
-    peers_decr_ref(peer, 1);
-    pthread_exit(NULL);
+    CLIENT_MUTEXUNLOCK(peer);
+    return peer->deadline;
 }
 
 /*
- * Create a thread executing "punch"
+ * Next attempt to write a record refused by the rate limiters (when they have
+ * the tokens) or by the full socket
  */
-static void start_punch(struct client *peer) {
-    peers_incr_ref(peer);
-    createDetachedThread(punch, (void *)peer);
+static uint64_t peer_write_retry(struct client *peer, uint64_t now) {
+    long delay = BIO_ctrl(peer->wbio, BIO_CTRL_RATE_GET_RETRY, 0, NULL);
+    return (delay > 0) ? now + (uint64_t) (delay + 999) / 1000 : now + 1;
 }
 
 /*
- * Thread associated with each SSL stream
- *
- * read the outgoing packets from peer->out_fifo
- * and write them to the SSL stream
- */
-static void *SSL_writing(void *args) {
-    fd_set set;
-    struct client *peer = (struct client *) args;
-    int r, w, err;
-    int packet_len = MESSAGE_MAX_LENGTH;
-    char *packet = CHECK_ALLOC_FATAL(malloc(packet_len));
-
-    /* stop dropping packets when this fifo is full */
-    BIO_ctrl(peer->out_fifo, BIO_CTRL_FIFO_SET_DROPTAIL, 0, NULL);
-
-    while (1) {
-        r = BIO_read(peer->out_fifo, packet, packet_len);
-        if (r == 0)
-            break;
-        do {
-            w = SSL_write(peer->ssl, packet, r);
-            if (w <= 0) {
-                if (BIO_should_write(peer->wbio)) {
-                    FD_ZERO(&set);
-                    FD_SET(peer->sockfd, &set);
-                    select(peer->sockfd+1, NULL, &set, NULL, NULL);
-                }
-                else {
+ * LINKED: DTLS handshake
+ * The handshake goes on each time a record is received. The last flight is
+ * sent again by DTLSv1_handle_timeout when the DTLS timer expires.
+ */
+static uint64_t peer_handshake(struct client *peer, uint64_t now) {
+    struct timeval tv;
+    int r;
+    long timer;
+    unsigned int mtu;
+
+    if (end_campagnol || peer->shutdown) {
+        CLIENT_MUTEXLOCK(peer);
+        CHANGE_STATE(peer, CLOSED);
+        CLIENT_MUTEXUNLOCK(peer);
+        return 0;
+    }
+    if (peer->deadline == 0) {
+        BIO_ctrl(peer->wbio, BIO_CTRL_DGRAM_SET_PEER, 0, &peer->clientaddr);
+        peer->deadline = now + CONNECT_TIMEOUT_MS;
+    }
+
+    r = SSL_do_handshake(peer->ssl);
+    if (r != 1 && SSL_get_error(peer->ssl, r) == SSL_ERROR_WANT_WRITE) {
+        // a flight waits for the tokens of the rate limiters or for the socket
+        return peer_write_retry(peer, now);
+    }
+    if (r != 1 && SSL_get_error(peer->ssl, r) == SSL_ERROR_WANT_READ) {
+        timer = DTLSv1_get_timeout(peer->ssl, &tv);
+        if (timer && tv.tv_sec == 0 && tv.tv_usec == 0) {
+            // the DTLS timer expired, send the last flight again
+            // a record which could not be written is sent with the next one
+            timer = (DTLSv1_handle_timeout(peer->ssl) < 0 && !BIO_should_write(peer->wbio)) ?
+                    -1 : DTLSv1_get_timeout(peer->ssl, &tv);
+        }
+        if (timer > 0) {
+            return now + (uint64_t) tv.tv_sec * 1000 + (uint64_t) (tv.tv_usec + 999) / 1000;
+        }
+        // no DTLS timer: waiting for the first message of the other peer
+        if (timer == 0 && now < peer->deadline) {
+            return peer->deadline;
+        }
+    }
+
+    if (r != 1) {
+        log_message("Error during DTLS handshake with peer %s", inet_ntoa(peer->vpnIP));
+        ERR_print_errors_fp(stderr);
+        send_close_connection(peer);
+        CLIENT_MUTEXLOCK(peer);
+        CHANGE_STATE(peer, CLOSED);
+        CLIENT_MUTEXUNLOCK(peer);
+        return 0;
+    }
+
+    if (config.sessions > 1 && peer->primary == NULL) {
+        sessions_announce(peer);
+    }
+
+    CLIENT_MUTEXLOCK(peer);
+    CHANGE_STATE(peer, ESTABLISHED);
+    peer->rx.time = clock_now();
+
+    // Compute the MTU of the records so that a packet of the TUN device
+    // fits in one record with the negotiated cipher (CBC or AEAD)
+    mtu = dtls_set_data_mtu(peer->ssl, config.tun_mtu);
+
+    log_message_level(2, "Internal MTU adjusted to %u (%s)", mtu, SSL_get_cipher_name(peer->ssl));
+    peer->tx_overhead = (int) mtu - config.tun_mtu;
+
+    CLIENT_MUTEXUNLOCK(peer);
+
+    log_message_level(1, "New DTLS connection opened with peer %s", inet_ntoa(peer->vpnIP));
+    if (SSL_session_reused(peer->ssl)) {
+        log_message_level(2, "DTLS session resumed with peer %s", inet_ntoa(peer->vpnIP));
+    }
+    /* the records are now sent by batches, see bf_batch.c */
+    BIO_ctrl(peer->wbio, BIO_CTRL_BATCH_SET_ENABLED, 1, NULL);
+    return 0;
+}
+
+/*
+ * Read and uncrypt the records queued in peer->rbio, hand them over to the
+ * writer of the TUN queue
+ * Return 0 when the FIFO is empty, 1 if more records must be read, -1 if the
+ * DTLS session is closed
+ */
+static int peer_read_records(struct client *peer, struct peer_worker_ctx *ctx) {
+    int n, r, err, ret = 0;
+    packet_t u; // union used to receive the messages
+    int u_len;
+    time_t timestamp;
+    struct tun_writer *writer = peer_pipeline(peer->vpnIP)->writer;
+
+    for (n = 0; n < PEER_RUN_BUDGET; n++) {
+        /* decrypt in a pool buffer, given to the TUN writer without copy */
+        if (ctx->pkt == NULL) {
+            ctx->pkt = CHECK_ALLOC_FATAL(pkt_alloc(packet_pool));
+        }
+        u.raw = ctx->pkt->data;
+        u_len = (int) ctx->pkt->size;
+        r = SSL_read(peer->ssl, u.raw, u_len);
+        if (r <= 0) { // empty FIFO, error or shutdown
+            err = SSL_get_error(peer->ssl, r);
+            switch(err) {
+                case SSL_ERROR_WANT_WRITE:
+                case SSL_ERROR_WANT_READ:
+                    break;
+                case SSL_ERROR_ZERO_RETURN: // shutdown received
+                    log_message_level(1, "DTLS connection closed by peer %s", inet_ntoa(peer->vpnIP));
+                    /* answer the close notify, the session stays resumable */
+                    peer_ssl_shutdown(peer);
+                    ret = -1;
+                    break;
+                default:
+                    ERR_print_errors_fp(stderr);
+                    log_message("DTLS error, shutting down the connexion.");
+                    ret = -1;
                     break;
-                }
             }
-            else {
+            break;
+        }
+        if (r == u_len && SSL_pending(peer->ssl) > 0) {
+            /* larger than the buffers (MTU + 200), drop the whole record */
+            while (SSL_pending(peer->ssl) > 0 && SSL_read(peer->ssl, u.raw, u_len) > 0);
+            continue;
+        }
+        timestamp = clock_now();
+        peer->rx.time = timestamp;
+        peer->rx.packets++;
+        peer->rx.bytes += r;
+        if (config.debug)
+            printf(
+                    "<< Received a VPN message: size %d from SRC = %"PRIu32".%"PRIu32".%"PRIu32".%"PRIu32" to DST = %"PRIu32".%"PRIu32".%"PRIu32".%"PRIu32"\n",
+                    r, (ntohl(u.ip->ip_src.s_addr) >> 24) & 0xFF,
+                    (ntohl(u.ip->ip_src.s_addr) >> 16) & 0xFF,
+                    (ntohl(u.ip->ip_src.s_addr) >> 8) & 0xFF,
+                    (ntohl(u.ip->ip_src.s_addr) >> 0) & 0xFF,
+                    (ntohl(u.ip->ip_dst.s_addr) >> 24) & 0xFF,
+                    (ntohl(u.ip->ip_dst.s_addr) >> 16) & 0xFF,
+                    (ntohl(u.ip->ip_dst.s_addr) >> 8) & 0xFF,
+                    (ntohl(u.ip->ip_dst.s_addr) >> 0) & 0xFF);
+        /*
+         * If dest IP = VPN broadcast VPN
+         * The TUN device creates a point to point connection which
+         * does not transmit the broadcast IP
+         * So alter the dest. IP to the normal VPN IP
+         * and compute the new checksum
+         */
+        if (u.ip->ip_dst.s_addr == config.vpnBroadcastIP.s_addr) {
+            u.ip->ip_dst.s_addr = config.vpnIP.s_addr;
+            u.ip->ip_sum = 0; // the checksum field is set to 0 for the calculation
+            u.ip->ip_sum = compute_csum((uint16_t*) u.ip, sizeof(*u.ip));
+        }
+        // send it to the TUN device, the writer takes the buffer
+        tun_writer_push(writer, ctx->pkt, u.raw, r);
+        ctx->pkt = NULL;
+    }
+    if (n == PEER_RUN_BUDGET)
+        ret = 1;
+    return ret;
+}
+
+/*
+ * The socket of the peer is full: run the peer again when it can be written,
+ * or in 1 ms if the worker cannot wait for it
+ */
+static void peer_wait_write(struct client *peer, uint64_t now) {
+    if (worker_wait_write(peer, peer->sockfd) == 0) {
+        peer->tx_retry = 0;
+    }
+    else {
+        peer->tx_retry = now + 1;
+    }
+}
+
+/*
+ * Write the packets queued by comm_tun in peer->out_fifo to the SSL stream
+ * A packet which can't be written now (rate limiters, full socket) is kept in
+ * peer->tx_pkt until peer->tx_retry or until the socket
+ * can be written.
+ * Return 0 when the FIFO is empty or the worker must wait, 1 if more packets
+ * must be written, -1 if the DTLS session is closed
+ */
+static int peer_write_records(struct client *peer, uint64_t now) {
+    int n, r, w, err, ret = 0;
+    long delay;
+
+    peer->tx_retry = 0;
+    for (n = 0; n < PEER_RUN_BUDGET; n++) {
+        if (peer->tx_pkt == NULL) {
+            /* take the packet queued by comm_tun, without copying it */
+            r = BIO_fifo_pop(peer->out_fifo, &peer->tx_pkt, &peer->tx_data);
+            if (r == -1) {
+                peer->tx_pkt = NULL;
+                break;
+            }
+            if (r == 0) {
+                pkt_free(peer->tx_pkt);
+                peer->tx_pkt = NULL;
+                continue;
+            }
+            peer->tx_len = r;
+        }
+        /* wait for the tokens instead of sleeping in the rate limiter */
+        if (config.tb_client_size != 0 || config.tb_connection_size != 0) {
+            delay = BIO_ctrl(peer->wbio, BIO_CTRL_RATE_GET_DELAY, peer->tx_len + peer->tx_overhead, NULL);
+            if (delay > 0) {
+                peer->tx_retry = now + (uint64_t) (delay + 999) / 1000;
                 break;
             }
-        } while (1);
+        }
+        /* the record carries the DSCP of the inner packet */
+        if (config.dscp_priority && (peer->tx_data[1] & 0xFC) != peer->tos) {
+            peer->tos = peer->tx_data[1] & 0xFC;
+            BIO_ctrl(peer->wbio, BIO_CTRL_BATCH_SET_TOS, peer->tos, NULL);
+        }
+        w = SSL_write(peer->ssl, peer->tx_data, peer->tx_len);
+        if (w <= 0 && BIO_should_write(peer->wbio)) {
+            delay = BIO_ctrl(peer->wbio, BIO_CTRL_RATE_GET_RETRY, 0, NULL);
+            if (delay > 0) {
+                /* another worker took the tokens of the global rate limiter */
+                peer->tx_retry = now + (uint64_t) (delay + 999) / 1000;
+            }
+            else {
+                /* the socket is full, write the same record again when it
+                 * can be written */
+                peer_wait_write(peer, now);
+            }
+            break;
+        }
+        pkt_free(peer->tx_pkt);
+        peer->tx_pkt = NULL;
 
-        if (w <= 0) {
+        if (w > 0) {
+            peer->tx.time = clock_now();
+            peer->tx.packets++;
+            peer->tx.bytes += w;
+        }
+        else {
             err = SSL_get_error(peer->ssl, w);
             if (err == SSL_ERROR_ZERO_RETURN)
-                break;
+                return -1;
             else if (err == SSL_ERROR_SSL && !SSL_get_shutdown(peer->ssl)) {
                 ERR_print_errors_fp(stderr);
-                break;
+                return -1;
             }
         }
     }
-    free(packet);
-    SSL_REMOVE_ERROR_STATE;
-    peers_decr_ref(peer, 1);
-    return NULL;
+    if (n == PEER_RUN_BUDGET) {
+        ret = 1;
+    }
+    else {
+        /* the FIFO is drained or the worker waits, send the batch */
+        (void) BIO_flush(peer->wbio);
+        if (BIO_wpending(peer->wbio) > 0) {
+            peer_wait_write(peer, now);
+        }
+    }
+    return ret;
 }
 
 /*
- * Create the SSL_writing thread.
- * Must be called when the DTLS session is opened
+ * ESTABLISHED: transfer the records, send the keepalive messages and close the
+ * inactive connections
  */
-static void start_SSL_writing(struct client *peer) {
-    peers_incr_ref(peer);
-    createDetachedThread(SSL_writing, peer);
+static uint64_t peer_transfer(struct client *peer, struct peer_worker_ctx *ctx, uint64_t now) {
+    message_t smsg;
+    int r, w;
+    time_t timestamp, activity, limit, keepalive;
+    uint64_t retry = 0;
+
+    if (peer->shutdown) { // end_peer_handling was called
+        log_message_level(1, "Closing DTLS connection with peer %s", inet_ntoa(peer->vpnIP));
+        peer_ssl_shutdown(peer);
+        CLIENT_MUTEXLOCK(peer);
+        CHANGE_STATE(peer, CLOSED);
+        CLIENT_MUTEXUNLOCK(peer);
+        return 0;
+    }
+
+    /* the main connection opens its parallel sessions */
+    if (config.sessions > 1 && peer->primary == NULL && peer->sessions_announced) {
+        if (now >= peer->sessions_retry) {
+            sessions_open_missing(peer);
+            peer->sessions_retry = now + SESSION_RETRY_MS;
+        }
+        retry = peer->sessions_retry;
+    }
+
+    r = peer_read_records(peer, ctx);
+    w = (r != -1) ? peer_write_records(peer, now) : -1;
+    if (r == -1 || w == -1) {
+        CLIENT_MUTEXLOCK(peer);
+        CHANGE_STATE(peer, CLOSED);
+        CLIENT_MUTEXUNLOCK(peer);
+        return 0;
+    }
+    if (r == 1 || w == 1) {
+        /* let the other peers of the worker run before going on */
+        worker_schedule(peer);
+    }
+
+    // check whether the connection is active and send keepalive messages
+    timestamp = clock_now();
+    activity = peers_last_activity(peer);
+    keepalive = (time_t) config.keepalive;
+    limit = peer->is_dtls_client ? config.timeout : config.timeout + 10;
+    CLIENT_MUTEXLOCK(peer);
+    if (timestamp - activity > keepalive
+            && timestamp - peer->rx.last_keepalive > keepalive) {
+        init_smsg(&smsg, PUNCH_KEEP_ALIVE, 0, 0);
+        xsendto_nowait(peer->sockfd ,&smsg, sizeof(smsg), 0, (struct sockaddr *)&(peer->clientaddr), sizeof(peer->clientaddr));
+        peer->rx.last_keepalive = timestamp;
+    }
+
+    if ((timestamp - activity) > limit) {
+        log_message_level(2, "Session timeout: %s", inet_ntoa(peer->vpnIP));
+        log_message_level(1, "Closing DTLS connection with peer %s", inet_ntoa(peer->vpnIP));
+        CHANGE_STATE(peer, CLOSED);
+        CLIENT_MUTEXUNLOCK(peer);
+        send_close_connection(peer);
+        peer_ssl_shutdown(peer);
+        return 0;
+    }
+    CLIENT_MUTEXUNLOCK(peer);
+
+    /* run again for the next keepalive message or the timeout */
+    timestamp = activity + limit;
+    if (activity < peer->rx.last_keepalive)
+        activity = peer->rx.last_keepalive;
+    if (activity + keepalive < timestamp)
+        timestamp = activity + keepalive;
+    return earliest(earliest((uint64_t) (timestamp + 1) * 1000,
+            peer->tx_retry), retry);
 }
 
 /*
- * Kill the SSL_writing thread
+ * CLOSED: release the worker's reference, the peer is destroyed
  */
-static void end_SSL_writing(struct client *peer) {
-    BIO_write(peer->out_fifo, &peer, 0);
+static void peer_close(struct client *peer) {
+    /* send the remaining records */
+    BIO_ctrl(peer->wbio, BIO_CTRL_BATCH_SET_ENABLED, 0, NULL);
+    BIO_ctrl(peer->wbio, BIO_CTRL_BATCH_SET_TOS, 0, NULL);
+    if (peer->tx_pkt != NULL) {
+        pkt_free(peer->tx_pkt);
+        peer->tx_pkt = NULL;
+    }
+    if (config.sessions > 1 && peer->primary == NULL) {
+        sessions_close(peer);
+    }
+    worker_detach(peer);
+    /* remove one ref. for the worker and the last ref to destroy the
+     * client
+     */
+    peers_decr_ref(peer, 2); // now this peer is dead.
 }
 
-#if 0
-#   define CHANGE_STATE(peer,_state) \
-    printf("%X %d->%d\n", peer->vpnIP.s_addr, peer->state, _state); \
-    peer->state = _state;
-#else
-#   define CHANGE_STATE(peer,_state) peer->state = _state;
-#endif
+/*
+ * Run function of the workers
+ * A step changing the state is followed by the step of the new state.
+ */
+static void peer_run(struct client *peer, void *arg) {
+    struct peer_worker_ctx *ctx = (struct peer_worker_ctx *) arg;
+    uint64_t now = clock_now_ms();
+    uint64_t timer = 0;
+    int state;
+
+    /* a session is closed with its main connection */
+    if (peer->primary != NULL && peer->primary->state == CLOSED) {
+        peer->shutdown = 1;
+    }
+
+    do {
+        state = peer->state;
+        switch (state) {
+            case NEW:
+                timer = peer_connect(peer, now);
+                break;
+            case PUNCHING:
+                timer = peer_wait_punch(peer, now);
+                break;
+            case LINKED:
+                timer = peer_handshake(peer, now);
+                break;
+            case ESTABLISHED:
+                timer = peer_transfer(peer, ctx, now);
+                break;
+            default:
+                peer_close(peer);
+                return;
+        }
+    } while (peer->state != state);
+
+    peer_punch(peer, now);
+    worker_set_timer(peer, earliest(timer, peer->punch_next));
+}
+
+static struct worker_ops peer_ops = {
+        peer_worker_init,
+        peer_run,
+        peer_worker_cleanup
+};
 
 /*
- * This thread does most of the work to handle a connection
- * - hole punching,
- * - DTLS session opening and closing
- * - starting/ending the SSL_writing thread
- * - handling the SSL reading
- *
- * The SSL stream is fed by calling BIO_write with peer->rbio
- *
- * args: the connected peer (struct client *)
+ * Perform the registration of the client to the RDV server
+ * args: rdv_args structure with the FIFO and the socket descriptor
+ */
+static int register_rdv(struct rdv_args *args) {
+    message_t smsg, rmsg;
+
+    int r;
+    int registered = 0;
+    int registeringTries = 0;
+
+    /* Create a HELLO message */
+    log_message_level(1, "Registering with the RDV server...");
+    if (config.send_local_addr == 1) {
+        init_smsg(&smsg, HELLO, config.vpnIP.s_addr, config.localIP.s_addr);
+        smsg.port = htons(config.localport);
+    }
+    else if (config.send_local_addr == 2) {
+        init_smsg(&smsg, HELLO, config.vpnIP.s_addr,
+                config.override_local_addr.sin_addr.s_addr);
+        smsg.port = config.override_local_addr.sin_port;
+    }
+    else {
+        init_smsg(&smsg, HELLO, config.vpnIP.s_addr, 0);
+    }
+
+    while (!registered && registeringTries < MAX_REGISTERING_TRIES
+            && !end_campagnol) {
+        /* sending HELLO to the server */
+        registeringTries++;
+        log_message_level(2, "Sending HELLO");
+        if (xsendto(args->sockfd, &smsg, sizeof(smsg), 0,
+                (struct sockaddr *) &config.serverAddr,
+                sizeof(config.serverAddr)) == -1) {
+            log_error(errno, "sendto");
+        }
+
+        r = BIO_read(args->fifo, &rmsg, sizeof(rmsg));
+
+        if (r == sizeof(rmsg)) {
+            switch (rmsg.type) {
+                case OK:
+                    /* Registration OK */
+                    log_message_level(1, "Registration complete");
+                    registered = 1;
+                    break;
+                case NOK:
+                    /* The RDV server rejected the client */
+                    log_message("The RDV server rejected the client");
+                    sleep(1);
+                    break;
+                default:
+                    log_message("The RDV server replied with something strange... (message code is %d)", rmsg.type);
+                    break;
+            }
+        }
+    }
+
+    /* Registration failed. The server may be down */
+    if (!registered) {
+        log_message_level(1, "The connection with the RDV server failed");
+    }
+
+    return registered;
+}
+
+/*
+ * This thread handle the connection with the RDV server. It doesn't do the
+ * initial registration.
  *
- * TODO: this design with two threads per session is not supported by OpenSSL
- * and broken. It breaks at least SSL_get_error (WANT_READ and WANT_WRITE are
- * not reliable) and it would also break SSL renegotiations.
+ * arg: (struct rdv_args *)
  */
-static void * peer_handling(void * args) {
+static void *rdv_handling(void *arg) {
+    struct rdv_args *args = (struct rdv_args *) arg;
+    message_t rmsg;
+    struct client *peer;
     int r;
-    int err;
-    packet_t u; // union used to receive the messages
-    message_t smsg;
-    struct client *peer = (struct client*) args;
-#ifndef HAVE_CYGWIN
-    int tunfd = peer->tunfd;
-#endif
-    struct timespec timeout_connect;            // timeout
-    time_t timestamp, last_time = 0;
 
-    int u_len = 1<<16;
-    u.raw = CHECK_ALLOC_FATAL(malloc(u_len));
+    while (!end_campagnol) {
+        r = BIO_read(args->fifo, &rmsg, sizeof(message_t));
+        if (r > 0) {
+            /* which type */
+            switch (rmsg.type) {
+                case REJ_CONNECTION:
+                    peer = peers_get_by_VPN(&rmsg.ip1);
+                    if (peer != NULL) {
+                        peer->rdv_answer = REJ_CONNECTION;
+                        CLIENT_MUTEXUNLOCK(peer);
+                        worker_schedule(peer);
+                        peers_decr_ref(peer, 1);
+                    }
+                    break;
+                case ANS_CONNECTION:
+                    peer = peers_get_by_VPN(&rmsg.ip2);
+                    if (peer != NULL) {
+                        peer->rdv_answer = ANS_CONNECTION;
+                        peer->clientaddr.sin_addr = rmsg.ip1;
+                        peer->clientaddr.sin_port = rmsg.port;
+                        CLIENT_MUTEXUNLOCK(peer);
+                        worker_schedule(peer);
+                        peers_decr_ref(peer, 1);
+                    }
+                    break;
+                case FWD_CONNECTION:
+                    peer = peers_get_by_VPN(&rmsg.ip2);
+                    if (peer == NULL) {
+                        /* Unknown client, add a new structure */
+                        peer = peers_add_caller(peer_pipeline(rmsg.ip2)->sockfd,
+                                peer_pipeline(rmsg.ip2)->tunfd,
+                                PUNCHING, clock_now(), rmsg.ip1, rmsg.port,
+                                rmsg.ip2);
+                        if (peer == NULL) {
+                            /* max number of clients */
+                            break;
+                        }
+                        /* start punching */
+                        start_peer_handling(peer);
+                        peers_decr_ref(peer, 1);
+                    }
+                    else {
+                        CLIENT_MUTEXUNLOCK(peer);
+                        peers_decr_ref(peer, 1);
+                    }
+                    break;
+                case RECONNECT:
+                    register_rdv(args);
+                    break;
+                case PONG:
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
 
+    return NULL;
+}
 
-    while (1) {
-        CLIENT_MUTEXLOCK(peer);
-        if (peer->state == NEW) {
-            if (end_campagnol) {
-                CHANGE_STATE(peer, CLOSED);
-                CLIENT_MUTEXUNLOCK(peer);
+/*
+ * Reply to a DTLS record received from an unknown peer with a fatal alert.
+ * This may be due to a lost close notification, or we died uncleanly and were
+ * restarted.
+ */
+static void send_dtls_alert(int sockfd, dtlsheader_t *header,
+        struct sockaddr_in *addr) {
+    unsigned char alert_mess[15];
+    dtlsheader_t *alert_mess_hdr = (dtlsheader_t *)alert_mess;
+    alert_mess_hdr->contentType = DTLS_ALERT;
+    alert_mess_hdr->version = header->version;
+    alert_mess_hdr->epoch = header->epoch;
+    alert_mess_hdr->seq_number = header->seq_number;
+    alert_mess[11] = 0; // length
+    alert_mess[12] = 2; // length
+    alert_mess[13] = 2; // fatal
+    alert_mess[14] = 80; // internal error
+    xsendto_nowait(sockfd, alert_mess, 15, 0, (struct sockaddr *)addr, sizeof(*addr));
+}
+
+/* Is this datagram a DTLS record? */
+static inline int is_dtls_record(packet_t u, int r) {
+    return r >= (int) sizeof(dtlsheader_t) &&
+            (u.dtlsheader->contentType == DTLS_APPLICATION_DATA
+            || u.dtlsheader->contentType == DTLS_HANDSHAKE
+            || u.dtlsheader->contentType == DTLS_ALERT
+            || u.dtlsheader->contentType == DTLS_CHANGE_CIPHER_SPEC);
+}
+
+/*
+ * Classify and dispatch a batch of datagrams read from the UDP socket.
+ * A datagram coalesced by UDP GRO is handled as a sequence of records.
+ *
+ * Consecutive DTLS records from the same endpoint are usually part of the
+ * same stream, so the peer found for a record is kept for the next ones
+ * instead of searching it again.
+ */
+static void handle_socket_batch(struct comm_args *args, struct recv_batch *batch) {
+    int i, r, off;
+    packet_t u;
+    struct sockaddr_in *unknownaddr;
+    struct client *peer;
+    struct client *last_peer = NULL;            // peer of the previous DTLS record
+    struct sockaddr_in *last_addr = NULL;       // and its endpoint
+    int last_accept = 0;                        // can last_peer receive records?
+
+    for (i = 0; i < batch->n; i++) {
+        unknownaddr = &batch->addr[i];
+        /* split the datagrams coalesced by UDP GRO into records */
+        for (off = 0; off < batch->len[i]; off += batch->seg[i]) {
+            u.raw = batch->buf[i] + off;
+            r = batch->len[i] - off;
+            if (r > batch->seg[i]) r = batch->seg[i];
+
+            /* from the RDV server ? */
+            if (config.serverAddr.sin_addr.s_addr == unknownaddr->sin_addr.s_addr
+                && config.serverAddr.sin_port == unknownaddr->sin_port) {
+                if (r == sizeof(message_t))
+                    BIO_write(args->rdvargs->fifo, u.raw, r);
                 continue;
             }
 
-            /* ask the RDV server for a new connection with peer */
-            init_smsg(&smsg, ASK_CONNECTION, peer->vpnIP.s_addr, 0);
-            xsendto(peer->sockfd,&smsg,sizeof(smsg),0,(struct sockaddr *)&config.serverAddr, sizeof(config.serverAddr));
-
-            /* wait for and check answer */
-            clock_gettime(CLOCK_REALTIME, &timeout_connect);
-            timeout_connect.tv_sec += 3; // wait 3 secs
-            r = conditionTimedwait(&peer->cond_connected, &peer->mutex, &timeout_connect);
-            if (r != 0 || (r == 0 && peer->rdv_answer == REJ_CONNECTION) || end_campagnol) {
-                // timeout or connection rejected by the RDV
-                CHANGE_STATE(peer, CLOSED);
-            }
-            else {
-                // the RDV accepted the connection,
-                // we now know the public endpoint of the peer
-                if (peers_register_endpoint(peer) != 0) {
-                    CHANGE_STATE(peer, CLOSED);
+            /* Message from another peer */
+            if (config.debug) printf("<  Received a UDP packet: size %d from %s:%d\n", r, inet_ntoa(unknownaddr->sin_addr), ntohs(unknownaddr->sin_port));
+            if (is_dtls_record(u, r)) {
+                /* It's a DTLS packet, send it to the worker of the peer using the FIFO BIO */
+                if (last_addr == NULL
+                        || last_addr->sin_addr.s_addr != unknownaddr->sin_addr.s_addr
+                        || last_addr->sin_port != unknownaddr->sin_port) {
+                    if (last_peer != NULL) {
+                        peers_decr_ref(last_peer, 1);
+                    }
+                    /* lock-free lookup, the peer's mutex is not needed here */
+                    last_peer = peers_find_by_endpoint(unknownaddr);
+                    last_addr = unknownaddr;
+                    if (last_peer != NULL) {
+                        last_accept = last_peer->state == ESTABLISHED || last_peer->state == LINKED;
+                    }
+                }
+                if (last_peer != NULL) {
+                    if (last_accept) {
+                        /* the FIFO keeps a reference on the datagram buffer
+                         * the record is dropped if the worker is late */
+                        if (batch->pkt[i] != NULL) {
+                            BIO_fifo_try_push(last_peer->rbio, pkt_ref(batch->pkt[i]), u.raw, r);
+                        }
+                        else {
+                            struct pkt_buf *pkt = CHECK_ALLOC_FATAL(pkt_alloc_size(packet_pool, r));
+                            memcpy(pkt->data, u.raw, r);
+                            BIO_fifo_try_push(last_peer->rbio, pkt, pkt->data, r);
+                        }
+                    }
                 }
-                else {
-                    CHANGE_STATE(peer, PUNCHING);
+                else if (u.dtlsheader->contentType == DTLS_APPLICATION_DATA) {
+                    /* We received a DTLS record from an unknown peer. */
+                    send_dtls_alert(args->sockfd, u.dtlsheader, unknownaddr);
+                }
+            }
+            else if (r == sizeof(message_t)) {
+                switch (u.message->type) {
+                    /* UDP hole punching */
+                    case PUNCH :
+                        /* we can now reach the client */
+                        peer = peers_get_by_endpoint(unknownaddr);
+                        if (peer == NULL && args->session != 0) {
+                            /* the other peer opens a parallel session */
+                            peer = session_accept(args->session, u.message, unknownaddr);
+                            if (peer != NULL) {
+                                CLIENT_MUTEXLOCK(peer);
+                            }
+                        }
+                        if (peer != NULL) {
+                            peer->punched = 1;
+                            CLIENT_MUTEXUNLOCK(peer);
+                            if (peer->state == PUNCHING) {
+                                worker_schedule(peer);
+                            }
+                            peers_decr_ref(peer, 1);
+                        }
+                        break;
+                    case PUNCH_KEEP_ALIVE:
+                        /* receive a keepalive message */
+                    default :
+                        break;
                 }
             }
-            CLIENT_MUTEXUNLOCK(peer);
         }
-        else if (peer->state == PUNCHING) {
-            if (end_campagnol) {
-                CHANGE_STATE(peer, CLOSED);
-                CLIENT_MUTEXUNLOCK(peer);
-                continue;
+    }
+
+    if (last_peer != NULL) {
+        peers_decr_ref(last_peer, 1);
+    }
+}
+
+#ifdef HAVE_IO_URING
+#define URING_ENTRIES 64                        // size of the submission queues
+#define URING_RECV_BUFS 64                      // number of buffers provided for the socket
+#define URING_RECV_BUF_SIZE ((1<<16) + 256)     // datagram + recvmsg header, address and cmsg
+#define URING_TUN_READS 16                      // number of reads outstanding on the TUN device
+#define URING_TUN_BUFFERS 1024                  // packet_pool buffers registered with the TUN ring
+#define URING_TUN_SLABS 64                      // max number of registered packet_pool slabs
+#define URING_TAG_STOP ((uint64_t) -1)          // completion of the poll on vpn_stop
+#define URING_TAG_POLL 0x10000                  // TUN device: poll before reading again
+
+static int uring_post_poll(struct uring *ring, int fd, uint64_t tag) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = tag;
+    return 0;
+}
+
+/*
+ * Handle the datagrams of the batch, then give their buffers back to the
+ * kernel
+ */
+static void uring_socket_flush(struct comm_args *args, struct recv_batch *batch,
+        struct uring_buf_ring *br, const uint16_t *bids) {
+    int i;
+
+    handle_socket_batch(args, batch);
+    for (i = 0; i < batch->n; i++) {
+        uring_buf_ring_recycle(br, bids[i]);
+    }
+    batch->n_wakeups++;
+    batch->n_datagrams += batch->n;
+    batch->hist[batch->n]++;
+    batch->n = 0;
+}
+
+/*
+ * comm_socket with io_uring:
+ * one multishot recvmsg stays armed on the socket, the kernel picks the
+ * buffers from a provided buffer ring. The completions are gathered in
+ * a recv_batch pointing to these buffers and given to handle_socket_batch.
+ *
+ * Return -1 if io_uring is not usable (use the event loop instead)
+ */
+static int comm_socket_uring(struct comm_args *args) {
+    struct uring ring;
+    struct uring_buf_ring br;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct io_uring_recvmsg_out *out;
+    struct msghdr msg, cmsg_msg;
+    struct recv_batch batch;                    // not allocated, points to the ring buffers
+    uint16_t bids[SOCKET_BATCH_SIZE];           // buffers of the batch
+    unsigned char *buf, *name, *control;
+    int r, rearm = 1, ret = 0;
+    uint16_t bid;
+
+    if (uring_init(&ring, URING_ENTRIES) == -1)
+        return -1;
+    if (uring_buf_ring_init(&ring, &br, 0, URING_RECV_BUFS, URING_RECV_BUF_SIZE) == -1) {
+        uring_close(&ring);
+        return -1;
+    }
+    log_message_level(2, "Using io_uring on the UDP socket");
+
+    /* layout of the buffers: io_uring_recvmsg_out, name, control, payload */
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_controllen = socket_gro ? CMSG_SPACE(sizeof(int)) : 0;
+    memset(&batch, 0, sizeof(batch));
+
+    if (uring_post_poll(&ring, vpn_stop.rfd, URING_TAG_STOP) == -1) {
+        log_message("Could not initialise the io_uring engine");
+        abort();
+    }
+
+    while (!end_campagnol && ret == 0) {
+        if (rearm) {
+            sqe = uring_get_sqe(&ring);
+            if (sqe == NULL) {
+                log_message("io_uring: the submission queue is full");
+                abort();
             }
+            sqe->opcode = IORING_OP_RECVMSG;
+            sqe->fd = args->sockfd;
+            sqe->addr = (uint64_t) (uintptr_t) &msg;
+            sqe->len = 1;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = br.bgid;
+            sqe->user_data = 0;
+            rearm = 0;
+        }
+
+        r = uring_submit_and_wait(&ring, SELECT_DELAY_SEC*1000 + SELECT_DELAY_USEC/1000);
+        batch.n_syscalls++;
+        if (r < 0 && r != -EAGAIN && r != -EBUSY) {
+            log_error(-r, "io_uring_enter");
+            abort();
+        }
 
-            start_punch(peer);
-            clock_gettime(CLOCK_REALTIME, &timeout_connect);
-            timeout_connect.tv_sec += 3; // wait 3 secs
-            if (conditionTimedwait(&peer->cond_connected, &peer->mutex, &timeout_connect) != 0) {
-                // timeout
-                CHANGE_STATE(peer, CLOSED);
-                CLIENT_MUTEXUNLOCK(peer);
-                init_smsg(&smsg, CLOSE_CONNECTION, peer->vpnIP.s_addr, 0);
-                xsendto(peer->sockfd, &smsg, sizeof(smsg), 0, (struct sockaddr *)&config.serverAddr, sizeof(config.serverAddr));
+        while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+            if (cqe->user_data == URING_TAG_STOP) {
+                uring_cqe_seen(&ring);
+                continue;
             }
-            else if (end_campagnol) {
-                CHANGE_STATE(peer, CLOSED);
-                CLIENT_MUTEXUNLOCK(peer);
+            /* the multishot request ended (error or no more buffers) */
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                rearm = 1;
+            if (cqe->res == -EINVAL) {
+                /* multishot receives need Linux 6.0 */
+                log_message("io_uring: multishot receive not supported, using the event loop");
+                uring_cqe_seen(&ring);
+                ret = -1;
+                break;
             }
-            else {
-                CHANGE_STATE(peer, LINKED);
-                CLIENT_MUTEXUNLOCK(peer);
+            if (cqe->res < 0) {
+                if (cqe->res != -ENOBUFS)
+                    log_error(-cqe->res, "io_uring recvmsg");
+                uring_cqe_seen(&ring);
+                continue;
             }
-        }
-        else if (peer->state == LINKED) {
-            if (end_campagnol) {
-                CHANGE_STATE(peer, CLOSED);
-                CLIENT_MUTEXUNLOCK(peer);
+
+            bid = (uint16_t) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            buf = uring_buf(&br, bid);
+            out = (struct io_uring_recvmsg_out *) buf;
+            name = buf + sizeof(*out);
+            control = name + msg.msg_namelen;
+            uring_cqe_seen(&ring);
+            if ((out->flags & MSG_TRUNC) || out->namelen < sizeof(struct sockaddr_in)) {
+                uring_buf_ring_recycle(&br, bid);
                 continue;
             }
-            CLIENT_MUTEXUNLOCK(peer);
-            /* DTLS handshake */
-            BIO_ctrl(peer->wbio, BIO_CTRL_DGRAM_SET_PEER, 0, &peer->clientaddr);
-            while (1) {
-                r = SSL_do_handshake(peer->ssl);
-                if (r == 1)
-                    break;
-                else {
-                    err = SSL_get_error(peer->ssl, r);
-                    if (err == SSL_ERROR_WANT_READ) {
-                        DTLSv1_handle_timeout(peer->ssl);
-                    }
-                    else
-                        break;
+
+            batch.buf[batch.n] = control + msg.msg_controllen;
+            batch.len[batch.n] = (int) out->payloadlen;
+            memcpy(&batch.addr[batch.n], name, sizeof(struct sockaddr_in));
+            batch.seg[batch.n] = batch.len[batch.n];
+            if (socket_gro) {
+                memset(&cmsg_msg, 0, sizeof(cmsg_msg));
+                cmsg_msg.msg_control = control;
+                cmsg_msg.msg_controllen = out->controllen;
+                if ((r = recv_gro_size(&cmsg_msg)) > 0) {
+                    batch.seg[batch.n] = r;
+                    batch.n_coalesced++;
                 }
             }
+            bids[batch.n++] = bid;
 
-            if (r != 1) {
-                log_message("Error during DTLS handshake with peer %s", inet_ntoa(peer->vpnIP));
-                ERR_print_errors_fp(stderr);
-                init_smsg(&smsg, CLOSE_CONNECTION, peer->vpnIP.s_addr, 0);
-                xsendto(peer->sockfd, &smsg, sizeof(smsg), 0, (struct sockaddr *)&config.serverAddr, sizeof(config.serverAddr));
-                CLIENT_MUTEXLOCK(peer);
-                CHANGE_STATE(peer, CLOSED);
-                CLIENT_MUTEXUNLOCK(peer);
+            if (batch.n == SOCKET_BATCH_SIZE) {
+                uring_socket_flush(args, &batch, &br, bids);
             }
-            else {
-                unsigned int mac_size, blocksize;
-                unsigned int pkt_size;
-                CLIENT_MUTEXLOCK(peer);
-                CHANGE_STATE(peer, ESTABLISHED);
-                peers_update_peer_time(peer, time(NULL));
-
-                // Get the mac size and the block size, compute the required MTU
-                // for OpenSSL.
-                if (peer->ssl->write_hash)
-#if OPENSSL_VERSION_NUMBER >= 0x10000000
-                    mac_size = EVP_MD_CTX_size(peer->ssl->write_hash);
-#else
-                    mac_size = EVP_MD_size(peer->ssl->write_hash);
-#endif
-                else
-                    mac_size = 0;
-
-                if (peer->ssl->enc_write_ctx &&
-                    (EVP_CIPHER_mode( peer->ssl->enc_write_ctx->cipher) & EVP_CIPH_CBC_MODE))
-                    blocksize = EVP_CIPHER_block_size(peer->ssl->enc_write_ctx->cipher);
-                else
-                    blocksize = 0;
+        }
 
-                pkt_size = config.tun_mtu + 1 + blocksize + mac_size; // padding field + IV + MAC
-                peer->ssl->d1->mtu = pkt_size;
-                if (pkt_size & (blocksize - 1)) // not a multiple of the block size, need to add padding
-                    peer->ssl->d1->mtu += blocksize - (pkt_size & (blocksize - 1));
+        /* the buffers go back to the kernel once the batch is handled,
+         * whatever the last completion was (-ENOBUFS ends the multishot
+         * receive under load) */
+        if (batch.n != 0) {
+            uring_socket_flush(args, &batch, &br, bids);
+        }
+    }
 
-                // DTLS header
-                peer->ssl->d1->mtu += DTLS1_RT_HEADER_LENGTH; // Header length
+    recv_batch_log_stats(&batch);
+    uring_close(&ring);
+    uring_buf_ring_free(&br);
+    return ret;
+}
+#endif
 
-                log_message_level(2, "Internal MTU adjusted to %u", peer->ssl->d1->mtu);
+/*
+ * Manage the incoming messages from the UDP socket
+ * argument: struct comm_args *
+ */
+static void * comm_socket(void * argument) {
+    struct comm_args * args = argument;
+    int sockfd = args->sockfd;
 
-                CLIENT_MUTEXUNLOCK(peer);
-            }
-        }
-        else if (peer->state == ESTABLISHED) {
-            CLIENT_MUTEXUNLOCK(peer);
-            int end_reading_loop = 0;
-            log_message_level(1, "New DTLS connection opened with peer %s", inet_ntoa(peer->vpnIP));
-
-            /* Start the writing thread */
-            start_SSL_writing(peer);
-
-            /* And do the reading stuff */
-            while (!end_reading_loop) {
-                /* Read and uncrypt a message, send it on the TUN device */
-                r = SSL_read(peer->ssl, u.raw, u_len);
-                timestamp = time(NULL);
-                if (BIO_should_read(peer->rbio)) { // timeout on SSL_read
-                    // check whether the connection is active and send keepalive messages
-                    if (timestamp != last_time) {
-                        CLIENT_MUTEXLOCK(peer);
-                        if (timestamp - peer->last_keepalive > (time_t) config.keepalive) {
-                            init_smsg(&smsg, PUNCH_KEEP_ALIVE, 0, 0);
-                            xsendto(peer->sockfd ,&smsg, sizeof(smsg), 0, (struct sockaddr *)&(peer->clientaddr), sizeof(peer->clientaddr));
-                            peer->last_keepalive = timestamp;
-                        }
+    int i, n;
+    struct evloop loop;
+    struct evloop_event events[EVLOOP_MAX_EVENTS];
+    struct recv_batch batch;
 
-                        if ((!peer->is_dtls_client && (timestamp - peer->time) > (config.timeout + 10))
-                                || (peer->is_dtls_client && (timestamp - peer->time) > config.timeout)) {
-                            log_message_level(2, "Session timeout: %s", inet_ntoa(peer->vpnIP));
-                            log_message_level(1, "Closing DTLS connection with peer %s", inet_ntoa(peer->vpnIP));
-                            init_smsg(&smsg, CLOSE_CONNECTION, peer->vpnIP.s_addr, 0);
-                            xsendto(peer->sockfd, &smsg, sizeof(smsg), 0, (struct sockaddr *)&config.serverAddr, sizeof(config.serverAddr));
-                            CHANGE_STATE(peer, CLOSED);
-                            CLIENT_MUTEXUNLOCK(peer);
-                            r = SSL_shutdown(peer->ssl);
-                            while (r == 0 && peer->ssl->s3->alert_dispatch) {
-                                /* data are still being written out,
-                                 * wait and retry */
-                                usleep(10000);
-                                /* clear some flags before retrying */
-                                peer->ssl->s3->alert_dispatch = 0;
-                                peer->ssl->shutdown&=~SSL_SENT_SHUTDOWN;
-                                SSL_shutdown(peer->ssl);
-                            }
-                            ERR_print_errors_fp(stderr);
-                            end_SSL_writing(peer);
-                            end_reading_loop = 1;
-                        }
-                        else {
-                            CLIENT_MUTEXUNLOCK(peer);
-                        }
-                        last_time = timestamp;
-                    }
-                    continue;
-                }
-                if (r <= 0) { // error or shutdown
-                    err = SSL_get_error(peer->ssl, r);
-                    switch(err) {
-                        case SSL_ERROR_WANT_WRITE:
-                        case SSL_ERROR_WANT_READ:
-                            continue;
-                            break;
-                        case SSL_ERROR_ZERO_RETURN: // shutdown received
-                            log_message_level(1, "DTLS connection closed by peer %s", inet_ntoa(peer->vpnIP));
-                            break;
-                        case SSL_ERROR_SYSCALL: // end_peer_handling or error
-                            if (peer->shutdown) { //end_peer_handling was called
-                                log_message_level(1, "Closing DTLS connection with peer %s", inet_ntoa(peer->vpnIP));
-                                r = SSL_shutdown(peer->ssl);
-                                while (r == 0 && peer->ssl->s3->alert_dispatch) {
-                                    /* data are still being written out,
-                                     * wait and retry */
-                                    usleep(10000);
-                                    /* clear some flags before retrying */
-                                    peer->ssl->s3->alert_dispatch = 0;
-                                    peer->ssl->shutdown&=~SSL_SENT_SHUTDOWN;
-                                    SSL_shutdown(peer->ssl);
-                                }
-                                ERR_print_errors_fp(stderr);
-                            }
-                            else {// I don't think we can get there
-                                ERR_print_errors_fp(stderr);
-                                log_message("DTLS error, shutting down the connexion.");
-                            }
-                            break;
-                        default:
-                            ERR_print_errors_fp(stderr);
-                            log_message("DTLS error, shutting down the connexion.");
-                            break;
-                    }
-                    CLIENT_MUTEXLOCK(peer);
-                    CHANGE_STATE(peer, CLOSED);
-                    CLIENT_MUTEXUNLOCK(peer);
-                    end_SSL_writing(peer);
-                    end_reading_loop = 1;
-                }
-                else {// everything's fine
-                    CLIENT_MUTEXLOCK(peer);
-                    peers_update_peer_time(peer, timestamp);
-                    CLIENT_MUTEXUNLOCK(peer);
-                    if (config.debug)
-                        printf(
-                                "<< Received a VPN message: size %d from SRC = %"PRIu32".%"PRIu32".%"PRIu32".%"PRIu32" to DST = %"PRIu32".%"PRIu32".%"PRIu32".%"PRIu32"\n",
-                                r, (ntohl(u.ip->ip_src.s_addr) >> 24) & 0xFF,
-                                (ntohl(u.ip->ip_src.s_addr) >> 16) & 0xFF,
-                                (ntohl(u.ip->ip_src.s_addr) >> 8) & 0xFF,
-                                (ntohl(u.ip->ip_src.s_addr) >> 0) & 0xFF,
-                                (ntohl(u.ip->ip_dst.s_addr) >> 24) & 0xFF,
-                                (ntohl(u.ip->ip_dst.s_addr) >> 16) & 0xFF,
-                                (ntohl(u.ip->ip_dst.s_addr) >> 8) & 0xFF,
-                                (ntohl(u.ip->ip_dst.s_addr) >> 0) & 0xFF);
-                    /*
-                     * If dest IP = VPN broadcast VPN
-                     * The TUN device creates a point to point connection which
-                     * does not transmit the broadcast IP
-                     * So alter the dest. IP to the normal VPN IP
-                     * and compute the new checksum
-                     */
-                    if (u.ip->ip_dst.s_addr == config.vpnBroadcastIP.s_addr) {
-                        u.ip->ip_dst.s_addr = config.vpnIP.s_addr;
-                        u.ip->ip_sum = 0; // the checksum field is set to 0 for the calculation
-                        u.ip->ip_sum = compute_csum((uint16_t*) u.ip, sizeof(*u.ip));
-                    }
-                    // send it to the TUN device
-#ifdef HAVE_CYGWIN
-                    write_tun(u.raw, r);
-#else
-                    write_tun(tunfd, u.raw, r);
+#ifdef HAVE_IO_URING
+    /* io_uring engine, the event loop is used if the ring cannot be set up */
+    if (comm_socket_uring(args) == 0) {
+        SSL_REMOVE_ERROR_STATE;
+        return NULL;
+    }
 #endif
+
+    recv_batch_init(&batch, recv_pool);
+    if (evloop_init(&loop) == -1
+            || evloop_add(&loop, sockfd, EVLOOP_IN, &sockfd) == -1
+            || evloop_add(&loop, vpn_stop.rfd, EVLOOP_IN, &vpn_stop) == -1) {
+        log_message("Could not initialise the event loop");
+        abort();
+    }
+
+    while (!end_campagnol) {
+        n = evloop_wait(&loop, events, EVLOOP_MAX_EVENTS, SELECT_DELAY_SEC*1000 + SELECT_DELAY_USEC/1000);
+
+        for (i = 0; i < n; i++) {
+            /* MESSAGES READ FROM THE SOCKET */
+            if (events[i].data == &sockfd) {
+                /* a partial batch means that the socket is empty */
+                while (recv_batch(sockfd, &batch) == SOCKET_BATCH_SIZE) {
+                    handle_socket_batch(args, &batch);
                 }
+                handle_socket_batch(args, &batch);
             }
-
-        }
-        else if (peer->state == CLOSED) {
-            CLIENT_MUTEXUNLOCK(peer);
-            /* remove one ref. for this thread and the last ref to destroy the
-             * client
-             */
-            peers_decr_ref(peer, 2); // now this peer is dead.
-            break;
         }
     }
 
-
+    evloop_close(&loop);
+    recv_batch_log_stats(&batch);
+    recv_batch_free(&batch);
     SSL_REMOVE_ERROR_STATE;
-    free(u.raw);
     return NULL;
 }
 
 
 /*
- * Create the peer_handling thread
+ * Hash of the flow of an IPv4 packet: addresses, protocol and the ports of the
+ * TCP and UDP packets. The fragments are hashed without the ports since only
+ * the first one carries them.
  */
-static void start_peer_handling(struct client *peer) {
-    peers_incr_ref(peer);
-    createDetachedThread(peer_handling, peer);
+static inline unsigned int flow_hash(packet_t u, int r) {
+    unsigned int hl = u.ip->ip_hl * 4;
+    uint32_t ports;
+    uint64_t h;
+
+    h = ((uint64_t) u.ip->ip_src.s_addr << 32 | u.ip->ip_dst.s_addr) ^ u.ip->ip_p;
+    if ((u.ip->ip_p == IPPROTO_TCP || u.ip->ip_p == IPPROTO_UDP)
+            && (ntohs(u.ip->ip_off) & (IP_MF | IP_OFFMASK)) == 0
+            && r >= (int) hl + 4) {
+        memcpy(&ports, u.raw + hl, sizeof(ports));
+        h ^= (uint64_t) ports << 8;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (unsigned int) h;
 }
 
-/*
- * Stop the peer_handling thread.
- * The peer is detroyed after calling peer_handling.
- *
- * islocked: the peer's mutex is currently locked. It will be unlocked when the
- * function returns.
- */
-static inline void end_peer_handling(struct client *peer, int islocked) {
-    if (!islocked) {
-        islocked = 1;
-        CLIENT_MUTEXLOCK(peer);
+/*
+ * Session of peer carrying the flow of a packet, with a reference
+ * A flow always takes the same session so that its packets stay in order. The
+ * flows of a session which is not established take the main connection.
+ */
+static struct client *flow_session(struct client *peer, packet_t u, int r) {
+    struct client *session;
+    int i = (int) (flow_hash(u, r) % (unsigned int) config.sessions);
+
+    if (i != 0 && (session = peers_find_session(peer, i)) != NULL) {
+        if (session->state == ESTABLISHED)
+            return session;
+        peers_decr_ref(session, 1);
     }
-    peer->shutdown = 1;
-    /* SSL_read will return with 0, which is the same
-     * as when we receive a DTLS shutdown alert
-     * Just pass a non NULL pointer to BIO_write
-     */
-    if (islocked)
-        CLIENT_MUTEXUNLOCK(peer);
-    BIO_write(peer->rbio, &peer, 0);
+    peers_incr_ref(peer);
+    return peer;
 }
 
 /*
- * Perform the registration of the client to the RDV server
- * args: rdv_args structure with the FIFO and the socket descriptor
+ * Handle a packet read from the TUN device
+ * The packet is queued without copy, the caller's reference on pkt is
+ * handed over to the peer's FIFO or released
+ *
+ * The FIFOs are never waited for: a packet for a peer whose queue is full
+ * (slow link, rate limiter) is dropped and counted instead of stalling the
+ * traffic to the other peers.
  */
-static int register_rdv(struct rdv_args *args) {
-    message_t smsg, rmsg;
+static void handle_tun_packet(struct comm_args *args, struct pkt_buf *pkt, int r) {
+    int tunfd = args->tunfd;
+    struct in_addr peer_addr;
+    struct client *peer, *session;
+    packet_t u;
 
-    int r;
-    int registered = 0;
-    int registeringTries = 0;
+    u.raw = pkt->data;
 
-    /* Create a HELLO message */
-    log_message_level(1, "Registering with the RDV server...");
-    if (config.send_local_addr == 1) {
-        init_smsg(&smsg, HELLO, config.vpnIP.s_addr, config.localIP.s_addr);
-        smsg.port = htons(config.localport);
+    if (config.debug)
+        printf(
+                ">> Sending a VPN message: size %d from SRC = %"PRIu32".%"PRIu32".%"PRIu32".%"PRIu32" to DST = %"PRIu32".%"PRIu32".%"PRIu32".%"PRIu32"\n",
+                r, (ntohl(u.ip->ip_src.s_addr) >> 24) & 0xFF,
+                (ntohl(u.ip->ip_src.s_addr) >> 16) & 0xFF,
+                (ntohl(u.ip->ip_src.s_addr) >> 8) & 0xFF,
+                (ntohl(u.ip->ip_src.s_addr) >> 0) & 0xFF,
+                (ntohl(u.ip->ip_dst.s_addr) >> 24) & 0xFF,
+                (ntohl(u.ip->ip_dst.s_addr) >> 16) & 0xFF,
+                (ntohl(u.ip->ip_dst.s_addr) >> 8) & 0xFF,
+                (ntohl(u.ip->ip_dst.s_addr) >> 0) & 0xFF);
+
+    peer_addr.s_addr = u.ip->ip_dst.s_addr;
+
+    /*
+     * If dest IP = VPN broadcast VPN
+     */
+    if (peer_addr.s_addr == config.vpnBroadcastIP.s_addr) {
+        GLOBAL_MUTEXLOCK;
+        peer = peers_list;
+        while (peer != NULL) {
+            struct client *next = peer->next;
+            CLIENT_MUTEXLOCK(peer);
+            /* once per peer, not per session */
+            if (peer->state == ESTABLISHED && peer->primary == NULL) {
+                BIO_fifo_try_push(peer->out_fifo, pkt_ref(pkt), u.raw, r);
+            }
+            CLIENT_MUTEXUNLOCK(peer);
+            peer = next;
+        }
+        GLOBAL_MUTEXUNLOCK;
+        pkt_free(pkt);
     }
-    else if (config.send_local_addr == 2) {
-        init_smsg(&smsg, HELLO, config.vpnIP.s_addr,
-                config.override_local_addr.sin_addr.s_addr);
-        smsg.port = config.override_local_addr.sin_port;
+    /*
+     * Local packet, loop back
+     */
+    else if (peer_addr.s_addr == config.vpnIP.s_addr) {
+#ifdef HAVE_CYGWIN
+        write_tun(u.raw, r);
+#else
+        write_tun(tunfd, u.raw, r);
+#endif
+        pkt_free(pkt);
     }
     else {
-        init_smsg(&smsg, HELLO, config.vpnIP.s_addr, 0);
-    }
-
-    while (!registered && registeringTries < MAX_REGISTERING_TRIES
-            && !end_campagnol) {
-        /* sending HELLO to the server */
-        registeringTries++;
-        log_message_level(2, "Sending HELLO");
-        if (xsendto(args->sockfd, &smsg, sizeof(smsg), 0,
-                (struct sockaddr *) &config.serverAddr,
-                sizeof(config.serverAddr)) == -1) {
-            log_error(errno, "sendto");
+        /* lock-free lookup, the peer's mutex is not needed here */
+        peer = peers_find_by_VPN(&peer_addr);
+        if (peer == NULL) {
+            peer = peers_add_requested(peer_pipeline(peer_addr)->sockfd,
+                    peer_pipeline(peer_addr)->tunfd, NEW, clock_now(), peer_addr);
+            if (peer == NULL) {
+                pkt_free(pkt);
+                return;
+            }
+            BIO_fifo_try_push(peer->out_fifo, pkt, u.raw, r);
+            start_peer_handling(peer);
         }
-
-        r = BIO_read(args->fifo, &rmsg, sizeof(rmsg));
-
-        if (r == sizeof(rmsg)) {
-            switch (rmsg.type) {
-                case OK:
-                    /* Registration OK */
-                    log_message_level(1, "Registration complete");
-                    registered = 1;
-                    break;
-                case NOK:
-                    /* The RDV server rejected the client */
-                    log_message("The RDV server rejected the client");
-                    sleep(1);
-                    break;
-                default:
-                    log_message("The RDV server replied with something strange... (message code is %d)", rmsg.type);
-                    break;
+        else {
+            if (config.sessions > 1 && peer->state == ESTABLISHED) {
+                /* spread the flows over the parallel sessions */
+                session = flow_session(peer, u, r);
+                BIO_fifo_try_push(session->out_fifo, pkt, u.raw, r);
+                peers_decr_ref(session, 1);
+            }
+            else if (peer->state != CLOSED) {
+                BIO_fifo_try_push(peer->out_fifo, pkt, u.raw, r);
+            }
+            else {
+                pkt_free(pkt);
             }
         }
+        peers_decr_ref(peer, 1);
     }
+}
 
-    /* Registration failed. The server may be down */
-    if (!registered) {
-        log_message_level(1, "The connection with the RDV server failed");
-    }
+#ifdef HAVE_LINUX
+/*
+ * Handle a segment of a packet read in offload mode
+ */
+static void handle_tun_segment(void *arg, unsigned char *seg, int len) {
+    struct pkt_buf *pkt = CHECK_ALLOC_FATAL(pkt_alloc_size(packet_pool, len));
+    memcpy(pkt->data, seg, len);
+    handle_tun_packet((struct comm_args *) arg, pkt, len);
+}
+#endif
 
-    return registered;
+#ifdef HAVE_IO_URING
+/* buffer of a read outstanding on the TUN device */
+struct uring_tun_slot {
+    struct pkt_buf *pkt;                        // pool buffer handed over to handle_tun_packet, NULL in offload mode
+    unsigned char *buf;
+    size_t len;
+    int buf_index;                              // registered buffer containing buf, -1 if none
+};
+
+static int uring_post_tun_read(struct uring *ring, int tunfd, struct uring_tun_slot *slot, uint64_t tag) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = (slot->buf_index >= 0) ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = tunfd;
+    sqe->addr = (uint64_t) (uintptr_t) slot->buf;
+    sqe->len = (uint32_t) slot->len;
+    sqe->buf_index = (slot->buf_index >= 0) ? (uint16_t) slot->buf_index : 0;
+    sqe->off = (uint64_t) -1;
+    sqe->user_data = tag;
+    return 0;
 }
 
 /*
- * This thread handle the connection with the RDV server. It doesn't do the
- * initial registration.
- *
- * arg: (struct rdv_args *)
+ * Take a new packet_pool buffer for the read of slot
+ * slabs: the registered slabs of packet_pool
  */
-static void *rdv_handling(void *arg) {
-    struct rdv_args *args = (struct rdv_args *) arg;
-    message_t rmsg;
-    struct client *peer;
-    int r;
+static void uring_tun_slot_alloc(struct uring_tun_slot *slot, const struct iovec *slabs, int n_slabs) {
+    int i;
 
-    while (!end_campagnol) {
-        r = BIO_read(args->fifo, &rmsg, sizeof(message_t));
-        if (r > 0) {
-            /* which type */
-            switch (rmsg.type) {
-                case REJ_CONNECTION:
-                    peer = peers_get_by_VPN(&rmsg.ip1);
-                    if (peer != NULL) {
-                        peer->rdv_answer = REJ_CONNECTION;
-                        CLIENT_MUTEXUNLOCK(peer);
-                        conditionSignal(&peer->cond_connected);
-                        peers_decr_ref(peer, 1);
-                    }
-                    break;
-                case ANS_CONNECTION:
-                    peer = peers_get_by_VPN(&rmsg.ip2);
-                    if (peer != NULL) {
-                        peer->rdv_answer = ANS_CONNECTION;
-                        peer->clientaddr.sin_addr = rmsg.ip1;
-                        peer->clientaddr.sin_port = rmsg.port;
-                        CLIENT_MUTEXUNLOCK(peer);
-                        conditionSignal(&peer->cond_connected);
-                        peers_decr_ref(peer, 1);
-                    }
-                    break;
-                case FWD_CONNECTION:
-                    peer = peers_get_by_VPN(&rmsg.ip2);
-                    if (peer == NULL) {
-                        /* Unknown client, add a new structure */
-                        peer = peers_add_caller(args->sockfd, args->tunfd,
-                                PUNCHING, time(NULL), rmsg.ip1, rmsg.port,
-                                rmsg.ip2);
-                        if (peer == NULL) {
-                            /* max number of clients */
-                            break;
-                        }
-                        /* start punching */
-                        start_peer_handling(peer);
-                        peers_decr_ref(peer, 1);
-                    }
-                    else {
-                        CLIENT_MUTEXUNLOCK(peer);
-                        peers_decr_ref(peer, 1);
-                    }
-                    break;
-                case RECONNECT:
-                    register_rdv(args);
-                    break;
-                case PONG:
-                    break;
-                default:
-                    break;
-            }
+    slot->pkt = CHECK_ALLOC_FATAL(pkt_alloc(packet_pool));
+    slot->buf = slot->pkt->data;
+    slot->len = slot->pkt->size;
+    /* the slabs allocated after the registration are read without it */
+    slot->buf_index = -1;
+    for (i = 0; i < n_slabs; i++) {
+        if (slot->buf >= (unsigned char *) slabs[i].iov_base
+                && slot->buf + slot->len <= (unsigned char *) slabs[i].iov_base + slabs[i].iov_len) {
+            slot->buf_index = i;
+            break;
         }
     }
-
-    return NULL;
 }
 
 /*
- * Manage the incoming messages from the UDP socket
- * argument: struct comm_args *
+ * comm_tun with io_uring:
+ * URING_TUN_READS reads stay outstanding on the TUN device. A read completed
+ * with EAGAIN waits for a poll before being submitted again.
+ *
+ * The packets are read into packet_pool buffers, whose slabs are registered
+ * with the ring when possible. A filled buffer is handed over to
+ * handle_tun_packet without copy and the next read takes a fresh buffer.
+ * In offload mode, the super-packets are read into dedicated frames, then
+ * segmented into pool buffers.
+ *
+ * Return -1 if the ring could not be created (use the event loop instead)
  */
-static void * comm_socket(void * argument) {
-    struct comm_args * args = argument;
-    int sockfd = args->sockfd;
-
-    int r;
-    int r_select;
-    fd_set fd_select;                           // for the select call
-    struct timeval timeout;                     // timeout used with select
+static int comm_tun_uring(struct comm_args *args) {
+    struct uring ring;
+    struct io_uring_cqe *cqe;
+    struct uring_tun_slot slots[URING_TUN_READS];
+    struct iovec iov[URING_TUN_SLABS];
+    struct virtio_net_hdr vh;
+    unsigned char *bufs = NULL, *seg = NULL;
+    size_t hdr_len = 0, frame_len;
+    int i, r, res, n_iov, fixed;
+    uint64_t tag;
     packet_t u;
-    struct sockaddr_in unknownaddr;             // address of the sender
-    socklen_t len = sizeof(struct sockaddr_in);
-    struct client *peer;
 
-    size_t u_len = 1<<16;
-    u.raw = CHECK_ALLOC_FATAL(malloc(u_len));
+    if (uring_init(&ring, URING_ENTRIES) == -1)
+        return -1;
+
+    memset(slots, 0, sizeof(slots));
+    if (config.tun_offload) {
+        /* in offload mode, each frame starts with a virtio_net_hdr */
+        hdr_len = sizeof(struct virtio_net_hdr);
+        frame_len = hdr_len + TUN_OFFLOAD_MAX;
+        seg = CHECK_ALLOC_FATAL(malloc(MESSAGE_MAX_LENGTH));
+        bufs = CHECK_ALLOC_FATAL(malloc(URING_TUN_READS * frame_len));
+        for (i = 0; i < URING_TUN_READS; i++) {
+            iov[i].iov_base = bufs + i * frame_len;
+            iov[i].iov_len = frame_len;
+        }
+        n_iov = URING_TUN_READS;
+    }
+    else {
+        n_iov = (int) pkt_pool_slabs(packet_pool, URING_TUN_BUFFERS, iov, URING_TUN_SLABS);
+    }
+    /* registered buffers need some locked memory, read into plain buffers otherwise */
+    fixed = uring_register_buffers(&ring, iov, (unsigned int) n_iov) == 0;
+    log_message_level(2, "Using io_uring on the TUN device (%s buffers)",
+            fixed ? "registered" : "unregistered");
+    if (!fixed)
+        n_iov = 0;
+    for (i = 0; i < URING_TUN_READS; i++) {
+        if (config.tun_offload) {
+            slots[i].buf = bufs + i * frame_len;
+            slots[i].len = frame_len;
+            slots[i].buf_index = fixed ? i : -1;
+        }
+        else {
+            uring_tun_slot_alloc(&slots[i], iov, n_iov);
+        }
+    }
+
+    r = uring_post_poll(&ring, vpn_stop.rfd, URING_TAG_STOP);
+    for (i = 0; i < URING_TUN_READS && r == 0; i++) {
+        r = uring_post_tun_read(&ring, args->tunfd, &slots[i], (uint64_t) i);
+    }
+    if (r == -1) {
+        log_message("Could not initialise the io_uring engine");
+        abort();
+    }
 
     while (!end_campagnol) {
-        /* select call initialisation */
-        FD_ZERO(&fd_select);
-        FD_SET(sockfd, &fd_select);
+        r = uring_submit_and_wait(&ring, SELECT_DELAY_SEC*1000 + SELECT_DELAY_USEC/1000);
+        if (r < 0 && r != -EAGAIN && r != -EBUSY) {
+            log_error(-r, "io_uring_enter");
+            abort();
+        }
 
-        init_timeout(&timeout);
-        r_select = select(sockfd+1, &fd_select, NULL, NULL, &timeout);
+        while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+            tag = cqe->user_data;
+            res = cqe->res;
+            uring_cqe_seen(&ring);
+            if (tag == URING_TAG_STOP)
+                continue;
 
-        /* MESSAGE READ FROM THE SOCKET */
-        if (r_select > 0) {
-            while ((r = (int) recvfrom(sockfd,u.raw,u_len,0,(struct sockaddr *)&unknownaddr,&len)) != -1) {
-                /* from the RDV server ? */
-                if (config.serverAddr.sin_addr.s_addr == unknownaddr.sin_addr.s_addr
-                    && config.serverAddr.sin_port == unknownaddr.sin_port) {
-                    if (r == sizeof(message_t))
-                        BIO_write(args->rdvargs->fifo, u.raw, r);
-                }
-                /* Message from another peer */
-                else {
-                    if (config.debug) printf("<  Received a UDP packet: size %d from %s:%d\n", r, inet_ntoa(unknownaddr.sin_addr), ntohs(unknownaddr.sin_port));
-                    if (r >= (int) sizeof(dtlsheader_t) &&
-                            (u.dtlsheader->contentType == DTLS_APPLICATION_DATA
-                            || u.dtlsheader->contentType == DTLS_HANDSHAKE
-                            || u.dtlsheader->contentType == DTLS_ALERT
-                            || u.dtlsheader->contentType == DTLS_CHANGE_CIPHER_SPEC)) {
-                        /* It's a DTLS packet, send it to the associated peer_handling thread using the FIFO BIO */
-                        peer = peers_get_by_endpoint(&unknownaddr);
-                        if (peer != NULL) {
-                            if (peer->state == ESTABLISHED || peer->state == LINKED) {
-                                CLIENT_MUTEXUNLOCK(peer);
-                                BIO_write(peer->rbio, u.raw, r);
-                            }
-                            else {
-                                CLIENT_MUTEXUNLOCK(peer);
-                            }
-                            peers_decr_ref(peer, 1);
-                        }
-                        else if (u.dtlsheader->contentType == DTLS_APPLICATION_DATA) {
-                            /* We received a DTLS record from an unknown peer.
-                             * This may be due to a lost close notification, or we
-                             * died uncleanly and were restarted.
-                             * Let's reply with a fatal alert record...
-                             */
-                            unsigned char alert_mess[15];
-                            dtlsheader_t *alert_mess_hdr = (dtlsheader_t *)alert_mess;
-                            alert_mess_hdr->contentType = DTLS_ALERT;
-                            alert_mess_hdr->version = u.dtlsheader->version;
-                            alert_mess_hdr->epoch = u.dtlsheader->epoch;
-                            alert_mess_hdr->seq_number = u.dtlsheader->seq_number;
-                            alert_mess[11] = 0; // length
-                            alert_mess[12] = 2; // length
-                            alert_mess[13] = 2; // fatal
-                            alert_mess[14] = 80; // internal error
-                            xsendto(sockfd, alert_mess, 15, 0, (struct sockaddr *)&unknownaddr, len);
-                        }
-                    }
-                    else if (r == sizeof(message_t)) {
-                        switch (u.message->type) {
-                            /* UDP hole punching */
-                            case PUNCH :
-                                /* we can now reach the client */
-                                peer = peers_get_by_endpoint(&unknownaddr);
-                                if (peer != NULL) {
-                                    conditionSignal(&peer->cond_connected);
-                                    CLIENT_MUTEXUNLOCK(peer);
-                                    peers_decr_ref(peer, 1);
-                                }
-                                break;
-                            case PUNCH_KEEP_ALIVE:
-                                /* receive a keepalive message */
-                            default :
-                                break;
+            /* the device is readable again */
+            if (tag & URING_TAG_POLL) {
+                i = (int) (tag & ~URING_TAG_POLL);
+                r = uring_post_tun_read(&ring, args->tunfd, &slots[i], (uint64_t) i);
+            }
+            /* the device was empty (older kernels do not wait) */
+            else if (res == -EAGAIN) {
+                r = uring_post_poll(&ring, args->tunfd, tag | URING_TAG_POLL);
+            }
+            else if (res < 0) {
+                log_error(-res, "Error while reading the tun device");
+                abort();
+            }
+            /* MESSAGE READ FROM TUN DEVICE */
+            else {
+                i = (int) tag;
+                u.raw = slots[i].buf + hdr_len;
+                if (config.tun_offload) {
+                    if (res >= (int) hdr_len) {
+                        memcpy(&vh, slots[i].buf, hdr_len);
+                        if (tun_offload_segment(&vh, u.raw, res - (int) hdr_len, seg,
+                                MESSAGE_MAX_LENGTH, handle_tun_segment, args) == -1) {
+                            log_message_level(2, "Dropping an unsupported packet from the TUN device");
                         }
                     }
                 }
+                else if (res > 0) {
+                    /* hand the buffer over, read the next packet in a new one */
+                    handle_tun_packet(args, slots[i].pkt, res);
+                    uring_tun_slot_alloc(&slots[i], iov, n_iov);
+                }
+                r = uring_post_tun_read(&ring, args->tunfd, &slots[i], (uint64_t) i);
+            }
+            if (r == -1) {
+                log_message("io_uring: the submission queue is full");
+                abort();
             }
         }
     }
 
-    free(u.raw);
-    SSL_REMOVE_ERROR_STATE;
-    return NULL;
+    /* the outstanding reads are cancelled with the ring */
+    uring_close(&ring);
+    for (i = 0; i < URING_TUN_READS; i++) {
+        if (slots[i].pkt != NULL)
+            pkt_free(slots[i].pkt);
+    }
+    free(bufs);
+    free(seg);
+    return 0;
 }
-
+#endif
 
 /*
  * Manage the incoming messages from the TUN device
@@ -804,111 +1696,93 @@ static void * comm_socket(void * argument) {
  */
 static void * comm_tun(void * argument) {
     struct comm_args * args = argument;
-    int sockfd = args->sockfd;
-    int tunfd = args->tunfd;
-
-    int r;
+    struct pkt_buf *pkt;                        // buffer of the next packet
+#ifdef HAVE_CYGWIN
     int r_select;
-#ifndef HAVE_CYGWIN
-    fd_set fd_select;                           // for the select call
-    struct timeval timeout;                     // timeout used with select
+#else
+    int tunfd = args->tunfd;
+    int i, n;
+    ssize_t r;
+    struct evloop loop;
+    struct evloop_event events[EVLOOP_MAX_EVENTS];
+#endif
+#ifdef HAVE_LINUX
+    struct virtio_net_hdr vh;
+    struct pkt_buf *frame = NULL;               // offload mode, super-packet buffer
+    unsigned char *seg = NULL;                  // offload mode, segment buffer
 #endif
-    packet_t u;
-    struct in_addr peer_addr;
-    struct client *peer;
 
-    u.raw = CHECK_ALLOC_FATAL(malloc(MESSAGE_MAX_LENGTH));
+#ifdef HAVE_IO_URING
+    /* io_uring engine, the event loop is used if the ring cannot be set up */
+    if (comm_tun_uring(args) == 0) {
+        SSL_REMOVE_ERROR_STATE;
+        return NULL;
+    }
+#endif
 
-    while (!end_campagnol) {
-#ifdef HAVE_CYGWIN
-        r_select = read_tun_wait(u.raw, MESSAGE_MAX_LENGTH, SELECT_DELAY_SEC*1000 + SELECT_DELAY_USEC/1000);
-#else
-        /* select call initialisation */
-        init_timeout(&timeout);
-        FD_ZERO(&fd_select);
-        FD_SET(tunfd, &fd_select);
-        r_select = select(tunfd+1, &fd_select, NULL, NULL, &timeout);
+#ifdef HAVE_LINUX
+    if (config.tun_offload) {
+        frame = CHECK_ALLOC_FATAL(pkt_alloc(recv_pool));
+        seg = CHECK_ALLOC_FATAL(malloc(MESSAGE_MAX_LENGTH));
+    }
 #endif
+    /* the packets are read into pool buffers and queued without copy */
+    pkt = CHECK_ALLOC_FATAL(pkt_alloc(packet_pool));
 
+#ifdef HAVE_CYGWIN
+    while (!end_campagnol) {
+        r_select = read_tun_wait(pkt->data, MESSAGE_MAX_LENGTH, SELECT_DELAY_SEC*1000 + SELECT_DELAY_USEC/1000);
 
         /* MESSAGE READ FROM TUN DEVICE */
         if (r_select > 0) {
-#ifdef HAVE_CYGWIN
-            r = read_tun_finalize();
+            handle_tun_packet(args, pkt, read_tun_finalize());
+            pkt = CHECK_ALLOC_FATAL(pkt_alloc(packet_pool));
+        }
+    }
+
+    read_tun_cancel();
 #else
-            r = (int) read_tun(tunfd, u.raw, MESSAGE_MAX_LENGTH);
-#endif
-            if (config.debug)
-                printf(
-                        ">> Sending a VPN message: size %d from SRC = %"PRIu32".%"PRIu32".%"PRIu32".%"PRIu32" to DST = %"PRIu32".%"PRIu32".%"PRIu32".%"PRIu32"\n",
-                        r, (ntohl(u.ip->ip_src.s_addr) >> 24) & 0xFF,
-                        (ntohl(u.ip->ip_src.s_addr) >> 16) & 0xFF,
-                        (ntohl(u.ip->ip_src.s_addr) >> 8) & 0xFF,
-                        (ntohl(u.ip->ip_src.s_addr) >> 0) & 0xFF,
-                        (ntohl(u.ip->ip_dst.s_addr) >> 24) & 0xFF,
-                        (ntohl(u.ip->ip_dst.s_addr) >> 16) & 0xFF,
-                        (ntohl(u.ip->ip_dst.s_addr) >> 8) & 0xFF,
-                        (ntohl(u.ip->ip_dst.s_addr) >> 0) & 0xFF);
-
-            peer_addr.s_addr = u.ip->ip_dst.s_addr;
-
-            /*
-             * If dest IP = VPN broadcast VPN
-             */
-            if (peer_addr.s_addr == config.vpnBroadcastIP.s_addr) {
-                GLOBAL_MUTEXLOCK;
-                peer = peers_list;
-                while (peer != NULL) {
-                    struct client *next = peer->next;
-                    CLIENT_MUTEXLOCK(peer);
-                    if (peer->state == ESTABLISHED) {
-                        BIO_write(peer->out_fifo, u.raw, r);
+    if (evloop_init(&loop) == -1
+            || evloop_add(&loop, tunfd, EVLOOP_IN, &tunfd) == -1
+            || evloop_add(&loop, vpn_stop.rfd, EVLOOP_IN, &vpn_stop) == -1) {
+        log_message("Could not initialise the event loop");
+        abort();
+    }
+
+    while (!end_campagnol) {
+        n = evloop_wait(&loop, events, EVLOOP_MAX_EVENTS, SELECT_DELAY_SEC*1000 + SELECT_DELAY_USEC/1000);
+
+        for (i = 0; i < n; i++) {
+            /* MESSAGES READ FROM TUN DEVICE, until the device is empty */
+            if (events[i].data == &tunfd) {
+#ifdef HAVE_LINUX
+                /* split the super-packets before queuing them */
+                if (config.tun_offload) {
+                    while ((r = read_tun_offload(tunfd, &vh, frame->data, TUN_OFFLOAD_MAX)) > 0) {
+                        if (tun_offload_segment(&vh, frame->data, (int) r, seg,
+                                MESSAGE_MAX_LENGTH, handle_tun_segment, args) == -1) {
+                            log_message_level(2, "Dropping an unsupported packet from the TUN device");
+                        }
                     }
-                    CLIENT_MUTEXUNLOCK(peer);
-                    peer = next;
+                    continue;
                 }
-                GLOBAL_MUTEXUNLOCK;
-            }
-            /*
-             * Local packet, loop back
-             */
-            else if (peer_addr.s_addr == config.vpnIP.s_addr) {
-#ifdef HAVE_CYGWIN
-                write_tun(u.raw, r);
-#else
-                write_tun(tunfd, u.raw, r);
 #endif
-            }
-            else {
-                peer = peers_get_by_VPN(&peer_addr);
-                if (peer == NULL) {
-                    peer = peers_add_requested(sockfd, tunfd, NEW, time(NULL), peer_addr);
-                    if (peer == NULL) {
-                        continue;
-                    }
-                    BIO_write(peer->out_fifo, u.raw, r);
-                    start_peer_handling(peer);
-                }
-                else {
-                    if (peer->state != CLOSED) {
-                        peers_update_peer_time(peer,time(NULL));
-                        CLIENT_MUTEXUNLOCK(peer);
-                        BIO_write(peer->out_fifo, u.raw, r);
-                    }
-                    else {
-                        CLIENT_MUTEXUNLOCK(peer);
-                    }
+                while ((r = read_tun(tunfd, pkt->data, MESSAGE_MAX_LENGTH)) > 0) {
+                    handle_tun_packet(args, pkt, (int) r);
+                    pkt = CHECK_ALLOC_FATAL(pkt_alloc(packet_pool));
                 }
-                peers_decr_ref(peer, 1);
             }
         }
     }
 
-#ifdef HAVE_CYGWIN
-    read_tun_cancel();
+    evloop_close(&loop);
 #endif
 
-    free(u.raw);
+#ifdef HAVE_LINUX
+    free(seg);
+    pkt_free(frame);
+#endif
+    pkt_free(pkt);
     SSL_REMOVE_ERROR_STATE;
     return NULL;
 }
@@ -916,65 +1790,128 @@ static void * comm_tun(void * argument) {
 
 /*
  * Start the VPN:
- * start a thread running comm_tun and another one running comm_socket
+ * start one thread running comm_socket for each pipeline, one thread running
+ * comm_tun for each additional pipeline and run comm_tun for the first one
+ *
+ * sockfd and tunfd are arrays of config.pipelines file descriptors
+ * sessfd holds the sockets of the parallel sessions 1 to config.sessions - 1
+ * (-1 if the session is disabled), each one is read by a comm_socket thread
  *
  * set end_campagnol to 1 un order to stop both threads (and others)
  */
-int start_vpn(int sockfd, int tunfd) {
+int start_vpn(int sockfd[], int tunfd[], int sessfd[]) {
     message_t smsg;
-    struct comm_args args;
     struct rdv_args rdvargs;
-    int registered;
-    pthread_t th_socket, th_rdv;
-    struct itimerval timer_ping;
+    int registered, i;
+    pthread_t th_socket[MAX_PIPELINES], th_tun[MAX_PIPELINES], th_rdv;
+    pthread_t th_session[MAX_SESSIONS];
     struct timeval timeout;
 
-    args.sockfd = sockfd;
-    args.tunfd = tunfd;
-    rdvargs.sockfd = sockfd;
-    rdvargs.tunfd = tunfd;
+    rdvargs.sockfd = sockfd[0];
+    rdvargs.tunfd = tunfd[0];
     rdvargs.fifo = BIO_new_fifo(10, sizeof(message_t));
     timeout.tv_sec = SELECT_DELAY_SEC;
     timeout.tv_usec = SELECT_DELAY_USEC;
     BIO_ctrl(rdvargs.fifo, BIO_CTRL_DGRAM_SET_RECV_TIMEOUT, 0, &timeout);
-    args.rdvargs = &rdvargs;
+    for (i = 0; i < config.pipelines; i++) {
+        pipelines[i].sockfd = sockfd[i];
+        pipelines[i].tunfd = tunfd[i];
+        pipelines[i].rdvargs = &rdvargs;
+        pipelines[i].writer = &tun_writers[i];
+        pipelines[i].session = 0;
+    }
+    session_sockets[0].sockfd = -1;
+    for (i = 1; i < config.sessions; i++) {
+        session_sockets[i].sockfd = sessfd[i];
+        session_sockets[i].tunfd = tunfd[0];
+        session_sockets[i].rdvargs = &rdvargs;
+        session_sockets[i].writer = &tun_writers[0];
+        session_sockets[i].session = i;
+    }
 
     /* initialize the global rate limiter */
     if (config.tb_client_size != 0) {
         tb_init(&global_rate_limiter, config.tb_client_size, (double) config.tb_client_rate, 8, 1);
     }
 
+    /* created once, kept across the reloads */
+    if (vpn_stop.rfd == -1 && evnotifier_init(&vpn_stop) == -1) {
+        return -1;
+    }
+    if (packet_pool == NULL) {
+        packet_pool = pkt_pool_new(MESSAGE_MAX_LENGTH, 1, config.hugepages);
+        recv_pool = pkt_pool_new(1<<16, 1, config.hugepages);
+        if (packet_pool == NULL || recv_pool == NULL) {
+            return -1;
+        }
+    }
+    evnotifier_clear(&vpn_stop);
+
     peers_mutex_init();
     if (initDTLS() == -1) {
         return -1;
     }
+    sockfd_global = sockfd[0];
+    ping_enabled = 0;
+    ping_started = 0;
+    memset(&ping_timer, 0, sizeof(ping_timer));
+    for (i = 0; i < config.pipelines; i++) {
+        if (tun_writer_start(&tun_writers[i], tunfd[i]) == -1) {
+            log_message("Could not start the TUN writer threads");
+            while (--i >= 0) tun_writer_stop(&tun_writers[i]);
+            clearDTLS();
+            return -1;
+        }
+    }
+    if (workers_start(config.workers, &peer_ops) == -1) {
+        for (i = 0; i < config.pipelines; i++) {
+            tun_writer_stop(&tun_writers[i]);
+        }
+        clearDTLS();
+        return -1;
+    }
 
-    th_socket = createThread(comm_socket, &args);
+    for (i = 0; i < config.pipelines; i++) {
+        th_socket[i] = createThread(comm_socket, &pipelines[i]);
+    }
+    for (i = 1; i < config.sessions; i++) {
+        if (session_sockets[i].sockfd >= 0)
+            th_session[i] = createThread(comm_socket, &session_sockets[i]);
+    }
 
     registered = register_rdv(&rdvargs);
 
     if (registered) {
-        /* set a timer for the ping messages */
-        timer_ping.it_interval.tv_sec = TIMER_PING_SEC;
-        timer_ping.it_interval.tv_usec = TIMER_PING_USEC;
-        timer_ping.it_value.tv_sec = TIMER_PING_SEC;
-        timer_ping.it_value.tv_usec = TIMER_PING_USEC;
-        sockfd_global = sockfd;
-        setitimer(ITIMER_REAL, &timer_ping, NULL);
+        /* start the ping messages */
+        ping_enabled = 1;
 
         /* start the RDV handler and do some work */
         th_rdv = createThread(rdv_handling, &rdvargs);
-        comm_tun(&args);
+        for (i = 1; i < config.pipelines; i++) {
+            th_tun[i] = createThread(comm_tun, &pipelines[i]);
+        }
+        comm_tun(&pipelines[0]);
 
+        for (i = 1; i < config.pipelines; i++) {
+            joinThread(th_tun[i], NULL);
+        }
         joinThread(th_rdv, NULL);
     }
     else {
         end_campagnol = 1;
+        interrupt_vpn();
     }
 
-    joinThread(th_socket, NULL);
+    for (i = 0; i < config.pipelines; i++) {
+        joinThread(th_socket[i], NULL);
+    }
+    for (i = 1; i < config.sessions; i++) {
+        if (session_sockets[i].sockfd >= 0)
+            joinThread(th_session[i], NULL);
+    }
 
     BIO_free(rdvargs.fifo);
+    ping_enabled = 0;
 
     GLOBAL_MUTEXLOCK;
     struct client *peer, *next;
@@ -983,20 +1920,24 @@ int start_vpn(int sockfd, int tunfd) {
         next = peer->next;
         CLIENT_MUTEXLOCK(peer);
         end_peer_handling(peer, 1); // this also unlock the mutex
-        // don't wait for the peer_handling thread terminaison here !
-        // the thread needs to lock the mutex
+        // don't wait for the worker here !
+        // it needs to lock the mutex
         peer = next;
     }
     GLOBAL_MUTEXUNLOCK;
 
     init_smsg(&smsg, BYE, config.vpnIP.s_addr, 0);
     log_message_level(2, "Sending BYE");
-    if (xsendto(sockfd,&smsg,sizeof(smsg),0,(struct sockaddr *)&config.serverAddr, sizeof(config.serverAddr)) == -1) {
+    if (xsendto(sockfd[0],&smsg,sizeof(smsg),0,(struct sockaddr *)&config.serverAddr, sizeof(config.serverAddr)) == -1) {
         log_error(errno, "sendto");
     }
 
-    // wait for all the peer_handling threads to finish
+    // wait for the workers to close all the peers
     while (peers_n_clients != 0) { usleep(100000); }
+    workers_stop();
+    for (i = 0; i < config.pipelines; i++) {
+        tun_writer_stop(&tun_writers[i]);
+    }
 
     if (config.tb_client_size != 0) {
         tb_clean(&global_rate_limiter);
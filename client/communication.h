@@ -38,7 +38,10 @@
 #ifndef COMMUNICATION_H_
 #define COMMUNICATION_H_
 
+#include <poll.h>
+
 #include "rate_limiter.h"
+#include "../common/pkt_pool.h"
 
 /*
  * Message types (1 byte)
@@ -65,15 +68,25 @@
 #define DTLS_APPLICATION_DATA 23
 
 /*
- * duration of the timeout used with the select calls*/
+ * duration of the timeout used with the event loops and the select calls*/
 #define SELECT_DELAY_SEC 2
 #define SELECT_DELAY_USEC 0
 
 /*
- * time between two PING messages
+ * time between two PING messages (ms)
+ */
+#define TIMER_PING_MS 3000
+
+/*
+ * Maximum number of data plane pipelines (TUN queue + UDP socket)
+ */
+#define MAX_PIPELINES 64
+
+/*
+ * Time between two attempts to open the missing parallel sessions with a
+ * peer (ms)
  */
-#define TIMER_PING_SEC 3
-#define TIMER_PING_USEC 0
+#define SESSION_RETRY_MS 30000
 
 /*
  * Number of tries when registering to the rendezvous server
@@ -133,6 +146,11 @@
  * Duration between two punch messages
  */
 #define PUNCH_DELAY_USEC 200000
+/*
+ * Time to wait for the answer of the RDV server, then for the first punch
+ * message of the other peer and for its first handshake message (ms)
+ */
+#define CONNECT_TIMEOUT_MS 3000
 
 
 /*
@@ -172,41 +190,56 @@ struct rdv_args {
     int tunfd;
 };
 
-/* arguments for the punch thread */
-struct punch_arg {
-    struct client *peer;
-    int sockfd;
-};
+struct tun_writer;
 
-/* arguments for the comm_tun and comm_socket threads */
+/* arguments for the comm_tun and comm_socket threads
+ * one per pipeline, and one comm_socket per parallel session socket */
 struct comm_args {
     int sockfd;
     int tunfd;
     struct rdv_args *rdvargs;
+    struct tun_writer *writer;  // writes the packets received for this TUN queue
+    int session;                // parallel session of the socket, 0 for a pipeline
 };
 
-extern int start_vpn(int sockfd, int tunfd);
-
-/* the handler for SIGALRM */
-extern void handler_sigTimerPing(int sig);
+extern int start_vpn(int sockfd[], int tunfd[], int sessfd[]);
+/* wake up the VPN threads after setting end_campagnol */
+extern void interrupt_vpn(void);
 
 /* The rate limiter for the whole client */
 extern struct tb_state global_rate_limiter;
 
+/* Packet buffers: MESSAGE_MAX_LENGTH bytes for the FIFOs,
+ * 64 KB for the datagrams read from the socket and the decrypted packets */
+extern struct pkt_pool *packet_pool;
+extern struct pkt_pool *recv_pool;
+
 
 /* wrapper around sendto for non blocking I/O */
 static inline ssize_t xsendto(int sockfd, const void *buf, size_t len, int flags, const
         struct sockaddr *dest_addr, socklen_t addrlen) {
     ssize_t r;
-    fd_set set;
+    struct pollfd pfd;
 
     while ((r = sendto(sockfd, buf, len, flags, dest_addr, addrlen)) == -1
             && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-        FD_ZERO(&set);
-        FD_SET(sockfd, &set);
-        select(sockfd+1, NULL, &set, NULL, NULL);
+        pfd.fd = sockfd;
+        pfd.events = POLLOUT;
+        poll(&pfd, 1, -1);
     }
     return r;
 }
 
+/* sendto for the worker threads, which must not wait: the datagram is dropped
+ * if the socket is full. The PUNCH, keepalive and RDV messages are sent again
+ * by the timers of the peers or are best effort. */
+static inline ssize_t xsendto_nowait(int sockfd, const void *buf, size_t len, int flags, const
+        struct sockaddr *dest_addr, socklen_t addrlen) {
+    ssize_t r;
+
+    while ((r = sendto(sockfd, buf, len, flags, dest_addr, addrlen)) == -1
+            && errno == EINTR);
+    return r;
+}
+
 #endif /*COMMUNICATION_H_*/
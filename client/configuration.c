@@ -42,8 +42,12 @@
 #include "configuration.h"
 #include "../common/config_parser.h"
 #include "communication.h"
+#include "peer.h"
+#include "peer_worker.h"
+#include "bf_batch.h"
 #include "../common/log.h"
 
+#include <ctype.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <net/if.h>
@@ -51,6 +55,9 @@
 #ifdef HAVE_IFADDRS_H
 # include <ifaddrs.h>
 #endif
+#ifdef HAVE_LINUX
+#   include <linux/if_tun.h>
+#endif
 #ifdef HAVE_CYGWIN
 #   include <w32api/windows.h>
 #   include "tap-win32_common.h"
@@ -86,24 +93,44 @@ void initConfig() {
     config.verif_dir = NULL;
     config.verify_depth = 0;
     config.cipher_list = NULL;
+    config.groups = NULL;
     config.crl = NULL;
+    config.psk_keys = NULL;
+    config.n_psk_keys = 0;
+    config.psk_secret = NULL;
+    config.psk = 0;
+    config.trusted_keys = NULL;
+    config.session_cache = 1;
+    config.session_cache_file = NULL;
 
     config.FIFO_size = 20;
     config.tb_client_rate = 0.f;
     config.tb_connection_rate = 0.f;
     config.tb_client_size = 0;
     config.tb_connection_size = 0;
+    config.send_batch = 16;
+    config.send_batch_latency = 1000;
+    config.aqm = AQM_NONE;
+    config.aqm_target = 5000;
+    config.aqm_interval = 100000;
+    config.dscp_priority = 0;
     config.timeout = 120;
     config.max_clients = 100;
+    config.workers = 1;
+    config.sessions = 1;
     config.keepalive = 10;
     config.exec_up = NULL;
     config.exec_down = NULL;
 
     config.pidfile = NULL;
+    config.pipelines = 1;
+    config.hugepages = 0;
 
 #ifdef HAVE_LINUX
     config.txqueue = 0;
     config.tun_one_queue = 0;
+    config.udp_offload = 1;
+    config.tun_offload = 0;
 #endif
 }
 
@@ -236,6 +263,41 @@ static int get_ipv4_broadcast(uint32_t vpnip, int len, uint32_t *broadcast,
     return 0;
 }
 
+/*
+ * Parse a pre-shared key: "VPN_IP hexadecimal_key"
+ */
+static int parse_psk_key(const char *s, struct psk_key *psk) {
+    char ip[INET_ADDRSTRLEN];
+    size_t n;
+    unsigned int byte;
+
+    n = strcspn(s, " \t");
+    if (n == 0 || n >= sizeof(ip)) {
+        return -1;
+    }
+    memcpy(ip, s, n);
+    ip[n] = '\0';
+    if (inet_aton(ip, &psk->vpnIP) == 0) {
+        return -1;
+    }
+    s += n;
+    s += strspn(s, " \t");
+
+    psk->len = 0;
+    while (isxdigit((unsigned char) s[0]) && isxdigit((unsigned char) s[1])) {
+        if (psk->len == PSK_KEY_MAX) {
+            return -1;
+        }
+        sscanf(s, "%2x", &byte);
+        psk->key[psk->len++] = (unsigned char) byte;
+        s += 2;
+    }
+    if (*s != '\0' || psk->len < PSK_KEY_MIN) {
+        return -1;
+    }
+    return 0;
+}
+
 int parseConfFile(const char *confFile) {
     parser_context_t parser;
     item_value_t *value;
@@ -244,6 +306,7 @@ int parseConfFile(const char *confFile) {
     int ret = -1;
     int res;
     int default_commands, i, n;
+    int aqm_ms;
     uint16_t port_tmp;
 
     int localIP_set = 0; // config.localIP is not defined
@@ -505,11 +568,52 @@ int parseConfFile(const char *confFile) {
         goto config_end;
     }
 
+    /* pre-shared keys: the certificates are not used */
+    section = parser_section_get(SECTION_SECURITY, &parser);
+    key = (section != NULL) ? parser_key_get(OPT_PSK, section) : NULL;
+    if (key != NULL) {
+        n = parser_key_get_nvalues(key);
+        config.psk_keys = CHECK_ALLOC_FATAL(malloc(sizeof(struct psk_key) * n));
+        TAILQ_FOREACH(value, &key->values_list, tailq) {
+            parser_value_expand(section, value);
+            if (parse_psk_key(value->expanded.s, &config.psk_keys[config.n_psk_keys]) != 0) {
+                log_message(
+                        "[%s:"OPT_PSK":%zu] Invalid pre-shared key (use \"VPN_IP hex_key\", %d to %d bytes)",
+                        confFile, value->nline, PSK_KEY_MIN, PSK_KEY_MAX);
+                goto config_end;
+            }
+            config.n_psk_keys++;
+        }
+    }
+
+    value = parser_get(SECTION_SECURITY, OPT_PSK_SECRET, -1, 1, &parser);
+    if (value != NULL) {
+        if (strlen(value->expanded.s) < PSK_KEY_MIN) {
+            log_message(
+                    "[%s:"OPT_PSK_SECRET":%zu] The secret must have at least %d characters",
+                    confFile, value->nline, PSK_KEY_MIN);
+            goto config_end;
+        }
+        config.psk_secret = CHECK_ALLOC_FATAL(strdup(value->expanded.s));
+    }
+    config.psk = (config.n_psk_keys != 0 || config.psk_secret != NULL);
+
+    value = parser_get(SECTION_SECURITY, OPT_TRUSTED_KEYS, -1, 1, &parser);
+    if (value != NULL) {
+        if (config.psk) {
+            log_message(
+                    "[%s:"OPT_TRUSTED_KEYS":%zu] The pre-shared keys and the pinned public keys cannot be used together",
+                    confFile, value->nline);
+            goto config_end;
+        }
+        config.trusted_keys = CHECK_ALLOC_FATAL(strdup(value->expanded.s));
+    }
+
     value = parser_get(SECTION_SECURITY, OPT_CERTIFICATE, -1, 1, &parser);
     if (value != NULL) {
         config.certificate_pem = CHECK_ALLOC_FATAL(strdup(value->expanded.s));
     }
-    else {
+    else if (!config.psk && config.trusted_keys == NULL) {
         log_message("[%s] Parameter \""OPT_CERTIFICATE"\" is mandatory",
                 confFile);
         goto config_end;
@@ -519,7 +623,7 @@ int parseConfFile(const char *confFile) {
     if (value != NULL) {
         config.key_pem = CHECK_ALLOC_FATAL(strdup(value->expanded.s));
     }
-    else {
+    else if (!config.psk) {
         log_message("[%s] Parameter \""OPT_KEY"\" is mandatory", confFile);
         goto config_end;
     }
@@ -532,7 +636,8 @@ int parseConfFile(const char *confFile) {
     if (value != NULL) {
         config.verif_dir = CHECK_ALLOC_FATAL(strdup(value->expanded.s));
     }
-    if (config.verif_pem == NULL && config.verif_dir == NULL) {
+    if (config.verif_pem == NULL && config.verif_dir == NULL && !config.psk
+            && config.trusted_keys == NULL) {
         log_message(
                 "[%s] At least one of \""OPT_CA"\" and \""OPT_CA_DIR"\"is required",
                 confFile);
@@ -561,11 +666,30 @@ int parseConfFile(const char *confFile) {
         config.cipher_list = CHECK_ALLOC_FATAL(strdup(value->expanded.s));
     }
 
+    value = parser_get(SECTION_SECURITY, OPT_GROUPS, -1, 1, &parser);
+    if (value != NULL) {
+        config.groups = CHECK_ALLOC_FATAL(strdup(value->expanded.s));
+    }
+
     value = parser_get(SECTION_SECURITY, OPT_CRL, -1, 1, &parser);
     if (value != NULL) {
         config.crl = CHECK_ALLOC_FATAL(strdup(value->expanded.s));
     }
 
+    res = parser_get_bool(SECTION_SECURITY, OPT_SESSION_CACHE, -1,
+            &config.session_cache, &value, &parser);
+    if (res == 0) {
+        log_message(
+                "[%s:"OPT_SESSION_CACHE":%zu] Invalid value (use \"yes\" or \"no\"): \"%s\"",
+                confFile, value->nline, value->expanded.s);
+        goto config_end;
+    }
+
+    value = parser_get(SECTION_SECURITY, OPT_SESSION_FILE, -1, 1, &parser);
+    if (value != NULL) {
+        config.session_cache_file = CHECK_ALLOC_FATAL(strdup(value->expanded.s));
+    }
+
     res = parser_get_int(SECTION_CLIENT, OPT_FIFO, -1, &config.FIFO_size,
             &value, &parser);
     if (res == 1) {
@@ -609,6 +733,67 @@ int parseConfFile(const char *confFile) {
                 confFile, value->nline, value->expanded.s);
         goto config_end;
     }
+
+    res = parser_get_int(SECTION_CLIENT, OPT_PIPELINES, -1, &config.pipelines,
+            &value, &parser);
+    if (res == 1) {
+        if (config.pipelines < 0) {
+            log_message(
+                    "[%s:"OPT_PIPELINES":%zu] Number of pipelines %d must be >= 0",
+                    confFile, value->nline, config.pipelines);
+            goto config_end;
+        }
+        /* 0: one pipeline per online CPU */
+        if (config.pipelines == 0) {
+            config.pipelines = (int) sysconf(_SC_NPROCESSORS_ONLN);
+            if (config.pipelines < 1) config.pipelines = 1;
+        }
+        if (config.pipelines > MAX_PIPELINES) {
+            log_message("[%s:"OPT_PIPELINES":%zu] Using %d pipelines instead of %d",
+                    confFile, value->nline, MAX_PIPELINES, config.pipelines);
+            config.pipelines = MAX_PIPELINES;
+        }
+#if !defined(IFF_MULTI_QUEUE) || !defined(SO_REUSEPORT)
+        if (config.pipelines > 1) {
+            log_message("[%s:"OPT_PIPELINES":%zu] Multi-queue TUN devices or SO_REUSEPORT are not supported, using one pipeline",
+                    confFile, value->nline);
+            config.pipelines = 1;
+        }
+#endif
+    }
+    else if (res == 0) {
+        log_message(
+                "[%s:"OPT_PIPELINES":%zu] Number of pipelines is not valid: \"%s\"",
+                confFile, value->nline, value->expanded.s);
+        goto config_end;
+    }
+
+    res = parser_get_bool(SECTION_CLIENT, OPT_UDP_OFFLOAD, -1,
+            &config.udp_offload, &value, &parser);
+    if (res == 0) {
+        log_message(
+                "[%s:"OPT_UDP_OFFLOAD":%zu] Invalid value (use \"yes\" or \"no\"): \"%s\"",
+                confFile, value->nline, value->expanded.s);
+        goto config_end;
+    }
+
+    res = parser_get_bool(SECTION_CLIENT, OPT_TUN_OFFLOAD, -1,
+            &config.tun_offload, &value, &parser);
+    if (res == 0) {
+        log_message(
+                "[%s:"OPT_TUN_OFFLOAD":%zu] Invalid value (use \"yes\" or \"no\"): \"%s\"",
+                confFile, value->nline, value->expanded.s);
+        goto config_end;
+    }
+
+    res = parser_get_bool(SECTION_CLIENT, OPT_HUGEPAGES, -1,
+            &config.hugepages, &value, &parser);
+    if (res == 0) {
+        log_message(
+                "[%s:"OPT_HUGEPAGES":%zu] Invalid value (use \"yes\" or \"no\"): \"%s\"",
+                confFile, value->nline, value->expanded.s);
+        goto config_end;
+    }
 #endif
 
     res = parser_get_float(SECTION_CLIENT, OPT_CLIENT_RATE, -1,
@@ -645,6 +830,104 @@ int parseConfFile(const char *confFile) {
         goto config_end;
     }
 
+    res = parser_get_int(SECTION_CLIENT, OPT_SEND_BATCH, -1,
+            &config.send_batch, &value, &parser);
+    if (res == 1) {
+        if (config.send_batch < 1 || config.send_batch > BATCH_MAX_SIZE) {
+            log_message(
+                    "[%s:"OPT_SEND_BATCH":%zu] Batch size %d must be between 1 and %d",
+                    confFile, value->nline, config.send_batch, BATCH_MAX_SIZE);
+            goto config_end;
+        }
+    }
+    else if (res == 0) {
+        log_message(
+                "[%s:"OPT_SEND_BATCH":%zu] Batch size is not valid: \"%s\"",
+                confFile, value->nline, value->expanded.s);
+        goto config_end;
+    }
+
+    res = parser_get_int(SECTION_CLIENT, OPT_SEND_BATCH_LATENCY, -1,
+            &config.send_batch_latency, &value, &parser);
+    if (res == 1) {
+        if (config.send_batch_latency < 0) {
+            log_message(
+                    "[%s:"OPT_SEND_BATCH_LATENCY":%zu] Batch latency %d must be >= 0",
+                    confFile, value->nline, config.send_batch_latency);
+            goto config_end;
+        }
+    }
+    else if (res == 0) {
+        log_message(
+                "[%s:"OPT_SEND_BATCH_LATENCY":%zu] Batch latency is not valid: \"%s\"",
+                confFile, value->nline, value->expanded.s);
+        goto config_end;
+    }
+
+    value = parser_get(SECTION_CLIENT, OPT_AQM, -1, 1, &parser);
+    if (value != NULL) {
+        if (strcmp(value->expanded.s, "none") == 0) {
+            config.aqm = AQM_NONE;
+        }
+        else if (strcmp(value->expanded.s, "codel") == 0) {
+            config.aqm = AQM_CODEL;
+        }
+        else if (strcmp(value->expanded.s, "fq_codel") == 0) {
+            config.aqm = AQM_FQ_CODEL;
+        }
+        else {
+            log_message(
+                    "[%s:"OPT_AQM":%zu] Invalid value (use \"none\", \"codel\" or \"fq_codel\"): \"%s\"",
+                    confFile, value->nline, value->expanded.s);
+            goto config_end;
+        }
+    }
+
+    res = parser_get_int(SECTION_CLIENT, OPT_AQM_TARGET, -1,
+            &aqm_ms, &value, &parser);
+    if (res == 1) {
+        if (aqm_ms <= 0) {
+            log_message(
+                    "[%s:"OPT_AQM_TARGET":%zu] Target delay %d must be > 0",
+                    confFile, value->nline, aqm_ms);
+            goto config_end;
+        }
+        config.aqm_target = (unsigned int) aqm_ms * 1000;
+    }
+    else if (res == 0) {
+        log_message(
+                "[%s:"OPT_AQM_TARGET":%zu] Target delay is not valid: \"%s\"",
+                confFile, value->nline, value->expanded.s);
+        goto config_end;
+    }
+
+    res = parser_get_int(SECTION_CLIENT, OPT_AQM_INTERVAL, -1,
+            &aqm_ms, &value, &parser);
+    if (res == 1) {
+        if (aqm_ms <= 0) {
+            log_message(
+                    "[%s:"OPT_AQM_INTERVAL":%zu] Interval %d must be > 0",
+                    confFile, value->nline, aqm_ms);
+            goto config_end;
+        }
+        config.aqm_interval = (unsigned int) aqm_ms * 1000;
+    }
+    else if (res == 0) {
+        log_message(
+                "[%s:"OPT_AQM_INTERVAL":%zu] Interval is not valid: \"%s\"",
+                confFile, value->nline, value->expanded.s);
+        goto config_end;
+    }
+
+    res = parser_get_bool(SECTION_CLIENT, OPT_DSCP_PRIORITY, -1,
+            &config.dscp_priority, &value, &parser);
+    if (res == 0) {
+        log_message(
+                "[%s:"OPT_DSCP_PRIORITY":%zu] Invalid value (use \"yes\" or \"no\"): \"%s\"",
+                confFile, value->nline, value->expanded.s);
+        goto config_end;
+    }
+
     res = parser_get_int(SECTION_CLIENT, OPT_TIMEOUT, -1, &config.timeout,
             &value, &parser);
     if (res == 1) {
@@ -678,6 +961,50 @@ int parseConfFile(const char *confFile) {
         goto config_end;
     }
 
+    res = parser_get_int(SECTION_CLIENT, OPT_WORKERS, -1, &config.workers,
+            &value, &parser);
+    if (res == 1) {
+        if (config.workers < 0) {
+            log_message(
+                    "[%s:"OPT_WORKERS":%zu] Number of workers %d must be >= 0",
+                    confFile, value->nline, config.workers);
+            goto config_end;
+        }
+        /* 0: one worker per online CPU */
+        if (config.workers == 0) {
+            config.workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+            if (config.workers < 1) config.workers = 1;
+        }
+        if (config.workers > MAX_WORKERS) {
+            log_message("[%s:"OPT_WORKERS":%zu] Using %d workers instead of %d",
+                    confFile, value->nline, MAX_WORKERS, config.workers);
+            config.workers = MAX_WORKERS;
+        }
+    }
+    else if (res == 0) {
+        log_message(
+                "[%s:"OPT_WORKERS":%zu] Number of workers is not valid: \"%s\"",
+                confFile, value->nline, value->expanded.s);
+        goto config_end;
+    }
+
+    res = parser_get_int(SECTION_CLIENT, OPT_SESSIONS, -1, &config.sessions,
+            &value, &parser);
+    if (res == 1) {
+        if (config.sessions < 1 || config.sessions > MAX_SESSIONS) {
+            log_message(
+                    "[%s:"OPT_SESSIONS":%zu] Number of sessions %d must be between 1 and %d",
+                    confFile, value->nline, config.sessions, MAX_SESSIONS);
+            goto config_end;
+        }
+    }
+    else if (res == 0) {
+        log_message(
+                "[%s:"OPT_SESSIONS":%zu] Number of sessions is not valid: \"%s\"",
+                confFile, value->nline, value->expanded.s);
+        goto config_end;
+    }
+
     res = parser_get_uint(SECTION_CLIENT, OPT_KEEPALIVE, -1, &config.keepalive,
             &value, &parser);
     if (res == 1) {
@@ -791,6 +1118,7 @@ int parseConfFile(const char *confFile) {
 void freeConfig() {
     char **s;
     if (config.crl) free(config.crl);
+    if (config.session_cache_file) free(config.session_cache_file);
     if (config.iface) free(config.iface);
     if (config.network) free(config.network);
     if (config.certificate_pem) free(config.certificate_pem);
@@ -798,6 +1126,17 @@ void freeConfig() {
     if (config.verif_pem) free(config.verif_pem);
     if (config.verif_dir) free(config.verif_dir);
     if (config.cipher_list) free(config.cipher_list);
+    if (config.groups) free(config.groups);
+    if (config.psk_keys) {
+        /* the keys are secret */
+        OPENSSL_cleanse(config.psk_keys, sizeof(struct psk_key) * config.n_psk_keys);
+        free(config.psk_keys);
+    }
+    if (config.psk_secret) {
+        OPENSSL_cleanse(config.psk_secret, strlen(config.psk_secret));
+        free(config.psk_secret);
+    }
+    if (config.trusted_keys) free(config.trusted_keys);
     if (config.pidfile) free(config.pidfile);
     if (config.tun_device) free(config.tun_device);
     if (config.tap_id) free(config.tap_id);
@@ -37,6 +37,15 @@
 #ifndef CONFIGURATION_H_
 #define CONFIGURATION_H_
 
+/* Pre-shared key of a peer (PSK mode) */
+#define PSK_KEY_MIN 16
+#define PSK_KEY_MAX 64
+struct psk_key {
+    struct in_addr vpnIP;                       // VPN IP of the peer
+    unsigned int len;                           // length of key
+    unsigned char key[PSK_KEY_MAX];
+};
+
 struct configuration {
     int verbose;                                // verbose
     int debug;                                  // more verbose
@@ -65,27 +74,53 @@ struct configuration {
     int verify_depth;                           // Maximum depth for the certificate chain verification
     char *cipher_list;                          // ciphers list for SSL_CTX_set_cipher_list
                                                 // see openssl ciphers man page
+    char *groups;                               // groups list for SSL_CTX_set1_groups_list
     char *crl;                                  // A CRL or NULL
+    struct psk_key *psk_keys;                   // pre-shared keys of the peers
+    int n_psk_keys;
+    char *psk_secret;                           // secret to derive the pre-shared keys or NULL
+    int psk;                                    // PSK mode, no certificates
+    char *trusted_keys;                         // PEM file of the pinned public keys of the peers or NULL
+    int session_cache;                          // Resume the DTLS sessions with the peers
+    char *session_cache_file;                   // File keeping the sessions across restarts or NULL
 
     int FIFO_size;                              // Size of the FIFO list for the incoming packets
     float tb_client_rate;                       // Maximum outgoing rate for the client
     float tb_connection_rate;                   // Maximum outgoing rate for each connection
     size_t tb_client_size;                      // Bucket size for the client
     size_t tb_connection_size;                  // Bucket size for a connection
+    int send_batch;                             // Max number of DTLS records sent with one system call
+    int send_batch_latency;                     // Max delay (usec) of a record in a batch
+    int aqm;                                    // Queue management of the outgoing FIFOs (AQM_*)
+    unsigned int aqm_target;                    // CoDel target queueing delay (usec)
+    unsigned int aqm_interval;                  // CoDel interval (usec)
+    int dscp_priority;                          // Priority classes from the inner DSCP
     int timeout;                                // wait timeout secs before closing a session for inactivity
     int max_clients;                            // maximum number of clients
+    int workers;                                // number of worker threads driving the peers
+    int sessions;                               // number of parallel DTLS sessions with each peer
     unsigned int keepalive;                     // seconds between keepalive messages;
     char ** exec_up;                            // UP commands
     char ** exec_down;                          // DOWN commands
 
     char *pidfile;                              // PID file in daemon mode
 
+    int pipelines;                              // Number of TUN queues and UDP sockets (1 if not on Linux)
+    int hugepages;                              // Back the packet buffers with huge pages (Linux)
+
 #ifdef HAVE_LINUX
     int txqueue;                                // TX queue length for the TUN device (0 means default)
     int tun_one_queue;                          // Single queue mode
+    int udp_offload;                            // Use UDP GSO/GRO when available
+    int tun_offload;                            // TUN offload mode (IFF_VNET_HDR)
 #endif
 };
 
+/* values of aqm */
+#define AQM_NONE            0
+#define AQM_CODEL           1
+#define AQM_FQ_CODEL        2
+
 extern void initConfig(void);
 extern int parseConfFile(const char *file);
 extern void freeConfig(void);
@@ -118,17 +153,35 @@ extern void freeConfig(void);
 #define OPT_CRL             "crl_file"
 #define OPT_DEPTH           "verify_depth"
 #define OPT_CIPHERS         "cipher_list"
+#define OPT_GROUPS          "groups"
+#define OPT_PSK             "psk"
+#define OPT_PSK_SECRET      "psk_secret"
+#define OPT_TRUSTED_KEYS    "trusted_keys"
+#define OPT_SESSION_CACHE   "session_cache"
+#define OPT_SESSION_FILE    "session_cache_file"
 
 #define OPT_FIFO            "fifo_size"
 #ifdef HAVE_LINUX
 #   define OPT_TXQUEUE         "txqueue"
 #   define OPT_TUN_ONE_QUEUE   "tun_one_queue"
+#   define OPT_PIPELINES       "pipelines"
+#   define OPT_UDP_OFFLOAD     "udp_offload"
+#   define OPT_TUN_OFFLOAD     "tun_offload"
+#   define OPT_HUGEPAGES       "hugepages"
 #endif
 #define OPT_CLIENT_RATE     "client_max_rate"
 #define OPT_CONNECTION_RATE "connection_max_rate"
+#define OPT_SEND_BATCH      "send_batch"
+#define OPT_SEND_BATCH_LATENCY "send_batch_latency"
+#define OPT_AQM             "aqm"
+#define OPT_AQM_TARGET      "aqm_target"
+#define OPT_AQM_INTERVAL    "aqm_interval"
+#define OPT_DSCP_PRIORITY   "dscp_priority"
 #define OPT_TIMEOUT         "timeout"
 #define OPT_KEEPALIVE       "keepalive"
 #define OPT_MAX_CLIENTS     "max_clients"
+#define OPT_WORKERS         "workers"
+#define OPT_SESSIONS        "sessions"
 
 #define OPT_DEFAULT_UP      "default_up"
 #define OPT_DEFAULT_DOWN    "default_down"
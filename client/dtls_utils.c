@@ -37,11 +37,25 @@
  */
 
 #include "campagnol.h"
+
+#if defined(HAVE_CPUID_H) && (defined(__x86_64__) || defined(__i386__))
+#   include <cpuid.h>
+#endif
+#if defined(HAVE_SYS_AUXV_H) && defined(__aarch64__)
+#   include <sys/auxv.h>
+#endif
+
+#include <arpa/inet.h>
+#include <openssl/kdf.h>
+#include <openssl/pem.h>
+
 #include "dtls_utils.h"
 #include "../common/log.h"
 #include "../common/bss_fifo.h"
 #include "bf_rate_limiter.h"
+#include "bf_batch.h"
 #include "communication.h"
+#include "session_cache.h"
 #include "../common/pthread_wrap.h"
 
 /* SSL contexts */
@@ -49,8 +63,101 @@ static SSL_CTX *campagnol_ctx_client;
 static SSL_CTX *campagnol_ctx_server;
 static pthread_mutex_t ctx_lock;
 
-/* mutexes for OpenSSL internal use */
-static pthread_mutex_t *crypto_mutexes = NULL;
+/* index of the pinned public keys in the ex_data of the SSL contexts */
+static int trusted_keys_idx = -1;
+
+/* The pinned public keys of the peers (DER encoded SubjectPublicKeyInfo) */
+struct trusted_keys {
+    int n;
+    unsigned char **der;
+    int *len;
+};
+
+/*
+ * Default cipher lists: the AEAD suites of DTLS 1.2 first, the fastest one
+ * on this CPU before the other. CBC suites are kept for the older peers.
+ */
+#define CIPHERS_AES_FIRST "ECDHE+AESGCM:ECDHE+CHACHA20:AESGCM:CHACHA20:HIGH:!aNULL:!MD5"
+#define CIPHERS_CHACHA_FIRST "ECDHE+CHACHA20:ECDHE+AESGCM:CHACHA20:AESGCM:HIGH:!aNULL:!MD5"
+
+/*
+ * Default cipher lists in PSK mode: all the forward secret suites first
+ * (ECDHE-PSK, only ChaCha20-Poly1305 is AEAD), then the AEAD suites of the
+ * plain PSK key exchange.
+ */
+#define CIPHERS_PSK_AES_FIRST "ECDHE-PSK-CHACHA20-POLY1305:kECDHEPSK:kPSK+AESGCM:PSK-CHACHA20-POLY1305:kPSK:!eNULL"
+#define CIPHERS_PSK_CHACHA_FIRST "ECDHE-PSK-CHACHA20-POLY1305:kECDHEPSK:PSK-CHACHA20-POLY1305:kPSK+AESGCM:kPSK:!eNULL"
+
+/* Length of the keys derived from psk_secret */
+#define PSK_DERIVED_LEN 32
+
+/* Default groups of the ECDHE key exchange */
+#define GROUPS_DEFAULT "X25519:P-256:P-384"
+
+/*
+ * Does the CPU have AES instructions (AES-NI, ARMv8 crypto extensions)?
+ * Without them AES-GCM is slower than ChaCha20-Poly1305.
+ */
+static int cpu_has_aes(void) {
+#if defined(HAVE_CPUID_H) && (defined(__x86_64__) || defined(__i386__))
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return (ecx & bit_AES) != 0;
+    }
+    return 0;
+#elif defined(HAVE_SYS_AUXV_H) && defined(__aarch64__) && defined(HWCAP_AES)
+    return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Flow of an IPv4 packet for the FQ-CoDel sub-queues:
+ * addresses, protocol and the TCP/UDP ports of the first fragment
+ */
+static unsigned int ip_flow_hash(const unsigned char *data, int len) {
+    const struct ip *ip = (const struct ip *) data;
+    const unsigned char *l4;
+    unsigned int h, hl;
+
+    if (len < (int) sizeof(struct ip)) {
+        return 0;
+    }
+    h = ip->ip_src.s_addr * 2654435761u;
+    h = (h ^ ip->ip_dst.s_addr) * 2654435761u;
+    h = (h ^ ip->ip_p) * 2654435761u;
+    hl = (unsigned int) ip->ip_hl * 4;
+    if ((ip->ip_p == IPPROTO_TCP || ip->ip_p == IPPROTO_UDP)
+            && (ntohs(ip->ip_off) & IP_OFFMASK) == 0 && (int) hl + 4 <= len) {
+        l4 = data + hl;
+        h = (h ^ ((unsigned int) l4[0] << 24 | (unsigned int) l4[1] << 16
+                | (unsigned int) l4[2] << 8 | l4[3])) * 2654435761u;
+    }
+    return h ^ (h >> 16);
+}
+
+/*
+ * Priority class of an IPv4 packet from its DSCP
+ */
+static int ip_dscp_class(const unsigned char *data, int len) {
+    if (len < (int) sizeof(struct ip)) {
+        return DSCP_CLASS_NORMAL;
+    }
+    switch (((const struct ip *) data)->ip_tos >> 2) {
+        case 40: // CS5
+        case 44: // VOICE-ADMIT
+        case 46: // EF
+        case 48: // CS6
+        case 56: // CS7
+            return DSCP_CLASS_HIGH;
+        case 1: // LE
+        case 8: // CS1
+            return DSCP_CLASS_LOW;
+        default:
+            return DSCP_CLASS_NORMAL;
+    }
+}
 
 /*
  * Callback function for certificate validation
@@ -90,12 +197,12 @@ static int verify_callback(int ok, X509_STORE_CTX *ctx) {
 
         BIO_free(bio_buf);
 
-        switch (ctx->error) {
+        switch (err) {
             case X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT:
                 bio_buf = BIO_new(BIO_s_mem());
                 if (bio_buf) {
                     X509_NAME_print_ex(bio_buf, X509_get_issuer_name(
-                            ctx->current_cert), 0, XN_FLAG_ONELINE);
+                            err_cert), 0, XN_FLAG_ONELINE);
                     BIO_write(bio_buf, "", 1);
                     BIO_get_mem_data(bio_buf, &buf);
                 }
@@ -128,34 +235,134 @@ static void ctx_info_callback(const SSL *ssl, int where, int ret) {
 }
 
 /*
- * Allocate and configure a DTLS context
+ * Key shared with a peer: the key configured for its VPN IP, or a key derived
+ * from psk_secret and the two VPN IPs (HKDF-SHA256). Both peers derive the
+ * same key.
+ * Return the length of the key, 0 if there is none.
  */
-static SSL_CTX * createContext(int is_client) {
-    SSL_CTX *ctx;
+static unsigned int psk_key(struct in_addr peer, unsigned char *key, unsigned int max_len) {
+    EVP_PKEY_CTX *pctx;
+    unsigned char info[8];
+    uint32_t low, high;
+    size_t len = PSK_DERIVED_LEN;
+    int i;
+
+    for (i = 0; i < config.n_psk_keys; i++) {
+        if (config.psk_keys[i].vpnIP.s_addr == peer.s_addr) {
+            if (config.psk_keys[i].len > max_len)
+                return 0;
+            memcpy(key, config.psk_keys[i].key, config.psk_keys[i].len);
+            return config.psk_keys[i].len;
+        }
+    }
+    if (config.psk_secret == NULL || max_len < PSK_DERIVED_LEN) {
+        return 0;
+    }
+
+    /* the info is the lower then the higher VPN IP */
+    low = ntohl(peer.s_addr) < ntohl(config.vpnIP.s_addr) ? peer.s_addr : config.vpnIP.s_addr;
+    high = (low == peer.s_addr) ? config.vpnIP.s_addr : peer.s_addr;
+    memcpy(info, &low, 4);
+    memcpy(info + 4, &high, 4);
+
+    pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    if (pctx == NULL
+            || EVP_PKEY_derive_init(pctx) <= 0
+            || EVP_PKEY_CTX_set_hkdf_md(pctx, EVP_sha256()) <= 0
+            || EVP_PKEY_CTX_set1_hkdf_salt(pctx, (const unsigned char *) "campagnol psk", 13) <= 0
+            || EVP_PKEY_CTX_set1_hkdf_key(pctx, (const unsigned char *) config.psk_secret,
+                    (int) strlen(config.psk_secret)) <= 0
+            || EVP_PKEY_CTX_add1_hkdf_info(pctx, info, sizeof(info)) <= 0
+            || EVP_PKEY_derive(pctx, key, &len) <= 0) {
+        ERR_print_errors_fp(stderr);
+        EVP_PKEY_CTX_free(pctx);
+        return 0;
+    }
+    EVP_PKEY_CTX_free(pctx);
+    return (unsigned int) len;
+}
 
+/*
+ * PSK callback of the DTLS client: the identity is our VPN IP
+ */
+static unsigned int psk_client_callback(SSL *ssl, const char *hint __attribute__((unused)),
+        char *identity, unsigned int max_identity_len, unsigned char *psk,
+        unsigned int max_psk_len) {
+    struct client *peer = (struct client *) SSL_get_app_data(ssl);
+    unsigned int len;
+
+    if (peer == NULL
+            || inet_ntop(AF_INET, &config.vpnIP, identity, max_identity_len) == NULL) {
+        return 0;
+    }
+    len = psk_key(peer->vpnIP, psk, max_psk_len);
+    if (len == 0) {
+        log_message("No pre-shared key for peer %s", inet_ntoa(peer->vpnIP));
+    }
+    return len;
+}
+
+/*
+ * PSK callback of the DTLS server: the identity must be the VPN IP of the
+ * peer announced by the RDV server
+ */
+static unsigned int psk_server_callback(SSL *ssl, const char *identity,
+        unsigned char *psk, unsigned int max_psk_len) {
+    struct client *peer = (struct client *) SSL_get_app_data(ssl);
+    struct in_addr id;
+    unsigned int len;
+
+    if (peer == NULL) {
+        return 0;
+    }
+    if (inet_pton(AF_INET, identity, &id) != 1 || id.s_addr != peer->vpnIP.s_addr) {
+        log_message("Invalid PSK identity \"%s\" for peer %s", identity, inet_ntoa(peer->vpnIP));
+        return 0;
+    }
+    len = psk_key(peer->vpnIP, psk, max_psk_len);
+    if (len == 0) {
+        log_message("No pre-shared key for peer %s", identity);
+    }
+    return len;
+}
+
+/*
+ * PSK mode: the peers are authenticated by their pre-shared keys
+ */
+static void setupPSK(SSL_CTX *ctx, int is_client) {
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
     if (is_client) {
-        ctx = SSL_CTX_new(DTLSv1_client_method());
+        SSL_CTX_set_psk_client_callback(ctx, psk_client_callback);
     }
     else {
-        ctx = SSL_CTX_new(DTLSv1_server_method());
-    }
-    if (ctx == NULL) {
-        ERR_print_errors_fp(stderr);
-        log_error(-1, "SSL_CTX_new");
-        return NULL;
+        SSL_CTX_set_psk_server_callback(ctx, psk_server_callback);
     }
+}
+
+/*
+ * Load the certificate and the key, set up the verification of the peer's
+ * certificate. Return -1 on error.
+ */
+static int setupCertificates(SSL_CTX *ctx) {
+    int key_type;
+
     if (!SSL_CTX_use_certificate_chain_file(ctx, config.certificate_pem)) {
         ERR_print_errors_fp(stderr);
         log_error(-1, "SSL_CTX_use_certificate_chain_file (%s)",
                 config.certificate_pem);
-        SSL_CTX_free(ctx);
-        return NULL;
+        return -1;
     }
     if (!SSL_CTX_use_PrivateKey_file(ctx, config.key_pem, SSL_FILETYPE_PEM)) {
         ERR_print_errors_fp(stderr);
         log_error(-1, "SSL_CTX_use_PrivateKey_file");
-        SSL_CTX_free(ctx);
-        return NULL;
+        return -1;
+    }
+    /* OpenSSL has no EdDSA signature algorithm for DTLS 1.2 */
+    key_type = EVP_PKEY_base_id(SSL_CTX_get0_privatekey(ctx));
+    if (key_type == EVP_PKEY_ED25519 || key_type == EVP_PKEY_ED448) {
+        log_message("The EdDSA keys cannot be used with DTLS 1.2, use an ECDSA key (%s)",
+                config.key_pem);
+        return -1;
     }
     SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT,
             verify_callback);
@@ -166,8 +373,7 @@ static SSL_CTX * createContext(int is_client) {
     if (!SSL_CTX_load_verify_locations(ctx, config.verif_pem, config.verif_dir)) {
         ERR_print_errors_fp(stderr);
         log_error(-1, "SSL_CTX_load_verify_locations");
-        SSL_CTX_free(ctx);
-        return NULL;
+        return -1;
     }
 
     // add CRL
@@ -182,6 +388,253 @@ static SSL_CTX * createContext(int is_client) {
     // validate the key
     if (!SSL_CTX_check_private_key(ctx)) {
         log_error(-1, "SSL_CTX_check_private_key");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * ex_data free function of the pinned public keys
+ */
+static void trusted_keys_free(void *parent __attribute__((unused)), void *ptr,
+        CRYPTO_EX_DATA *ad __attribute__((unused)), int idx __attribute__((unused)),
+        long argl __attribute__((unused)), void *argp __attribute__((unused))) {
+    struct trusted_keys *keys = (struct trusted_keys *) ptr;
+    int i;
+
+    if (keys == NULL)
+        return;
+    for (i = 0; i < keys->n; i++) {
+        OPENSSL_free(keys->der[i]);
+    }
+    free(keys->der);
+    free(keys->len);
+    free(keys);
+}
+
+/*
+ * Read the public keys of the trust file (PEM "PUBLIC KEY" blocks)
+ * Return NULL on error or if the file has no key.
+ */
+static struct trusted_keys *trusted_keys_load(const char *file) {
+    struct trusted_keys *keys;
+    EVP_PKEY *pkey;
+    BIO *bio;
+    unsigned char *der;
+    int len;
+
+    bio = BIO_new_file(file, "r");
+    if (bio == NULL) {
+        ERR_print_errors_fp(stderr);
+        log_message("Cannot open the trusted keys file %s", file);
+        return NULL;
+    }
+    keys = CHECK_ALLOC_FATAL(calloc(1, sizeof(struct trusted_keys)));
+    while ((pkey = PEM_read_bio_PUBKEY(bio, NULL, NULL, NULL)) != NULL) {
+        der = NULL;
+        len = i2d_PUBKEY(pkey, &der);
+        EVP_PKEY_free(pkey);
+        if (len <= 0) {
+            ERR_print_errors_fp(stderr);
+            continue;
+        }
+        keys->der = CHECK_ALLOC_FATAL(realloc(keys->der, sizeof(unsigned char *) * (keys->n + 1)));
+        keys->len = CHECK_ALLOC_FATAL(realloc(keys->len, sizeof(int) * (keys->n + 1)));
+        keys->der[keys->n] = der;
+        keys->len[keys->n] = len;
+        keys->n++;
+    }
+    /* the end of the file */
+    ERR_clear_error();
+    BIO_free(bio);
+
+    if (keys->n == 0) {
+        log_message("No public key in the trusted keys file %s", file);
+        trusted_keys_free(NULL, keys, NULL, 0, 0, NULL);
+        return NULL;
+    }
+    log_message_level(2, "%d trusted public keys loaded from %s", keys->n, file);
+    return keys;
+}
+
+/*
+ * Is this public key in the pinned keys of the SSL context?
+ */
+static int trusted_keys_match(SSL_CTX *ctx, EVP_PKEY *pkey) {
+    struct trusted_keys *keys = SSL_CTX_get_ex_data(ctx, trusted_keys_idx);
+    unsigned char *der = NULL;
+    int len, i, found = 0;
+
+    if (keys == NULL || pkey == NULL)
+        return 0;
+    len = i2d_PUBKEY(pkey, &der);
+    if (len <= 0)
+        return 0;
+    for (i = 0; i < keys->n && !found; i++) {
+        found = (keys->len[i] == len && memcmp(keys->der[i], der, (size_t) len) == 0);
+    }
+    OPENSSL_free(der);
+    return found;
+}
+
+/*
+ * Verification callback with pinned public keys: the chain does not matter,
+ * the public key of the peer (raw public key or key of its certificate) must
+ * be in the trust file. The handshake proves that the peer has the private key.
+ */
+static int rpk_verify_callback(int ok __attribute__((unused)), X509_STORE_CTX *x509_ctx) {
+    SSL *ssl;
+    X509 *cert;
+    EVP_PKEY *pkey;
+
+    if (X509_STORE_CTX_get_error_depth(x509_ctx) != 0) {
+        return 1;
+    }
+    ssl = X509_STORE_CTX_get_ex_data(x509_ctx, SSL_get_ex_data_X509_STORE_CTX_idx());
+    cert = X509_STORE_CTX_get_current_cert(x509_ctx);
+    if (cert != NULL) {
+        pkey = X509_get0_pubkey(cert);
+    }
+    else {
+#ifdef TLSEXT_cert_type_rpk
+        pkey = X509_STORE_CTX_get0_rpk(x509_ctx);
+#else
+        pkey = NULL;
+#endif
+    }
+    if (ssl == NULL || !trusted_keys_match(SSL_get_SSL_CTX(ssl), pkey)) {
+        log_message("The public key of the peer is not in %s", config.trusted_keys);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Minimal self-signed certificate of our key, sent to the peers which do not
+ * negotiate the raw public keys. It has no extension and no chain: the first
+ * flights of the handshake fit in one datagram.
+ */
+static X509 *rpk_certificate(EVP_PKEY *pkey) {
+    X509 *cert;
+    X509_NAME *name;
+
+    cert = X509_new();
+    if (cert == NULL)
+        return NULL;
+    name = X509_get_subject_name(cert);
+    if (!ASN1_INTEGER_set(X509_get_serialNumber(cert), 1)
+            || !X509_gmtime_adj(X509_getm_notBefore(cert), -86400)
+            || !X509_time_adj_ex(X509_getm_notAfter(cert), 36500, 0, NULL)
+            || !X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                    (const unsigned char *) inet_ntoa(config.vpnIP), -1, -1, 0)
+            || !X509_set_issuer_name(cert, name)
+            || !X509_set_pubkey(cert, pkey)
+            || !X509_sign(cert, pkey, EVP_sha256())) {
+        X509_free(cert);
+        return NULL;
+    }
+    return cert;
+}
+
+/*
+ * Pinned public keys mode: load the key and the trust file, send a raw public
+ * key (RFC 7250) or a bare self-signed certificate. Return -1 on error.
+ */
+static int setupRawPublicKeys(SSL_CTX *ctx) {
+#ifdef TLSEXT_cert_type_rpk
+    static const unsigned char cert_types[] = {
+        TLSEXT_cert_type_rpk, TLSEXT_cert_type_x509
+    };
+#endif
+    struct trusted_keys *keys;
+    EVP_PKEY *pkey;
+    X509 *cert;
+    int key_type;
+
+    if (!SSL_CTX_use_PrivateKey_file(ctx, config.key_pem, SSL_FILETYPE_PEM)) {
+        ERR_print_errors_fp(stderr);
+        log_error(-1, "SSL_CTX_use_PrivateKey_file");
+        return -1;
+    }
+    pkey = SSL_CTX_get0_privatekey(ctx);
+    key_type = EVP_PKEY_base_id(pkey);
+    if (key_type == EVP_PKEY_ED25519 || key_type == EVP_PKEY_ED448) {
+        log_message("The EdDSA keys cannot be used with DTLS 1.2, use an ECDSA key (%s)",
+                config.key_pem);
+        return -1;
+    }
+    cert = rpk_certificate(pkey);
+    if (cert == NULL || !SSL_CTX_use_certificate(ctx, cert)) {
+        ERR_print_errors_fp(stderr);
+        log_message("Cannot create the certificate of the public key");
+        X509_free(cert);
+        return -1;
+    }
+    X509_free(cert);
+    if (!SSL_CTX_check_private_key(ctx)) {
+        log_error(-1, "SSL_CTX_check_private_key");
+        return -1;
+    }
+
+    keys = trusted_keys_load(config.trusted_keys);
+    if (keys == NULL) {
+        return -1;
+    }
+    SSL_CTX_set_ex_data(ctx, trusted_keys_idx, keys);
+
+    /* never send a chain */
+    SSL_CTX_set_mode(ctx, SSL_MODE_NO_AUTO_CHAIN);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT,
+            rpk_verify_callback);
+
+#ifdef TLSEXT_cert_type_rpk
+    if (!SSL_CTX_set1_client_cert_type(ctx, cert_types, sizeof(cert_types))
+            || !SSL_CTX_set1_server_cert_type(ctx, cert_types, sizeof(cert_types))) {
+        ERR_print_errors_fp(stderr);
+        log_error(-1, "SSL_CTX_set1_server_cert_type");
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+/*
+ * Allocate and configure a DTLS context
+ * DTLS 1.2 only: the AEAD ciphers are not available with DTLS 1.0
+ */
+static SSL_CTX * createContext(int is_client) {
+    SSL_CTX *ctx;
+    const char *ciphers;
+
+    if (is_client) {
+        ctx = SSL_CTX_new(DTLS_client_method());
+    }
+    else {
+        ctx = SSL_CTX_new(DTLS_server_method());
+    }
+    if (ctx == NULL) {
+        ERR_print_errors_fp(stderr);
+        log_error(-1, "SSL_CTX_new");
+        return NULL;
+    }
+    if (!SSL_CTX_set_min_proto_version(ctx, DTLS1_2_VERSION)) {
+        ERR_print_errors_fp(stderr);
+        log_error(-1, "SSL_CTX_set_min_proto_version");
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    if (config.psk) {
+        setupPSK(ctx, is_client);
+    }
+    else if (config.trusted_keys != NULL) {
+        if (setupRawPublicKeys(ctx) == -1) {
+            SSL_CTX_free(ctx);
+            return NULL;
+        }
+    }
+    else if (setupCertificates(ctx) == -1) {
         SSL_CTX_free(ctx);
         return NULL;
     }
@@ -194,11 +647,8 @@ static SSL_CTX * createContext(int is_client) {
     SSL_CTX_set_read_ahead(ctx, 1);
 
     /* No zlib compression */
-#ifdef SSL_OP_NO_COMPRESSION
     SSL_CTX_set_options(ctx, SSL_OP_NO_COMPRESSION);
-#else
-    ctx->comp_methods = NULL;
-#endif
+
     /* Algorithms */
     if (config.cipher_list != NULL) {
         if (!SSL_CTX_set_cipher_list(ctx, config.cipher_list)) {
@@ -208,12 +658,42 @@ static SSL_CTX * createContext(int is_client) {
             return NULL;
         }
     }
+    else {
+        if (config.psk)
+            ciphers = cpu_has_aes() ? CIPHERS_PSK_AES_FIRST : CIPHERS_PSK_CHACHA_FIRST;
+        else
+            ciphers = cpu_has_aes() ? CIPHERS_AES_FIRST : CIPHERS_CHACHA_FIRST;
+        if (!SSL_CTX_set_cipher_list(ctx, ciphers)) {
+            log_error(-1, "SSL_CTX_set_cipher_list");
+            ERR_print_errors_fp(stderr);
+            SSL_CTX_free(ctx);
+            return NULL;
+        }
+        /* The server chooses with its own list, but it takes
+         * ChaCha20-Poly1305 when the client prefers it (no AES instructions) */
+        if (!is_client) {
+            SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE
+                    | SSL_OP_PRIORITIZE_CHACHA);
+        }
+    }
 
-    if (!is_client) {
+    /* Groups of the ECDHE key exchange */
+    if (!SSL_CTX_set1_groups_list(ctx,
+            (config.groups != NULL) ? config.groups : GROUPS_DEFAULT)) {
+        log_error(-1, "SSL_CTX_set1_groups_list");
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    if (!is_client && !config.psk && config.trusted_keys == NULL) {
         SSL_CTX_set_client_CA_list(ctx, SSL_load_client_CA_file(
                 config.verif_pem));
     }
 
+    /* resumption of the sessions */
+    session_cache_setup_ctx(ctx, is_client);
+
     return ctx;
 }
 
@@ -222,15 +702,24 @@ static SSL_CTX * createContext(int is_client) {
  * return -1 on error.
  */
 int initDTLS() {
+    if (trusted_keys_idx == -1) {
+        trusted_keys_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL,
+                trusted_keys_free);
+    }
+    if (session_cache_init() == -1) {
+        return -1;
+    }
     campagnol_ctx_client = createContext(1);
     if (campagnol_ctx_client == NULL) {
         log_error(-1, "Cannot allocate a new SSL context");
+        session_cache_close();
         return -1;
     }
     campagnol_ctx_server = createContext(0);
     if (campagnol_ctx_server == NULL) {
         SSL_CTX_free(campagnol_ctx_client);
         log_error(-1, "Cannot allocate a new SSL context");
+        session_cache_close();
         return -1;
     }
     mutexInit(&ctx_lock, NULL);
@@ -241,11 +730,14 @@ void clearDTLS() {
     SSL_CTX_free(campagnol_ctx_client);
     SSL_CTX_free(campagnol_ctx_server);
     mutexDestroy(&ctx_lock);
+    session_cache_close();
 }
 
 int rebuildDTLS() {
     SSL_CTX *tmp;
     mutexLock(&ctx_lock);
+    /* the certificates or the CRL may have changed */
+    session_cache_flush();
     tmp = createContext(1);
     if (tmp != NULL) {
         SSL_CTX_free(campagnol_ctx_client);
@@ -276,7 +768,7 @@ int rebuildDTLS() {
  * Build the SSL structure for a client
  */
 int createClientSSL(struct client *peer) {
-    struct timeval recv_timeout;
+    struct fifo_notify notify;
     BIO *wbio_tmp;
 
     mutexLock(&ctx_lock);
@@ -303,6 +795,21 @@ int createClientSSL(struct client *peer) {
         mutexUnlock(&ctx_lock);
         return -1;
     }
+    /* create a BIO to send the records by batches if required
+     * it also sets the outer DSCP of the records */
+    if (config.send_batch > 1 || config.dscp_priority) {
+        BIO *batch = BIO_f_new_batch(config.send_batch,
+                config.send_batch_latency, MESSAGE_MAX_LENGTH);
+        if (batch == NULL) {
+            ERR_print_errors_fp(stderr);
+            log_error(-1, "BIO_f_new_batch");
+            BIO_free(wbio_tmp);
+            SSL_free(peer->ssl);
+            mutexUnlock(&ctx_lock);
+            return -1;
+        }
+        wbio_tmp = BIO_push(batch, wbio_tmp);
+    }
     /* create a BIO for the rate limiter if required */
     if (config.tb_client_size != 0 || config.tb_connection_size != 0) {
         struct tb_state *global =
@@ -313,7 +820,7 @@ int createClientSSL(struct client *peer) {
         if (peer->wbio == NULL) {
             ERR_print_errors_fp(stderr);
             log_error(-1, "BIO_f_new_rate_limiter");
-            BIO_free(wbio_tmp);
+            BIO_free_all(wbio_tmp);
             SSL_free(peer->ssl);
             mutexUnlock(&ctx_lock);
             return -1;
@@ -324,7 +831,10 @@ int createClientSSL(struct client *peer) {
         peer->wbio = wbio_tmp;
     }
 
-    peer->rbio = BIO_new_fifo(config.FIFO_size, MESSAGE_MAX_LENGTH);
+    /* with one pipeline, comm_socket is the only writer and the worker of the peer the only reader */
+    peer->rbio = (config.pipelines == 1) ?
+            BIO_new_fifo_spsc(config.FIFO_size, packet_pool) :
+            BIO_new_fifo_pool(config.FIFO_size, packet_pool);
     if (peer->rbio == NULL) {
         ERR_print_errors_fp(stderr);
         log_error(-1, "BIO_new_fifo");
@@ -333,12 +843,13 @@ int createClientSSL(struct client *peer) {
         mutexUnlock(&ctx_lock);
         return -1;
     }
-    recv_timeout.tv_usec = PEER_RECV_TIMEMOUT_USEC;
-    recv_timeout.tv_sec = PEER_RECV_TIMEOUT_SEC;
-    BIO_ctrl(peer->rbio, BIO_CTRL_DGRAM_SET_RECV_TIMEOUT, 0, &recv_timeout);
     SSL_set_bio(peer->ssl, peer->rbio, peer->wbio);
 
-    peer->out_fifo = BIO_new_fifo(config.FIFO_size, MESSAGE_MAX_LENGTH);
+    /* same with comm_tun and the worker of the peer
+     * the AQM and the priority classes need the locked FIFO */
+    peer->out_fifo = (config.pipelines == 1 && config.aqm == AQM_NONE && !config.dscp_priority) ?
+            BIO_new_fifo_spsc(config.FIFO_size, packet_pool) :
+            BIO_new_fifo_pool(config.FIFO_size, packet_pool);
     if (peer->out_fifo == NULL) {
         ERR_print_errors_fp(stderr);
         log_error(-1, "BIO_new_fifo");
@@ -346,76 +857,74 @@ int createClientSSL(struct client *peer) {
         mutexUnlock(&ctx_lock);
         return -1;
     }
-    /* The FIFO for the outgoing SSL stream is created with a drop tail policy
-     * until the DTLS session is opened and we start transmitting VPN packets
+    if (config.aqm != AQM_NONE || config.dscp_priority) {
+        struct fifo_aqm_params aqm;
+        memset(&aqm, 0, sizeof(aqm));
+        aqm.flows = (config.aqm == AQM_FQ_CODEL) ? AQM_FLOWS : 1;
+        aqm.target = (config.aqm != AQM_NONE) ? config.aqm_target : 0;
+        aqm.interval = config.aqm_interval;
+        aqm.quantum = config.tun_mtu;
+        aqm.flow_hash = ip_flow_hash;
+        if (config.dscp_priority) {
+            aqm.classes = DSCP_CLASSES;
+            aqm.weights[DSCP_CLASS_HIGH] = 0;
+            aqm.weights[DSCP_CLASS_NORMAL] = DSCP_WEIGHT_NORMAL;
+            aqm.weights[DSCP_CLASS_LOW] = DSCP_WEIGHT_LOW;
+            aqm.classify = ip_dscp_class;
+        }
+        if (BIO_ctrl(peer->out_fifo, BIO_CTRL_FIFO_SET_AQM, 0, &aqm) != 1) {
+            log_message("Could not enable the queue management of the FIFO");
+        }
+    }
+    /* The FIFO for the outgoing SSL stream drops the new packets when it is
+     * full (drop tail policy), for instance while the DTLS session is opened
      */
     BIO_ctrl(peer->out_fifo, BIO_CTRL_FIFO_SET_DROPTAIL, 1, NULL);
 
+    /* the worker of the peer is scheduled by the writes in both FIFOs,
+     * its reads never wait */
+    notify.fn = worker_fifo_notify;
+    notify.arg = peer;
+    BIO_ctrl(peer->rbio, BIO_CTRL_FIFO_SET_NOTIFY, 0, &notify);
+    BIO_ctrl(peer->out_fifo, BIO_CTRL_FIFO_SET_NOTIFY, 0, &notify);
+
+    /* the session cache finds the peer of a SSL structure */
+    SSL_set_app_data(peer->ssl, peer);
     if (peer->is_dtls_client) {
         SSL_set_connect_state(peer->ssl);
+        session_cache_resume(peer);
     }
     else {
         SSL_set_accept_state(peer->ssl);
     }
 
     /* Don't try to discover the MTU
+     * The MTU of the records is adjusted to the cipher after the handshake
      */
     SSL_set_options(peer->ssl, SSL_OP_NO_QUERY_MTU);
-    peer->ssl->d1->mtu = config.tun_mtu;
+    SSL_set_mtu(peer->ssl, config.tun_mtu);
 
     mutexUnlock(&ctx_lock);
     return 0;
 }
 
-/* locking callback function for openssl */
-static void openssl_locking_function(int mode, int n, const char *file __attribute__((unused)),
-        int line __attribute__((unused))) {
-    if (mode & CRYPTO_LOCK) {
-        mutexLock(&crypto_mutexes[n]);
-    }
-    else {
-        mutexUnlock(&crypto_mutexes[n]);
-    }
-}
-
-#ifndef HAVE_CRYPTO_THREADID_CURRENT
-/* id_function for openssl threading support
- * openssl >= 1.0.0 has a default implementation */
-static unsigned long openssl_id_function(void) {
-    /* linux: pthread_t is a unsigned long int, ok
-     * freebsd/openbsd: pthread_t is a pointer, ok
-     */
-    return (unsigned long) pthread_self();
-}
-#endif
-
-/* setup callback functions for openssl threading support */
-void setup_openssl_thread() {
-    int i, n;
-    n = CRYPTO_num_locks();
-
-    crypto_mutexes = CHECK_ALLOC_FATAL(malloc(sizeof(pthread_mutex_t)*n));
-    for (i = 0; i < n; i++) {
-        mutexInit(&crypto_mutexes[i], NULL);
-    }
-#ifndef HAVE_CRYPTO_THREADID_CURRENT
-    CRYPTO_set_id_callback(&openssl_id_function);
-#endif
-    CRYPTO_set_locking_callback(&openssl_locking_function);
-}
-
-/* clean callback functions */
-void cleanup_openssl_thread() {
-    int i, n;
-    n = CRYPTO_num_locks();
-
-#ifndef HAVE_CRYPTO_THREADID_CURRENT
-    CRYPTO_set_id_callback(NULL);
-#endif
-    CRYPTO_set_locking_callback(NULL);
-
-    for (i = 0; i < n; i++) {
-        mutexDestroy(&crypto_mutexes[i]);
-    }
-    free(crypto_mutexes);
+/*
+ * Set the MTU of the records of an established session so that a packet of
+ * data_mtu bytes fits in one record. The overhead of the record depends on
+ * the cipher: explicit IV, MAC and padding for CBC, nonce and tag for AEAD.
+ * Return the MTU of the records.
+ */
+unsigned int dtls_set_data_mtu(SSL *ssl, unsigned int data_mtu) {
+    unsigned int mtu;
+
+    /* overhead measured with a large enough MTU */
+    mtu = data_mtu + 512;
+    SSL_set_mtu(ssl, mtu);
+    mtu = data_mtu + (mtu - (unsigned int) DTLS_get_data_mtu(ssl));
+    /* the block ciphers round down the payload */
+    SSL_set_mtu(ssl, mtu);
+    while (DTLS_get_data_mtu(ssl) < data_mtu) {
+        SSL_set_mtu(ssl, ++mtu);
+    }
+    return mtu;
 }
@@ -46,9 +46,7 @@ extern int initDTLS(void);
 extern void clearDTLS(void);
 extern int rebuildDTLS(void);
 
-extern void setup_openssl_thread(void);
-extern void cleanup_openssl_thread(void);
-
 extern int createClientSSL(struct client *peer);
+extern unsigned int dtls_set_data_mtu(SSL *ssl, unsigned int data_mtu);
 
 #endif /* DTLS_UTILS_H_ */
@@ -0,0 +1,244 @@
+/*
+ * Campagnol, event loop
+ *
+ * Copyright (C) 2011 Florent Bondoux
+ *
+ * This file is part of Campagnol.
+ *
+ * Campagnol is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Campagnol is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Campagnol.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * 
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ */
+
+
+#include "campagnol.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#   include <sys/eventfd.h>
+#endif
+
+#include "event_loop.h"
+#include "../common/log.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+
+int evloop_init(struct evloop *loop) {
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd == -1) {
+        log_error(errno, "epoll_create1");
+        return -1;
+    }
+    return 0;
+}
+
+void evloop_close(struct evloop *loop) {
+    if (loop->epfd != -1) {
+        close(loop->epfd);
+        loop->epfd = -1;
+    }
+}
+
+int evloop_add(struct evloop *loop, int fd, int events, void *data) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLET;
+    if (events & EVLOOP_IN) ev.events |= EPOLLIN;
+    if (events & EVLOOP_OUT) ev.events |= EPOLLOUT;
+    ev.data.ptr = data;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        log_error(errno, "epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+int evloop_del(struct evloop *loop, int fd) {
+    struct epoll_event ev; // non-NULL for pre-2.6.9 kernels
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, &ev) == -1) {
+        log_error(errno, "epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+int evloop_wait(struct evloop *loop, struct evloop_event *events, int maxevents, int timeout) {
+    struct epoll_event ev[EVLOOP_MAX_EVENTS];
+    int r, i;
+
+    if (maxevents > EVLOOP_MAX_EVENTS)
+        maxevents = EVLOOP_MAX_EVENTS;
+
+    r = epoll_wait(loop->epfd, ev, maxevents, timeout);
+    if (r == -1) {
+        if (errno == EINTR)
+            return 0;
+        log_error(errno, "epoll_wait");
+        return -1;
+    }
+    for (i = 0; i < r; i++) {
+        events[i].events = 0;
+        /* report errors and hang-ups as readable, the next read will fail */
+        if (ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) events[i].events |= EVLOOP_IN;
+        if (ev[i].events & EPOLLOUT) events[i].events |= EVLOOP_OUT;
+        events[i].data = ev[i].data.ptr;
+    }
+    return r;
+}
+
+#else
+
+int evloop_init(struct evloop *loop) {
+    loop->nfds = 0;
+    return 0;
+}
+
+void evloop_close(struct evloop *loop) {
+    loop->nfds = 0;
+}
+
+int evloop_add(struct evloop *loop, int fd, int events, void *data) {
+    if (loop->nfds == EVLOOP_MAX_FDS) {
+        log_message("Too many file descriptors in the event loop");
+        return -1;
+    }
+    loop->fds[loop->nfds].fd = fd;
+    loop->fds[loop->nfds].events = 0;
+    if (events & EVLOOP_IN) loop->fds[loop->nfds].events |= POLLIN;
+    if (events & EVLOOP_OUT) loop->fds[loop->nfds].events |= POLLOUT;
+    loop->data[loop->nfds] = data;
+    loop->nfds++;
+    return 0;
+}
+
+int evloop_del(struct evloop *loop, int fd) {
+    int i;
+    for (i = 0; i < loop->nfds; i++) {
+        if (loop->fds[i].fd == fd) {
+            loop->nfds--;
+            loop->fds[i] = loop->fds[loop->nfds];
+            loop->data[i] = loop->data[loop->nfds];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int evloop_wait(struct evloop *loop, struct evloop_event *events, int maxevents, int timeout) {
+    int r, i, n;
+
+    r = poll(loop->fds, loop->nfds, timeout);
+    if (r == -1) {
+        if (errno == EINTR)
+            return 0;
+        log_error(errno, "poll");
+        return -1;
+    }
+    n = 0;
+    for (i = 0; i < loop->nfds && n < r && n < maxevents; i++) {
+        if (loop->fds[i].revents == 0)
+            continue;
+        events[n].events = 0;
+        if (loop->fds[i].revents & (POLLIN | POLLERR | POLLHUP)) events[n].events |= EVLOOP_IN;
+        if (loop->fds[i].revents & POLLOUT) events[n].events |= EVLOOP_OUT;
+        events[n].data = loop->data[i];
+        n++;
+    }
+    return n;
+}
+
+#endif
+
+
+#ifdef HAVE_SYS_EVENTFD_H
+
+int evnotifier_init(struct evnotifier *n) {
+    n->rfd = n->wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (n->rfd == -1) {
+        log_error(errno, "eventfd");
+        return -1;
+    }
+    return 0;
+}
+
+void evnotifier_close(struct evnotifier *n) {
+    if (n->rfd != -1) close(n->rfd);
+    n->rfd = n->wfd = -1;
+}
+
+void evnotifier_signal(struct evnotifier *n) {
+    uint64_t one = 1;
+    if (write(n->wfd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        log_error(errno, "eventfd write");
+    }
+}
+
+void evnotifier_clear(struct evnotifier *n) {
+    uint64_t value;
+    while (read(n->rfd, &value, sizeof(value)) == sizeof(value));
+}
+
+#else
+
+int evnotifier_init(struct evnotifier *n) {
+    int fds[2];
+    if (pipe(fds) == -1) {
+        log_error(errno, "pipe");
+        return -1;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    n->rfd = fds[0];
+    n->wfd = fds[1];
+    return 0;
+}
+
+void evnotifier_close(struct evnotifier *n) {
+    if (n->rfd != -1) close(n->rfd);
+    if (n->wfd != -1) close(n->wfd);
+    n->rfd = n->wfd = -1;
+}
+
+void evnotifier_signal(struct evnotifier *n) {
+    char c = 0;
+    /* if the pipe is full, the loops are already notified */
+    if (write(n->wfd, &c, 1) == -1 && errno != EAGAIN) {
+        log_error(errno, "pipe write");
+    }
+}
+
+void evnotifier_clear(struct evnotifier *n) {
+    char buf[64];
+    while (read(n->rfd, buf, sizeof(buf)) > 0);
+}
+
+#endif
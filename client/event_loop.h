@@ -0,0 +1,106 @@
+/*
+ * Campagnol, event loop
+ *
+ * Copyright (C) 2011 Florent Bondoux
+ *
+ * This file is part of Campagnol.
+ *
+ * Campagnol is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Campagnol is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Campagnol.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * 
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ */
+
+
+#ifndef EVENT_LOOP_H_
+#define EVENT_LOOP_H_
+
+#include <stdint.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#   include <sys/epoll.h>
+#else
+#   include <poll.h>
+#endif
+
+/*
+ * Event loop used by the data plane threads
+ *
+ * With epoll, the file descriptors are registered in edge-triggered mode: an
+ * event is reported once when the descriptor becomes ready, so the handler
+ * must read (or write) until EAGAIN. The poll backend is level-triggered, the
+ * same draining code works with both.
+ *
+ * Each thread owns its loop. An evnotifier is a file descriptor used to wake
+ * up one or more loops from another thread (eventfd on Linux, a pipe
+ * otherwise).
+ */
+
+/* event types */
+#define EVLOOP_IN       0x1
+#define EVLOOP_OUT      0x2
+
+/* max number of events returned by one call of evloop_wait */
+#define EVLOOP_MAX_EVENTS 16
+/* max number of file descriptors per loop with the poll backend */
+#define EVLOOP_MAX_FDS 16
+
+struct evloop_event {
+    int events;                     // EVLOOP_IN and/or EVLOOP_OUT
+    void *data;                     // user data given to evloop_add
+};
+
+struct evloop {
+#ifdef HAVE_SYS_EPOLL_H
+    int epfd;                       // epoll instance
+#else
+    int nfds;                       // number of registered fd
+    struct pollfd fds[EVLOOP_MAX_FDS];
+    void *data[EVLOOP_MAX_FDS];
+#endif
+};
+
+extern int evloop_init(struct evloop *loop);
+extern void evloop_close(struct evloop *loop);
+extern int evloop_add(struct evloop *loop, int fd, int events, void *data);
+extern int evloop_del(struct evloop *loop, int fd);
+/* Wait for at most timeout ms (-1: infinite) and fill events.
+ * Return the number of events, 0 on timeout or -1 on error */
+extern int evloop_wait(struct evloop *loop, struct evloop_event *events, int maxevents, int timeout);
+
+struct evnotifier {
+    int rfd;                        // read end, registered into the loops
+    int wfd;                        // write end (same as rfd with eventfd)
+};
+
+extern int evnotifier_init(struct evnotifier *n);
+extern void evnotifier_close(struct evnotifier *n);
+/* wake up the loops where n is registered */
+extern void evnotifier_signal(struct evnotifier *n);
+/* consume the pending notifications */
+extern void evnotifier_clear(struct evnotifier *n);
+
+#endif /* EVENT_LOOP_H_ */
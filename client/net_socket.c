@@ -39,20 +39,23 @@
 
 #include <net/if.h>
 #include <arpa/inet.h>
+#include <netinet/udp.h>
 
 #include "configuration.h"
 #include "net_socket.h"
 #include "../common/log.h"
 
-/* Create the UDP socket
+int socket_gso = 0;
+int socket_gro = 0;
+
+/* Create a UDP socket
  * Bind it to config.localIP
- *            config.localport (localport > 0)
+ *            port (port > 0)
  *            config.iface (iface != NULL)
  */
-int create_socket(void) {
+static int open_socket(uint16_t port, int reuseport) {
     int sockfd;
-    struct sockaddr_in localaddr, tmp_addr;
-    socklen_t tmp_addr_len;
+    struct sockaddr_in localaddr;
 
     /* Socket creation */
     log_message_level(2, "Creating the UDP socket...");
@@ -68,11 +71,24 @@ int create_socket(void) {
         memset(&ifr, 0, sizeof(ifr));
         if (strlen(config.iface) + 1 > IFNAMSIZ) {
             log_message("The interface name '%s' is too long", config.iface);
+            close(sockfd);
             return -1;
         }
         strcpy(ifr.ifr_name, config.iface);
         if(setsockopt(sockfd, SOL_SOCKET, SO_BINDTODEVICE, &ifr, sizeof(ifr))) {
             log_error(errno, "Could not bind the socket to the interface (%s)", config.iface);
+            close(sockfd);
+            return -1;
+        }
+    }
+#endif
+
+#ifdef SO_REUSEPORT
+    if (reuseport) {
+        int on = 1;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+            log_error(errno, "Could not set SO_REUSEPORT on the socket");
+            close(sockfd);
             return -1;
         }
     }
@@ -81,15 +97,56 @@ int create_socket(void) {
     memset(&localaddr, 0, sizeof(localaddr));
     localaddr.sin_family = AF_INET;
     localaddr.sin_addr.s_addr=config.localIP.s_addr;
-    if (config.localport != 0) localaddr.sin_port=htons(config.localport);
+    if (port != 0) localaddr.sin_port=htons(port);
     if (bind(sockfd,(struct sockaddr *)&localaddr,sizeof(localaddr))<0) {
         log_error(errno,
                 "Could not bind the socket to the local IP address (%s port %u)",
-                inet_ntoa(config.localIP), config.localport);
+                inet_ntoa(config.localIP), port);
+        close(sockfd);
         return -1;
     }
     log_message_level(1, "Socket opened");
 
+#ifdef HAVE_LINUX
+    if (config.udp_offload) {
+        int on = 1;
+        socklen_t on_len = sizeof(on);
+        (void) on_len;
+#ifdef UDP_SEGMENT
+        /* the segment size is given with each message, just check the support */
+        if (getsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &on, &on_len) == 0) {
+            socket_gso = 1;
+        }
+#endif
+#if defined(UDP_GRO) && defined(HAVE_RECVMMSG)
+        /* recv_batch needs recvmmsg to get the segment size */
+        on = 1;
+        if (setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0) {
+            socket_gro = 1;
+        }
+#endif
+        log_message_level(2, "UDP offload: segmentation %s, receive %s",
+                socket_gso ? "on" : "off", socket_gro ? "on" : "off");
+    }
+#endif
+
+    return sockfd;
+}
+
+/* Create the UDP socket of a pipeline
+ * With several pipelines, the sockets share the same port (SO_REUSEPORT).
+ * The first call sets config.localport if it was 0.
+ */
+int create_socket(void) {
+    int sockfd;
+    struct sockaddr_in tmp_addr;
+    socklen_t tmp_addr_len;
+
+    sockfd = open_socket(config.localport, config.pipelines > 1);
+    if (sockfd < 0) {
+        return -1;
+    }
+
     /* Get the local port */
     if (config.localport == 0) {
         tmp_addr_len = sizeof(tmp_addr);
@@ -100,3 +157,162 @@ int create_socket(void) {
     return sockfd;
 }
 
+/* Create the UDP socket of a parallel session, bound to config.localport +
+ * session. The sockets of the pipelines must be created before.
+ */
+int create_session_socket(int session) {
+    if (config.localport + session > 65535) {
+        log_message("Could not open the socket of session %d: no port after %u",
+                session, config.localport);
+        return -1;
+    }
+    return open_socket((uint16_t) (config.localport + session), 0);
+}
+
+
+/*
+ * Set the receive buffer of the slot i of a batch
+ */
+static void recv_batch_set_buf(struct recv_batch *batch, int i) {
+    batch->pkt[i] = CHECK_ALLOC_FATAL(pkt_alloc(batch->pool));
+    batch->buf[i] = batch->pkt[i]->data;
+#ifdef HAVE_RECVMMSG
+    batch->iov[i].iov_base = batch->buf[i];
+    batch->iov[i].iov_len = batch->buf_size;
+#endif
+}
+
+/*
+ * Allocate the receive buffers of a batch from pool
+ */
+void recv_batch_init(struct recv_batch *batch, struct pkt_pool *pool) {
+    int i;
+
+    memset(batch, 0, sizeof(*batch));
+    batch->pool = pool;
+    batch->buf_size = pool->buf_size;
+    for (i = 0; i < SOCKET_BATCH_SIZE; i++) {
+        recv_batch_set_buf(batch, i);
+#ifdef HAVE_RECVMMSG
+        batch->msgs[i].msg_hdr.msg_name = &batch->addr[i];
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+#endif
+    }
+}
+
+void recv_batch_free(struct recv_batch *batch) {
+    int i;
+    for (i = 0; i < SOCKET_BATCH_SIZE; i++) {
+        pkt_free(batch->pkt[i]);
+    }
+}
+
+/*
+ * Get the size of the records of a datagram coalesced by UDP GRO
+ * from the control messages of msg
+ * Return 0 if the datagram was not coalesced
+ */
+int recv_gro_size(struct msghdr *msg) {
+    int seg = 0;
+#ifdef UDP_GRO
+    struct cmsghdr *cmsg;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            memcpy(&seg, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+#else
+    (void) msg;
+#endif
+    return (seg > 0) ? seg : 0;
+}
+
+/*
+ * Read up to SOCKET_BATCH_SIZE datagrams from the non blocking socket sockfd
+ * Return the number of datagrams read (batch->n)
+ */
+int recv_batch(int sockfd, struct recv_batch *batch) {
+    int r, j;
+
+    /* the records of the previous batch may still be in the FIFOs */
+    for (j = 0; j < batch->n; j++) {
+        if (pkt_shared(batch->pkt[j])) {
+            pkt_free(batch->pkt[j]);
+            recv_batch_set_buf(batch, j);
+        }
+    }
+#ifdef HAVE_RECVMMSG
+    int i;
+
+    for (i = 0; i < SOCKET_BATCH_SIZE; i++) {
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->addr[i]);
+        if (socket_gro) {
+            batch->msgs[i].msg_hdr.msg_control = batch->ctrl[i].buf;
+            batch->msgs[i].msg_hdr.msg_controllen = sizeof(batch->ctrl[i].buf);
+        }
+        else {
+            batch->msgs[i].msg_hdr.msg_control = NULL;
+            batch->msgs[i].msg_hdr.msg_controllen = 0;
+        }
+        batch->msgs[i].msg_hdr.msg_flags = 0;
+    }
+    batch->n_syscalls++;
+    r = recvmmsg(sockfd, batch->msgs, SOCKET_BATCH_SIZE, 0, NULL);
+    if (r == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            log_error(errno, "recvmmsg");
+        r = 0;
+    }
+    for (i = 0; i < r; i++) {
+        batch->len[i] = (int) batch->msgs[i].msg_len;
+        /* coalesced datagram, get the size of the records */
+        if (socket_gro && (batch->seg[i] = recv_gro_size(&batch->msgs[i].msg_hdr)) > 0)
+            batch->n_coalesced++;
+        else
+            batch->seg[i] = batch->len[i];
+    }
+#else
+    socklen_t len;
+    ssize_t s;
+
+    r = 0;
+    while (r < SOCKET_BATCH_SIZE) {
+        len = sizeof(batch->addr[r]);
+        batch->n_syscalls++;
+        s = recvfrom(sockfd, batch->buf[r], batch->buf_size, 0,
+                (struct sockaddr *) &batch->addr[r], &len);
+        if (s == -1)
+            break;
+        batch->len[r] = (int) s;
+        batch->seg[r] = (int) s;
+        r++;
+    }
+#endif
+
+    batch->n = r;
+    batch->n_wakeups++;
+    batch->n_datagrams += r;
+    batch->hist[r]++;
+    return r;
+}
+
+/*
+ * Log the batch size statistics
+ */
+void recv_batch_log_stats(struct recv_batch *batch) {
+    int i;
+
+    if (batch->n_wakeups == 0)
+        return;
+    log_message_level(1, "UDP socket: %lu datagrams, %lu wakeups, %lu system calls (%.2f datagrams/call)",
+            batch->n_datagrams, batch->n_wakeups, batch->n_syscalls,
+            batch->n_syscalls ? (double) batch->n_datagrams / (double) batch->n_syscalls : 0.);
+    if (batch->n_coalesced != 0)
+        log_message_level(1, "  %lu datagrams coalesced by UDP GRO", batch->n_coalesced);
+    for (i = 1; i <= SOCKET_BATCH_SIZE; i++) {
+        if (batch->hist[i] != 0)
+            log_message_level(2, "  batches of %2d datagrams: %lu", i, batch->hist[i]);
+    }
+}
@@ -40,6 +40,58 @@
 
 #include "communication.h"
 
+/*
+ * Maximum number of datagrams read from the UDP socket per wakeup
+ */
+#define SOCKET_BATCH_SIZE 16
+
+/*
+ * A set of preallocated receive buffers filled by recv_batch
+ * The buffers come from a packet pool. A buffer still referenced by a FIFO
+ * when the next batch is read is replaced by a new one.
+ * With recvmmsg, the whole batch is read with one system call. Otherwise,
+ * recvfrom is called until the socket is empty or the batch is full.
+ * With UDP GRO, a datagram may hold several records of seg[i] bytes sent by
+ * the same endpoint (the last one may be shorter).
+ */
+struct recv_batch {
+    int n;                                      // number of datagrams in the batch
+    unsigned char *buf[SOCKET_BATCH_SIZE];      // receive buffers
+    struct pkt_buf *pkt[SOCKET_BATCH_SIZE];     // pool buffers holding buf (or NULL)
+    struct pkt_pool *pool;
+    int len[SOCKET_BATCH_SIZE];                 // length of each datagram
+    struct sockaddr_in addr[SOCKET_BATCH_SIZE]; // source address of each datagram
+    size_t buf_size;                            // size of each buffer
+    int seg[SOCKET_BATCH_SIZE];                 // size of the records in each datagram
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr msgs[SOCKET_BATCH_SIZE];
+    struct iovec iov[SOCKET_BATCH_SIZE];
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl[SOCKET_BATCH_SIZE];                  // UDP_GRO control messages
+#endif
+
+    /* statistics */
+    unsigned long int n_wakeups;                // number of calls to recv_batch
+    unsigned long int n_syscalls;               // number of receive system calls
+    unsigned long int n_datagrams;              // total number of datagrams
+    unsigned long int n_coalesced;              // datagrams coalesced by UDP GRO
+    unsigned long int hist[SOCKET_BATCH_SIZE+1];// histogram of the batch sizes
+};
+
+/* UDP segmentation offload (UDP_SEGMENT) is available on the sockets */
+extern int socket_gso;
+/* UDP receive offload (UDP_GRO) is enabled on the sockets */
+extern int socket_gro;
+
 extern int create_socket(void);
+extern int create_session_socket(int session);
+
+extern void recv_batch_init(struct recv_batch *batch, struct pkt_pool *pool);
+extern void recv_batch_free(struct recv_batch *batch);
+extern int recv_batch(int sockfd, struct recv_batch *batch);
+extern int recv_gro_size(struct msghdr *msg);
+extern void recv_batch_log_stats(struct recv_batch *batch);
 
 #endif /*NET_SOCKET_H_*/
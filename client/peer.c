@@ -43,44 +43,259 @@
 #include "dtls_utils.h"
 #include "../common/pthread_wrap.h"
 #include "../common/log.h"
+#include "../common/bss_fifo.h"
+#include "../common/epoch.h"
 
 #include <arpa/inet.h>
-#include <search.h>
+#include <inttypes.h>
 
 /* List of known clients */
 struct client *peers_list = NULL;
 int peers_n_clients = 0;
-/* tree, items ordered by VPN IP */
-static void *clients_vpn_root = NULL;
-/* tree, items ordered by public endpoint */
-static void *clients_address_root = NULL;
-
-/* comparison routine for clients_vpn_root (by VPN IP) */
-static int compare_clients_vpn(const void *itema, const void *itemb) {
-    const struct client *peer1 = (const struct client *) itema;
-    const struct client *peer2 = (const struct client *) itemb;
-    return memcmp(&peer1->vpnIP, &peer2->vpnIP, sizeof(peer1->vpnIP));
+/* parallel sessions in the list, not counted in max_clients */
+static int peers_n_sessions = 0;
+
+/*
+ * Hash tables of the clients, by VPN IP (outside of the VPN subnet, see
+ * vpn_pages) and by public endpoint
+ *
+ * Open addressing with linear probing. The lookups don't take any lock, the
+ * modifications are done with peers_mutex held. A slot goes from empty to
+ * used and then to deleted, it is never reused: the table is rebuilt when
+ * the deleted slots fill it. The old tables and the removed clients are
+ * freed once the current lookups are done (see common/epoch.h).
+ */
+#define PEER_TABLE_MIN_SIZE 64
+#define PEER_DELETED ((struct client *) 1)
+
+struct peer_slot {
+    uint64_t key;
+    struct client * volatile peer;  // NULL: empty, PEER_DELETED: removed
+};
+
+struct peer_table {
+    unsigned int mask;              // size - 1, the size is a power of 2
+    unsigned int used;              // used and deleted slots
+    unsigned int count;             // used slots
+    struct peer_slot slots[];
+};
+
+static struct peer_table * volatile clients_vpn_table = NULL;
+static struct peer_table * volatile clients_address_table = NULL;
+
+static inline uint64_t vpn_key(struct in_addr address) {
+    return (uint64_t) address.s_addr;
 }
 
-/* comparison routine for clients_address_root (by public endpoint) */
-static int compare_clients_addr(const void *itema, const void *itemb) {
-    const struct client *peer1 = (const struct client *) itema;
-    const struct client *peer2 = (const struct client *) itemb;
-    if (peer1->clientaddr.sin_addr.s_addr < peer2->clientaddr.sin_addr.s_addr)
-        return -1;
-    if (peer1->clientaddr.sin_addr.s_addr == peer2->clientaddr.sin_addr.s_addr) {
-        if (peer1->clientaddr.sin_port < peer2->clientaddr.sin_port)
+static inline uint64_t endpoint_key(const struct sockaddr_in *address) {
+    return ((uint64_t) address->sin_addr.s_addr << 16) | address->sin_port;
+}
+
+static inline unsigned int peer_hash(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (unsigned int) key;
+}
+
+static struct peer_table *peer_table_new(unsigned int size) {
+    struct peer_table *t;
+    t = calloc(1, sizeof(struct peer_table) + size * sizeof(struct peer_slot));
+    if (t == NULL) {
+        return NULL;
+    }
+    t->mask = size - 1;
+    return t;
+}
+
+static struct client *peer_table_find(struct peer_table *t, uint64_t key) {
+    struct peer_slot *slot;
+    struct client *peer;
+    unsigned int i;
+
+    for (i = peer_hash(key);; i++) {
+        slot = &t->slots[i & t->mask];
+        peer = slot->peer;
+        if (peer == NULL) {
+            return NULL;
+        }
+        /* the key was written before the peer */
+        __sync_synchronize();
+        if (peer != PEER_DELETED && slot->key == key) {
+            return peer;
+        }
+    }
+}
+
+/* Insert without resizing, there must be a free slot */
+static void peer_table_put(struct peer_table *t, uint64_t key, struct client *peer) {
+    struct peer_slot *slot;
+    unsigned int i;
+
+    for (i = peer_hash(key);; i++) {
+        slot = &t->slots[i & t->mask];
+        if (slot->peer == NULL) {
+            slot->key = key;
+            __sync_synchronize();
+            slot->peer = peer;
+            t->used++;
+            t->count++;
+            return;
+        }
+    }
+}
+
+/*
+ * Add peer to the table *tp
+ * An existing entry with the same key is kept (as tsearch does)
+ * peers_mutex must be held
+ */
+static int peer_table_insert(struct peer_table * volatile *tp, uint64_t key, struct client *peer) {
+    struct peer_table *t = *tp, *n;
+    unsigned int size, i;
+
+    if (peer_table_find(t, key) != NULL) {
+        return 0;
+    }
+    /* keep the load factor below 3/4, counting the deleted slots */
+    if ((t->used + 1) * 4 > (t->mask + 1) * 3) {
+        size = PEER_TABLE_MIN_SIZE;
+        while (size < (t->count + 1) * 4) {
+            size *= 2;
+        }
+        n = peer_table_new(size);
+        if (n == NULL) {
             return -1;
-        if (peer1->clientaddr.sin_port == peer2->clientaddr.sin_port) {
-            return 0;
         }
-        return 1;
+        for (i = 0; i <= t->mask; i++) {
+            if (t->slots[i].peer != NULL && t->slots[i].peer != PEER_DELETED) {
+                peer_table_put(n, t->slots[i].key, t->slots[i].peer);
+            }
+        }
+        __sync_synchronize();
+        *tp = n;
+        epoch_retire(t, free);
+        t = n;
     }
-    return 1;
+    peer_table_put(t, key, peer);
+    return 0;
 }
 
 /*
- * mutex used to manipulate the clients list and the trees
+ * Remove the entry key -> peer
+ * peers_mutex must be held
+ */
+static void peer_table_remove(struct peer_table *t, uint64_t key, struct client *peer) {
+    struct peer_slot *slot;
+    unsigned int i;
+
+    for (i = peer_hash(key);; i++) {
+        slot = &t->slots[i & t->mask];
+        if (slot->peer == NULL) {
+            return;
+        }
+        if (slot->peer == peer && slot->key == key) {
+            slot->peer = PEER_DELETED;
+            t->count--;
+            return;
+        }
+    }
+}
+
+/*
+ * Direct index of the clients of the VPN subnet, by host offset
+ *
+ * The slots are allocated by pages on the first client of a page and
+ * never freed, so a sparse subnet stays cheap. The addresses outside of
+ * the subnet, or all of them if the subnet is too large, are in
+ * clients_vpn_table. Same locking as the tables.
+ */
+#define PEER_PAGE_BITS 8
+#define PEER_PAGE_SIZE (1U << PEER_PAGE_BITS)
+#define PEER_DIRECT_MAX_BITS 20             // up to a /12 subnet
+
+static struct client * volatile * volatile *vpn_pages = NULL;
+static uint32_t vpn_base;                   // first address of the subnet (host order)
+static uint32_t vpn_size;                   // number of addresses
+
+static void peer_direct_init(void) {
+    uint32_t mask = ntohl(config.vpnNetmask.s_addr);
+
+    if (~mask >= (1U << PEER_DIRECT_MAX_BITS)) {
+        return;
+    }
+    vpn_base = ntohl(config.vpnIP.s_addr) & mask;
+    vpn_size = ~mask + 1;
+    vpn_pages = CHECK_ALLOC_FATAL(calloc((vpn_size + PEER_PAGE_SIZE - 1) >> PEER_PAGE_BITS,
+            sizeof(*vpn_pages)));
+}
+
+static inline int peer_in_subnet(struct in_addr address) {
+    return vpn_pages != NULL && ntohl(address.s_addr) - vpn_base < vpn_size;
+}
+
+/*
+ * Slot of an address of the subnet
+ * Without alloc, return NULL if its page doesn't exist
+ * With alloc, peers_mutex must be held
+ */
+static struct client * volatile *peer_direct_slot(struct in_addr address, int alloc) {
+    uint32_t offset = ntohl(address.s_addr) - vpn_base;
+    struct client * volatile *page;
+
+    page = vpn_pages[offset >> PEER_PAGE_BITS];
+    if (page == NULL) {
+        if (!alloc) {
+            return NULL;
+        }
+        page = calloc(PEER_PAGE_SIZE, sizeof(*page));
+        if (page == NULL) {
+            return NULL;
+        }
+        __sync_synchronize();
+        vpn_pages[offset >> PEER_PAGE_BITS] = page;
+    }
+    return &page[offset & (PEER_PAGE_SIZE - 1)];
+}
+
+/*
+ * Index a client by VPN IP
+ * An existing client with the same address is kept
+ * peers_mutex must be held
+ */
+static int peers_vpn_insert(struct client *peer) {
+    struct client * volatile *slot;
+
+    if (!peer_in_subnet(peer->vpnIP)) {
+        return peer_table_insert(&clients_vpn_table, vpn_key(peer->vpnIP), peer);
+    }
+    slot = peer_direct_slot(peer->vpnIP, 1);
+    if (slot == NULL) {
+        return -1;
+    }
+    if (*slot == NULL) {
+        /* the client is initialized before being published */
+        __sync_synchronize();
+        *slot = peer;
+    }
+    return 0;
+}
+
+static void peers_vpn_remove(struct client *peer) {
+    struct client * volatile *slot;
+
+    if (!peer_in_subnet(peer->vpnIP)) {
+        peer_table_remove(clients_vpn_table, vpn_key(peer->vpnIP), peer);
+        return;
+    }
+    slot = peer_direct_slot(peer->vpnIP, 0);
+    if (slot != NULL && *slot == peer) {
+        *slot = NULL;
+    }
+}
+
+/*
+ * mutex used to manipulate the clients list and the tables
  */
 pthread_mutex_t peers_mutex;
 
@@ -89,20 +304,41 @@ void peers_mutex_init(void) {
     mutexattrInit(&attrs);
     mutexattrSettype(&attrs, PTHREAD_MUTEX_RECURSIVE);
     mutexInit(&peers_mutex, &attrs);
+    /* the tables are kept when the VPN is restarted */
+    if (clients_vpn_table == NULL) {
+        clients_vpn_table = CHECK_ALLOC_FATAL(peer_table_new(PEER_TABLE_MIN_SIZE));
+        clients_address_table = CHECK_ALLOC_FATAL(peer_table_new(PEER_TABLE_MIN_SIZE));
+        peer_direct_init();
+    }
 }
 
+/* The workers and the lookup threads must be stopped */
 void peers_mutex_destroy(void) {
+    /* free the removed peers and the old tables still waiting in the limbo */
+    epoch_drain();
     mutexDestroy(&peers_mutex);
 }
 
 /*
  * Safely increment the reference counter of peer
+ * The caller must already hold a reference
  */
 void peers_incr_ref(struct client *peer) {
-    mutexLock(&peer->mutex_ref);
-    peer->ref_count++;
-//    fprintf(stderr, "incr %s [%d]\n", inet_ntoa(peer->vpnIP), peer->ref_count);
-    mutexUnlock(&peer->mutex_ref);
+    __sync_fetch_and_add(&peer->ref_count, 1);
+}
+
+/*
+ * Take a reference on a peer found in a table, unless it is being removed
+ */
+static int peers_try_ref(struct client *peer) {
+    unsigned int count;
+    do {
+        count = peer->ref_count;
+        if (count == 0) {
+            return 0;
+        }
+    } while (!__sync_bool_compare_and_swap(&peer->ref_count, count, count + 1));
+    return 1;
 }
 
 /*
@@ -110,18 +346,9 @@ void peers_incr_ref(struct client *peer) {
  * If the count reaches 0, the peer is freed
  */
 void peers_decr_ref(struct client *peer, int n) {
-    GLOBAL_MUTEXLOCK;
-    mutexLock(&peer->mutex_ref);
-    peer->ref_count -= n;
-//    fprintf(stderr, "decr %s [%d]\n", inet_ntoa(peer->vpnIP), peer->ref_count);
-    if (peer->ref_count == 0) {
-        mutexUnlock(&peer->mutex_ref);
+    if (__sync_sub_and_fetch(&peer->ref_count, n) == 0) {
         peers_remove(peer);
     }
-    else {
-        mutexUnlock(&peer->mutex_ref);
-    }
-    GLOBAL_MUTEXUNLOCK;
 }
 
 /*
@@ -132,30 +359,42 @@ void peers_decr_ref(struct client *peer, int n) {
  *
  * just call peers_decr_ref to remove the last reference from "peers_list":
  * This will remove the client from the linked list and free it's memory
+ *
+ * A parallel session (primary != NULL) is not indexed by VPN IP, it is
+ * published in primary->sessions and holds a reference on primary.
  */
 static struct client * peers_add(int sockfd, int tunfd, int state, time_t t,
         struct in_addr clientIP, uint16_t clientPort, struct in_addr vpnIP,
-        int is_dtls_client) {
+        int is_dtls_client, struct client *primary, int session) {
     int r;
-    void *slot;
 
     GLOBAL_MUTEXLOCK;
 
-    if (peers_n_clients >= config.max_clients) {
+    if (primary == NULL && peers_n_clients - peers_n_sessions >= config.max_clients) {
         log_message_level(2, "Cannot open a new connection: maximum number of connections reached");
         GLOBAL_MUTEXUNLOCK;
         return NULL;
     }
+    if (primary != NULL && primary->sessions[session] != NULL) {
+        GLOBAL_MUTEXUNLOCK;
+        return NULL;
+    }
 
-    log_message_level(2, "Adding new client %s", inet_ntoa(vpnIP));
-    struct client *peer = malloc(sizeof(struct client));
-    if (peer == NULL) {
-        log_error(errno, "Cannot allocate a new client (malloc)");
+    if (primary == NULL)
+        log_message_level(2, "Adding new client %s", inet_ntoa(vpnIP));
+    else
+        log_message_level(2, "Adding session %d with client %s", session, inet_ntoa(vpnIP));
+    struct client *peer;
+    r = posix_memalign((void **) &peer, PEER_CACHE_LINE, sizeof(struct client));
+    if (r != 0) {
+        log_error(r, "Cannot allocate a new client (malloc)");
         GLOBAL_MUTEXUNLOCK;
         return NULL;
     }
-    peer->time = t;
-    peer->last_keepalive = t;
+    memset(peer, 0, sizeof(struct client));
+    peer->tx.time = t;
+    peer->rx.time = t;
+    peer->rx.last_keepalive = t;
     memset(&(peer->clientaddr), 0, sizeof(peer->clientaddr));
     peer->clientaddr.sin_family = AF_INET;
     peer->clientaddr.sin_addr = clientIP;
@@ -164,12 +403,14 @@ static struct client * peers_add(int sockfd, int tunfd, int state, time_t t,
     peer->state = state;
     peer->tunfd = tunfd;
     peer->sockfd = sockfd;
-    conditionInit(&peer->cond_connected, NULL);
     mutexInit(&peer->mutex, NULL);
     peer->shutdown = 0;
     peer->is_dtls_client = is_dtls_client;
-    mutexInit(&(peer->mutex_ref), NULL);
     peer->ref_count = 2;
+    peer->endpoint_key = 0;
+    peer->primary = primary;
+    peer->session = session;
+    peer->worker = worker_assign(vpnIP, session);
 
     /* initialize rate limiter */
     if (config.tb_connection_size != 0) {
@@ -179,53 +420,48 @@ static struct client * peers_add(int sockfd, int tunfd, int state, time_t t,
 
     r = createClientSSL(peer);
     if (r != 0) {
-        mutexDestroy(&peer->mutex_ref);
         mutexDestroy(&peer->mutex);
-        conditionDestroy(&peer->cond_connected);
         free(peer);
         log_error(-1, "Could not create the new client");
         GLOBAL_MUTEXUNLOCK;
         return NULL;
     }
 
-    slot = tsearch((void *) peer, &clients_vpn_root, compare_clients_vpn);
-    if (slot == NULL) {
-        log_error(errno, "Cannot allocate a new client (tsearch)");
-        mutexDestroy(&peer->mutex_ref);
-        mutexDestroy(&peer->mutex);
-        conditionDestroy(&peer->cond_connected);
-        SSL_free(peer->ssl);
-        free(peer);
-        GLOBAL_MUTEXUNLOCK;
-        return NULL;
+    peer->next = peers_list;
+    peer->prev = NULL;
+    if (peer->next) peer->next->prev = peer;
+    peers_list = peer;
+    peers_n_clients ++;
+    if (primary != NULL) {
+        peers_incr_ref(primary);
+        primary->sessions[session] = peer;
+        peers_n_sessions ++;
     }
 
+    /* from now on, the peer is released through its reference counter */
+    if (primary == NULL && peers_vpn_insert(peer) != 0) {
+        goto publish_error;
+    }
     /*
-     * Only add the client to clients_address_root if the real endpoint is
+     * Only add the client to clients_address_table if the real endpoint is
      * available. Otherwise, need to call peers_register_endpoint later.
      */
     if (clientPort != 0) {
-        slot = tsearch((void *) peer, &clients_address_root, compare_clients_addr);
-        if (slot == NULL) {
-            log_error(errno, "Cannot allocate a new client (tsearch)");
-            tdelete(peer, &clients_address_root, compare_clients_addr);
-            mutexDestroy(&peer->mutex_ref);
-            mutexDestroy(&peer->mutex);
-            conditionDestroy(&peer->cond_connected);
-            SSL_free(peer->ssl);
-            free(peer);
-            GLOBAL_MUTEXUNLOCK;
-            return NULL;
+        if (peer_table_insert(&clients_address_table, endpoint_key(&peer->clientaddr), peer) != 0) {
+            goto publish_error;
         }
+        peer->endpoint_key = endpoint_key(&peer->clientaddr);
     }
-
-    peer->next = peers_list;
-    peer->prev = NULL;
-    if (peer->next) peer->next->prev = peer;
-    peers_list = peer;
-    peers_n_clients ++;
     GLOBAL_MUTEXUNLOCK;
     return peer;
+
+publish_error:
+    log_error(errno, "Cannot allocate a new client (hash table)");
+    GLOBAL_MUTEXUNLOCK;
+    /* the peer may already be referenced by a lookup: release the two
+     * references, peers_remove frees it with the last one */
+    peers_decr_ref(peer, 2);
+    return NULL;
 }
 
 /*
@@ -235,7 +471,7 @@ static struct client * peers_add(int sockfd, int tunfd, int state, time_t t,
  */
 struct client * peers_add_requested(int sockfd, int tunfd, int state, time_t t,
         struct in_addr vpnIP) {
-    return peers_add(sockfd, tunfd, state, t, (struct in_addr) {0}, 0, vpnIP, 1);
+    return peers_add(sockfd, tunfd, state, t, (struct in_addr) {0}, 0, vpnIP, 1, NULL, 0);
 }
 
 /*
@@ -244,41 +480,86 @@ struct client * peers_add_requested(int sockfd, int tunfd, int state, time_t t,
  */
 struct client * peers_add_caller(int sockfd, int tunfd, int state, time_t t,
         struct in_addr clientIP, uint16_t clientPort, struct in_addr vpnIP) {
-    return peers_add(sockfd, tunfd, state, t, clientIP, clientPort, vpnIP, 0);
+    return peers_add(sockfd, tunfd, state, t, clientIP, clientPort, vpnIP, 0, NULL, 0);
 }
 
 /*
- * Add the client to the real address tree.
+ * Add a parallel session with the peer of primary, from our session socket
+ * sockfd to the port of primary + session. The DTLS roles are the same as for
+ * primary.
+ * Return NULL if the session is already opened
+ */
+struct client * peers_add_session(struct client *primary, int session,
+        int sockfd, int state, time_t t) {
+    unsigned int port = ntohs(primary->clientaddr.sin_port) + (unsigned int) session;
+
+    if (port > 65535) {
+        return NULL;
+    }
+    return peers_add(sockfd, primary->tunfd, state, t,
+            primary->clientaddr.sin_addr, htons((uint16_t) port), primary->vpnIP,
+            primary->is_dtls_client, primary, session);
+}
+
+/*
+ * Add the client to the endpoint table.
  */
 int peers_register_endpoint(struct client *peer) {
-    void *slot;
+    uint64_t key;
     GLOBAL_MUTEXLOCK;
-    slot = tsearch((void *) peer, &clients_address_root, compare_clients_addr);
-    if (slot == NULL) {
-        log_error(errno, "Cannot allocate a new client (tsearch)");
+    key = endpoint_key(&peer->clientaddr);
+    if (peer_table_insert(&clients_address_table, key, peer) != 0) {
+        log_error(errno, "Cannot allocate a new client (hash table)");
         GLOBAL_MUTEXUNLOCK;
         return -1;
     }
+    peer->endpoint_key = key;
     GLOBAL_MUTEXUNLOCK;
     return 0;
 }
 
 /*
- * Remove a client from the list "peers_list"
+ * Remove a client from the list "peers_list" and from the tables
  * Free the associated SSL structures
+ * The structure itself is freed when the concurrent lookups are done
  */
 void peers_remove(struct client *peer) {
+    struct client *primary = peer->primary;
+
     GLOBAL_MUTEXLOCK;
     log_message_level(2, "Deleting the client %s", inet_ntoa(peer->vpnIP));
 
-    conditionDestroy(&peer->cond_connected);
+    if (primary == NULL) {
+        peers_vpn_remove(peer);
+    }
+    else {
+        if (primary->sessions[peer->session] == peer) {
+            primary->sessions[peer->session] = NULL;
+        }
+        peers_n_sessions --;
+    }
+    if (peer->endpoint_key != 0) {
+        peer_table_remove(clients_address_table, peer->endpoint_key, peer);
+    }
+
     mutexDestroy(&peer->mutex);
-    mutexDestroy(&peer->mutex_ref);
     /* clean rate limiter */
     if (config.tb_connection_size != 0) {
         tb_clean(&peer->rate_limiter);
     }
 
+    if (BIO_ctrl(peer->out_fifo, BIO_CTRL_FIFO_GET_DROPPED, 0, NULL) != 0
+            || BIO_ctrl(peer->rbio, BIO_CTRL_FIFO_GET_DROPPED, 0, NULL) != 0) {
+        log_message_level(1, "Packets dropped for %s (queue full): %ld sent, %ld received",
+                inet_ntoa(peer->vpnIP),
+                BIO_ctrl(peer->out_fifo, BIO_CTRL_FIFO_GET_DROPPED, 0, NULL),
+                BIO_ctrl(peer->rbio, BIO_CTRL_FIFO_GET_DROPPED, 0, NULL));
+    }
+
+    log_message_level(2, "Traffic with %s: %"PRIu64" packets (%"PRIu64" bytes) sent, %"PRIu64" packets (%"PRIu64" bytes) received",
+            inet_ntoa(peer->vpnIP), peer->tx.packets, peer->tx.bytes,
+            peer->rx.packets, peer->rx.bytes);
+
     SSL_free(peer->ssl);
     BIO_free(peer->out_fifo);
 
@@ -290,12 +571,77 @@ void peers_remove(struct client *peer) {
         peers_list = peer->next;
     }
 
-    tdelete(peer, &clients_vpn_root, compare_clients_vpn);
-    tdelete(peer, &clients_address_root, compare_clients_addr);
-
-    free(peer);
+    epoch_retire(peer, free);
     peers_n_clients --;
     GLOBAL_MUTEXUNLOCK;
+
+    /* the session's reference on its main connection */
+    if (primary != NULL) {
+        peers_decr_ref(primary, 1);
+    }
+}
+
+/*
+ * Lookup in a table without any lock and take a reference
+ */
+static struct client *peers_find(struct peer_table * volatile *tp, uint64_t key) {
+    struct client *peer;
+    epoch_enter();
+    peer = peer_table_find(*tp, key);
+    if (peer != NULL && !peers_try_ref(peer)) {
+        peer = NULL;
+    }
+    epoch_exit();
+    return peer;
+}
+
+/*
+ * Get a client by its VPN IP address and increments its ref. counter
+ * return NULL if the client is unknown
+ * the client's mutex is not locked.
+ */
+struct client * peers_find_by_VPN(struct in_addr *address) {
+    struct client * volatile *slot;
+    struct client *peer = NULL;
+
+    if (!peer_in_subnet(*address)) {
+        return peers_find(&clients_vpn_table, vpn_key(*address));
+    }
+    epoch_enter();
+    slot = peer_direct_slot(*address, 0);
+    if (slot != NULL) {
+        peer = *slot;
+    }
+    if (peer != NULL && !peers_try_ref(peer)) {
+        peer = NULL;
+    }
+    epoch_exit();
+    return peer;
+}
+
+/*
+ * Get a client by its real IP address and UDP port and increments its ref. counter
+ * return NULL if the client is unknown
+ * the client's mutex is not locked.
+ */
+struct client * peers_find_by_endpoint(struct sockaddr_in *cl_address) {
+    return peers_find(&clients_address_table, endpoint_key(cl_address));
+}
+
+/*
+ * Get a parallel session of peer and increments its ref. counter
+ * return NULL if the session is not opened
+ * the session's mutex is not locked.
+ */
+struct client * peers_find_session(struct client *peer, int session) {
+    struct client *s;
+    epoch_enter();
+    s = peer->sessions[session];
+    if (s != NULL && !peers_try_ref(s)) {
+        s = NULL;
+    }
+    epoch_exit();
+    return s;
 }
 
 /*
@@ -304,16 +650,10 @@ void peers_remove(struct client *peer) {
  * the client's mutex is locked.
  */
 struct client * peers_get_by_VPN(struct in_addr *address) {
-    struct client peer_tmp, *peer;
-    GLOBAL_MUTEXLOCK;
-    peer_tmp.vpnIP.s_addr = address->s_addr;
-    peer = tfind(&peer_tmp, &clients_vpn_root, compare_clients_vpn);
+    struct client *peer = peers_find_by_VPN(address);
     if (peer != NULL) {
-        peer = *(void **) peer;
-        peers_incr_ref(peer);
         CLIENT_MUTEXLOCK(peer);
     }
-    GLOBAL_MUTEXUNLOCK;
     return peer;
 }
 
@@ -323,16 +663,9 @@ struct client * peers_get_by_VPN(struct in_addr *address) {
  * the client's mutex is locked.
  */
 struct client * peers_get_by_endpoint(struct sockaddr_in *cl_address) {
-    struct client peer_tmp, *peer;
-    GLOBAL_MUTEXLOCK;
-    peer_tmp.clientaddr.sin_addr.s_addr = cl_address->sin_addr.s_addr;
-    peer_tmp.clientaddr.sin_port = cl_address->sin_port;
-    peer = tfind(&peer_tmp, &clients_address_root, compare_clients_addr);
+    struct client *peer = peers_find_by_endpoint(cl_address);
     if (peer != NULL) {
-        peer = *(void **)peer;
-        peers_incr_ref(peer);
         CLIENT_MUTEXLOCK(peer);
     }
-    GLOBAL_MUTEXUNLOCK;
     return peer;
 }
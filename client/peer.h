@@ -38,41 +38,108 @@
 #define PEER_H_
 
 #include "pthread.h"
+#include <stdint.h>
 #include "rate_limiter.h"
+#include "peer_worker.h"
 
 /* clients states */
 enum client_type {NEW, PUNCHING, LINKED, ESTABLISHED, CLOSED};
 
-/* default receive timeout */
-#define PEER_RECV_TIMEMOUT_USEC 250000
-#define PEER_RECV_TIMEOUT_SEC 0
-
-/* client storage structure */
+/* max number of records read or written for a peer before running the
+ * other peers of the worker */
+#define PEER_RUN_BUDGET 64
+
+/* number of sub-queues of the outgoing FIFO with FQ-CoDel */
+#define AQM_FLOWS 64
+
+/* priority classes of the outgoing FIFO (dscp_priority)
+ * the high class is served first, the others share the rest by weight */
+#define DSCP_CLASS_HIGH     0   // network control, voice (CS5-CS7, EF, VOICE-ADMIT)
+#define DSCP_CLASS_NORMAL   1
+#define DSCP_CLASS_LOW      2   // bulk (CS1, LE)
+#define DSCP_CLASSES        3
+#define DSCP_WEIGHT_NORMAL  4
+#define DSCP_WEIGHT_LOW     1
+
+#define PEER_CACHE_LINE 64
+
+/* max number of parallel DTLS sessions with a peer (config.sessions) */
+#define MAX_SESSIONS 16
+/* size of the token of a session in its PUNCH messages (port and ip2) */
+#define SESSION_TOKEN_LEN 6
+
+/* outgoing traffic, written by the worker of the peer only */
+struct client_tx {
+    time_t time;                    // last packet sent (clock_now())
+    uint64_t packets;
+    uint64_t bytes;
+} __attribute__((aligned(PEER_CACHE_LINE)));
+
+/* incoming traffic, written by the worker of the peer only */
+struct client_rx {
+    time_t time;                    // last packet received (clock_now())
+    time_t last_keepalive;          // last keepalive message sent
+    uint64_t packets;
+    uint64_t bytes;
+} __attribute__((aligned(PEER_CACHE_LINE)));
+
+/* client storage structure
+ * The fields used for each packet are grouped at the beginning, the fields
+ * written by several threads or for each packet have their own cache lines.
+ * Must be allocated with peers_add (aligned). */
 struct client {
-    time_t time;                    // last message received (time(NULL))
-    time_t last_keepalive;          // last time we send a keepalive or a DTLS msg
-    struct sockaddr_in clientaddr;  // real IP address and port
+    /* read mostly, used on the data path */
     struct in_addr vpnIP;           // VPN IP address
     int state;                      // client's state
+    BIO *out_fifo;                  // FIFO BIO for outgoing packets
+    BIO *rbio;                      // BIO for incoming packets
+    SSL *ssl;                       // SSL structure
+    BIO *wbio;                      // BIO (I/O abstraction) used for outgoing packets
     int tunfd;                      // tun device file descriptor
     int sockfd;                     // local UDP socket file descriptor
+    struct sockaddr_in clientaddr;  // real IP address and port
+
+    /* setup and control */
     struct client *next;            // next client in list
     struct client *prev;            // previous client in list
-    pthread_cond_t cond_connected;  // pthread_cond used during connection
-    SSL *ssl;                       // SSL structure
-    BIO *wbio;                      // BIO (I/O abstraction) used for outgoing packets
-    BIO *rbio;                      // BIO for incoming packets
-    BIO *out_fifo;                  // FIFO BIO for outgoing packets
     SSL_CTX *ctx;                   // SSL context associated to the connection
     int is_dtls_client;             // DTLS client or server ?
     int shutdown;                   // Set to 1 by end_peer_handling
     int rdv_answer;                 // The answer from the RDV (ANS_CONNECTION or REJ_CONNECTION)
+    volatile int punched;           // A PUNCH message was received
+    uint64_t endpoint_key;          // key in the endpoint table, 0 if not registered
+    struct client *primary;         // main connection of a session, NULL for the main connection
+    int session;                    // index of the session, 0 for the main connection
+    struct client * volatile sessions[MAX_SESSIONS]; // sessions of a main connection
+    uint64_t sessions_retry;        // next time the missing sessions are opened
+    volatile int sessions_announced; // session_tokens is set
+    unsigned char session_tokens[MAX_SESSIONS][SESSION_TOKEN_LEN]; // exported from the DTLS session
     struct tb_state rate_limiter;   // Rate limiter for this client
-
     pthread_mutex_t mutex;          // local mutex;
 
-    pthread_mutex_t mutex_ref;      // mutex used to change the reference counter
-    unsigned int ref_count;         // reference counter
+    /* event engine (peer_worker.c), used by the worker of the peer */
+    struct peer_worker *worker;     // worker thread running this peer
+    struct client *run_next;        // next peer in the run queue
+    struct client *wait_next;       // next peer waiting for the same full socket
+    int waiting;                    // waiting for a full socket
+    volatile int attached;          // 0: not started, 1: run by its worker, 2: detached
+    struct wheel_timer timer;       // next timed run, in the wheel of the worker
+    uint64_t deadline;              // end of the current connection step, 0 before the step
+    uint64_t punch_next;            // next PUNCH message, 0 if not punching
+    int punch_count;                // PUNCH messages sent
+    int tos;                        // TOS of the records being written
+    struct pkt_buf *tx_pkt;         // packet waiting for the tokens of the rate limiters
+    unsigned char *tx_data;
+    int tx_len;
+    uint64_t tx_retry;              // next write attempt (tx_pkt or the batch), 0 if none
+    int tx_overhead;                // max size added by DTLS to a packet
+
+    /* taken and released by every lookup */
+    volatile unsigned int ref_count __attribute__((aligned(PEER_CACHE_LINE))); // reference counter (atomic)
+    volatile int scheduled;         // in the run queue of its worker (atomic)
+
+    struct client_tx tx;
+    struct client_rx rx;
 };
 
 
@@ -95,21 +162,24 @@ extern struct client * peers_add_requested(int sockfd, int tunfd, int state,
 extern struct client * peers_add_caller(int sockfd, int tunfd, int state,
         time_t t, struct in_addr clientIP, uint16_t clientPort,
         struct in_addr vpnIP);
+extern struct client * peers_add_session(struct client *primary, int session,
+        int sockfd, int state, time_t t);
 extern int peers_register_endpoint(struct client *peer);
 extern void peers_remove(struct client *peer);
 
 extern struct client * peers_get_by_VPN(struct in_addr *address);
 extern struct client * peers_get_by_endpoint(struct sockaddr_in *cl_address);
+extern struct client * peers_find_by_VPN(struct in_addr *address);
+extern struct client * peers_find_by_endpoint(struct sockaddr_in *cl_address);
+extern struct client * peers_find_session(struct client *peer, int session);
 
 extern void peers_incr_ref(struct client *peer);
 extern void peers_decr_ref(struct client *peer, int n);
 
-/* update the activity timestamp and the link activity timestamp */
-#define peers_update_peer_time(peer,timestamp) ({\
-    time_t t = timestamp;\
+/* last activity in both directions */
+#define peers_last_activity(peer) ({\
     struct client * c = peer;\
-    c->time = t;\
-    c->last_keepalive = t;\
+    (c->tx.time > c->rx.time) ? c->tx.time : c->rx.time;\
     })
 
 #endif /*PEER_H_*/
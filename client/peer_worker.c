@@ -0,0 +1,359 @@
+/*
+ * Worker threads of the peers
+ *
+ * Copyright (C) 2011 Florent Bondoux
+ *
+ * This file is part of Campagnol.
+ *
+ * Campagnol is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Campagnol is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Campagnol.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * 
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ */
+
+
+#include "campagnol.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <arpa/inet.h>
+
+#include "peer.h"
+#include "peer_worker.h"
+#include "../common/clock.h"
+#include "../common/epoch.h"
+#include "../common/log.h"
+#include "../common/pthread_wrap.h"
+
+static struct peer_worker workers[MAX_WORKERS];
+static int n_workers = 0;
+
+/* function of the timers of the peers */
+static void worker_timer_run(struct wheel_timer *t, void *arg) {
+    struct peer_worker *w = (struct peer_worker *) arg;
+    struct client *peer = (struct client *) ((char *) t - offsetof(struct client, timer));
+
+    w->ops->run(peer, w->ctx);
+}
+
+void worker_set_timer(struct client *peer, uint64_t deadline) {
+    if (deadline == peer->timer.expires)
+        return;
+    if (deadline == 0)
+        wheel_del(&peer->worker->wheel, &peer->timer);
+    else
+        wheel_add(&peer->worker->wheel, &peer->timer, deadline);
+}
+
+void worker_add_timer(struct peer_worker *w, struct wheel_timer *t, uint64_t expires) {
+    if (expires == 0)
+        wheel_del(&w->wheel, t);
+    else
+        wheel_add(&w->wheel, t, expires);
+}
+
+/*
+ * The peer is run again when the socket can be written. The socket is
+ * registered once in the loop of the worker, whatever the number of peers
+ * waiting for it. The list holds a reference on the peers.
+ */
+int worker_wait_write(struct client *peer, int fd) {
+    struct peer_worker *w = peer->worker;
+    struct worker_wait *wait = NULL, *free_wait = NULL;
+    int i;
+
+    if (peer->waiting)
+        return 0;
+    for (i = 0; i < w->n_waits && wait == NULL; i++) {
+        if (w->waits[i].fd == fd)
+            wait = &w->waits[i];
+        else if (w->waits[i].fd == -1 && free_wait == NULL)
+            free_wait = &w->waits[i];
+    }
+    if (wait == NULL) {
+        if (free_wait == NULL) {
+            if (w->n_waits == WORKER_MAX_WAITS)
+                return -1;
+            free_wait = &w->waits[w->n_waits];
+            free_wait->fd = -1;
+            w->n_waits++;
+        }
+        wait = free_wait;
+        /* with epoll, adding a writable socket reports it at once */
+        if (evloop_add(&w->loop, fd, EVLOOP_OUT, wait) == -1)
+            return -1;
+        wait->fd = fd;
+        wait->peers = NULL;
+    }
+    peers_incr_ref(peer);
+    peer->waiting = 1;
+    peer->wait_next = wait->peers;
+    wait->peers = peer;
+    return 0;
+}
+
+/*
+ * Schedule the peers waiting for the sockets which can be written
+ * events: returned by evloop_wait
+ */
+static void worker_wake_writers(struct peer_worker *w, struct evloop_event *events, int n) {
+    struct worker_wait *wait;
+    struct client *peer;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (events[i].data == &w->notify || !(events[i].events & EVLOOP_OUT))
+            continue;
+        wait = (struct worker_wait *) events[i].data;
+        evloop_del(&w->loop, wait->fd);
+        while ((peer = wait->peers) != NULL) {
+            wait->peers = peer->wait_next;
+            peer->waiting = 0;
+            worker_schedule(peer);
+            peers_decr_ref(peer, 1);
+        }
+        wait->fd = -1;
+    }
+    /* the registered entries keep their address, only the free entries at
+     * the end are removed */
+    while (w->n_waits > 0 && w->waits[w->n_waits - 1].fd == -1) {
+        w->n_waits--;
+    }
+}
+
+/* release the peers still waiting when the worker stops */
+static void worker_clear_waits(struct peer_worker *w) {
+    struct client *peer;
+    int i;
+
+    for (i = 0; i < w->n_waits; i++) {
+        if (w->waits[i].fd == -1)
+            continue;
+        evloop_del(&w->loop, w->waits[i].fd);
+        while ((peer = w->waits[i].peers) != NULL) {
+            w->waits[i].peers = peer->wait_next;
+            peer->waiting = 0;
+            peers_decr_ref(peer, 1);
+        }
+    }
+    w->n_waits = 0;
+}
+
+/*
+ * Run the scheduled peers and the expired timers, then wait for the next event
+ */
+static void *worker_loop(void *arg) {
+    struct peer_worker *w = (struct peer_worker *) arg;
+    struct client *peer, *list;
+    struct evloop_event events[EVLOOP_MAX_EVENTS];
+    uint64_t now, next;
+    int timeout, n;
+
+    wheel_init(&w->wheel, clock_now_ms());
+    w->ctx = (w->ops->init != NULL) ? w->ops->init(w) : NULL;
+
+    while (!w->stop) {
+        mutexLock(&w->mutex);
+        list = w->runq_head;
+        w->runq_head = w->runq_tail = NULL;
+        mutexUnlock(&w->mutex);
+
+        while (list != NULL) {
+            peer = list;
+            list = peer->run_next;
+            /* an event arriving from now on schedules the peer again
+             * see the barrier in worker_schedule */
+            peer->scheduled = 0;
+            __sync_synchronize();
+            if (peer->attached == 1) {
+                w->ops->run(peer, w->ctx);
+            }
+            peers_decr_ref(peer, 1);
+        }
+
+        /* the peers of the timers are attached, worker_detach removes them */
+        wheel_run(&w->wheel, clock_now_ms(), w);
+
+        /* no timer: no wakeup until a peer is scheduled */
+        timeout = -1;
+        if ((next = wheel_next(&w->wheel)) != 0) {
+            now = clock_now_ms();
+            if (next <= now)
+                timeout = 0;
+            else if (next - now < INT_MAX)
+                timeout = (int) (next - now);
+        }
+
+        /* idle: free the peers and the tables removed since the last
+         * epoch_retire, try again later if a lookup still sees them */
+        if (w->runq_head == NULL && epoch_collect()
+                && (timeout == -1 || timeout > WORKER_COLLECT_MS)) {
+            timeout = WORKER_COLLECT_MS;
+        }
+
+        /* sleep unless a peer was scheduled in the meantime */
+        w->sleeping = 1;
+        __sync_synchronize();
+        n = 0;
+        if (w->runq_head == NULL && !w->stop && timeout != 0) {
+            n = evloop_wait(&w->loop, events, EVLOOP_MAX_EVENTS, timeout);
+            evnotifier_clear(&w->notify);
+        }
+        else if (w->n_waits != 0) {
+            /* busy: look at the full sockets without sleeping */
+            n = evloop_wait(&w->loop, events, EVLOOP_MAX_EVENTS, 0);
+        }
+        w->sleeping = 0;
+        if (n > 0 && w->n_waits != 0) {
+            worker_wake_writers(w, events, n);
+        }
+    }
+
+    worker_clear_waits(w);
+    if (w->ops->cleanup != NULL) {
+        w->ops->cleanup(w->ctx);
+    }
+    SSL_REMOVE_ERROR_STATE;
+    return NULL;
+}
+
+int workers_start(int n, struct worker_ops *ops) {
+    int i;
+    struct peer_worker *w;
+
+    if (n > MAX_WORKERS) n = MAX_WORKERS;
+    for (i = 0; i < n; i++) {
+        w = &workers[i];
+        memset(w, 0, sizeof(*w));
+        w->ops = ops;
+        mutexInit(&w->mutex, NULL);
+        if (evnotifier_init(&w->notify) == -1) {
+            mutexDestroy(&w->mutex);
+            break;
+        }
+        if (evloop_init(&w->loop) == -1) {
+            evnotifier_close(&w->notify);
+            mutexDestroy(&w->mutex);
+            break;
+        }
+        if (evloop_add(&w->loop, w->notify.rfd, EVLOOP_IN, &w->notify) == -1) {
+            evloop_close(&w->loop);
+            evnotifier_close(&w->notify);
+            mutexDestroy(&w->mutex);
+            break;
+        }
+        w->thread = createThread(worker_loop, w);
+        n_workers++;
+    }
+    if (n_workers != n) {
+        log_message("Could not start the worker threads");
+        workers_stop();
+        return -1;
+    }
+    log_message_level(2, "%d worker threads started", n_workers);
+    return 0;
+}
+
+/*
+ * Stop the workers. The peers must be closed before.
+ */
+void workers_stop(void) {
+    int i;
+    struct peer_worker *w;
+
+    for (i = 0; i < n_workers; i++) {
+        w = &workers[i];
+        w->stop = 1;
+        __sync_synchronize();
+        evnotifier_signal(&w->notify);
+    }
+    for (i = 0; i < n_workers; i++) {
+        w = &workers[i];
+        joinThread(w->thread, NULL);
+        evloop_close(&w->loop);
+        evnotifier_close(&w->notify);
+        mutexDestroy(&w->mutex);
+    }
+    n_workers = 0;
+}
+
+/*
+ * The peers are spread over the workers by VPN IP address, the parallel
+ * sessions with a peer go to the next workers
+ */
+struct peer_worker *worker_assign(struct in_addr vpnIP, int session) {
+    return &workers[(ntohl(vpnIP.s_addr) + (unsigned int) session) % n_workers];
+}
+
+/*
+ * The reference taken here is released by the run function when the peer is
+ * closed, after calling worker_detach.
+ */
+void worker_attach(struct client *peer) {
+    peers_incr_ref(peer);
+    peer->timer.fn = worker_timer_run;
+    peer->attached = 1;
+    worker_schedule(peer);
+}
+
+void worker_detach(struct client *peer) {
+    wheel_del(&peer->worker->wheel, &peer->timer);
+    peer->attached = 2;
+}
+
+/*
+ * The peer is queued once until its worker takes it. The queue holds a
+ * reference on the peer.
+ */
+void worker_schedule(struct client *peer) {
+    struct peer_worker *w = peer->worker;
+
+    /* order the event (a packet in a FIFO...) before the test, the worker
+     * clears the flag before looking at the peer */
+    __sync_synchronize();
+    if (peer->scheduled || !__sync_bool_compare_and_swap(&peer->scheduled, 0, 1))
+        return;
+
+    peers_incr_ref(peer);
+    peer->run_next = NULL;
+    mutexLock(&w->mutex);
+    if (w->runq_head == NULL)
+        w->runq_head = peer;
+    else
+        w->runq_tail->run_next = peer;
+    w->runq_tail = peer;
+    mutexUnlock(&w->mutex);
+
+    __sync_synchronize();
+    if (w->sleeping) {
+        evnotifier_signal(&w->notify);
+    }
+}
+
+void worker_fifo_notify(void *arg) {
+    worker_schedule((struct client *) arg);
+}
@@ -0,0 +1,139 @@
+/*
+ * Worker threads of the peers
+ *
+ * Copyright (C) 2011 Florent Bondoux
+ *
+ * This file is part of Campagnol.
+ *
+ * Campagnol is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Campagnol is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Campagnol.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * 
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ */
+
+
+#ifndef PEER_WORKER_H_
+#define PEER_WORKER_H_
+
+#include <stdint.h>
+
+#include "event_loop.h"
+#include "timer_wheel.h"
+#include "../common/pthread_wrap.h"
+
+/*
+ * Event driven engine of the peers
+ *
+ * A fixed number of worker threads drive all the DTLS sessions. Each peer is
+ * bound to one worker, chosen from its VPN IP address, so its SSL structure
+ * is only used by this thread.
+ *
+ * A peer is run by its worker when it is scheduled (a packet was written in
+ * one of its FIFOs, a message from the RDV server...) or when its timer
+ * expires. The run function must not wait: it handles what can be handled
+ * and sets the timer of the peer for what must be done later.
+ *
+ * The timers are kept in a timer wheel by each worker, which sleeps until the
+ * next one. Other timers (not related to a peer) can be started from the
+ * worker threads with worker_add_timer.
+ */
+
+struct client;
+struct peer_worker;
+
+/* max number of worker threads */
+#define MAX_WORKERS 64
+
+/* max number of sockets waited for writing by a worker */
+#define WORKER_MAX_WAITS 16
+
+/* delay (ms) before freeing again the retired peers and tables which were
+ * still seen by a lookup */
+#define WORKER_COLLECT_MS 1000
+
+/* a full socket and the peers waiting until it can be written */
+struct worker_wait {
+    int fd;
+    struct client *peers;                       // linked by wait_next
+};
+
+/* callbacks of the engine, called by the worker threads */
+struct worker_ops {
+    void *(*init)(struct peer_worker *w);       // create the context of a worker
+    void (*run)(struct client *peer, void *ctx);
+    void (*cleanup)(void *ctx);
+};
+
+struct peer_worker {
+    pthread_t thread;
+    struct worker_ops *ops;
+    void *ctx;                                  // returned by ops->init
+
+    /* peers to run, filled by any thread */
+    pthread_mutex_t mutex;
+    struct client * volatile runq_head;
+    struct client *runq_tail;
+    volatile int sleeping;                      // waiting in evloop_wait
+    struct evnotifier notify;                   // wakes up the worker
+    struct evloop loop;
+
+    /* timers of the peers, only used by the worker thread */
+    struct timer_wheel wheel;
+
+    /* full sockets, only used by the worker thread */
+    struct worker_wait waits[WORKER_MAX_WAITS];
+    int n_waits;
+
+    volatile int stop;
+};
+
+/* start and stop n workers */
+extern int workers_start(int n, struct worker_ops *ops);
+extern void workers_stop(void);
+
+/* worker of a new peer */
+extern struct peer_worker *worker_assign(struct in_addr vpnIP, int session);
+/* hand a peer over to its worker and run it, takes a reference on peer */
+extern void worker_attach(struct client *peer);
+/* called by the run function of a closed peer
+ * the peer is not run anymore, its timer is cancelled */
+extern void worker_detach(struct client *peer);
+
+/* run peer as soon as possible, from any thread */
+extern void worker_schedule(struct client *peer);
+/* notify hook of the FIFOs of the peers (arg is the peer) */
+extern void worker_fifo_notify(void *arg);
+/* run peer at the time deadline (clock_now_ms), 0 cancels the timer
+ * only from the worker of peer */
+extern void worker_set_timer(struct client *peer, uint64_t deadline);
+/* run peer again when fd can be written, only from the worker of peer
+ * return -1 if the socket cannot be waited for (use a timer instead) */
+extern int worker_wait_write(struct client *peer, int fd);
+/* start t on the worker w (t->fn is called with w), 0 cancels the timer
+ * only from the thread of w: ops->init or the function of a timer */
+extern void worker_add_timer(struct peer_worker *w, struct wheel_timer *t, uint64_t expires);
+
+#endif /* PEER_WORKER_H_ */
@@ -92,6 +92,26 @@ void tb_clean(struct tb_state * tb) {
         mutexDestroy(&tb->mutex);
 }
 
+/*
+ * refill the bucket with the number of tokens added since the last call
+ * The lock must be held
+ */
+static void tb_refill(struct tb_state *tb) {
+    struct timespec now, elapsed;
+    double elapsed_ms;
+
+    clock_gettime(SHAPER_CLOCK, &now);
+
+    timespecsub(&now, &tb->last_arrival_time, &elapsed);
+    elapsed_ms = (double) elapsed.tv_sec * 1000. + ((double) elapsed.tv_nsec/1000000.);
+
+    tb->bucket_available += (size_t) round(elapsed_ms * tb->bucket_rate);
+    tb->bucket_available = (tb->bucket_available > tb->bucket_size) ? tb->bucket_size : tb->bucket_available;
+
+    /* update last arrival time */
+    memcpy(&tb->last_arrival_time, &now, sizeof(tb->last_arrival_time));
+}
+
 /*
  * count a packet
  * wait untill the bucket contains enough tokens
@@ -111,17 +131,7 @@ void tb_count(struct tb_state *tb, size_t packet_size) {
 
     ASSERT(packet_size <= tb->bucket_size);
 
-    /* refill the bucket with the number of tokens added since the last call */
-    clock_gettime(SHAPER_CLOCK, &now);
-
-    timespecsub(&now, &tb->last_arrival_time, &elapsed);
-    elapsed_ms = (double) elapsed.tv_sec * 1000. + ((double) elapsed.tv_nsec/1000000.);
-
-    tb->bucket_available += (size_t) round(elapsed_ms * tb->bucket_rate);
-    tb->bucket_available = (tb->bucket_available > tb->bucket_size) ? tb->bucket_size : tb->bucket_available;
-
-    /* update last arrival time */
-    memcpy(&tb->last_arrival_time, &now, sizeof(tb->last_arrival_time));
+    tb_refill(tb);
 
     /* ok */
     if (packet_size <= tb->bucket_available) {
@@ -164,3 +174,89 @@ void tb_count(struct tb_state *tb, size_t packet_size) {
         mutexUnlock(&tb->mutex);
     }
 }
+
+/*
+ * delay (usec) before the bucket contains enough tokens for a packet
+ * return 0 if the packet can be counted without waiting
+ * no token is taken, call tb_count to count the packet
+ *
+ * packet_size: size of the packet in bytes
+ */
+long tb_delay(struct tb_state *tb, size_t packet_size) {
+    long delay = 0;
+
+    if (tb->lock) {
+        mutexLock(&tb->mutex);
+    }
+
+    packet_size += tb->packet_overhead;
+    if (packet_size > tb->bucket_size) {
+        packet_size = tb->bucket_size;
+    }
+    tb_refill(tb);
+    if (packet_size > tb->bucket_available) {
+        delay = (long) ceil((double) (packet_size - tb->bucket_available) / tb->bucket_rate * 1000.);
+    }
+
+    if (tb->lock) {
+        mutexUnlock(&tb->mutex);
+    }
+    return delay;
+}
+
+/*
+ * count a packet if the bucket contains enough tokens, without waiting
+ * return 0 if the tokens were taken, or the delay (usec) before the bucket
+ * contains enough tokens
+ *
+ * packet_size: size of the packet in bytes
+ */
+long tb_try_count(struct tb_state *tb, size_t packet_size) {
+    long delay = 0;
+
+    if (tb->lock) {
+        mutexLock(&tb->mutex);
+    }
+
+    packet_size += tb->packet_overhead;
+    if (packet_size > tb->bucket_size) {
+        packet_size = tb->bucket_size;
+    }
+    tb_refill(tb);
+    if (packet_size <= tb->bucket_available) {
+        tb->bucket_available -= packet_size;
+    }
+    else {
+        delay = (long) ceil((double) (packet_size - tb->bucket_available) / tb->bucket_rate * 1000.);
+        if (delay == 0)
+            delay = 1;
+    }
+
+    if (tb->lock) {
+        mutexUnlock(&tb->mutex);
+    }
+    return delay;
+}
+
+/*
+ * give back the tokens taken by tb_try_count for a packet which was not sent
+ *
+ * packet_size: size of the packet in bytes
+ */
+void tb_uncount(struct tb_state *tb, size_t packet_size) {
+    if (tb->lock) {
+        mutexLock(&tb->mutex);
+    }
+
+    packet_size += tb->packet_overhead;
+    if (packet_size > tb->bucket_size) {
+        packet_size = tb->bucket_size;
+    }
+    tb->bucket_available += packet_size;
+    if (tb->bucket_available > tb->bucket_size)
+        tb->bucket_available = tb->bucket_size;
+
+    if (tb->lock) {
+        mutexUnlock(&tb->mutex);
+    }
+}
@@ -54,6 +54,9 @@ struct tb_state {
 extern void tb_init(struct tb_state *, size_t, double, size_t, int);
 extern void tb_clean(struct tb_state *);
 extern void tb_count(struct tb_state *, size_t);
+extern long tb_delay(struct tb_state *, size_t);
+extern long tb_try_count(struct tb_state *, size_t);
+extern void tb_uncount(struct tb_state *, size_t);
 
 
 #endif /* RATE_LIMITING_H_ */
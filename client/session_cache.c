@@ -0,0 +1,316 @@
+/*
+ * Cache of the DTLS sessions for the resumption
+ *
+ * Copyright (C) 2011 Florent Bondoux
+ *
+ * This file is part of Campagnol.
+ *
+ * Campagnol is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Campagnol is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Campagnol.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * 
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ */
+
+
+#include "campagnol.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "session_cache.h"
+#include "../common/log.h"
+#include "../common/pthread_wrap.h"
+
+static struct session_cache_header *cache_header = NULL;
+static struct session_entry *cache = NULL;
+static size_t cache_size = 0;                  // size of the mapping
+static unsigned int cache_mask = 0;            // number of entries - 1
+static pthread_mutex_t cache_mutex;
+
+/*
+ * Search the entry of a peer. If create is set and the peer has no entry,
+ * take a free entry or the oldest one among the probed entries.
+ * The mutex must be held.
+ */
+static struct session_entry *cache_find(uint32_t vpn_ip, uint32_t session, int create) {
+    unsigned int i, h, n_probe;
+    struct session_entry *e, *victim = NULL;
+
+    n_probe = (cache_mask + 1 < SESSION_CACHE_PROBE) ? cache_mask + 1 : SESSION_CACHE_PROBE;
+    h = ntohl(vpn_ip) * 2654435761u + session;
+    for (i = 0; i < n_probe; i++) {
+        e = &cache[(h + i) & cache_mask];
+        if (e->vpn_ip == vpn_ip && e->session == session) {
+            return e;
+        }
+        if (victim == NULL || (victim->vpn_ip != 0
+                && (e->vpn_ip == 0 || e->time < victim->time))) {
+            victim = e;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    victim->vpn_ip = vpn_ip;
+    victim->session = session;
+    victim->len = 0;
+    victim->id_len = 0;
+    return victim;
+}
+
+/* A new session is established: store a copy in the entry of the peer */
+static int cache_new_session(SSL *ssl, SSL_SESSION *sess) {
+    struct client *peer = (struct client *) SSL_get_app_data(ssl);
+    struct session_entry *e;
+    const unsigned char *id;
+    unsigned char *p;
+    unsigned int id_len;
+    int len;
+
+    if (peer == NULL || !SSL_SESSION_is_resumable(sess)) {
+        return 0;
+    }
+    len = i2d_SSL_SESSION(sess, NULL);
+    if (len <= 0 || len > SESSION_DER_MAX) {
+        return 0;
+    }
+    id = SSL_SESSION_get_id(sess, &id_len);
+
+    mutexLock(&cache_mutex);
+    e = cache_find(peer->vpnIP.s_addr, (uint32_t) peer->session, 1);
+    p = e->der;
+    e->len = (uint32_t) i2d_SSL_SESSION(sess, &p);
+    e->id_len = id_len;
+    memcpy(e->id, id, id_len);
+    e->time = (int64_t) SSL_SESSION_get_time(sess);
+    mutexUnlock(&cache_mutex);
+
+    /* the cache does not keep a reference on sess */
+    return 0;
+}
+
+/* DTLS server: find the session ID sent by the peer in its entry */
+static SSL_SESSION *cache_get_session(SSL *ssl, const unsigned char *id, int id_len, int *copy) {
+    struct client *peer = (struct client *) SSL_get_app_data(ssl);
+    struct session_entry *e;
+    const unsigned char *p;
+    SSL_SESSION *sess = NULL;
+
+    *copy = 0;
+    if (peer == NULL) {
+        return NULL;
+    }
+    mutexLock(&cache_mutex);
+    e = cache_find(peer->vpnIP.s_addr, (uint32_t) peer->session, 0);
+    if (e != NULL && e->len != 0 && e->id_len == (uint32_t) id_len
+            && memcmp(e->id, id, e->id_len) == 0) {
+        p = e->der;
+        sess = d2i_SSL_SESSION(NULL, &p, e->len);
+    }
+    mutexUnlock(&cache_mutex);
+    return sess;
+}
+
+/* The session is not resumable anymore (expired, or closed by an error) */
+static void cache_remove_session(SSL_CTX *ctx __attribute__((unused)), SSL_SESSION *sess) {
+    const unsigned char *id;
+    unsigned int id_len, i;
+
+    id = SSL_SESSION_get_id(sess, &id_len);
+    if (id_len == 0) {
+        return;
+    }
+    mutexLock(&cache_mutex);
+    for (i = 0; i <= cache_mask; i++) {
+        if (cache[i].len != 0 && cache[i].id_len == id_len
+                && memcmp(cache[i].id, id, id_len) == 0) {
+            cache[i].len = 0;
+        }
+    }
+    mutexUnlock(&cache_mutex);
+}
+
+/*
+ * Map the cache. With a file, the sessions of the previous run are kept if
+ * the layout of the file is the same.
+ */
+int session_cache_init(void) {
+    unsigned int n = 1, wanted, i, n_sessions = 0;
+    struct session_cache_header *h;
+    struct stat st;
+    int fd, reset = 0;
+
+    if (!config.session_cache) {
+        return 0;
+    }
+
+    /* at least twice the number of sessions with the peers */
+    wanted = 2 * (unsigned int) config.max_clients * (unsigned int) config.sessions;
+    while (n < wanted) n <<= 1;
+    cache_size = sizeof(struct session_cache_header) + n * sizeof(struct session_entry);
+
+    if (config.session_cache_file != NULL) {
+#ifdef O_NOFOLLOW
+        fd = open(config.session_cache_file, O_RDWR | O_CREAT | O_NOFOLLOW, S_IRUSR | S_IWUSR);
+#else
+        fd = open(config.session_cache_file, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+#endif
+        if (fd == -1) {
+            log_error(errno, "Cannot open the session cache %s", config.session_cache_file);
+            return -1;
+        }
+        if (fstat(fd, &st) == -1) {
+            log_error(errno, "Cannot open the session cache %s", config.session_cache_file);
+            close(fd);
+            return -1;
+        }
+        /* the file holds the secrets of the sessions */
+        if (!S_ISREG(st.st_mode) || st.st_uid != geteuid()) {
+            log_message("The session cache %s must be a regular file owned by the user of the client",
+                    config.session_cache_file);
+            close(fd);
+            return -1;
+        }
+        if (st.st_mode & (S_IRWXG | S_IRWXO)) {
+            /* the sessions may have been read, do not resume them */
+            log_message("The session cache %s was accessible by other users, resetting it with mode 0600",
+                    config.session_cache_file);
+            if (fchmod(fd, S_IRUSR | S_IWUSR) == -1) {
+                log_error(errno, "Cannot change the mode of the session cache %s", config.session_cache_file);
+                close(fd);
+                return -1;
+            }
+            reset = 1;
+        }
+        if ((size_t) st.st_size != cache_size && ftruncate(fd, (off_t) cache_size) == -1) {
+            log_error(errno, "Cannot resize the session cache %s", config.session_cache_file);
+            close(fd);
+            return -1;
+        }
+        h = mmap(NULL, cache_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    }
+    else {
+        h = mmap(NULL, cache_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (h == MAP_FAILED) {
+        log_error(errno, "Cannot map the session cache");
+        return -1;
+    }
+
+    cache_header = h;
+    cache = (struct session_entry *) (h + 1);
+    cache_mask = n - 1;
+    if (reset || h->magic != SESSION_CACHE_MAGIC || h->n_entries != n
+            || h->entry_size != sizeof(struct session_entry)) {
+        memset(h, 0, cache_size);
+        h->magic = SESSION_CACHE_MAGIC;
+        h->n_entries = n;
+        h->entry_size = sizeof(struct session_entry);
+    }
+    else {
+        for (i = 0; i < n; i++) {
+            if (cache[i].len != 0) n_sessions++;
+        }
+    }
+    mutexInit(&cache_mutex, NULL);
+    log_message_level(2, "Session cache: %u entries, %u sessions loaded", n, n_sessions);
+    return 0;
+}
+
+void session_cache_close(void) {
+    if (cache_header == NULL) {
+        return;
+    }
+    if (config.session_cache_file != NULL) {
+        msync(cache_header, cache_size, MS_SYNC);
+    }
+    munmap(cache_header, cache_size);
+    mutexDestroy(&cache_mutex);
+    cache_header = NULL;
+    cache = NULL;
+}
+
+/*
+ * Forget all the sessions, the peers will do full handshakes
+ * (new certificates or CRL)
+ */
+void session_cache_flush(void) {
+    if (cache == NULL) {
+        return;
+    }
+    mutexLock(&cache_mutex);
+    memset(cache, 0, (cache_mask + 1) * sizeof(struct session_entry));
+    mutexUnlock(&cache_mutex);
+}
+
+/*
+ * Use the cache with a DTLS context
+ */
+void session_cache_setup_ctx(SSL_CTX *ctx, int is_client) {
+    if (cache == NULL) {
+        return;
+    }
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *) "campagnol", 9);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    SSL_CTX_set_session_cache_mode(ctx,
+            (is_client ? SSL_SESS_CACHE_CLIENT : SSL_SESS_CACHE_SERVER)
+            | SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_new_cb(ctx, cache_new_session);
+    SSL_CTX_sess_set_remove_cb(ctx, cache_remove_session);
+    if (!is_client) {
+        SSL_CTX_sess_set_get_cb(ctx, cache_get_session);
+    }
+}
+
+/*
+ * DTLS client: offer the cached session of the peer, if any
+ */
+void session_cache_resume(struct client *peer) {
+    struct session_entry *e;
+    const unsigned char *p;
+    SSL_SESSION *sess = NULL;
+
+    if (cache == NULL) {
+        return;
+    }
+    mutexLock(&cache_mutex);
+    e = cache_find(peer->vpnIP.s_addr, (uint32_t) peer->session, 0);
+    if (e != NULL && e->len != 0) {
+        p = e->der;
+        sess = d2i_SSL_SESSION(NULL, &p, e->len);
+    }
+    mutexUnlock(&cache_mutex);
+
+    if (sess != NULL) {
+        SSL_set_session(peer->ssl, sess);
+        SSL_SESSION_free(sess);
+    }
+}
@@ -0,0 +1,91 @@
+/*
+ * Cache of the DTLS sessions for the resumption
+ *
+ * Copyright (C) 2011 Florent Bondoux
+ *
+ * This file is part of Campagnol.
+ *
+ * Campagnol is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Campagnol is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Campagnol.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * 
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ */
+
+
+#ifndef SESSION_CACHE_H_
+#define SESSION_CACHE_H_
+
+#include <stdint.h>
+#include <openssl/ssl.h>
+
+#include "peer.h"
+
+/*
+ * Cache of the DTLS sessions, keyed by the VPN IP of the peer and the
+ * parallel session number
+ *
+ * Both sides of a connection store the session in their cache once it is
+ * established. The DTLS client offers its cached session, the DTLS server
+ * looks up the session ID it receives in the entry of the peer. A peer which
+ * reconnects does an abbreviated handshake, without the certificate
+ * verification and the private key operations.
+ *
+ * The session tickets are disabled: their keys are not kept across the
+ * restarts, the session IDs are.
+ *
+ * The cache is a fixed size table in an anonymous mapping, or in a file
+ * mapped in memory when session_cache_file is set. The file holds the master
+ * secrets of the sessions, it is created with mode 0600.
+ */
+
+#define SESSION_CACHE_MAGIC 0x43534331 // "CSC1"
+#define SESSION_DER_MAX 4096           // maximum size of a serialized session
+#define SESSION_CACHE_PROBE 8          // entries searched for a key
+
+struct session_entry {
+    uint32_t vpn_ip;                   // VPN IP of the peer (network order), 0 for a free entry
+    uint32_t session;                  // parallel session
+    int64_t time;                      // time of the session, to evict the oldest entry
+    uint32_t id_len;
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    uint32_t len;                      // length of der, 0 if the session was removed
+    unsigned char der[SESSION_DER_MAX];
+};
+
+struct session_cache_header {
+    uint32_t magic;
+    uint32_t n_entries;
+    uint32_t entry_size;
+    uint32_t reserved;
+};
+
+extern int session_cache_init(void);
+extern void session_cache_close(void);
+extern void session_cache_flush(void);
+extern void session_cache_setup_ctx(SSL_CTX *ctx, int is_client);
+extern void session_cache_resume(struct client *peer);
+
+#endif /* SESSION_CACHE_H_ */
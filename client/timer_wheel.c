@@ -0,0 +1,208 @@
+/*
+ * Hierarchical timer wheel
+ *
+ * Copyright (C) 2011 Florent Bondoux
+ *
+ * This file is part of Campagnol.
+ *
+ * Campagnol is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Campagnol is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Campagnol.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * 
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ */
+
+
+
+#include "campagnol.h"
+
+#include "timer_wheel.h"
+
+/* circular lists, the heads are the slots */
+static inline void list_init(struct wheel_timer *head) {
+    head->next = head->prev = head;
+}
+
+static inline void list_append(struct wheel_timer *head, struct wheel_timer *t) {
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static inline void list_unlink(struct wheel_timer *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+}
+
+/* move all the timers of src at the end of dst */
+static inline void list_splice(struct wheel_timer *dst, struct wheel_timer *src) {
+    if (src->next == src)
+        return;
+    src->next->prev = dst->prev;
+    src->prev->next = dst;
+    dst->prev->next = src->next;
+    dst->prev = src->prev;
+    list_init(src);
+}
+
+void wheel_init(struct timer_wheel *w, uint64_t now) {
+    int level, i;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        w->count[level] = 0;
+        for (i = 0; i < WHEEL_SLOTS; i++) {
+            list_init(&w->slots[level][i]);
+        }
+    }
+    w->now = now;
+}
+
+/*
+ * Put t in the slot of its expiration time
+ * The level is chosen from the delay, so a slot of the level n > 0 is
+ * cascaded before the expiration of its timers.
+ */
+static void wheel_insert(struct timer_wheel *w, struct wheel_timer *t) {
+    uint64_t expires = t->expires;
+    uint64_t delta;
+    int level;
+
+    if (expires < w->now)
+        expires = w->now;
+    delta = expires - w->now;
+    for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+        if (delta < ((uint64_t) 1 << (WHEEL_BITS * (level + 1))))
+            break;
+    }
+    if (delta >= ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS))) {
+        expires = w->now + ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+
+    t->level = level;
+    list_append(&w->slots[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK], t);
+    w->count[level]++;
+}
+
+void wheel_add(struct timer_wheel *w, struct wheel_timer *t, uint64_t expires) {
+    wheel_del(w, t);
+    t->expires = expires;
+    wheel_insert(w, t);
+}
+
+void wheel_del(struct timer_wheel *w, struct wheel_timer *t) {
+    if (t->expires == 0)
+        return;
+    list_unlink(t);
+    if (t->level >= 0)
+        w->count[t->level]--;
+    t->expires = 0;
+}
+
+/*
+ * The first level wrapped: move the timers of the current slot of the next
+ * level to the lower levels, and so on while the levels wrap
+ */
+static void wheel_cascade(struct timer_wheel *w) {
+    struct wheel_timer list, *t;
+    int level, idx;
+
+    for (level = 1; level < WHEEL_LEVELS; level++) {
+        idx = (int) (w->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+        list_init(&list);
+        list_splice(&list, &w->slots[level][idx]);
+        while ((t = list.next) != &list) {
+            list_unlink(t);
+            w->count[level]--;
+            wheel_insert(w, t);
+        }
+        if (idx != 0)
+            break;
+    }
+}
+
+void wheel_run(struct timer_wheel *w, uint64_t now, void *arg) {
+    struct wheel_timer expired, *head, *t;
+    uint64_t span, next;
+    int level;
+
+    /* take all the expired timers before calling them, so that a timer can
+     * be started again from its function */
+    list_init(&expired);
+    while (w->now <= now) {
+        if ((w->now & WHEEL_MASK) == 0) {
+            wheel_cascade(w);
+        }
+        if (w->count[0] == 0) {
+            /* nothing to do until the next cascade of a non empty level */
+            for (level = 1; level < WHEEL_LEVELS && w->count[level] == 0; level++);
+            if (level == WHEEL_LEVELS) {
+                w->now = now + 1;
+                break;
+            }
+            span = (uint64_t) 1 << (WHEEL_BITS * level);
+            next = (w->now | (span - 1)) + 1;
+            w->now = (next < now + 1) ? next : now + 1;
+            continue;
+        }
+        head = &w->slots[0][w->now & WHEEL_MASK];
+        for (t = head->next; t != head; t = t->next) {
+            t->level = -1;
+            w->count[0]--;
+        }
+        list_splice(&expired, head);
+        w->now++;
+    }
+
+    while ((t = expired.next) != &expired) {
+        list_unlink(t);
+        t->expires = 0;
+        t->fn(t, arg);
+    }
+}
+
+uint64_t wheel_next(struct timer_wheel *w) {
+    uint64_t next = 0, base, tick;
+    int level, i;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        if (w->count[level] == 0)
+            continue;
+        /* first non empty slot of the level, the slots of the level n > 0
+         * give the time of their cascade */
+        base = w->now >> (WHEEL_BITS * level);
+        for (i = 0; i <= WHEEL_SLOTS; i++) {
+            tick = (base + i) << (WHEEL_BITS * level);
+            if (tick < w->now)
+                continue;
+            if (w->slots[level][(base + i) & WHEEL_MASK].next != &w->slots[level][(base + i) & WHEEL_MASK]) {
+                if (next == 0 || tick < next)
+                    next = tick;
+                break;
+            }
+        }
+    }
+    return next;
+}
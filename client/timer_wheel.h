@@ -0,0 +1,88 @@
+/*
+ * Hierarchical timer wheel
+ *
+ * Copyright (C) 2011 Florent Bondoux
+ *
+ * This file is part of Campagnol.
+ *
+ * Campagnol is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Campagnol is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Campagnol.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * 
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ */
+
+
+
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+#include <stdint.h>
+
+/*
+ * Hierarchical timer wheel (see the timers of the Linux kernel)
+ *
+ * The wheel has WHEEL_LEVELS levels of WHEEL_SLOTS slots. A slot of the first
+ * level holds the timers of one millisecond, a slot of the level n holds the
+ * timers of WHEEL_SLOTS^n milliseconds. Each time the first level wraps, a
+ * slot of the next level is cascaded to the lower levels. Adding and
+ * cancelling a timer are O(1).
+ *
+ * The timers further than WHEEL_SLOTS^WHEEL_LEVELS ms (4.6 hours) are kept in
+ * the last level and cascaded again.
+ *
+ * A wheel is not thread safe: it is used by the thread running its timers.
+ */
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+
+struct wheel_timer {
+    struct wheel_timer *next;
+    struct wheel_timer *prev;
+    uint64_t expires;               // clock_now_ms, 0 if the timer is not pending
+    int level;                      // level of the slot, -1 once expired
+    void (*fn)(struct wheel_timer *t, void *arg); // called by wheel_run
+};
+
+struct timer_wheel {
+    uint64_t now;                   // next tick to handle (ms)
+    int count[WHEEL_LEVELS];        // number of timers in each level
+    struct wheel_timer slots[WHEEL_LEVELS][WHEEL_SLOTS]; // heads of the lists
+};
+
+extern void wheel_init(struct timer_wheel *w, uint64_t now);
+/* (re)start t at the time expires (clock_now_ms), t->fn must be set */
+extern void wheel_add(struct timer_wheel *w, struct wheel_timer *t, uint64_t expires);
+/* cancel t if it is pending */
+extern void wheel_del(struct timer_wheel *w, struct wheel_timer *t);
+/* call the functions of the timers expired at now, they may add timers */
+extern void wheel_run(struct timer_wheel *w, uint64_t now, void *arg);
+/* lower bound of the next expiration, 0 if there is no timer */
+extern uint64_t wheel_next(struct timer_wheel *w);
+
+#endif /* TIMER_WHEEL_H_ */
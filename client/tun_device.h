@@ -43,15 +43,28 @@
 
 extern int init_tun(void);
 extern int close_tun(int fd);
+#ifdef HAVE_LINUX
+/* open another queue of a multi-queue TUN device */
+extern int init_tun_queue(void);
+#endif
 
 extern void exec_up(const char *device);
 extern void exec_down(const char *device);
 extern const char *tun_default_up[];
 extern const char *tun_default_down[];
 
+/* write_tun returns -1 if the packet is dropped because the queue of the
+ * device is full (EAGAIN) */
 #if defined (HAVE_OPENBSD)
 extern ssize_t read_tun(int fd, void *buf, size_t count);
 extern ssize_t write_tun(int fd, void *buf, size_t count);
+#elif defined (HAVE_LINUX)
+struct virtio_net_hdr;
+extern ssize_t read_tun(int fd, void *buf, size_t count);
+extern ssize_t write_tun(int fd, void *buf, size_t count);
+/* offload mode (config.tun_offload), the frames start with a virtio_net_hdr */
+extern ssize_t read_tun_offload(int fd, struct virtio_net_hdr *vh, void *buf, size_t count);
+extern ssize_t write_tun_offload(int fd, struct virtio_net_hdr *vh, void *buf, size_t count);
 #elif defined (HAVE_CYGWIN)
 extern int read_tun_wait(void *buf, size_t count, unsigned long int ms);
 extern ssize_t read_tun_finalize(void);
@@ -62,8 +75,9 @@ static inline ssize_t read_tun(int fd, void *buf, size_t count) {
     ssize_t r;
     r = read(fd, buf, count);
     // We do not expect EINTR since signals are masked in this thread so any
-    // error should be fatal
-    if (r == -1) {
+    // error should be fatal. The device is in non-blocking mode, EAGAIN
+    // means it is empty.
+    if (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
         log_error(errno, "Error while reading the tun device");
         abort();
     }
@@ -73,8 +87,10 @@ static inline ssize_t read_tun(int fd, void *buf, size_t count) {
 static inline ssize_t write_tun(int fd, const void *buf, size_t count) {
     ssize_t r;
     r = write(fd, buf, count);
-    // We do not expect any non fatal error
-    if (r == -1) {
+    // The device is in non-blocking mode, EAGAIN means that its queue is
+    // full and the packet is dropped. We do not expect any other non fatal
+    // error
+    if (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
         log_error(errno, "Error while writting to the tun device");
         abort();
     }
@@ -42,6 +42,8 @@
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <linux/if_tun.h>
+#include <linux/virtio_net.h>
+#include <sys/uio.h>
 
 #include "configuration.h"
 #include "communication.h"
@@ -83,6 +85,16 @@ int init_tun() {
     if (config.tun_one_queue) {
         ifr.ifr_flags |= IFF_ONE_QUEUE;
     }
+    /* IFF_VNET_HDR  - Prepend a virtio_net_hdr to the frames (offload mode) */
+    if (config.tun_offload) {
+        ifr.ifr_flags |= IFF_VNET_HDR;
+    }
+#ifdef IFF_MULTI_QUEUE
+    /* IFF_MULTI_QUEUE - one file descriptor per pipeline, see init_tun_queue */
+    if (config.pipelines > 1) {
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    }
+#endif
 
     if (config.tun_device != NULL) {
         strncpy(ifr.ifr_name, config.tun_device, IFNAMSIZ);
@@ -102,6 +114,13 @@ int init_tun() {
         close(tunfd);
         return -1;
     }
+    /* Accept unchecksummed packets and TCP/IPv4 super-packets */
+    if (config.tun_offload
+            && (ioctl(tunfd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO_ECN)) < 0) {
+        log_error(errno, "Error ioctl TUNSETOFFLOAD");
+        close(tunfd);
+        return -1;
+    }
 
     if (config.txqueue != 0 && config.txqueue != TUN_READQ_SIZE) {
         /* The default queue length is 500 frames (TUN_READQ_SIZE) */
@@ -131,9 +150,118 @@ int init_tun() {
     return tunfd;
 }
 
+#ifdef IFF_MULTI_QUEUE
+/*
+ * Attach a new queue to the multi-queue TUN device opened by init_tun
+ */
+int init_tun_queue() {
+    int tunfd;
+    struct ifreq ifr;
+
+    if( (tunfd = open("/dev/net/tun", O_RDWR)) < 0 ) {
+         log_error(errno, "Could not open /dev/net/tun");
+         return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI | IFF_MULTI_QUEUE;
+    if (config.tun_one_queue) {
+        ifr.ifr_flags |= IFF_ONE_QUEUE;
+    }
+    if (config.tun_offload) {
+        ifr.ifr_flags |= IFF_VNET_HDR;
+    }
+    strncpy(ifr.ifr_name, device, IFNAMSIZ);
+    ifr.ifr_name[IFNAMSIZ - 1] = '\0';
+
+    if ((ioctl(tunfd, TUNSETIFF, (void *) &ifr)) < 0) {
+        log_error(errno, "Error ioctl TUNSETIFF (new queue)");
+        close(tunfd);
+        return -1;
+    }
+
+    return tunfd;
+}
+#else
+int init_tun_queue() {
+    return -1;
+}
+#endif
+
 int close_tun(int fd) {
     exec_down(device);
     free(device);
     return close(fd); // the close call destroys the device
 }
 
+ssize_t read_tun(int fd, void *buf, size_t count) {
+    ssize_t r;
+    r = read(fd, buf, count);
+    // We do not expect EINTR since signals are masked in this thread so any
+    // error should be fatal. The device is in non-blocking mode, EAGAIN
+    // means it is empty.
+    if (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        log_error(errno, "Error while reading the tun device");
+        abort();
+    }
+    return r;
+}
+
+/* In offload mode, the packets are sent without any offload request */
+ssize_t write_tun(int fd, void *buf, size_t count) {
+    struct virtio_net_hdr vh;
+    ssize_t r;
+
+    if (config.tun_offload) {
+        memset(&vh, 0, sizeof(vh));
+        return write_tun_offload(fd, &vh, buf, count);
+    }
+
+    r = write(fd, buf, count);
+    // The device is in non-blocking mode, EAGAIN means that its queue is
+    // full and the packet is dropped. We do not expect any other non fatal
+    // error
+    if (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        log_error(errno, "Error while writting to the tun device");
+        abort();
+    }
+    return r;
+}
+
+/* Each frame starts with a virtio_net_hdr
+ * Return the length of the packet */
+ssize_t read_tun_offload(int fd, struct virtio_net_hdr *vh, void *buf, size_t count) {
+    struct iovec iov[2];
+    ssize_t r;
+
+    iov[0].iov_base = vh;
+    iov[0].iov_len = sizeof(*vh);
+    iov[1].iov_base = buf;
+    iov[1].iov_len = count;
+
+    r = readv(fd, iov, 2);
+    if (r >= (ssize_t) sizeof(*vh))
+        return r - sizeof(*vh);
+    else if (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        log_error(errno, "Error while reading the tun device");
+        abort();
+    }
+    return (r == -1) ? -1 : 0;
+}
+
+ssize_t write_tun_offload(int fd, struct virtio_net_hdr *vh, void *buf, size_t count) {
+    struct iovec iov[2];
+    ssize_t r;
+
+    iov[0].iov_base = vh;
+    iov[0].iov_len = sizeof(*vh);
+    iov[1].iov_base = buf;
+    iov[1].iov_len = count;
+
+    r = writev(fd, iov, 2);
+    if (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        log_error(errno, "Error while writting to the tun device");
+        abort();
+    }
+    return (r == -1) ? -1 : r - (ssize_t) sizeof(*vh);
+}
@@ -116,7 +116,7 @@ int close_tun(int fd) {
 ssize_t read_tun(int fd, void *buf, size_t count) {
     struct iovec iov[2];
     uint32_t family;
-    size_t r;
+    ssize_t r;
 
     iov[0].iov_base = &family;
     iov[0].iov_len = sizeof(family);
@@ -127,7 +127,7 @@ ssize_t read_tun(int fd, void *buf, size_t count) {
     r = readv(fd, iov, 2);
     if (r > 0)
         return r - sizeof(family);
-    else if (r == -1) {
+    else if (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
         log_error(errno, "Error while reading the tun device");
         abort();
     }
@@ -147,7 +147,7 @@ ssize_t write_tun(int fd, void *buf, size_t count) {
     iov[1].iov_len = count;
 
     r = writev(fd, iov, 2);
-    if (r == -1) {
+    if (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
         log_error(errno, "Error while writting to the tun device");
         abort();
     }
@@ -0,0 +1,300 @@
+/*
+ * Campagnol, TUN offload (Linux)
+ *
+ * Copyright (C) 2011 Florent Bondoux
+ *
+ * This file is part of Campagnol.
+ *
+ * Campagnol is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Campagnol is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Campagnol.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * 
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ */
+
+
+#include "campagnol.h"
+
+#include <netinet/tcp.h>
+
+#include "tun_offload.h"
+#include "tun_device.h"
+#include "../common/log.h"
+
+/* one's complement sum of len bytes (RFC 1071) */
+static uint32_t csum_add(uint32_t sum, const unsigned char *data, int len) {
+    uint16_t w;
+
+    while (len > 1) {
+        memcpy(&w, data, 2);
+        sum += w;
+        data += 2;
+        len -= 2;
+    }
+    if (len > 0) {
+        w = 0;
+        memcpy(&w, data, 1);
+        sum += w;
+    }
+    return sum;
+}
+
+static inline uint16_t csum_fold(uint32_t sum) {
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t) sum;
+}
+
+/* sum of the TCP/IPv4 pseudo header */
+static inline uint32_t csum_pseudo(const struct ip *ip, int tcp_len) {
+    uint32_t sum = 0;
+    sum = csum_add(sum, (const unsigned char *) &ip->ip_src, 4);
+    sum = csum_add(sum, (const unsigned char *) &ip->ip_dst, 4);
+    sum += htons(IPPROTO_TCP);
+    sum += htons((uint16_t) tcp_len);
+    return sum;
+}
+
+static inline void ip_set_csum(struct ip *ip) {
+    ip->ip_sum = 0;
+    ip->ip_sum = (uint16_t) ~csum_fold(csum_add(0, (unsigned char *) ip, ip->ip_hl * 4));
+}
+
+/*
+ * Parse a TCP/IPv4 packet
+ * Return the length of the IP + TCP headers or -1
+ */
+static int parse_tcp4(unsigned char *pkt, int len, struct ip **ip, struct tcphdr **tcp) {
+    int ihl, thl;
+
+    if (len < (int) sizeof(struct ip))
+        return -1;
+    *ip = (struct ip *) pkt;
+    ihl = (*ip)->ip_hl * 4;
+    if ((*ip)->ip_v != 4 || (*ip)->ip_p != IPPROTO_TCP || ihl < 20
+            || len < ihl + (int) sizeof(struct tcphdr))
+        return -1;
+    *tcp = (struct tcphdr *) (pkt + ihl);
+    thl = (*tcp)->th_off * 4;
+    if (thl < 20 || len < ihl + thl)
+        return -1;
+    return ihl + thl;
+}
+
+int tun_offload_segment(const struct virtio_net_hdr *vh,
+        unsigned char *pkt, int len, unsigned char *seg, int seg_size,
+        tun_segment_cb cb, void *arg) {
+    struct ip *ip, *sip;
+    struct tcphdr *tcp, *stcp;
+    int hdr, ihl, payload, off, plen, n;
+    uint32_t seq;
+    uint16_t id;
+
+    if ((vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) == VIRTIO_NET_HDR_GSO_NONE) {
+        /* complete the checksum left by the kernel */
+        if (vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+            uint16_t csum;
+            if (vh->csum_start + vh->csum_offset + 2 > len)
+                return -1;
+            csum = (uint16_t) ~csum_fold(csum_add(0, pkt + vh->csum_start, len - vh->csum_start));
+            memcpy(pkt + vh->csum_start + vh->csum_offset, &csum, 2);
+        }
+        cb(arg, pkt, len);
+        return 1;
+    }
+
+    /* only TCP/IPv4 is enabled with TUNSETOFFLOAD */
+    if ((vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) != VIRTIO_NET_HDR_GSO_TCPV4
+            || vh->gso_size == 0)
+        return -1;
+    hdr = parse_tcp4(pkt, len, &ip, &tcp);
+    if (hdr == -1 || hdr + vh->gso_size > seg_size)
+        return -1;
+
+    ihl = ip->ip_hl * 4;
+    payload = len - hdr;
+    seq = ntohl(tcp->th_seq);
+    id = ntohs(ip->ip_id);
+    sip = (struct ip *) seg;
+    stcp = (struct tcphdr *) (seg + ihl);
+
+    n = 0;
+    for (off = 0; off < payload; off += vh->gso_size) {
+        plen = payload - off;
+        if (plen > vh->gso_size) plen = vh->gso_size;
+
+        memcpy(seg, pkt, hdr);
+        memcpy(seg + hdr, pkt + hdr + off, plen);
+
+        sip->ip_len = htons((uint16_t) (hdr + plen));
+        sip->ip_id = htons(id++);
+        ip_set_csum(sip);
+
+        stcp->th_seq = htonl(seq + off);
+        /* FIN and PSH only on the last segment, CWR only on the first one */
+        if (off + plen < payload)
+            stcp->th_flags &= ~(TH_FIN | TH_PUSH);
+        if (off != 0)
+            stcp->th_flags &= ~0x80;
+        stcp->th_sum = 0;
+        stcp->th_sum = (uint16_t) ~csum_fold(csum_add(
+                csum_pseudo(sip, hdr - ihl + plen), seg + ihl, hdr - ihl + plen));
+
+        cb(arg, seg, hdr + plen);
+        n++;
+    }
+    return n;
+}
+
+
+void tun_coalesce_init(struct tun_coalesce *c) {
+    memset(c, 0, sizeof(*c));
+    c->buf = CHECK_ALLOC_FATAL(malloc(TUN_OFFLOAD_MAX));
+}
+
+void tun_coalesce_free(struct tun_coalesce *c) {
+    if (c->n_packets != 0)
+        log_message_level(2, "TUN offload: %lu packets written with %lu writes (%lu dropped by the device)",
+                c->n_packets, c->n_writes, c->n_eagain);
+    free(c->buf);
+    c->buf = NULL;
+}
+
+void tun_coalesce_flush(struct tun_coalesce *c, int fd) {
+    struct virtio_net_hdr vh;
+    struct ip *ip;
+    struct tcphdr *tcp;
+    int ihl;
+
+    if (c->len == 0)
+        return;
+
+    memset(&vh, 0, sizeof(vh));
+    if (c->n > 1) {
+        /* the kernel finishes the TCP checksum and splits the packet if it
+         * has to forward it */
+        ip = (struct ip *) c->buf;
+        ihl = ip->ip_hl * 4;
+        tcp = (struct tcphdr *) (c->buf + ihl);
+        ip->ip_len = htons((uint16_t) c->len);
+        ip_set_csum(ip);
+        tcp->th_sum = csum_fold(csum_pseudo(ip, c->len - ihl));
+
+        vh.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        vh.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        vh.hdr_len = (uint16_t) c->hdr_len;
+        vh.gso_size = (uint16_t) c->mss;
+        vh.csum_start = (uint16_t) ihl;
+        vh.csum_offset = offsetof(struct tcphdr, th_sum);
+    }
+    if (write_tun_offload(fd, &vh, c->buf, c->len) == -1)
+        c->n_eagain++;
+    c->n_writes++;
+    c->len = 0;
+    c->n = 0;
+}
+
+/* Can this packet be merged with other segments? */
+static inline int coalesce_candidate(unsigned char *pkt, int len,
+        struct ip **ip, struct tcphdr **tcp, int *hdr) {
+    *hdr = parse_tcp4(pkt, len, ip, tcp);
+    return *hdr != -1
+            && ntohs((*ip)->ip_len) == len
+            && (ntohs((*ip)->ip_off) & (IP_MF | IP_OFFMASK)) == 0
+            && ((*tcp)->th_flags & ~(TH_ACK | TH_PUSH)) == 0
+            && ((*tcp)->th_flags & TH_ACK)
+            && len > *hdr;
+}
+
+/* Is pkt the next segment of the pending super-packet? */
+static inline int coalesce_match(struct tun_coalesce *c, unsigned char *pkt,
+        int len, struct ip *ip, struct tcphdr *tcp, int hdr) {
+    struct ip *cip = (struct ip *) c->buf;
+    struct tcphdr *ctcp;
+    int ihl = ip->ip_hl * 4;
+
+    if (hdr != c->hdr_len || len - hdr > c->mss
+            || c->len + len - hdr > TUN_OFFLOAD_MAX
+            || ntohl(tcp->th_seq) != c->next_seq)
+        return 0;
+    /* same addresses, TOS, TTL and DF */
+    if (ip->ip_src.s_addr != cip->ip_src.s_addr
+            || ip->ip_dst.s_addr != cip->ip_dst.s_addr
+            || ip->ip_tos != cip->ip_tos || ip->ip_ttl != cip->ip_ttl
+            || ip->ip_off != cip->ip_off || ihl != cip->ip_hl * 4
+            || memcmp(pkt + sizeof(struct ip), c->buf + sizeof(struct ip), ihl - sizeof(struct ip)) != 0)
+        return 0;
+    /* same TCP header except the sequence number, the checksum and PSH */
+    ctcp = (struct tcphdr *) (c->buf + ihl);
+    if (tcp->th_sport != ctcp->th_sport || tcp->th_dport != ctcp->th_dport
+            || tcp->th_ack != ctcp->th_ack || tcp->th_win != ctcp->th_win
+            || tcp->th_urp != ctcp->th_urp
+            || ((tcp->th_flags ^ ctcp->th_flags) & ~TH_PUSH) != 0
+            || memcmp(pkt + ihl + sizeof(struct tcphdr), c->buf + ihl + sizeof(struct tcphdr),
+                    hdr - ihl - sizeof(struct tcphdr)) != 0)
+        return 0;
+    return 1;
+}
+
+void tun_coalesce_add(struct tun_coalesce *c, int fd, unsigned char *pkt, int len) {
+    struct ip *ip;
+    struct tcphdr *tcp;
+    int hdr, payload;
+    struct virtio_net_hdr vh;
+
+    c->n_packets++;
+
+    if (!coalesce_candidate(pkt, len, &ip, &tcp, &hdr)) {
+        tun_coalesce_flush(c, fd);
+        memset(&vh, 0, sizeof(vh));
+        if (write_tun_offload(fd, &vh, pkt, len) == -1)
+            c->n_eagain++;
+        c->n_writes++;
+        return;
+    }
+
+    payload = len - hdr;
+    if (c->len != 0 && coalesce_match(c, pkt, len, ip, tcp, hdr)) {
+        memcpy(c->buf + c->len, pkt + hdr, payload);
+        c->len += payload;
+        c->n++;
+        c->next_seq += payload;
+        /* the PSH flag of the last segment is kept in the merged header */
+        ((struct tcphdr *) (c->buf + ip->ip_hl * 4))->th_flags |= tcp->th_flags;
+    }
+    else {
+        tun_coalesce_flush(c, fd);
+        memcpy(c->buf, pkt, len);
+        c->len = len;
+        c->hdr_len = hdr;
+        c->mss = payload;
+        c->n = 1;
+        c->next_seq = ntohl(tcp->th_seq) + payload;
+    }
+
+    /* a short segment or a push ends the super-packet */
+    if (payload < c->mss || (tcp->th_flags & TH_PUSH))
+        tun_coalesce_flush(c, fd);
+}
@@ -0,0 +1,90 @@
+/*
+ * Campagnol, TUN offload (Linux)
+ *
+ * Copyright (C) 2011 Florent Bondoux
+ *
+ * This file is part of Campagnol.
+ *
+ * Campagnol is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Campagnol is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Campagnol.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * 
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ */
+
+
+#ifndef TUN_OFFLOAD_H_
+#define TUN_OFFLOAD_H_
+
+#include <stdint.h>
+#include <linux/virtio_net.h>
+
+/*
+ * Offload mode of the Linux TUN device (IFF_VNET_HDR)
+ *
+ * Each frame exchanged with the device starts with a struct virtio_net_hdr.
+ * The kernel hands us TCP/IPv4 super-packets of up to 64 kB with an
+ * unfinished checksum (TSO). They are split into MTU sized packets before
+ * being queued for encryption. In the other direction, consecutive TCP
+ * segments of the same flow received from a peer are merged back into one
+ * super-packet before being written to the device.
+ */
+
+/* max size of a frame read from or written to the device */
+#define TUN_OFFLOAD_MAX 65535
+
+/* called for each packet produced by tun_offload_segment */
+typedef void (*tun_segment_cb)(void *arg, unsigned char *pkt, int len);
+
+/* Split pkt according to vh into packets of at most seg_size bytes (seg is
+ * used as a buffer) and finish the checksums.
+ * Return the number of packets or -1 if the packet is dropped */
+extern int tun_offload_segment(const struct virtio_net_hdr *vh,
+        unsigned char *pkt, int len, unsigned char *seg, int seg_size,
+        tun_segment_cb cb, void *arg);
+
+/* TCP segments waiting to be written as one super-packet */
+struct tun_coalesce {
+    unsigned char *buf;         // IP + TCP headers followed by the payloads
+    int len;                    // length of the super-packet, 0 if empty
+    int hdr_len;                // length of the IP + TCP headers
+    int mss;                    // payload length of the segments
+    int n;                      // number of segments
+    uint32_t next_seq;          // sequence number of the next segment
+
+    /* statistics */
+    unsigned long int n_packets;    // number of packets given to tun_coalesce_add
+    unsigned long int n_writes;     // number of writes on the device
+    unsigned long int n_eagain;     // writes dropped by the device (EAGAIN)
+};
+
+extern void tun_coalesce_init(struct tun_coalesce *c);
+extern void tun_coalesce_free(struct tun_coalesce *c);
+/* queue or write an IP packet */
+extern void tun_coalesce_add(struct tun_coalesce *c, int fd, unsigned char *pkt, int len);
+/* write the pending super-packet */
+extern void tun_coalesce_flush(struct tun_coalesce *c, int fd);
+
+#endif /* TUN_OFFLOAD_H_ */
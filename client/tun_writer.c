@@ -0,0 +1,238 @@
+/*
+ * Writer threads of the TUN device
+ *
+ * Copyright (C) 2011 Florent Bondoux
+ *
+ * This file is part of Campagnol.
+ *
+ * Campagnol is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Campagnol is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Campagnol.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * 
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ */
+
+
+#include "campagnol.h"
+
+#include "tun_writer.h"
+#include "tun_device.h"
+#include "../common/log.h"
+
+/*
+ * The ring is a bounded MPMC queue (D. Vyukov) with a single consumer.
+ * The sequence number of a cell tells whether it is free for the position of
+ * the producers (seq == pos) or holds a packet for the consumer
+ * (seq == pos + 1).
+ */
+static int ring_push(struct tun_writer *w, struct pkt_buf *pkt, unsigned char *data, int len) {
+    struct tun_writer_cell *cell;
+    unsigned long int pos = w->head;
+    long int dif;
+
+    for (;;) {
+        cell = &w->cells[pos & (TUN_WRITER_QUEUE - 1)];
+        dif = (long int) (cell->seq - pos);
+        if (dif == 0) {
+            if (__sync_bool_compare_and_swap(&w->head, pos, pos + 1))
+                break;
+            pos = w->head;
+        }
+        else if (dif < 0) { // full
+            return -1;
+        }
+        else {              // another producer took the cell
+            pos = w->head;
+        }
+    }
+
+    cell->pkt = pkt;
+    cell->data = data;
+    cell->len = len;
+    __sync_synchronize();
+    cell->seq = pos + 1;
+    return 0;
+}
+
+static int ring_pop(struct tun_writer *w, struct pkt_buf **pkt, unsigned char **data, int *len) {
+    struct tun_writer_cell *cell = &w->cells[w->tail & (TUN_WRITER_QUEUE - 1)];
+
+    if ((long int) (cell->seq - (w->tail + 1)) < 0) // empty
+        return 0;
+    __sync_synchronize();
+    *pkt = cell->pkt;
+    *data = cell->data;
+    *len = cell->len;
+    __sync_synchronize();
+    cell->seq = w->tail + TUN_WRITER_QUEUE;
+    w->tail++;
+    return 1;
+}
+
+static int ring_empty(struct tun_writer *w) {
+    struct tun_writer_cell *cell = &w->cells[w->tail & (TUN_WRITER_QUEUE - 1)];
+    return (long int) (cell->seq - (w->tail + 1)) < 0;
+}
+
+static inline void tun_writer_write(struct tun_writer *w, unsigned char *data, int len) {
+#ifdef HAVE_CYGWIN
+    write_tun(data, len);
+#else
+#   ifdef HAVE_LINUX
+    if (config.tun_offload) {
+        tun_coalesce_add(&w->coalesce, w->tunfd, data, len);
+        return;
+    }
+#   endif
+    if (write_tun(w->tunfd, data, len) == -1)
+        w->n_eagain++;
+#endif
+}
+
+static void tun_writer_log_stats(struct tun_writer *w) {
+    int i;
+
+    if (w->n_batches == 0 && w->n_dropped == 0)
+        return;
+#ifdef HAVE_LINUX
+    w->n_eagain += w->coalesce.n_eagain;
+#endif
+    log_message_level(1, "TUN writer: %lu packets, %lu batches (%.2f packets/batch), %lu dropped (full queue), %lu dropped by the device",
+            w->n_packets, w->n_batches,
+            w->n_batches ? (double) w->n_packets / (double) w->n_batches : 0.,
+            w->n_dropped, w->n_eagain);
+    for (i = 1; i <= TUN_WRITER_BATCH; i++) {
+        if (w->hist[i] != 0)
+            log_message_level(2, "  batches of %2d packets: %lu", i, w->hist[i]);
+    }
+}
+
+/*
+ * Write the queued packets by batches, then wait for the producers
+ * The ring is emptied before leaving
+ */
+static void *tun_writer_loop(void *arg) {
+    struct tun_writer *w = (struct tun_writer *) arg;
+    struct evloop_event events[1];
+    struct pkt_buf *pkt;
+    unsigned char *data;
+    int len, n;
+
+    for (;;) {
+        for (n = 0; n < TUN_WRITER_BATCH && ring_pop(w, &pkt, &data, &len); n++) {
+            tun_writer_write(w, data, len);
+            pkt_free(pkt);
+        }
+        if (n != 0) {
+#ifdef HAVE_LINUX
+            if (config.tun_offload)
+                tun_coalesce_flush(&w->coalesce, w->tunfd);
+#endif
+            w->n_packets += n;
+            w->n_batches++;
+            w->hist[n]++;
+            continue;
+        }
+        if (w->stop)
+            break;
+
+        /* sleep unless a packet was pushed in the meantime
+         * see the barrier in tun_writer_push */
+        w->sleeping = 1;
+        __sync_synchronize();
+        if (ring_empty(w) && !w->stop) {
+            evloop_wait(&w->loop, events, 1, -1);
+            evnotifier_clear(&w->notify);
+        }
+        w->sleeping = 0;
+    }
+    return NULL;
+}
+
+int tun_writer_start(struct tun_writer *w, int tunfd) {
+    unsigned long int i;
+
+    memset(w, 0, sizeof(*w));
+    w->tunfd = tunfd;
+    w->cells = CHECK_ALLOC_FATAL(malloc(TUN_WRITER_QUEUE * sizeof(struct tun_writer_cell)));
+    for (i = 0; i < TUN_WRITER_QUEUE; i++) {
+        w->cells[i].seq = i;
+    }
+    if (evnotifier_init(&w->notify) == -1) {
+        free(w->cells);
+        return -1;
+    }
+    if (evloop_init(&w->loop) == -1) {
+        evnotifier_close(&w->notify);
+        free(w->cells);
+        return -1;
+    }
+    if (evloop_add(&w->loop, w->notify.rfd, EVLOOP_IN, &w->notify) == -1) {
+        evloop_close(&w->loop);
+        evnotifier_close(&w->notify);
+        free(w->cells);
+        return -1;
+    }
+#ifdef HAVE_LINUX
+    if (config.tun_offload) tun_coalesce_init(&w->coalesce);
+#endif
+    w->thread = createThread(tun_writer_loop, w);
+    return 0;
+}
+
+/*
+ * The producers (the workers) must be stopped before
+ */
+void tun_writer_stop(struct tun_writer *w) {
+    w->stop = 1;
+    __sync_synchronize();
+    evnotifier_signal(&w->notify);
+    joinThread(w->thread, NULL);
+
+    tun_writer_log_stats(w);
+#ifdef HAVE_LINUX
+    if (config.tun_offload) tun_coalesce_free(&w->coalesce);
+#endif
+    evloop_close(&w->loop);
+    evnotifier_close(&w->notify);
+    free(w->cells);
+    w->cells = NULL;
+}
+
+int tun_writer_push(struct tun_writer *w, struct pkt_buf *pkt, unsigned char *data, int len) {
+    if (ring_push(w, pkt, data, len) == -1) {
+        __sync_fetch_and_add(&w->n_dropped, 1);
+        pkt_free(pkt);
+        return -1;
+    }
+
+    /* order the packet before the test, the writer sets the flag before
+     * looking at the ring */
+    __sync_synchronize();
+    if (w->sleeping) {
+        evnotifier_signal(&w->notify);
+    }
+    return 0;
+}
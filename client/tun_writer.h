@@ -0,0 +1,104 @@
+/*
+ * Writer threads of the TUN device
+ *
+ * Copyright (C) 2011 Florent Bondoux
+ *
+ * This file is part of Campagnol.
+ *
+ * Campagnol is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Campagnol is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Campagnol.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * 
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ */
+
+
+#ifndef TUN_WRITER_H_
+#define TUN_WRITER_H_
+
+#include "event_loop.h"
+#include "../common/pkt_pool.h"
+#include "../common/pthread_wrap.h"
+#ifdef HAVE_LINUX
+#   include "tun_offload.h"
+#endif
+
+/*
+ * Delivery of the decrypted packets to the TUN device
+ *
+ * Each TUN queue has one writer thread. The workers push the packets
+ * decrypted for the queue in a bounded multi-producer single-consumer ring
+ * and go on with the next record. The writer drains the ring by batches of
+ * at most TUN_WRITER_BATCH packets; in offload mode the TCP segments of a
+ * batch are coalesced before being written.
+ *
+ * When the ring is full the packet is dropped, like the device would do
+ * with a full queue.
+ */
+
+/* number of cells of the ring, power of 2 */
+#define TUN_WRITER_QUEUE 1024
+/* max number of packets written by batch */
+#define TUN_WRITER_BATCH 64
+
+struct tun_writer_cell {
+    volatile unsigned long int seq;     // position of the cell in the ring
+    struct pkt_buf *pkt;
+    unsigned char *data;
+    int len;
+};
+
+struct tun_writer {
+    int tunfd;
+    pthread_t thread;
+    volatile int stop;
+    volatile int sleeping;                  // the thread waits on notify
+    struct evnotifier notify;
+    struct evloop loop;
+    struct tun_writer_cell *cells;
+    /* producers and consumer positions, on their own cache line */
+    volatile unsigned long int head __attribute__((aligned(64)));
+    unsigned long int tail __attribute__((aligned(64)));
+#ifdef HAVE_LINUX
+    struct tun_coalesce coalesce;           // offload mode, merge the TCP segments
+#endif
+
+    /* statistics */
+    unsigned long int n_packets;            // packets written
+    unsigned long int n_batches;            // batches
+    unsigned long int n_eagain;             // packets dropped by the device
+    unsigned long int n_dropped;            // packets dropped, the ring is full
+    unsigned long int hist[TUN_WRITER_BATCH+1]; // batch sizes
+};
+
+extern int tun_writer_start(struct tun_writer *w, int tunfd);
+/* write the queued packets and stop the thread */
+extern void tun_writer_stop(struct tun_writer *w);
+/* Queue a packet of len bytes starting at data. The reference on pkt is
+ * handed over to the writer.
+ * Return -1 if the packet is dropped */
+extern int tun_writer_push(struct tun_writer *w, struct pkt_buf *pkt, unsigned char *data, int len);
+
+#endif /* TUN_WRITER_H_ */
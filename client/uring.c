@@ -0,0 +1,256 @@
+/*
+ * Campagnol, io_uring I/O engine (Linux)
+ *
+ * Copyright (C) 2011 Florent Bondoux
+ *
+ * This file is part of Campagnol.
+ *
+ * Campagnol is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Campagnol is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Campagnol.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * 
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ */
+
+
+#include "campagnol.h"
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+#include "../common/log.h"
+
+#define smp_load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static inline int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int sys_io_uring_enter(int fd, unsigned int to_submit,
+        unsigned int min_complete, unsigned int flags, void *arg, size_t argsz) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static inline int sys_io_uring_register(int fd, unsigned int opcode, const void *arg,
+        unsigned int nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(struct uring *ring, unsigned int entries) {
+    struct io_uring_params p;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+    ring->fd = sys_io_uring_setup(entries, &p);
+    if (ring->fd == -1) {
+        log_error(errno, "io_uring_setup");
+        return -1;
+    }
+    ring->features = p.features;
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        log_message("io_uring: the kernel is too old (no IORING_FEAT_EXT_ARG)");
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        log_error(errno, "io_uring mmap");
+        close(ring->fd);
+        return -1;
+    }
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+        log_error(errno, "io_uring mmap");
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return -1;
+    }
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        log_error(errno, "io_uring mmap");
+        munmap(ring->cq_ring, ring->cq_ring_size);
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sq_head = (unsigned int *) ((char *) ring->sq_ring + p.sq_off.head);
+    ring->sq_tail = (unsigned int *) ((char *) ring->sq_ring + p.sq_off.tail);
+    ring->sq_mask = *(unsigned int *) ((char *) ring->sq_ring + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *) ((char *) ring->sq_ring + p.sq_off.array);
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned int *) ((char *) ring->cq_ring + p.cq_off.head);
+    ring->cq_tail = (unsigned int *) ((char *) ring->cq_ring + p.cq_off.tail);
+    ring->cq_mask = *(unsigned int *) ((char *) ring->cq_ring + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ring + p.cq_off.cqes);
+
+    return 0;
+}
+
+void uring_close(struct uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+/* Publish the new SQEs and let the kernel consume them */
+static int uring_submit(struct uring *ring, unsigned int wait_nr, unsigned int flags,
+        void *arg, size_t argsz) {
+    int r;
+
+    smp_store_release(ring->sq_tail, ring->sq_local_tail);
+    do {
+        r = sys_io_uring_enter(ring->fd, ring->to_submit, wait_nr, flags, arg, argsz);
+    } while (r == -1 && errno == EINTR && wait_nr == 0);
+    if (r == -1) {
+        return -errno;
+    }
+    ring->to_submit -= ((unsigned int) r < ring->to_submit) ? (unsigned int) r : ring->to_submit;
+    return 0;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+    struct io_uring_sqe *sqe;
+    unsigned int head = smp_load_acquire(ring->sq_head);
+
+    if (ring->sq_local_tail - head > ring->sq_mask) {
+        /* full */
+        uring_submit(ring, 0, 0, NULL, 0);
+        head = smp_load_acquire(ring->sq_head);
+        if (ring->sq_local_tail - head > ring->sq_mask)
+            return NULL;
+    }
+    sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    ring->sq_array[ring->sq_local_tail & ring->sq_mask] = ring->sq_local_tail & ring->sq_mask;
+    ring->sq_local_tail++;
+    ring->to_submit++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uring_submit_and_wait(struct uring *ring, int timeout) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    int r;
+
+    if (uring_peek_cqe(ring) != NULL) {
+        /* completions are already waiting, just submit */
+        return (ring->to_submit != 0) ? uring_submit(ring, 0, 0, NULL, 0) : 0;
+    }
+
+    memset(&arg, 0, sizeof(arg));
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+    }
+    r = uring_submit(ring, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+            &arg, sizeof(arg));
+    if (r == -ETIME || r == -EINTR)
+        r = 0;
+    return r;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring) {
+    unsigned int head = *ring->cq_head;
+    if (head == smp_load_acquire(ring->cq_tail))
+        return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring) {
+    smp_store_release(ring->cq_head, *ring->cq_head + 1);
+}
+
+int uring_register_buffers(struct uring *ring, const struct iovec *iov, unsigned int n) {
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, n) == -1) {
+        log_error(errno, "io_uring_register buffers");
+        return -1;
+    }
+    return 0;
+}
+
+int uring_buf_ring_init(struct uring *ring, struct uring_buf_ring *br,
+        uint16_t bgid, unsigned int entries, size_t buf_size) {
+    struct io_uring_buf_reg reg;
+    unsigned int i;
+    size_t ring_size = entries * sizeof(struct io_uring_buf);
+
+    br->entries = entries;
+    br->bgid = bgid;
+    br->buf_size = buf_size;
+    br->br = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (br->br == MAP_FAILED) {
+        log_error(errno, "mmap");
+        return -1;
+    }
+    br->bufs = CHECK_ALLOC_FATAL(malloc(entries * buf_size));
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) br->br;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        log_error(errno, "io_uring_register buffer ring");
+        munmap(br->br, ring_size);
+        free(br->bufs);
+        return -1;
+    }
+
+    br->br->tail = 0;
+    for (i = 0; i < entries; i++) {
+        uring_buf_ring_recycle(br, (uint16_t) i);
+    }
+    return 0;
+}
+
+void uring_buf_ring_free(struct uring_buf_ring *br) {
+    munmap(br->br, br->entries * sizeof(struct io_uring_buf));
+    free(br->bufs);
+}
+
+void uring_buf_ring_recycle(struct uring_buf_ring *br, uint16_t bid) {
+    uint16_t tail = br->br->tail;
+    struct io_uring_buf *buf = &br->br->bufs[tail & (br->entries - 1)];
+
+    buf->addr = (uint64_t) (uintptr_t) uring_buf(br, bid);
+    buf->len = (uint32_t) br->buf_size;
+    buf->bid = bid;
+    smp_store_release(&br->br->tail, (uint16_t) (tail + 1));
+}
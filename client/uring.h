@@ -0,0 +1,110 @@
+/*
+ * Campagnol, io_uring I/O engine (Linux)
+ *
+ * Copyright (C) 2011 Florent Bondoux
+ *
+ * This file is part of Campagnol.
+ *
+ * Campagnol is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Campagnol is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Campagnol.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * 
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ */
+
+
+#ifndef URING_H_
+#define URING_H_
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring wrapper used by comm_socket and comm_tun
+ * (configure --enable-io-uring)
+ *
+ * It talks directly to the kernel (io_uring_setup, io_uring_enter and
+ * io_uring_register). Each ring is owned by one thread.
+ */
+
+struct uring {
+    int fd;
+    /* submission queue */
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int sq_local_tail;     // next free SQE
+    unsigned int to_submit;         // SQEs not submitted yet
+    /* completion queue */
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    /* mappings */
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned int features;
+};
+
+/* A ring of buffers provided to the kernel (IORING_REGISTER_PBUF_RING)
+ * The kernel picks a buffer for each completion of a multishot receive */
+struct uring_buf_ring {
+    struct io_uring_buf_ring *br;
+    unsigned int entries;           // power of 2
+    uint16_t bgid;                  // buffer group ID
+    size_t buf_size;
+    unsigned char *bufs;            // entries * buf_size bytes
+};
+
+extern int uring_init(struct uring *ring, unsigned int entries);
+extern void uring_close(struct uring *ring);
+/* Get a zeroed SQE, submit the pending ones if the queue is full */
+extern struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+/* Submit the pending SQEs and wait for at least one completion or timeout ms
+ * Return 0 or a negative errno value */
+extern int uring_submit_and_wait(struct uring *ring, int timeout);
+/* Return the next completion or NULL, then call uring_cqe_seen */
+extern struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+extern void uring_cqe_seen(struct uring *ring);
+
+extern int uring_register_buffers(struct uring *ring, const struct iovec *iov, unsigned int n);
+
+extern int uring_buf_ring_init(struct uring *ring, struct uring_buf_ring *br,
+        uint16_t bgid, unsigned int entries, size_t buf_size);
+extern void uring_buf_ring_free(struct uring_buf_ring *br);
+/* Give the buffer bid back to the kernel */
+extern void uring_buf_ring_recycle(struct uring_buf_ring *br, uint16_t bid);
+
+static inline unsigned char *uring_buf(struct uring_buf_ring *br, uint16_t bid) {
+    return br->bufs + (size_t) bid * br->buf_size;
+}
+
+#endif /* URING_H_ */
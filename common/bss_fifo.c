@@ -59,20 +59,32 @@ static int fifo_read(BIO *h, char *buf, int size);
 static long fifo_ctrl(BIO *h, int cmd, long arg1, void *arg2);
 static int fifo_new(BIO *h);
 static int fifo_free(BIO *data);
-static int fifo_allocate(BIO *bi, int len, int data_size);
-
-/* BIO_METHOD structure describing the BIO */
-static BIO_METHOD fifo_method = { BIO_TYPE_FIFO, // type
-        "fifo buffer", // name
-        fifo_write, // write function
-        fifo_read, // read function
-        NULL, // puts function, not implemented
-        NULL, // gets function, not implemented
-        fifo_ctrl, // BIO control function
-        fifo_new, // creation
-        fifo_free, // free
-        NULL, // callback function, not used
-        };
+static int fifo_allocate(BIO *bi, int len, struct pkt_pool *pool, int own_pool, int spsc);
+static void aqm_clear(struct fifo_data *d);
+
+/* BIO_METHOD structure describing the BIO, built once */
+static BIO_METHOD *fifo_method = NULL;
+static pthread_once_t fifo_method_once = PTHREAD_ONCE_INIT;
+
+static void fifo_method_init(void) {
+    BIO_METHOD *m = BIO_meth_new(BIO_TYPE_FIFO, "fifo buffer");
+    if (m == NULL) return;
+    BIO_meth_set_write(m, fifo_write);
+    BIO_meth_set_read(m, fifo_read);
+    BIO_meth_set_ctrl(m, fifo_ctrl);
+    BIO_meth_set_create(m, fifo_new);
+    BIO_meth_set_destroy(m, fifo_free);
+    fifo_method = m;
+}
+
+/* new BIO of the FIFO type, without its data */
+static BIO *fifo_bio_new(void) {
+    pthread_once(&fifo_method_once, fifo_method_init);
+    if (fifo_method == NULL) {
+        return NULL;
+    }
+    return BIO_new(fifo_method);
+}
 
 /*
  * Create a new FIFO BIO.
@@ -81,13 +93,19 @@ static BIO_METHOD fifo_method = { BIO_TYPE_FIFO, // type
  */
 BIO *BIO_new_fifo(int len, int data_size) {
     BIO *bi;
-    int r;
-    bi = BIO_new(&fifo_method);
+    struct pkt_pool *pool;
+
+    pool = pkt_pool_new(data_size, 0, 0);
+    if (pool == NULL) {
+        return NULL;
+    }
+    bi = fifo_bio_new();
     if (bi == NULL) {
+        pkt_pool_free(pool);
         return NULL;
     }
-    r = fifo_allocate(bi, len, data_size);
-    if (r != 1) {
+    if (fifo_allocate(bi, len, pool, 1, 0) != 1) {
+        pkt_pool_free(pool);
         BIO_free(bi);
         return NULL;
     }
@@ -95,20 +113,58 @@ BIO *BIO_new_fifo(int len, int data_size) {
 }
 
 /*
- * Allocate everything in the BIO and set bi->init = 1
+ * Create a new FIFO BIO using a shared pool of packet buffers.
  * len: number of items in the queue
- * data_size: packet size
  */
-int fifo_allocate(BIO *bi, int len, int data_size) {
-    unsigned int i, j;
+BIO *BIO_new_fifo_pool(int len, struct pkt_pool *pool) {
+    BIO *bi;
+    bi = fifo_bio_new();
+    if (bi == NULL) {
+        return NULL;
+    }
+    if (fifo_allocate(bi, len, pool, 0, 0) != 1) {
+        BIO_free(bi);
+        return NULL;
+    }
+    return bi;
+}
+
+/*
+ * Create a new single producer/single consumer FIFO BIO using a shared pool
+ * of packet buffers.
+ * len: number of items in the queue
+ */
+BIO *BIO_new_fifo_spsc(int len, struct pkt_pool *pool) {
+    BIO *bi;
+    bi = fifo_bio_new();
+    if (bi == NULL) {
+        return NULL;
+    }
+    if (fifo_allocate(bi, len, pool, 0, 1) != 1) {
+        BIO_free(bi);
+        return NULL;
+    }
+    return bi;
+}
+
+/*
+ * Allocate everything in the BIO and set the init flag
+ * len: number of items in the queue
+ * pool: pool of packet buffers, freed with the BIO if own_pool is set
+ */
+int fifo_allocate(BIO *bi, int len, struct pkt_pool *pool, int own_pool, int spsc) {
     struct fifo_data * d;
+    void *ptr;
+    int r;
 
-    bi->ptr = malloc(sizeof(struct fifo_data));
-    if (bi->ptr == NULL) {
-        log_error(errno, "Cannot allocate a new client");
+    /* the SPSC indexes are on their own cache lines */
+    r = posix_memalign(&ptr, FIFO_CACHE_LINE, sizeof(struct fifo_data));
+    if (r != 0) {
+        log_error(r, "Cannot allocate a new client");
         return 0;
     }
-    d = (struct fifo_data *) bi->ptr;
+    d = (struct fifo_data *) ptr;
+    memset(d, 0, sizeof(struct fifo_data));
     d->index_read = 0;
     d->index_write = 0;
     d->size = len;
@@ -118,28 +174,16 @@ int fifo_allocate(BIO *bi, int len, int data_size) {
     d->next_rcv_timeout.tv_sec = d->next_rcv_timeout.tv_usec = 0;
     d->curr_rcv_timeout.tv_sec = d->curr_rcv_timeout.tv_usec = 0;
     d->droptail = 0;
+    d->pool = pool;
+    d->own_pool = own_pool;
+    d->spsc = spsc;
 
-    d->fifo = (struct fifo_item *) malloc(d->size * sizeof(struct fifo_item));
+    /* the packets are only referenced by the items
+     * in SPSC mode, one item stays empty to tell a full ring from an empty one */
+    d->fifo = (struct fifo_item *) calloc(d->size + (spsc ? 1 : 0), sizeof(struct fifo_item));
     if (d->fifo == NULL) {
-        free(bi->ptr);
-        log_error(errno, "Cannot allocate a new client");
-        return 0;
-    }
-
-    for (i = 0; i < d->size; i++) {
-        d->fifo[i].data = malloc(data_size);
-        d->fifo[i].data_size = data_size;
-        if (d->fifo[i].data == NULL) {
-            break;
-        }
-    }
-    if (i != d->size) {
+        free(d);
         log_error(errno, "Cannot allocate a new client");
-        for (j = 0; j < i; j++) {
-            free(d->fifo[j].data);
-        }
-        free(d->fifo);
-        free(bi->ptr);
         return 0;
     }
 
@@ -150,19 +194,44 @@ int fifo_allocate(BIO *bi, int len, int data_size) {
     d->waiting_read = 0;
     d->waiting_write = 0;
 
-    bi->init = 1;
+    BIO_set_data(bi, d);
+    BIO_set_init(bi, 1);
 
     return 1;
 }
 
+static void spsc_drain(struct fifo_data *d);
+
+/*
+ * Drop the packets still in the queue
+ * The mutex must be held, except in SPSC mode where only the reader may call it
+ */
+static void fifo_clear(struct fifo_data *d) {
+    if (d->spsc) {
+        spsc_drain(d);
+        return;
+    }
+    if (d->aqm != NULL) {
+        aqm_clear(d);
+        return;
+    }
+    while (d->nelem != 0) {
+        pkt_free(d->fifo[d->index_read].pkt);
+        d->fifo[d->index_read].pkt = NULL;
+        (d->index_read == d->size - 1) ? d->index_read = 0 : d->index_read++;
+        d->nelem--;
+    }
+    d->index_read = 0;
+    d->index_write = 0;
+}
+
 /*
  * Doesn't do much
  * the work is done by fifo_allocate
  */
 static int fifo_new(BIO *bi) {
-    bi->shutdown = 1; // the "close flag" (see BIO_set_close(3))
-    bi->init = 0;
-    bi->num = -1; // not used
+    BIO_set_shutdown(bi, 1); // the "close flag" (see BIO_set_close(3))
+    BIO_set_init(bi, 0);
 
     return 1;
 }
@@ -172,21 +241,25 @@ static int fifo_new(BIO *bi) {
  */
 static int fifo_free(BIO *bi) {
     struct fifo_data *d;
-    unsigned int i;
     if (bi == NULL)
         return 0; // we have to check
-    if (bi->shutdown) {
-        if ((bi->init) && (bi->ptr != NULL)) {
-            d = (struct fifo_data *) bi->ptr;
-            for (i = 0; i < d->size; i++) {
-                free(d->fifo[i].data);
-            }
+    if (BIO_get_shutdown(bi)) {
+        if (BIO_get_init(bi) && (BIO_get_data(bi) != NULL)) {
+            d = (struct fifo_data *) BIO_get_data(bi);
+            fifo_clear(d);
             free(d->fifo);
+            if (d->aqm != NULL) {
+                free(d->aqm->flows);
+                free(d->aqm);
+            }
+            if (d->own_pool) {
+                pkt_pool_free(d->pool);
+            }
             mutexDestroy(&d->mutex);
             conditionDestroy(&d->cond_read);
             conditionDestroy(&d->cond_write);
             free(d);
-            bi->ptr = NULL;
+            BIO_set_data(bi, NULL);
         }
     }
     return 1;
@@ -213,7 +286,7 @@ static inline void set_timeout(struct timespec *tspec, struct timeval timeout) {
 static void fifo_adjust_rcv_timeout(BIO *b) {
     struct fifo_data *d;
 
-    d = (struct fifo_data *) b->ptr;
+    d = (struct fifo_data *) BIO_get_data(b);
 
     if (d->next_rcv_timeout.tv_sec > 0 || d->next_rcv_timeout.tv_usec > 0) {
         struct timeval timenow, timeleft;
@@ -258,7 +331,7 @@ static void fifo_adjust_rcv_timeout(BIO *b) {
 static void fifo_reset_rcv_timeout(BIO *b) {
     struct fifo_data *d;
 
-    d = (struct fifo_data *) b->ptr;
+    d = (struct fifo_data *) BIO_get_data(b);
 
     /* Is a timer active? */
     if (d->next_rcv_timeout.tv_sec > 0 || d->next_rcv_timeout.tv_usec > 0) {
@@ -267,22 +340,650 @@ static void fifo_reset_rcv_timeout(BIO *b) {
 }
 
 /*
- * Blocking read from the FIFO
+ * Single producer/single consumer mode
+ *
+ * Each index is written by one side only. A thread going to sleep sets its
+ * waiting flag with the mutex held and checks the ring again, the other side
+ * checks this flag after moving its index and takes the mutex to wake it up.
+ * The full barriers on both sides ensure that one of them sees the other.
  */
-static int fifo_read(BIO *b, char *out, int outl) {
-    int ret = 0, len, r = 0;
+static inline unsigned int spsc_next(struct fifo_data *d, unsigned int i) {
+    return (i == d->size) ? 0 : i + 1;
+}
+
+static inline unsigned int spsc_count(struct fifo_data *d, unsigned int head, unsigned int tail) {
+    return (tail >= head) ? tail - head : tail + d->size + 1 - head;
+}
+
+static void spsc_wake(struct fifo_data *d, pthread_cond_t *cond) {
+    mutexLock(&d->mutex);
+    conditionSignal(cond);
+    mutexUnlock(&d->mutex);
+}
+
+static int spsc_get(BIO *b, struct fifo_item *out) {
+    int r = 0;
     struct fifo_data *d;
     struct fifo_item *item;
     struct timespec timeout;
+    unsigned int head;
 
-    d = (struct fifo_data *) b->ptr;
+    d = (struct fifo_data *) BIO_get_data(b);
+    head = d->spsc_head;
 
-    if (!out) {
-        return ret;
+    if (head == d->spsc_tail && d->markers == 0 && d->notify.fn == NULL) {
+        mutexLock(&d->mutex);
+        d->spsc_reader_waiting = 1;
+        __sync_synchronize();
+        fifo_adjust_rcv_timeout(b);
+        if (d->curr_rcv_timeout.tv_sec || d->curr_rcv_timeout.tv_usec) {
+            set_timeout(&timeout, d->curr_rcv_timeout);
+            while (head == d->spsc_tail && d->markers == 0 && r == 0) {
+                r = conditionTimedwait(&d->cond_read, &d->mutex, &timeout);
+            }
+        }
+        else {
+            while (head == d->spsc_tail && d->markers == 0) {
+                conditionWait(&d->cond_read, &d->mutex);
+            }
+        }
+        fifo_reset_rcv_timeout(b);
+        d->spsc_reader_waiting = 0;
+        mutexUnlock(&d->mutex);
+    }
+
+    BIO_clear_retry_flags(b);
+
+    if (head == d->spsc_tail) {
+        if (d->markers != 0) { // end marker
+            __sync_fetch_and_sub(&d->markers, 1);
+            out->size = 0;
+            out->data = NULL;
+            out->pkt = NULL;
+            return 0;
+        }
+        // timeout, or empty FIFO with a notify hook
+        BIO_set_retry_read(b);
+        d->rcv_timer_exp = (d->notify.fn == NULL);
+        return -1;
+    }
+
+    /* read the item after the index, release the item before moving the index */
+    __sync_synchronize();
+    item = &d->fifo[head];
+    *out = *item;
+    item->pkt = NULL;
+    __sync_synchronize();
+    d->spsc_head = head = spsc_next(d, head);
+    __sync_synchronize();
+
+    if (d->spsc_writer_waiting
+            && d->size - spsc_count(d, head, d->spsc_tail) >= d->threshold) {
+        spsc_wake(d, &d->cond_write);
+    }
+    return 0;
+}
+
+/*
+ * Drop the queued packets from the reading side: only the head moves, like
+ * in spsc_get, so a concurrent writer is never disturbed. The packets pushed
+ * meanwhile stay queued and the end markers are kept.
+ */
+static void spsc_drain(struct fifo_data *d) {
+    unsigned int head, tail;
+
+    head = d->spsc_head;
+    tail = d->spsc_tail;
+    if (head == tail)
+        return;
+    __sync_synchronize();
+    while (head != tail) {
+        pkt_free(d->fifo[head].pkt);
+        d->fifo[head].pkt = NULL;
+        head = spsc_next(d, head);
+    }
+    __sync_synchronize();
+    d->spsc_head = head;
+    __sync_synchronize();
+
+    if (d->spsc_writer_waiting) {
+        spsc_wake(d, &d->cond_write);
+    }
+}
+
+static int spsc_put(BIO *b, struct pkt_buf *pkt, unsigned char *data, int len, int nonblock) {
+    struct fifo_data *d;
+    struct fifo_item *item;
+    unsigned int tail;
+
+    d = (struct fifo_data *) BIO_get_data(b);
+
+    /* end marker, may come from any thread */
+    if (len == 0) {
+        pkt_free(pkt);
+        __sync_fetch_and_add(&d->markers, 1);
+        if (d->spsc_reader_waiting) {
+            spsc_wake(d, &d->cond_read);
+        }
+        return 0;
+    }
+
+    tail = d->spsc_tail;
+    if (spsc_next(d, tail) == d->spsc_head) {
+        if (d->droptail || nonblock) {
+            pkt_free(pkt);
+            d->n_dropped++;
+            return nonblock ? -1 : len;
+        }
+        mutexLock(&d->mutex);
+        d->spsc_writer_waiting = 1;
+        __sync_synchronize();
+        while (spsc_next(d, tail) == d->spsc_head) {
+            conditionWait(&d->cond_write, &d->mutex);
+        }
+        d->spsc_writer_waiting = 0;
+        mutexUnlock(&d->mutex);
+    }
+
+    BIO_clear_retry_flags(b);
+    item = &d->fifo[tail];
+    item->size = len;
+    item->data = data;
+    item->pkt = pkt;
+    /* publish the item, then check whether the reader sleeps */
+    __sync_synchronize();
+    d->spsc_tail = spsc_next(d, tail);
+    __sync_synchronize();
+    if (d->spsc_reader_waiting) {
+        spsc_wake(d, &d->cond_read);
+    }
+    return len;
+}
+
+/*
+ * Active queue management
+ *
+ * The items of d->fifo are the nodes of the sub-queues, the unused ones are
+ * in aqm->free_items. Everything is protected by the mutex. The writers never
+ * wait: when every item is used, the head of the longest sub-queue is dropped.
+ * The end markers are counted in d->markers so they are never dropped.
+ */
+static inline uint64_t aqm_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + (uint64_t) now.tv_nsec / 1000;
+}
+
+/* integer square root */
+static uint64_t aqm_isqrt(uint64_t x) {
+    uint64_t r = 0, bit = (uint64_t) 1 << 62;
+
+    while (bit > x) bit >>= 2;
+    while (bit != 0) {
+        if (x >= r + bit) {
+            x -= r + bit;
+            r = (r >> 1) + bit;
+        }
+        else {
+            r >>= 1;
+        }
+        bit >>= 2;
+    }
+    return r;
+}
+
+/* compare two timestamps with a signed difference, like codel_time_before */
+static inline int codel_time_before(uint64_t a, uint64_t b) {
+    return (int64_t) (a - b) < 0;
+}
+
+/* CoDel control law: t + interval / sqrt(count) */
+static inline uint64_t aqm_control_law(struct fifo_aqm *aqm, uint64_t t, unsigned int count) {
+    return t + ((uint64_t) aqm->params.interval << 10) / aqm_isqrt((uint64_t) count << 20);
+}
+
+static void aqm_list_append(struct fifo_flow **head, struct fifo_flow **tail, struct fifo_flow *f) {
+    f->next = NULL;
+    if (*tail == NULL) {
+        *head = f;
+    }
+    else {
+        (*tail)->next = f;
+    }
+    *tail = f;
+}
+
+static struct fifo_flow *aqm_list_pop(struct fifo_flow **head, struct fifo_flow **tail) {
+    struct fifo_flow *f = *head;
+    *head = f->next;
+    if (*head == NULL) *tail = NULL;
+    f->next = NULL;
+    return f;
+}
+
+static struct fifo_item *aqm_flow_pop(struct fifo_flow *f) {
+    struct fifo_item *item = f->head;
+    if (item != NULL) {
+        f->head = item->next;
+        if (f->head == NULL) f->tail = NULL;
+        f->backlog -= item->size;
+    }
+    return item;
+}
+
+/* give an item back to the free list, the packet must have been taken or freed */
+static void aqm_release(struct fifo_data *d, struct fifo_item *item) {
+    item->pkt = NULL;
+    item->next = d->aqm->free_items;
+    d->aqm->free_items = item;
+    d->nelem--;
+}
+
+static void aqm_drop(struct fifo_data *d, struct fifo_item *item) {
+    pkt_free(item->pkt);
+    d->n_dropped++;
+    aqm_release(d, item);
+}
+
+/*
+ * Take the head of a sub-queue and tell whether CoDel may drop it
+ * (its sojourn time stayed above target for at least interval)
+ */
+static struct fifo_item *codel_dodequeue(struct fifo_data *d, struct fifo_flow *f,
+        uint64_t now, int *ok_to_drop) {
+    struct fifo_aqm *aqm = d->aqm;
+    struct fifo_item *item;
+
+    *ok_to_drop = 0;
+    item = aqm_flow_pop(f);
+    if (item == NULL) {
+        f->first_above_time = 0;
+        return NULL;
+    }
+    if (now - item->tstamp < aqm->params.target || f->backlog <= aqm->maxpacket) {
+        f->first_above_time = 0;
+    }
+    else if (f->first_above_time == 0) {
+        f->first_above_time = now + aqm->params.interval;
+    }
+    else if (!codel_time_before(now, f->first_above_time)) {
+        *ok_to_drop = 1;
+    }
+    return item;
+}
+
+/* CoDel dequeue (RFC 8289) */
+static struct fifo_item *codel_dequeue(struct fifo_data *d, struct fifo_flow *f, uint64_t now) {
+    struct fifo_aqm *aqm = d->aqm;
+    struct fifo_item *item;
+    unsigned int delta;
+    int ok_to_drop;
+
+    if (aqm->params.target == 0) { // scheduling only
+        return aqm_flow_pop(f);
+    }
+
+    item = codel_dodequeue(d, f, now, &ok_to_drop);
+    if (item == NULL) {
+        f->dropping = 0;
+        return NULL;
+    }
+    if (f->dropping) {
+        if (!ok_to_drop) {
+            f->dropping = 0;
+        }
+        while (f->dropping && !codel_time_before(now, f->drop_next)) {
+            aqm_drop(d, item);
+            f->count++;
+            item = codel_dodequeue(d, f, now, &ok_to_drop);
+            if (!ok_to_drop) {
+                f->dropping = 0;
+            }
+            else {
+                f->drop_next = aqm_control_law(aqm, f->drop_next, f->count);
+            }
+        }
     }
+    else if (ok_to_drop) {
+        aqm_drop(d, item);
+        item = codel_dodequeue(d, f, now, &ok_to_drop);
+        f->dropping = 1;
+        /* start from the previous drop rate if we were dropping recently */
+        delta = f->count - f->lastcount;
+        if (delta > 1 && codel_time_before(now - f->drop_next, 16 * (uint64_t) aqm->params.interval)) {
+            f->count = delta;
+        }
+        else {
+            f->count = 1;
+        }
+        f->drop_next = aqm_control_law(aqm, now, f->count);
+        f->lastcount = f->count;
+    }
+    return item;
+}
+
+/* FQ-CoDel dequeue (RFC 8290) within a class,
+ * deficit round robin favoring the new flows */
+static struct fifo_item *fq_dequeue(struct fifo_data *d, struct fifo_class *cl, uint64_t now) {
+    struct fifo_aqm *aqm = d->aqm;
+    struct fifo_flow *f;
+    struct fifo_item *item;
+    int is_new;
+
+    for (;;) {
+        if (cl->new_head != NULL) {
+            f = cl->new_head;
+            is_new = 1;
+        }
+        else if (cl->old_head != NULL) {
+            f = cl->old_head;
+            is_new = 0;
+        }
+        else {
+            return NULL;
+        }
+
+        if (f->deficit <= 0) {
+            f->deficit += aqm->params.quantum;
+            if (is_new) {
+                aqm_list_pop(&cl->new_head, &cl->new_tail);
+            }
+            else {
+                aqm_list_pop(&cl->old_head, &cl->old_tail);
+            }
+            f->list = 2;
+            aqm_list_append(&cl->old_head, &cl->old_tail, f);
+            continue;
+        }
+
+        item = codel_dequeue(d, f, now);
+        if (item == NULL) {
+            /* an empty new flow goes through the old list once */
+            if (is_new) {
+                aqm_list_pop(&cl->new_head, &cl->new_tail);
+                if (cl->old_head != NULL) {
+                    f->list = 2;
+                    aqm_list_append(&cl->old_head, &cl->old_tail, f);
+                }
+                else {
+                    f->list = 0;
+                }
+            }
+            else {
+                aqm_list_pop(&cl->old_head, &cl->old_tail);
+                f->list = 0;
+            }
+            continue;
+        }
+        f->deficit -= item->size;
+        return item;
+    }
+}
+
+static inline int class_active(struct fifo_class *cl) {
+    return cl->new_head != NULL || cl->old_head != NULL;
+}
+
+/* Serve the strict priority classes, then the weighted classes by DRR */
+static struct fifo_item *aqm_dequeue(struct fifo_data *d, uint64_t now) {
+    struct fifo_aqm *aqm = d->aqm;
+    struct fifo_class *cl;
+    struct fifo_item *item;
+    int i, active;
+
+    for (i = 0; i < aqm->params.classes; i++) {
+        cl = &aqm->classes[i];
+        if (aqm->params.weights[i] == 0 && class_active(cl)
+                && (item = fq_dequeue(d, cl, now)) != NULL) {
+            return item;
+        }
+    }
+
+    for (;;) {
+        active = 0;
+        for (i = 0; i < aqm->params.classes; i++) {
+            if (aqm->params.weights[i] != 0 && class_active(&aqm->classes[i])) {
+                active = 1;
+                break;
+            }
+        }
+        if (!active) {
+            return NULL;
+        }
+
+        i = aqm->cur_class;
+        cl = &aqm->classes[i];
+        if (aqm->params.weights[i] == 0 || !class_active(cl)) {
+            aqm->cur_class = (i + 1) % aqm->params.classes;
+            continue;
+        }
+        if (cl->deficit <= 0) {
+            cl->deficit += aqm->params.quantum * aqm->params.weights[i];
+            aqm->cur_class = (i + 1) % aqm->params.classes;
+            continue;
+        }
+        item = fq_dequeue(d, cl, now);
+        if (item == NULL) {
+            cl->deficit = 0;
+            aqm->cur_class = (i + 1) % aqm->params.classes;
+            continue;
+        }
+        cl->deficit -= item->size;
+        return item;
+    }
+}
+
+static void aqm_enqueue(struct fifo_data *d, struct pkt_buf *pkt, unsigned char *data, int len) {
+    struct fifo_aqm *aqm = d->aqm;
+    struct fifo_flow *f, *fattest;
+    struct fifo_item *item;
+    int i, c;
+
+    if (aqm->free_items == NULL) {
+        fattest = &aqm->flows[0];
+        for (i = 1; i < aqm->params.flows * aqm->params.classes; i++) {
+            if (aqm->flows[i].backlog > fattest->backlog) {
+                fattest = &aqm->flows[i];
+            }
+        }
+        aqm_drop(d, aqm_flow_pop(fattest));
+    }
+
+    c = 0;
+    if (aqm->params.classes > 1 && aqm->params.classify != NULL) {
+        c = aqm->params.classify(data, len);
+        if (c < 0 || c >= aqm->params.classes) c = aqm->params.classes - 1;
+    }
+    i = 0;
+    if (aqm->params.flows > 1 && aqm->params.flow_hash != NULL) {
+        i = (int) (aqm->params.flow_hash(data, len) % (unsigned int) aqm->params.flows);
+    }
+    f = &aqm->flows[c * aqm->params.flows + i];
+
+    item = aqm->free_items;
+    aqm->free_items = item->next;
+    item->size = len;
+    item->data = data;
+    item->pkt = pkt;
+    item->next = NULL;
+    item->tstamp = aqm_now();
+    if (f->tail == NULL) {
+        f->head = item;
+    }
+    else {
+        f->tail->next = item;
+    }
+    f->tail = item;
+    f->backlog += len;
+    if ((unsigned int) len > aqm->maxpacket) {
+        aqm->maxpacket = len;
+    }
+    d->nelem++;
+
+    if (f->list == 0) {
+        f->list = 1;
+        f->deficit = aqm->params.quantum;
+        aqm_list_append(&aqm->classes[c].new_head, &aqm->classes[c].new_tail, f);
+    }
+}
+
+/*
+ * Enable the AQM, the mutex must be held and the FIFO must be empty
+ */
+static int aqm_allocate(struct fifo_data *d, const struct fifo_aqm_params *params) {
+    struct fifo_aqm *aqm;
+    unsigned int i;
+
+    aqm = (struct fifo_aqm *) calloc(1, sizeof(struct fifo_aqm));
+    if (aqm == NULL) {
+        log_error(errno, "Cannot allocate the AQM state");
+        return 0;
+    }
+    aqm->params = *params;
+    if (aqm->params.flows < 1) aqm->params.flows = 1;
+    if (aqm->params.classes < 1) aqm->params.classes = 1;
+    if (aqm->params.classes > FIFO_MAX_CLASSES) aqm->params.classes = FIFO_MAX_CLASSES;
+    if (aqm->params.classes == 1) aqm->params.weights[0] = 0;
+    for (i = 0; i < (unsigned int) aqm->params.classes; i++) {
+        if (aqm->params.weights[i] < 0) aqm->params.weights[i] = 0;
+    }
+    if (aqm->params.quantum <= 0) aqm->params.quantum = (int) d->pool->buf_size;
+    if (aqm->params.interval == 0) aqm->params.interval = 1;
+    aqm->flows = (struct fifo_flow *) calloc(aqm->params.flows * aqm->params.classes,
+            sizeof(struct fifo_flow));
+    if (aqm->flows == NULL) {
+        log_error(errno, "Cannot allocate the AQM state");
+        free(aqm);
+        return 0;
+    }
+    for (i = d->size; i > 0; i--) {
+        d->fifo[i - 1].next = aqm->free_items;
+        aqm->free_items = &d->fifo[i - 1];
+    }
+    d->aqm = aqm;
+    return 1;
+}
+
+/*
+ * Drop everything, the mutex must be held
+ */
+static void aqm_clear(struct fifo_data *d) {
+    struct fifo_aqm *aqm = d->aqm;
+    struct fifo_item *item;
+    int i;
+
+    for (i = 0; i < aqm->params.flows * aqm->params.classes; i++) {
+        while ((item = aqm_flow_pop(&aqm->flows[i])) != NULL) {
+            pkt_free(item->pkt);
+            aqm_release(d, item);
+        }
+        memset(&aqm->flows[i], 0, sizeof(struct fifo_flow));
+    }
+    memset(aqm->classes, 0, sizeof(aqm->classes));
+    aqm->cur_class = 0;
+    d->markers = 0;
+}
+
+static int aqm_get(BIO *b, struct fifo_item *out) {
+    int ret = 0, r = 0, waited = 0, timed = 0;
+    struct fifo_data *d;
+    struct fifo_item *item;
+    struct timespec timeout;
+
+    d = (struct fifo_data *) BIO_get_data(b);
 
     mutexLock(&d->mutex);
-    if (d->nelem == 0) {
+    /* the dequeue may drop every packet, then wait again */
+    while ((item = aqm_dequeue(d, aqm_now())) == NULL && d->markers == 0 && r == 0
+            && d->notify.fn == NULL) {
+        if (!waited) {
+            waited = 1;
+            fifo_adjust_rcv_timeout(b);
+            timed = d->curr_rcv_timeout.tv_sec || d->curr_rcv_timeout.tv_usec;
+            if (timed) {
+                set_timeout(&timeout, d->curr_rcv_timeout);
+            }
+        }
+        d->waiting_read++;
+        if (timed) {
+            r = conditionTimedwait(&d->cond_read, &d->mutex, &timeout);
+        }
+        else {
+            conditionWait(&d->cond_read, &d->mutex);
+        }
+        d->waiting_read--;
+    }
+    if (waited) {
+        fifo_reset_rcv_timeout(b);
+    }
+
+    BIO_clear_retry_flags(b);
+
+    if (item != NULL) {
+        *out = *item;
+        out->next = NULL;
+        aqm_release(d, item);
+    }
+    else if (d->markers != 0) { // end marker
+        d->markers--;
+        out->size = 0;
+        out->data = NULL;
+        out->pkt = NULL;
+    }
+    else { // timeout, or empty FIFO with a notify hook
+        BIO_set_retry_read(b);
+        d->rcv_timer_exp = (d->notify.fn == NULL);
+        ret = -1;
+    }
+    mutexUnlock(&d->mutex);
+    return ret;
+}
+
+static int aqm_put(BIO *b, struct pkt_buf *pkt, unsigned char *data, int len) {
+    struct fifo_data *d;
+
+    d = (struct fifo_data *) BIO_get_data(b);
+
+    mutexLock(&d->mutex);
+    BIO_clear_retry_flags(b);
+    if (len == 0) {
+        pkt_free(pkt);
+        d->markers++;
+    }
+    else {
+        aqm_enqueue(d, pkt, data, len);
+    }
+    if (d->waiting_read) {
+        conditionSignal(&d->cond_read);
+    }
+    mutexUnlock(&d->mutex);
+    return len;
+}
+
+/*
+ * Wait for a packet and take it from the FIFO
+ * The caller gets the reference held by the item
+ * Return 0 or -1 after a timeout (immediately with a notify hook)
+ */
+static int fifo_get(BIO *b, struct fifo_item *out) {
+    int ret = 0, r = 0;
+    struct fifo_data *d;
+    struct fifo_item *item;
+    struct timespec timeout;
+
+    d = (struct fifo_data *) BIO_get_data(b);
+    if (d->spsc) {
+        return spsc_get(b, out);
+    }
+    if (d->aqm != NULL) {
+        return aqm_get(b, out);
+    }
+
+    mutexLock(&d->mutex);
+    if (d->nelem == 0 && d->notify.fn != NULL) {
+        r = -1;
+    }
+    else if (d->nelem == 0) {
         d->waiting_read++;
         fifo_adjust_rcv_timeout(b);
         if (d->curr_rcv_timeout.tv_sec || d->curr_rcv_timeout.tv_usec) {
@@ -299,18 +1000,15 @@ static int fifo_read(BIO *b, char *out, int outl) {
 
     BIO_clear_retry_flags(b);
 
-    if (r != 0) { // timeout
+    if (r != 0) { // timeout, or empty FIFO with a notify hook
         BIO_set_retry_read(b);
-        d->rcv_timer_exp = 1;
+        d->rcv_timer_exp = (d->notify.fn == NULL);
         ret = -1;
     }
     else {
         item = &d->fifo[d->index_read];
-        len = item->size;
-        ret = (outl >= len) ? len : outl; // is "out" big enough to store the packet
-        if ((out != NULL)) {
-            memcpy(out, item->data, ret); // copy the data into "out" and update the queue
-        }
+        *out = *item;
+        item->pkt = NULL;
         (d->index_read == d->size - 1) ? d->index_read = 0 : d->index_read++;
         d->nelem--;
         if (d->waiting_write && (d->size - d->nelem) >= d->threshold) {
@@ -321,24 +1019,19 @@ static int fifo_read(BIO *b, char *out, int outl) {
     return ret;
 }
 
-/*
- * Blocking write to the FIFO
- */
-static int fifo_write(BIO *b, const char *in, int inl) {
+/* Queue a packet in the ring of the locked FIFO */
+static int fifo_enqueue(BIO *b, struct pkt_buf *pkt, unsigned char *data, int len, int nonblock) {
     struct fifo_data *d;
     struct fifo_item *item;
-    int ret = -1;
 
-    if (in == NULL) {
-        BIOerr(BIO_F_BIO_WRITE,BIO_R_NULL_PARAMETER);
-        return ret;
-    }
+    d = (struct fifo_data *) BIO_get_data(b);
 
-    d = (struct fifo_data *) b->ptr;
     mutexLock(&d->mutex);
-    if (d->nelem == d->size && d->droptail) {
+    if (d->nelem == d->size && (d->droptail || nonblock)) {
+        d->n_dropped++;
         mutexUnlock(&d->mutex);
-        return inl;
+        pkt_free(pkt);
+        return nonblock ? -1 : len;
     }
     while (d->nelem == d->size) {
         d->waiting_write++;
@@ -348,29 +1041,104 @@ static int fifo_write(BIO *b, const char *in, int inl) {
 
     BIO_clear_retry_flags(b);
     item = &d->fifo[d->index_write];
-    if (inl > item->data_size) {
-        void * new = malloc(inl);
-        if (new) {
-            free(item->data);
-            item->data = new;
-            item->data_size = inl;
-        }
-        else {
-            inl = item->data_size;
-        }
-    }
-    item->size = inl;
-    memcpy(item->data, in, inl);
+    item->size = len;
+    item->data = data;
+    item->pkt = pkt;
     (d->index_write == d->size - 1) ? d->index_write = 0 : d->index_write++;
-    ret = inl;
     d->nelem++;
     if (d->waiting_read) {
         conditionSignal(&d->cond_read);
     }
     mutexUnlock(&d->mutex);
+    return len;
+}
+
+/*
+ * Queue a packet, blocking while the FIFO is full unless nonblock is set
+ * The FIFO takes the reference on pkt
+ * Return len, or -1 if the packet was dropped in nonblocking mode
+ */
+static int fifo_put(BIO *b, struct pkt_buf *pkt, unsigned char *data, int len, int nonblock) {
+    struct fifo_data *d;
+    int r;
+
+    d = (struct fifo_data *) BIO_get_data(b);
+    if (d->spsc) {
+        r = spsc_put(b, pkt, data, len, nonblock);
+    }
+    else if (d->aqm != NULL) {
+        r = aqm_put(b, pkt, data, len);
+    }
+    else {
+        r = fifo_enqueue(b, pkt, data, len, nonblock);
+    }
+    if (r != -1 && d->notify.fn != NULL) {
+        d->notify.fn(d->notify.arg);
+    }
+    return r;
+}
+
+/*
+ * Blocking read from the FIFO
+ */
+static int fifo_read(BIO *b, char *out, int outl) {
+    int ret;
+    struct fifo_item item;
+
+    if (!out) {
+        return 0;
+    }
+
+    if (fifo_get(b, &item) == -1) {
+        return -1;
+    }
+    ret = (outl >= item.size) ? item.size : outl; // is "out" big enough to store the packet
+    memcpy(out, item.data, ret);
+    pkt_free(item.pkt);
     return ret;
 }
 
+/*
+ * Blocking write to the FIFO
+ */
+static int fifo_write(BIO *b, const char *in, int inl) {
+    struct fifo_data *d;
+    struct pkt_buf *pkt;
+
+    if (in == NULL) {
+        BIOerr(BIO_F_BIO_WRITE,BIO_R_NULL_PARAMETER);
+        return -1;
+    }
+
+    d = (struct fifo_data *) BIO_get_data(b);
+    pkt = pkt_alloc_size(d->pool, inl);
+    if (pkt == NULL) {
+        log_error(errno, "Cannot allocate a packet buffer");
+        return -1;
+    }
+    memcpy(pkt->data, in, inl);
+    return fifo_put(b, pkt, pkt->data, inl, 0);
+}
+
+int BIO_fifo_push(BIO *b, struct pkt_buf *pkt, unsigned char *data, int len) {
+    return fifo_put(b, pkt, data, len, 0);
+}
+
+int BIO_fifo_try_push(BIO *b, struct pkt_buf *pkt, unsigned char *data, int len) {
+    return fifo_put(b, pkt, data, len, 1);
+}
+
+int BIO_fifo_pop(BIO *b, struct pkt_buf **pkt, unsigned char **data) {
+    struct fifo_item item;
+
+    if (fifo_get(b, &item) == -1) {
+        return -1;
+    }
+    *pkt = item.pkt;
+    *data = item.data;
+    return item.size;
+}
+
 /*
  * All the controls options are not implemented
  */
@@ -380,24 +1148,32 @@ static long fifo_ctrl(BIO *b, int cmd, long num, void *ptr) {
     int v;
     struct fifo_item *item;
 
-    struct fifo_data * d = (struct fifo_data *) b->ptr;
+    struct fifo_data * d = (struct fifo_data *) BIO_get_data(b);
 
     switch (cmd) {
         case BIO_CTRL_RESET:
-            d->index_read = 0;
-            d->index_write = 0;
-            d->nelem = 0;
+            if (d->spsc) {
+                spsc_drain(d);
+                break;
+            }
+            mutexLock(&d->mutex);
+            fifo_clear(d);
+            mutexUnlock(&d->mutex);
             break;
         case BIO_CTRL_EOF:
+            if (d->spsc) {
+                ret = (long) (d->spsc_head == d->spsc_tail);
+                break;
+            }
             mutexLock(&d->mutex);
             ret = (long) (d->nelem == 0);
             mutexUnlock(&d->mutex);
             break;
         case BIO_CTRL_GET_CLOSE:
-            ret = (long) b->shutdown;
+            ret = (long) BIO_get_shutdown(b);
             break;
         case BIO_CTRL_SET_CLOSE:
-            b->shutdown = (int) num;
+            BIO_set_shutdown(b, (int) num);
             break;
 
         case BIO_CTRL_WPENDING:
@@ -405,7 +1181,20 @@ static long fifo_ctrl(BIO *b, int cmd, long num, void *ptr) {
             break;
         case BIO_CTRL_PENDING:
             ret = 0;
+            if (d->spsc) { // from the reading thread
+                for (i = d->spsc_head; i != d->spsc_tail; i = spsc_next(d, i)) {
+                    ret += d->fifo[i].size;
+                }
+                break;
+            }
             mutexLock(&d->mutex);
+            if (d->aqm != NULL) {
+                for (v = 0; v < d->aqm->params.flows * d->aqm->params.classes; v++) {
+                    ret += d->aqm->flows[v].backlog;
+                }
+                mutexUnlock(&d->mutex);
+                break;
+            }
             v = d->nelem;
             for (i = d->index_read; i < d->index_read + v; i++) {
                 item = &d->fifo[((i < d->size) ? i : i - d->size)];
@@ -444,6 +1233,33 @@ static long fifo_ctrl(BIO *b, int cmd, long num, void *ptr) {
             ret = d->droptail;
             mutexUnlock(&d->mutex);
             break;
+        case BIO_CTRL_FIFO_GET_DROPPED:
+            ret = (long) d->n_dropped;
+            break;
+        case BIO_CTRL_FIFO_SET_AQM:
+            if (d->spsc) { // the AQM needs the mutex
+                ret = 0;
+                break;
+            }
+            mutexLock(&d->mutex);
+            if (d->aqm != NULL || d->nelem != 0) {
+                ret = 0;
+            }
+            else {
+                ret = aqm_allocate(d, (const struct fifo_aqm_params *) ptr);
+            }
+            mutexUnlock(&d->mutex);
+            break;
+        case BIO_CTRL_FIFO_SET_NOTIFY:
+            mutexLock(&d->mutex);
+            if (ptr != NULL) {
+                d->notify = *(struct fifo_notify *) ptr;
+            }
+            else {
+                memset(&d->notify, 0, sizeof(d->notify));
+            }
+            mutexUnlock(&d->mutex);
+            break;
         case BIO_CTRL_PUSH:
         case BIO_CTRL_POP:
         default:
@@ -39,9 +39,12 @@
 #define BSS_FIFO_H_
 
 #include <pthread.h>
+#include <stdint.h>
 #include <openssl/bio.h>
 #include <sys/time.h>
 
+#include "pkt_pool.h"
+
 /* BIO type: source/sink */
 #define BIO_TYPE_FIFO (100|BIO_TYPE_SOURCE_SINK)
 
@@ -50,9 +53,40 @@
 /* discard packets when the FIFO is full instead of waiting */
 #define BIO_CTRL_FIFO_SET_DROPTAIL          100
 #define BIO_CTRL_FIFO_GET_DROPTAIL          101
+/* number of packets dropped because the FIFO was full or by the AQM */
+#define BIO_CTRL_FIFO_GET_DROPPED           102
+/* enable the active queue management (struct fifo_aqm_params *), the FIFO must be empty */
+#define BIO_CTRL_FIFO_SET_AQM               103
+/* call a function after each write (struct fifo_notify *, NULL to remove it)
+ * The reads of a FIFO with a notify hook never wait: they fail with the retry
+ * flag when the FIFO is empty and the reader is called back later */
+#define BIO_CTRL_FIFO_SET_NOTIFY            104
+
+struct fifo_notify {
+    void (*fn)(void *arg);          // called by the writing thread, without the lock
+    void *arg;
+};
 
 /* Create a new BIO */
 extern BIO *BIO_new_fifo(int len, int data_size);
+/* Create a new BIO storing the packets in buffers from pool */
+extern BIO *BIO_new_fifo_pool(int len, struct pkt_pool *pool);
+/* Same, for one writing thread and one reading thread only
+ * Empty writes (end markers) are still allowed from any thread
+ * BIO_reset must be called by the reading thread */
+extern BIO *BIO_new_fifo_spsc(int len, struct pkt_pool *pool);
+
+/* Queue a packet without copying it: the FIFO takes the reference on pkt
+ * data and len describe the packet within pkt->data */
+extern int BIO_fifo_push(BIO *b, struct pkt_buf *pkt, unsigned char *data, int len);
+/* Same without ever waiting: the packet is dropped if the FIFO is full
+ * Return len or -1 if the packet was dropped */
+extern int BIO_fifo_try_push(BIO *b, struct pkt_buf *pkt, unsigned char *data, int len);
+/* Dequeue a packet without copying it: the caller gets the reference on *pkt
+ * Return the length of the packet (*data) or -1 after a timeout */
+extern int BIO_fifo_pop(BIO *b, struct pkt_buf **pkt, unsigned char **data);
+
+#define FIFO_CACHE_LINE 64
 
 /* Data structure used by the BIO */
 struct fifo_data {
@@ -72,13 +106,86 @@ struct fifo_data {
     struct timeval curr_rcv_timeout;    // Current recv timeout
     int rcv_timer_exp;              // Timeout during fifo_read
     int droptail;                   // Drop new packets when the fifo is full
+    unsigned long n_dropped;        // Packets dropped because the fifo was full
+    struct pkt_pool *pool;          // Buffers for BIO_write
+    int own_pool;                   // The pool was created with the BIO
+
+    /* Single producer/single consumer mode: the ring has size+1 items and the
+     * mutex is only taken by a thread going to sleep or waking up the other one */
+    int spsc;
+    volatile unsigned int spsc_head __attribute__((aligned(FIFO_CACHE_LINE))); // Read position (reader)
+    volatile int spsc_reader_waiting;                                          // The reader sleeps on cond_read
+    volatile unsigned int spsc_tail __attribute__((aligned(FIFO_CACHE_LINE))); // Write position (writer)
+    volatile int spsc_writer_waiting;                                          // The writer sleeps on cond_write
+    volatile unsigned int markers __attribute__((aligned(FIFO_CACHE_LINE))); // Pending end markers (SPSC, AQM)
+
+    struct fifo_aqm *aqm;           // CoDel/FQ-CoDel mode if not NULL
+    struct fifo_notify notify;      // Event driven reader if notify.fn is not NULL
+};
+
+/*
+ * Active queue management (CoDel, RFC 8289 and FQ-CoDel, RFC 8290)
+ * The packets are timestamped when they are queued. At dequeue time, CoDel
+ * drops packets while their sojourn time stays above target for interval.
+ * With several flows, the packets are spread in sub-queues by flow_hash and
+ * the sub-queues are served by a deficit round robin favoring the new flows.
+ * When the FIFO is full, the head of the longest sub-queue is dropped.
+ *
+ * The packets may also be sorted into traffic classes by classify. The
+ * classes with a weight of 0 are served first, by increasing index. The
+ * other classes share the remaining capacity in proportion to their weight.
+ * Each class has its own sub-queues.
+ */
+#define FIFO_MAX_CLASSES 4
+
+struct fifo_aqm_params {
+    int flows;                      // Number of sub-queues per class (1: CoDel)
+    unsigned int target;            // Acceptable queueing delay (usec), 0 disables CoDel
+    unsigned int interval;          // Window for the delay (usec)
+    int quantum;                    // Bytes served per sub-queue and per round
+    unsigned int (*flow_hash)(const unsigned char *data, int len);
+    int classes;                    // Number of traffic classes (0 or 1: no classes)
+    int weights[FIFO_MAX_CLASSES];  // 0: strict priority, > 0: share of the capacity
+    int (*classify)(const unsigned char *data, int len);
+};
+
+struct fifo_flow {
+    struct fifo_item *head;         // Packets of the sub-queue
+    struct fifo_item *tail;
+    struct fifo_flow *next;         // In the list of new or old flows
+    int list;                       // 0: not scheduled, 1: new flows, 2: old flows
+    int deficit;                    // DRR credit (bytes)
+    unsigned int backlog;           // Bytes in the sub-queue
+    /* CoDel state */
+    uint64_t first_above_time;      // When the sojourn time went above target + interval
+    uint64_t drop_next;             // Next drop in dropping state
+    unsigned int count;             // Drops since entering the dropping state
+    unsigned int lastcount;
+    int dropping;
+};
+
+struct fifo_class {
+    struct fifo_flow *new_head, *new_tail;
+    struct fifo_flow *old_head, *old_tail;
+    int deficit;                    // DRR credit of a weighted class (bytes)
+};
+
+struct fifo_aqm {
+    struct fifo_aqm_params params;
+    struct fifo_flow *flows;        // params.flows sub-queues per class
+    struct fifo_item *free_items;   // Unused items of fifo_data.fifo
+    struct fifo_class classes[FIFO_MAX_CLASSES];
+    int cur_class;                  // Weighted class served by the DRR
+    unsigned int maxpacket;         // Largest packet seen
 };
 
 /* An item in the queue */
 struct fifo_item {
     int size;                       // Size of the packet
-    int data_size;                  // Size of data
-    char *data;                     // Contains the data
+    unsigned char *data;            // The packet, within pkt
+    struct pkt_buf *pkt;            // Reference held by the queue
+    struct fifo_item *next;         // AQM: next item of the sub-queue or free item
+    uint64_t tstamp;                // AQM: enqueue time (usec)
 };
 
 #endif /*BSS_FIFO_H_*/
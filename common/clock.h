@@ -0,0 +1,75 @@
+/*
+ * Coarse monotonic clock
+ *
+ * Copyright (C) 2011 Florent Bondoux
+ *
+ * This file is part of Campagnol.
+ *
+ * Campagnol is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Campagnol is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Campagnol.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * 
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ */
+
+
+#ifndef CLOCK_H_
+#define CLOCK_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Clock used for the activity timestamps and the timeouts
+ *
+ * The timestamps are taken for every packet, and only compared with delays
+ * given in seconds or milliseconds. The coarse clock of Linux is read without
+ * a system call and is precise enough (one tick). It is monotonic, so the
+ * timeouts are not affected when the wall-clock time is changed.
+ */
+#if defined(CLOCK_MONOTONIC_COARSE)
+#   define COARSE_CLOCK CLOCK_MONOTONIC_COARSE
+#elif defined(_POSIX_MONOTONIC_CLOCK) && (_POSIX_MONOTONIC_CLOCK >= 0)
+#   define COARSE_CLOCK CLOCK_MONOTONIC
+#else
+#   define COARSE_CLOCK CLOCK_REALTIME
+#endif
+
+/* Current time in milliseconds. Only the differences are meaningful. */
+static inline uint64_t clock_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(COARSE_CLOCK, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+/* Current time in seconds, replaces time(NULL) for the timestamps */
+static inline time_t clock_now(void) {
+    struct timespec ts;
+    clock_gettime(COARSE_CLOCK, &ts);
+    return ts.tv_sec;
+}
+
+#endif /*CLOCK_H_*/
@@ -0,0 +1,214 @@
+/*
+ * Epoch based memory reclamation
+ *
+ * Copyright (C) 2011 Florent Bondoux
+ *
+ * This file is part of Campagnol.
+ *
+ * Campagnol is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Campagnol is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Campagnol.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * 
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ */
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "epoch.h"
+#include "pthread_wrap.h"
+
+#define EPOCH_ACTIVE 1UL
+
+/* A reading thread, state is (epoch << 1) | EPOCH_ACTIVE while reading */
+struct epoch_thread {
+    volatile unsigned long state;
+    volatile int used;              // owned by a running thread
+    struct epoch_thread *next;
+};
+
+/* An object waiting for the readers */
+struct epoch_limbo {
+    void *obj;
+    void (*free_fn)(void *);
+    unsigned long epoch;            // global epoch when it was retired
+    struct epoch_limbo *next;
+};
+
+static volatile unsigned long global_epoch = 0;
+/* the records are never freed, the record of a finished thread is reused */
+static struct epoch_thread * volatile threads = NULL;
+static struct epoch_limbo * volatile limbo = NULL;
+static pthread_mutex_t epoch_mutex;
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+
+/* the thread exits */
+static void epoch_thread_release(void *arg) {
+    struct epoch_thread *t = arg;
+    t->state = 0;
+    __sync_synchronize();
+    t->used = 0;
+}
+
+static void epoch_init(void) {
+    int r;
+    mutexInit(&epoch_mutex, NULL);
+    r = pthread_key_create(&epoch_key, epoch_thread_release);
+    if (r != 0) {
+        log_error(r, "pthread_key_create");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static struct epoch_thread *epoch_get_thread(void) {
+    struct epoch_thread *t;
+
+    pthread_once(&epoch_once, epoch_init);
+    t = pthread_getspecific(epoch_key);
+    if (t != NULL) {
+        return t;
+    }
+    /* reuse the record of a finished thread */
+    for (t = threads; t != NULL; t = t->next) {
+        if (!t->used && __sync_bool_compare_and_swap(&t->used, 0, 1)) {
+            break;
+        }
+    }
+    if (t == NULL) {
+        t = CHECK_ALLOC_FATAL(calloc(1, sizeof(struct epoch_thread)));
+        t->used = 1;
+        do {
+            t->next = threads;
+        } while (!__sync_bool_compare_and_swap(&threads, t->next, t));
+    }
+    pthread_setspecific(epoch_key, t);
+    return t;
+}
+
+void epoch_enter(void) {
+    struct epoch_thread *t = epoch_get_thread();
+    t->state = (global_epoch << 1) | EPOCH_ACTIVE;
+    /* publish the state before reading the protected structure */
+    __sync_synchronize();
+}
+
+void epoch_exit(void) {
+    struct epoch_thread *t = pthread_getspecific(epoch_key);
+    __sync_synchronize();
+    t->state = 0;
+}
+
+/*
+ * Move the global epoch forward if every active reader has seen it
+ * Return the global epoch
+ */
+static unsigned long epoch_try_advance(void) {
+    struct epoch_thread *t;
+    unsigned long epoch = global_epoch, state;
+
+    __sync_synchronize();
+    for (t = threads; t != NULL; t = t->next) {
+        state = t->state;
+        if ((state & EPOCH_ACTIVE) && (state >> 1) != epoch) {
+            return epoch;
+        }
+    }
+    if (__sync_bool_compare_and_swap(&global_epoch, epoch, epoch + 1)) {
+        return epoch + 1;
+    }
+    return global_epoch;
+}
+
+int epoch_collect(void) {
+    struct epoch_limbo *l, * volatile *prev, *done = NULL;
+    unsigned long epoch;
+    int left;
+
+    /* nothing to free, don't take the mutex */
+    if (limbo == NULL)
+        return 0;
+    pthread_once(&epoch_once, epoch_init);
+    mutexLock(&epoch_mutex);
+    /* twice, so that the objects retired now may go without any reader */
+    epoch_try_advance();
+    epoch = epoch_try_advance();
+    prev = &limbo;
+    while ((l = *prev) != NULL) {
+        if (l->epoch + 2 <= epoch) {
+            *prev = l->next;
+            l->next = done;
+            done = l;
+        }
+        else {
+            prev = &l->next;
+        }
+    }
+    left = (limbo != NULL);
+    mutexUnlock(&epoch_mutex);
+
+    while ((l = done) != NULL) {
+        done = l->next;
+        l->free_fn(l->obj);
+        free(l);
+    }
+    return left;
+}
+
+void epoch_drain(void) {
+    struct epoch_limbo *l;
+
+    pthread_once(&epoch_once, epoch_init);
+    mutexLock(&epoch_mutex);
+    while ((l = limbo) != NULL) {
+        limbo = l->next;
+        l->free_fn(l->obj);
+        free(l);
+    }
+    mutexUnlock(&epoch_mutex);
+}
+
+void epoch_retire(void *obj, void (*free_fn)(void *)) {
+    struct epoch_limbo *l;
+
+    l = CHECK_ALLOC_FATAL(malloc(sizeof(struct epoch_limbo)));
+    l->obj = obj;
+    l->free_fn = free_fn;
+    pthread_once(&epoch_once, epoch_init);
+    mutexLock(&epoch_mutex);
+    /* the object is already unlinked */
+    __sync_synchronize();
+    l->epoch = global_epoch;
+    l->next = limbo;
+    limbo = l;
+    mutexUnlock(&epoch_mutex);
+
+    epoch_collect();
+}
@@ -0,0 +1,68 @@
+/*
+ * Epoch based memory reclamation
+ *
+ * Copyright (C) 2011 Florent Bondoux
+ *
+ * This file is part of Campagnol.
+ *
+ * Campagnol is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Campagnol is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Campagnol.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * 
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ */
+
+
+#ifndef EPOCH_H_
+#define EPOCH_H_
+
+/*
+ * Epoch based reclamation
+ *
+ * The readers of a lock-free structure run between epoch_enter and
+ * epoch_exit. A writer unlinks an object from the structure and gives it to
+ * epoch_retire: the object is freed once every thread that was reading at
+ * that time has left its read section.
+ *
+ * The global epoch only moves forward when all the active readers have seen
+ * its current value. An object retired during epoch e is freed when the
+ * global epoch reaches e + 2.
+ */
+
+/* Start/end a read section. The sections must not be nested. */
+extern void epoch_enter(void);
+extern void epoch_exit(void);
+
+/* Free obj with free_fn after the current readers are gone */
+extern void epoch_retire(void *obj, void (*free_fn)(void *));
+
+/* Try to move the epoch forward and free what can be freed
+ * Return 1 if some objects are still waiting for the readers */
+extern int epoch_collect(void);
+
+/* Free all the retired objects, no reader may be running */
+extern void epoch_drain(void);
+
+#endif /*EPOCH_H_*/
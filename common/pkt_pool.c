@@ -0,0 +1,321 @@
+/*
+ * Packet buffer pool
+ *
+ * Copyright (C) 2011 Florent Bondoux
+ *
+ * This file is part of Campagnol.
+ *
+ * Campagnol is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Campagnol is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Campagnol.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * 
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ */
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "pkt_pool.h"
+#include "pthread_wrap.h"
+
+#define PKT_ALIGN 64                            // cache line
+#define PKT_SLAB_SIZE (256*1024)                // slab size without huge pages
+#define PKT_SLAB_MIN_BUFFERS 8                  // minimum number of buffers per slab
+#define PKT_HUGEPAGE_SIZE (2*1024*1024)
+#define PKT_CACHE_MAX 64                        // free buffers kept by a thread
+#define PKT_CACHE_BATCH 16                      // buffers moved at once between a cache and the pool
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t) (a) - 1))
+
+/* Free buffers of a thread */
+struct pkt_cache {
+    struct pkt_pool *pool;
+    struct pkt_buf *head;
+    unsigned int n;
+};
+
+/*
+ * Give all the buffers of a thread cache back to the pool
+ * Called when the thread exits
+ */
+static void pkt_cache_release(void *arg) {
+    struct pkt_cache *cache = arg;
+    struct pkt_pool *pool = cache->pool;
+    struct pkt_buf *pkt;
+
+    mutexLock(&pool->mutex);
+    while ((pkt = cache->head) != NULL) {
+        cache->head = pkt->next;
+        pkt->next = pool->free_list;
+        pool->free_list = pkt;
+        pool->n_free++;
+    }
+    mutexUnlock(&pool->mutex);
+    free(cache);
+}
+
+static struct pkt_cache *pkt_get_cache(struct pkt_pool *pool) {
+    struct pkt_cache *cache = pthread_getspecific(pool->cache_key);
+    if (cache == NULL) {
+        cache = CHECK_ALLOC_FATAL(calloc(1, sizeof(struct pkt_cache)));
+        cache->pool = pool;
+        pthread_setspecific(pool->cache_key, cache);
+    }
+    return cache;
+}
+
+struct pkt_pool *pkt_pool_new(size_t buf_size, int cached, int hugepages) {
+    struct pkt_pool *pool;
+    size_t n;
+    int r;
+
+    pool = calloc(1, sizeof(struct pkt_pool));
+    if (pool == NULL) {
+        log_error(errno, "Cannot allocate the packet pool");
+        return NULL;
+    }
+    pool->buf_size = buf_size;
+    pool->elem_size = ALIGN_UP(sizeof(struct pkt_buf), PKT_ALIGN) + ALIGN_UP(buf_size, PKT_ALIGN);
+    n = PKT_SLAB_SIZE / pool->elem_size;
+    if (n < PKT_SLAB_MIN_BUFFERS)
+        n = PKT_SLAB_MIN_BUFFERS;
+    pool->slab_size = n * pool->elem_size;
+#ifdef MAP_HUGETLB
+    pool->hugepages = hugepages;
+    if (hugepages)
+        pool->slab_size = ALIGN_UP(pool->slab_size, PKT_HUGEPAGE_SIZE);
+#else
+    (void) hugepages;
+#endif
+    pool->cached = cached;
+    if (cached) {
+        r = pthread_key_create(&pool->cache_key, pkt_cache_release);
+        if (r != 0) {
+            log_error(r, "pthread_key_create");
+            free(pool);
+            return NULL;
+        }
+    }
+    mutexInit(&pool->mutex, NULL);
+    return pool;
+}
+
+void pkt_pool_free(struct pkt_pool *pool) {
+    unsigned int i;
+
+    ASSERT(!pool->cached);
+    for (i = 0; i < pool->n_slabs; i++) {
+        if (pool->slab_mmap[i])
+            munmap(pool->slabs[i], pool->slab_size);
+        else
+            free(pool->slabs[i]);
+    }
+    free(pool->slabs);
+    free(pool->slab_mmap);
+    mutexDestroy(&pool->mutex);
+    free(pool);
+}
+
+/*
+ * Allocate a new slab and add its buffers to the free list
+ * The pool mutex must be held
+ */
+static int pkt_pool_grow(struct pkt_pool *pool) {
+    void *slab = NULL, **slabs;
+    int mapped = 0, *slab_mmap;
+    size_t header = ALIGN_UP(sizeof(struct pkt_buf), PKT_ALIGN);
+    size_t i, n;
+    struct pkt_buf *pkt;
+
+#ifdef MAP_HUGETLB
+    if (pool->hugepages) {
+        slab = mmap(NULL, pool->slab_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (slab == MAP_FAILED) {
+            log_error(errno, "Could not allocate huge pages for the packet buffers");
+            pool->hugepages = 0;
+            slab = NULL;
+        }
+        else {
+            mapped = 1;
+        }
+    }
+#endif
+    if (slab == NULL) {
+        slab = malloc(pool->slab_size);
+        if (slab == NULL)
+            return -1;
+    }
+
+    slabs = realloc(pool->slabs, (pool->n_slabs + 1) * sizeof(void *));
+    if (slabs != NULL)
+        pool->slabs = slabs;
+    slab_mmap = realloc(pool->slab_mmap, (pool->n_slabs + 1) * sizeof(int));
+    if (slab_mmap != NULL)
+        pool->slab_mmap = slab_mmap;
+    if (slabs == NULL || slab_mmap == NULL) {
+        if (mapped)
+            munmap(slab, pool->slab_size);
+        else
+            free(slab);
+        return -1;
+    }
+    pool->slabs[pool->n_slabs] = slab;
+    pool->slab_mmap[pool->n_slabs] = mapped;
+    pool->n_slabs++;
+
+    n = pool->slab_size / pool->elem_size;
+    for (i = 0; i < n; i++) {
+        pkt = (struct pkt_buf *) ((char *) slab + i * pool->elem_size);
+        pkt->pool = pool;
+        pkt->refcnt = 0;
+        pkt->size = pool->buf_size;
+        pkt->data = (unsigned char *) pkt + header;
+        pkt->next = pool->free_list;
+        pool->free_list = pkt;
+    }
+    pool->n_free += n;
+    pool->n_buffers += n;
+    return 0;
+}
+
+unsigned int pkt_pool_slabs(struct pkt_pool *pool, unsigned int n_buffers,
+        struct iovec *iov, unsigned int max) {
+    unsigned int i;
+
+    mutexLock(&pool->mutex);
+    while (pool->n_buffers < n_buffers && pkt_pool_grow(pool) == 0);
+    for (i = 0; i < pool->n_slabs && i < max; i++) {
+        iov[i].iov_base = pool->slabs[i];
+        iov[i].iov_len = pool->slab_size;
+    }
+    mutexUnlock(&pool->mutex);
+    return i;
+}
+
+struct pkt_buf *pkt_alloc(struct pkt_pool *pool) {
+    struct pkt_cache *cache = NULL;
+    struct pkt_buf *pkt;
+    int i;
+
+    if (pool->cached) {
+        cache = pkt_get_cache(pool);
+        if (cache->head != NULL) {
+            pkt = cache->head;
+            cache->head = pkt->next;
+            cache->n--;
+            pkt->refcnt = 1;
+            return pkt;
+        }
+    }
+
+    mutexLock(&pool->mutex);
+    if (pool->free_list == NULL && pkt_pool_grow(pool) == -1) {
+        mutexUnlock(&pool->mutex);
+        return NULL;
+    }
+    pkt = pool->free_list;
+    pool->free_list = pkt->next;
+    pool->n_free--;
+    /* refill the cache of this thread */
+    if (cache != NULL) {
+        for (i = 0; i < PKT_CACHE_BATCH && pool->free_list != NULL; i++) {
+            struct pkt_buf *next = pool->free_list;
+            pool->free_list = next->next;
+            pool->n_free--;
+            next->next = cache->head;
+            cache->head = next;
+            cache->n++;
+        }
+    }
+    mutexUnlock(&pool->mutex);
+
+    pkt->refcnt = 1;
+    return pkt;
+}
+
+struct pkt_buf *pkt_alloc_size(struct pkt_pool *pool, size_t size) {
+    struct pkt_buf *pkt;
+
+    if (size <= pool->buf_size)
+        return pkt_alloc(pool);
+
+    pkt = malloc(sizeof(struct pkt_buf) + size);
+    if (pkt == NULL)
+        return NULL;
+    pkt->pool = NULL;
+    pkt->refcnt = 1;
+    pkt->size = size;
+    pkt->data = (unsigned char *) (pkt + 1);
+    return pkt;
+}
+
+void pkt_free(struct pkt_buf *pkt) {
+    struct pkt_pool *pool;
+    struct pkt_cache *cache;
+    int i;
+
+    if (pkt == NULL || __sync_sub_and_fetch(&pkt->refcnt, 1) != 0)
+        return;
+
+    pool = pkt->pool;
+    if (pool == NULL) {
+        free(pkt);
+        return;
+    }
+
+    if (pool->cached) {
+        cache = pkt_get_cache(pool);
+        pkt->next = cache->head;
+        cache->head = pkt;
+        cache->n++;
+        if (cache->n <= PKT_CACHE_MAX)
+            return;
+        /* too many free buffers in this thread, give some back */
+        mutexLock(&pool->mutex);
+        for (i = 0; i < PKT_CACHE_BATCH; i++) {
+            pkt = cache->head;
+            cache->head = pkt->next;
+            cache->n--;
+            pkt->next = pool->free_list;
+            pool->free_list = pkt;
+            pool->n_free++;
+        }
+        mutexUnlock(&pool->mutex);
+        return;
+    }
+
+    mutexLock(&pool->mutex);
+    pkt->next = pool->free_list;
+    pool->free_list = pkt;
+    pool->n_free++;
+    mutexUnlock(&pool->mutex);
+}
@@ -0,0 +1,112 @@
+/*
+ * Packet buffer pool
+ *
+ * Copyright (C) 2011 Florent Bondoux
+ *
+ * This file is part of Campagnol.
+ *
+ * Campagnol is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Campagnol is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Campagnol.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * 
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ */
+
+
+#ifndef PKT_POOL_H_
+#define PKT_POOL_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/*
+ * Refcounted packet buffers
+ *
+ * The buffers are carved from slabs (optionally backed by huge pages) and
+ * never given back to the system. Each thread keeps a small cache of free
+ * buffers so that pkt_alloc and pkt_free rarely take the pool mutex.
+ *
+ * A buffer is passed between threads by handing over a reference: the FIFO
+ * BIO stores the buffer instead of a copy of the data (see BIO_fifo_push).
+ */
+
+struct pkt_pool;
+
+struct pkt_buf {
+    struct pkt_buf *next;           // free lists
+    struct pkt_pool *pool;          // NULL: standalone buffer, see pkt_alloc_size
+    int refcnt;                     // number of references (atomic)
+    size_t size;                    // size of data
+    unsigned char *data;
+};
+
+struct pkt_pool {
+    size_t buf_size;                // size of the buffers
+    size_t elem_size;               // buf_size + header, aligned on a cache line
+    size_t slab_size;               // bytes allocated at once
+    int hugepages;                  // try to back the slabs with huge pages
+    int cached;                     // use per thread caches
+    pthread_key_t cache_key;        // per thread cache (struct pkt_cache)
+    pthread_mutex_t mutex;
+    struct pkt_buf *free_list;      // free buffers
+    unsigned int n_free;
+    void **slabs;                   // allocated slabs
+    int *slab_mmap;                 // was this slab mmaped
+    unsigned int n_slabs;
+    unsigned int n_buffers;         // total number of buffers
+};
+
+/* Create a pool of buffers of buf_size bytes
+ * cached: use per thread caches. The pool must then live until the end of the process */
+extern struct pkt_pool *pkt_pool_new(size_t buf_size, int cached, int hugepages);
+/* Release a pool without thread caches. All the buffers must have been freed */
+extern void pkt_pool_free(struct pkt_pool *pool);
+
+/* Get a buffer from the pool (refcnt = 1) */
+extern struct pkt_buf *pkt_alloc(struct pkt_pool *pool);
+/* Get a buffer of at least size bytes, allocated outside the pool if it is too large */
+extern struct pkt_buf *pkt_alloc_size(struct pkt_pool *pool, size_t size);
+/* Drop a reference, the buffer returns to the pool with the last one */
+extern void pkt_free(struct pkt_buf *pkt);
+
+/* Grow the pool to at least n_buffers buffers and describe its slabs in iov
+ * (at most max entries), e.g. to register them as io_uring fixed buffers.
+ * Return the number of slabs described */
+extern unsigned int pkt_pool_slabs(struct pkt_pool *pool, unsigned int n_buffers,
+        struct iovec *iov, unsigned int max);
+
+/* Take a new reference */
+static inline struct pkt_buf *pkt_ref(struct pkt_buf *pkt) {
+    __sync_fetch_and_add(&pkt->refcnt, 1);
+    return pkt;
+}
+
+/* Is this buffer referenced by someone else? */
+static inline int pkt_shared(struct pkt_buf *pkt) {
+    return __sync_fetch_and_add(&pkt->refcnt, 0) > 1;
+}
+
+#endif /*PKT_POOL_H_*/
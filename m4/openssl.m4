@@ -14,8 +14,7 @@
 # 
 # When pkg-config is used, the required version number is TEXT_VER.
 # The version number in openssl/opensslv.h is checked agains NUM_VER.
-# Check whether SSL_library_init is available, abort if not
-# Check whether CRYPTO_THREADID_current is available (OpenSSL >= 0.9.9).
+# Check whether OPENSSL_init_ssl is available (OpenSSL >= 1.1.0), abort if not
 AC_DEFUN([OPENSSL_CHECK],
 [
 openssl_set=0
@@ -69,10 +68,7 @@ AC_COMPILE_IFELSE(
 )
 
 # usability checking
-AC_CHECK_FUNCS([SSL_library_init], [], [AC_MSG_ERROR([OpenSSL is not usable])])
-
-# check for the new THREADID API
-AC_CHECK_FUNCS([CRYPTO_THREADID_current])
+AC_CHECK_FUNCS([OPENSSL_init_ssl], [], [AC_MSG_ERROR([OpenSSL is not usable])])
 
 LIBS=$OLD_LIBS
 CFLAGS=$OLD_CFLAGS
@@ -38,6 +38,7 @@
 #define PEER_H_
 
 #include <time.h>
+#include "../common/clock.h"
 
 /* clients states */
 enum client_type {
@@ -48,7 +49,7 @@ enum client_type {
 
 /* client storage structure */
 struct client {
-    time_t time;                        // last message received (time(NULL))
+    time_t time;                        // last message received (clock_now())
     struct sockaddr_in clientaddr;      // real IP address and port
     struct sockaddr_in localaddr;       // client's local address
     struct in_addr vpnIP;               // VPN IP address
@@ -72,10 +73,10 @@ extern struct client * get_client_real(struct sockaddr_in *cl_address);
 
 /* update the activity timestamp and the link activity timestamp */
 #define client_update_time(peer) ({\
-    (peer)->time = time(NULL);\
+    (peer)->time = clock_now();\
     })
 
-#define client_is_timeout(peer) ((time(NULL) - (peer)->time) > PEER_TIMEOUT)
-#define client_is_dead(peer) ((time(NULL) - (peer)->time) > (2 * PEER_TIMEOUT))
+#define client_is_timeout(peer) ((clock_now() - (peer)->time) > PEER_TIMEOUT)
+#define client_is_dead(peer) ((clock_now() - (peer)->time) > (2 * PEER_TIMEOUT))
 
 #endif /*PEER_H_*/
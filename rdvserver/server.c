@@ -36,6 +36,7 @@
 
 #include "rdv.h"
 #include "../common/log.h"
+#include "../common/clock.h"
 #include "server.h"
 #include "peer.h"
 #include "session.h"
@@ -222,12 +223,12 @@ static void handle_packet(message_t *rmsg, struct sockaddr_in *unknownaddr, int
                 }
 
                 if (rmsg->port != 0) {
-                    peer = add_client(sockfd, time(NULL),
+                    peer = add_client(sockfd, clock_now(),
                             unknownaddr->sin_addr, unknownaddr->sin_port,
                             rmsg->ip1, rmsg->ip2, rmsg->port);
                 }
                 else {
-                    peer = add_client(sockfd, time(NULL),
+                    peer = add_client(sockfd, clock_now(),
                             unknownaddr->sin_addr, unknownaddr->sin_port,
                             rmsg->ip1, IN_ADDR_EMPTY, 0);
                 }
@@ -247,13 +248,13 @@ static void handle_packet(message_t *rmsg, struct sockaddr_in *unknownaddr, int
                         remove_sessions_with_client(peer);
                         remove_client(peer);
                         if (rmsg->port != 0) {
-                            peer = add_client(sockfd, time(NULL),
+                            peer = add_client(sockfd, clock_now(),
                                     unknownaddr->sin_addr,
                                     unknownaddr->sin_port, rmsg->ip1,
                                     rmsg->ip2, rmsg->port);
                         }
                         else {
-                            peer = add_client(sockfd, time(NULL),
+                            peer = add_client(sockfd, clock_now(),
                                     unknownaddr->sin_addr,
                                     unknownaddr->sin_port, rmsg->ip1,
                                     IN_ADDR_EMPTY, 0);
@@ -303,7 +304,7 @@ static void handle_packet(message_t *rmsg, struct sockaddr_in *unknownaddr, int
                     if (rev_sess_tmp != NULL) {
                         remove_session(rev_sess_tmp);
                     }
-                    sess_tmp = add_session(peer, peer_tmp, time(NULL));
+                    sess_tmp = add_session(peer, peer_tmp, clock_now());
                     if (sess_tmp != NULL) {
                         send_ANS(peer, peer_tmp, send_local_ip, sockfd);
                         send_FWD(peer_tmp, peer, send_local_ip, sockfd);
@@ -362,7 +363,7 @@ void rdv_server(int sockfd) {
 
         if (r_select> 0) {
             r = recvfrom(sockfd, (unsigned char *) &rmsg, sizeof(rmsg), 0, (struct sockaddr *) &unknownaddr, &len);
-            t = time(NULL);
+            t = clock_now();
 
             if (r == sizeof(message_t)) {
                 handle_packet(&rmsg, &unknownaddr, sockfd);
@@ -374,7 +375,7 @@ void rdv_server(int sockfd) {
             }
         }
         else if (r_select == 0) {
-            t = time(NULL);
+            t = clock_now();
             last_cleaning = t;
             clean_dead_clients();
         }
@@ -55,7 +55,7 @@ extern struct session * get_session(struct client *peer1, struct client *peer2);
 extern void remove_sessions_with_client(struct client *peer);
 
 #define session_update_time(s)  ({\
-    (s)->time = time(NULL);\
+    (s)->time = clock_now();\
     })
 
 #endif /* SESSION_H_ */
@@ -24,7 +24,14 @@ TOP_DIR="./CA"
 
 # Default values for the X509 certificates
 SSL_DAYS_DEFAULT="730"
-SSL_BITS_DEFAULT="1024"
+# Type of the keys: ec (ECDSA) or rsa
+# The ECDSA keys make the DTLS handshakes much cheaper than RSA
+# (OpenSSL does not support Ed25519 with DTLS 1.2)
+SSL_KEY_TYPE_DEFAULT="ec"
+# Curve of the ECDSA keys (P-256 or P-384)
+SSL_CURVE_DEFAULT="P-256"
+# Size of the RSA keys
+SSL_BITS_DEFAULT="2048"
 SSL_COUNTRY_DEFAULT="FR"
 SSL_STATE_DEFAULT="France"
 SSL_LOCALITY_DEFAULT="Paris"
@@ -55,6 +62,24 @@ CA_CRL="crl.pem"
 
 OPENSSL="openssl"
 
+# print the openssl req options generating a new key of type SSL_KEY_TYPE
+newkey_opts() {
+	local key_type="${SSL_KEY_TYPE:-${SSL_KEY_TYPE_DEFAULT}}"
+	case ${key_type} in
+		ec)
+			echo "-newkey ec -pkeyopt ec_paramgen_curve:${SSL_CURVE:-${SSL_CURVE_DEFAULT}}"
+			;;
+		rsa)
+			echo "-newkey rsa:${SSL_BITS:-${SSL_BITS_DEFAULT}}"
+			;;
+		*)
+			echo "!! Unknown key type: ${key_type}" >&2
+			return 1
+			;;
+	esac
+	return 0
+}
+
 CWD=`pwd`
 # create TOP_DIR
 mkdir -p "${TOP_DIR}" || exit 1
@@ -158,7 +183,7 @@ create_cnf() {
 		
 		default_days       = ${ssl_days}       # how long to certify for
 		default_crl_days   = ${ssl_crl_days}   # How long before next CRL
-		default_md         = sha1              # which digest to use
+		default_md         = default           # digest of the CA key type
 		preserve           = no                # keep passed DN ordering
 		
 		# A few difference way of specifying how similar the request should look
@@ -220,8 +245,10 @@ gen_ca() {
 	echo "* Generating the CA key and certificate"
 
 	local ssl_days="${SSL_DAYS:-${SSL_DAYS_DEFAULT}}"
+	local newkey
+	newkey=`newkey_opts` || return $?
 
-	${OPENSSL} req -new -x509 -days ${ssl_days} -extensions v3_ca \
+	${OPENSSL} req -new -x509 -days ${ssl_days} -extensions v3_ca ${newkey} \
     	-keyout "${ABS_TOP_DIR}/${CA_PRIV_KEY}" \
 		-out "${ABS_TOP_DIR}/${CA_CERTIFICATE}" \
 		-config "${ABS_TOP_DIR}/${SSL_CONF}" \
@@ -252,6 +279,8 @@ gen_cert() {
 	
 		local cl_dir="${ABS_TOP_DIR}/${1}"
 		local req_file="${cl_dir}/${$}_${1}.csr"
+		local newkey
+		newkey=`newkey_opts` || return $?
 		
 		mkdir -p "${cl_dir}" || return $?
 		
@@ -259,7 +288,7 @@ gen_cert() {
 		sed -i -e \
 "s:organizationalUnitName_default.*:organizationalUnitName_default=${1}:" \
 "${ABS_TOP_DIR}/${SSL_CONF}"
-		${OPENSSL} req -new -nodes -keyout "${cl_dir}/key.pem" \
+		${OPENSSL} req -new -nodes ${newkey} -keyout "${cl_dir}/key.pem" \
 		-out "${req_file}" -config "${ABS_TOP_DIR}/${SSL_CONF}" || return $?
 
 		chmod 0400 "${cl_dir}/key.pem" || return $?
@@ -337,6 +366,12 @@ Commands:
   * print_certs             print out the generated certificates
   * print_crl               print out the CRL
   * revoke_crt <dirname>    revoke the certificate stored in \"dirname\"
+
+Environment:
+  SSL_KEY_TYPE              type of the new keys: ec or rsa
+                            (default: ${SSL_KEY_TYPE_DEFAULT})
+  SSL_CURVE                 curve of the ECDSA keys (default: ${SSL_CURVE_DEFAULT})
+  SSL_BITS                  size of the RSA keys (default: ${SSL_BITS_DEFAULT})
 "
 }
 